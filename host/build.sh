@@ -0,0 +1,25 @@
+#!/bin/bash
+#Builds the Photon and mbed firmware, unmodified, as Linux processes in bin/.
+cd "$(dirname "$0")"
+PHOTON=../photon/dca-slave/src
+MBED=../mbed/dca-slave
+
+mkdir -p bin build/photon build/mbed
+
+#As the Particle preprocessor does, every .ino gets Particle.h and
+#prototypes of its functions after its own includes.
+for ino in $PHOTON/*.ino
+do
+	out=build/photon/$(basename $ino .ino).cpp
+	grep -E '^[A-Za-z][^;#=]*\)$' $ino | sed 's/$/;/' > build/photon/prototypes.h
+	awk -v protos=build/photon/prototypes.h '
+		! done && ! /^#include/ && ! /^$/ { while ((getline line < protos) > 0) print line; done = 1 }
+		{ print }
+	' $ino | sed '1i #include "Particle.h"' > $out
+done
+
+g++ -O2 -Wall -Ihal -I$PHOTON build/photon/*.cpp $PHOTON/*.cpp hal/particle.cpp hal/host.cpp -o bin/photon-slave -lpthread -lm || exit 1
+
+#The mbed firmware's main() runs once the host has read its command line.
+g++ -O2 -Wall -Ihal -Dmain=mbed_main -c $MBED/main.cpp -o build/mbed/main.o || exit 1
+g++ -O2 -Wall -Ihal build/mbed/main.o hal/mbed.cpp hal/host.cpp -o bin/mbed-slave -lpthread -lm
@@ -0,0 +1,48 @@
+#!/bin/bash
+#Runs the master against a cluster of host slaves and reports its throughput.
+#Usage: ./cluster.sh [photons] [mbeds] [digits] [slowdown] [bus_khz] [fault_profile[:seed]]
+cd "$(dirname "$0")"
+PHOTONS=${1:-4}
+MBEDS=${2:-0}
+DIGITS=${3:-1000}
+SLOWDOWN=${4:-1}
+BUS_KHZ=${5:-100}
+FAULTS=${6:-}
+RUN=/tmp/dca-cluster
+
+./build.sh || exit 1
+mkdir -p ../master/bin
+(cd ../master && ./build.sh) || exit 1
+
+rm -rf $RUN
+mkdir -p $RUN
+SLAVES=""
+PIDS=""
+
+for i in $(seq 1 $PHOTONS)
+do
+	bin/photon-slave -l unix:$RUN/photon$i.sock -k $BUS_KHZ -s $SLOWDOWN &
+	PIDS="$PIDS $!"
+	SLAVES="$SLAVES -t unix:$RUN/photon$i.sock@0x10"
+done
+for i in $(seq 1 $MBEDS)
+do
+	bin/mbed-slave -l unix:$RUN/mbed$i.sock -k $BUS_KHZ -s $SLOWDOWN &
+	PIDS="$PIDS $!"
+	SLAVES="$SLAVES -t unix:$RUN/mbed$i.sock@0x50"
+done
+trap "kill $PIDS 2>/dev/null" EXIT
+
+#Give the slaves time to start listening.
+sleep 1
+
+#The master has a menu and a curses display, so it runs on a pseudo
+#terminal: run the computation, then quit.
+START=$(date +%s.%N)
+printf "1\n2\n" | script -qc "../master/bin/dca -w 0 -c $RUN/checkpoint -T $RUN/dca.trace ${FAULTS:+-F $FAULTS} $SLAVES -s bench:1:$DIGITS" $RUN/master.log > /dev/null
+END=$(date +%s.%N)
+
+grep -a "Pi = \|digits of Pi from\|Fault profile\|All slaves:" $RUN/master.log
+awk -v start=$START -v end=$END -v digits=$DIGITS -v slaves=$((PHOTONS + MBEDS)) 'BEGIN {
+	printf "%u digits on %u slaves in %.2f s: %.1f digits/s\n", digits, slaves, end - start, digits / (end - start)
+}'
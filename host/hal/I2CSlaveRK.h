@@ -0,0 +1,38 @@
+#ifndef I2CSLAVERK_H
+#define I2CSLAVERK_H
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "Particle.h"
+
+//How many register writes are remembered until the firmware checks for them.
+#define I2CSLAVE_SET_QUEUE 8
+
+//The register file the Photon firmware shares with the master. As on the
+//device, the master writes a 16-bit register address, low byte first,
+//followed by any bytes to store from that register on, 32-bit registers
+//little endian. A read returns bytes from the last addressed register on.
+class I2CSlave
+{
+	public:
+		I2CSlave(TwoWire &wire, uint8_t addr, size_t num_registers);
+		void begin();
+		bool getRegisterSet(uint16_t &reg_addr);
+		uint32_t getRegister(uint16_t reg_addr);
+		void setRegister(uint16_t reg_addr, uint32_t value);
+
+		void masterWrite(const uint8_t *src, const uint8_t len);
+		void masterRead(uint8_t *des, const uint8_t len);
+
+	private:
+		uint8_t addr;
+		size_t num_registers;
+		uint32_t *registers;
+		uint16_t selected;
+		uint16_t set_queue[I2CSLAVE_SET_QUEUE];
+		uint8_t set_head;
+		uint8_t set_len;
+		pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PARTICLE_H
+#define PARTICLE_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "host.h"
+
+//Just enough of the Particle device OS for the Photon firmware to run as a
+//Linux process. The system thread is the process's main thread, calling
+//loop() until it is killed.
+
+//The firmware's system thread setting has nothing to switch here.
+#define SYSTEM_THREAD(mode)
+
+typedef void *os_mutex_t;
+
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_lock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+void os_thread_yield();
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+class SerialPort
+{
+	public:
+		void begin(int baud);
+		void printf(const char *format, ...);
+		void printlnf(const char *format, ...);
+};
+
+extern SerialPort Serial;
+
+//The I2C peripheral. The bus itself is the host's socket.
+class TwoWire
+{
+};
+
+extern TwoWire Wire;
+
+class Thread
+{
+	public:
+		Thread(const char *name, void (*fn)());
+};
+
+void setup();
+void loop();
+
+#endif
@@ -0,0 +1,432 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "host.h"
+
+//Enough for the compute thread and anything else a firmware starts.
+#define HOST_MAX_THREADS 8
+
+static void *host_listen_thread(void *arg);
+static void *host_connection_thread(void *arg);
+static bool host_recv_all(const int fd, uint8_t *des, const uint32_t len);
+static void *host_governor_thread(void *arg);
+static void host_throttle_handler(int sig);
+static void *host_thread_main(void *arg);
+
+static host_config config =
+{
+	"",
+	HOST_DEFAULT_BUS_KHZ,
+	0,
+	1,
+	false
+};
+
+static uint8_t device_addr;
+static const host_device *device;
+static int listen_fd = -1;
+
+//One transaction at a time, however many connections the master opens.
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Wakes firmware loops waiting for the master.
+static pthread_mutex_t activity_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t activity = PTHREAD_COND_INITIALIZER;
+static uint32_t activity_count;
+
+static pthread_t threads[HOST_MAX_THREADS];
+static uint8_t num_threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reads the command line of a host slave. Without -v the firmware's serial
+ * output is dropped, so many slaves can share a terminal.
+ * @param  argc The argument count.
+ * @param  argv The arguments.
+ * @param  name The program name for the usage message.
+ * @return      True if the slave should start.
+ */
+bool host_parse_args(int argc, char **argv, const char *name)
+{
+	int opt;
+
+	//-l is where to listen, unix:path or tcp:port.
+	//-k is the bus clock in kHz, or 0 for an instant bus.
+	//-d adds latency to every transaction, -s slows the compute threads.
+	while ((opt = getopt(argc, argv, "l:k:d:s:v")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l':
+				strncpy(config.listen, optarg, HOST_LISTEN_LEN -1);
+				break;
+			case 'k':
+				config.bus_khz = atoi(optarg);
+				break;
+			case 'd':
+				config.latency_us = atoi(optarg);
+				break;
+			case 's':
+				config.slowdown = atoi(optarg) > 1 ? atoi(optarg) : 1;
+				break;
+			case 'v':
+				config.verbose = true;
+				break;
+			default:
+				config.listen[0] = '\0';
+				break;
+		}
+	}
+
+	if (config.listen[0] == '\0')
+	{
+		fprintf(stderr, "Usage: %s -l unix:path|tcp:port [-k bus_khz] [-d latency_us] [-s slowdown] [-v]\n", name);
+		return false;
+	}
+
+	if (! config.verbose && freopen("/dev/null", "w", stdout) == NULL)
+		return false;
+
+	//A master going away mid-answer is not the slave's problem.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (config.slowdown > 1)
+	{
+		pthread_t governor;
+		struct sigaction throttle;
+
+		memset(&throttle, 0, sizeof(throttle));
+		throttle.sa_handler = host_throttle_handler;
+		sigaction(SIGUSR1, &throttle, NULL);
+		if (pthread_create(&governor, NULL, host_governor_thread, NULL) != 0)
+			return false;
+		pthread_detach(governor);
+	}
+
+	return true;
+}
+
+/**
+ * Gets the configuration the slave was started with.
+ * @return A pointer to the host_config.
+ */
+const host_config *host_get_config()
+{
+	return &config;
+}
+
+/**
+ * Starts answering the master's transactions for a device. Only the first
+ * device a process serves is used.
+ * @param  addr The device's 7-bit address. Transactions for others are refused.
+ * @param  dev  A pointer to what the device does with transactions.
+ * @return      True if the slave is listening.
+ */
+bool host_serve(const uint8_t addr, const host_device *dev)
+{
+	pthread_t listener;
+	int flag = 1;
+
+	if (listen_fd >= 0)
+		return false;
+
+	device_addr = addr;
+	device = dev;
+
+	if (strncmp(config.listen, "unix:", 5) == 0)
+	{
+		struct sockaddr_un sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		if (strlen(config.listen + 5) >= sizeof(sa.sun_path))
+		{
+			fprintf(stderr, "Socket path too long: %s\n", config.listen + 5);
+			return false;
+		}
+		strcpy(sa.sun_path, config.listen + 5);
+		unlink(sa.sun_path);
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		{
+			fprintf(stderr, "Cannot listen on %s\n", config.listen);
+			return false;
+		}
+	}
+	else if (strncmp(config.listen, "tcp:", 4) == 0)
+	{
+		struct sockaddr_in sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_ANY);
+		sa.sin_port = htons(atoi(config.listen + 4));
+
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0 ||
+			bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		{
+			fprintf(stderr, "Cannot listen on %s\n", config.listen);
+			return false;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "Unknown listen target %s\n", config.listen);
+		return false;
+	}
+
+	if (listen(listen_fd, 4) < 0 || pthread_create(&listener, NULL, host_listen_thread, NULL) != 0)
+		return false;
+	pthread_detach(listener);
+
+	fprintf(stderr, "Slave 0x%02x listening on %s\n", addr, config.listen);
+	return true;
+}
+
+/**
+ * Accepts the master's connections, each served on its own thread.
+ * @param  arg Unused.
+ * @return     NULL.
+ */
+static void *host_listen_thread(void *arg)
+{
+	while (1)
+	{
+		pthread_t connection;
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		if (pthread_create(&connection, NULL, host_connection_thread, (void *)(intptr_t)fd) != 0)
+		{
+			close(fd);
+			continue;
+		}
+		pthread_detach(connection);
+	}
+
+	return NULL;
+}
+
+/**
+ * Carries out one connection's transactions until the master hangs up.
+ * A transaction for another address is refused by hanging up, as an I2C
+ * slave would leave it unacknowledged. So is a general call the device
+ * doesn't answer, or one that tries to read.
+ * @param  arg The connection's file descriptor.
+ * @return     NULL.
+ */
+static void *host_connection_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	int flag = 1;
+	uint8_t header[HOST_HEADER];
+	uint8_t buffer[HOST_TRANSACTION_MAX];
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	while (host_recv_all(fd, header, HOST_HEADER))
+	{
+		uint8_t write_len = header[HOST_WRITE_LEN_BYTE];
+		uint8_t read_len = header[HOST_READ_LEN_BYTE];
+
+		bool general = header[HOST_ADDR_BYTE] == HOST_GENERAL_CALL_ADDR && device->general != NULL && read_len == 0;
+
+		if (! host_recv_all(fd, buffer, write_len) || (header[HOST_ADDR_BYTE] != device_addr && ! general))
+			break;
+
+		pthread_mutex_lock(&bus_lock);
+
+		//The time the bytes would have spent on the wire.
+		uint32_t bus_us = config.latency_us;
+		if (config.bus_khz > 0)
+			bus_us += (1 + write_len + read_len) * HOST_BITS_PER_BYTE * 1000 / config.bus_khz;
+		host_sleep_us(bus_us);
+
+		if (general)
+			device->general(buffer, write_len);
+		else if (write_len > 0)
+			device->write(buffer, write_len);
+		if (read_len > 0)
+			device->read(buffer, read_len);
+
+		pthread_mutex_unlock(&bus_lock);
+
+		if (read_len > 0 && send(fd, buffer, read_len, MSG_NOSIGNAL) != read_len)
+			break;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/**
+ * Reads exactly len bytes from a socket.
+ * @param  fd  The socket.
+ * @param  des A pointer to len bytes used to store them.
+ * @param  len The number of bytes.
+ * @return     False if the connection closed first.
+ */
+static bool host_recv_all(const int fd, uint8_t *des, const uint32_t len)
+{
+	uint32_t done = 0;
+
+	while (done < len)
+	{
+		ssize_t got = recv(fd, des + done, len - done, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+
+	return true;
+}
+
+/**
+ * Wakes anything waiting in host_wait_activity.
+ */
+void host_notify()
+{
+	pthread_mutex_lock(&activity_lock);
+	activity_count++;
+	pthread_cond_broadcast(&activity);
+	pthread_mutex_unlock(&activity_lock);
+}
+
+/**
+ * Gets a count of what the master has done, for host_wait_activity.
+ * @return The count.
+ */
+uint32_t host_get_activity()
+{
+	uint32_t result;
+
+	pthread_mutex_lock(&activity_lock);
+	result = activity_count;
+	pthread_mutex_unlock(&activity_lock);
+
+	return result;
+}
+
+/**
+ * Waits for the master to do something, so idle firmware loops don't spin.
+ * Returns at once if it already has since the count was taken.
+ * @param seen       The count from host_get_activity before the loop last ran.
+ * @param timeout_us The most microseconds to wait.
+ */
+void host_wait_activity(const uint32_t seen, const uint32_t timeout_us)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += (long)timeout_us * 1000;
+	until.tv_sec += until.tv_nsec / 1000000000;
+	until.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&activity_lock);
+	while (activity_count == seen)
+		if (pthread_cond_timedwait(&activity, &activity_lock, &until) != 0)
+			break;
+	pthread_mutex_unlock(&activity_lock);
+}
+
+/**
+ * Starts a firmware thread. Threads started here are the ones slowed down.
+ * @param  fn The thread's function.
+ * @return    True if the thread started.
+ */
+bool host_thread_start(void (*fn)())
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, host_thread_main, (void *)fn) != 0)
+		return false;
+
+	pthread_mutex_lock(&threads_lock);
+	if (num_threads < HOST_MAX_THREADS)
+		threads[num_threads++] = thread;
+	pthread_mutex_unlock(&threads_lock);
+
+	return true;
+}
+
+/**
+ * Runs a firmware thread's function.
+ * @param  arg The function.
+ * @return     NULL.
+ */
+static void *host_thread_main(void *arg)
+{
+	((void (*)())arg)();
+	return NULL;
+}
+
+/**
+ * Slows the firmware threads down by the configured factor. Each gets a
+ * signal every period and sleeps in the handler for all but a slice of it.
+ * @param  arg Unused.
+ * @return     NULL.
+ */
+static void *host_governor_thread(void *arg)
+{
+	while (1)
+	{
+		host_sleep_us(HOST_THROTTLE_SLICE_US * config.slowdown);
+
+		pthread_mutex_lock(&threads_lock);
+		for (uint8_t i=0; i<num_threads; ++i)
+			pthread_kill(threads[i], SIGUSR1);
+		pthread_mutex_unlock(&threads_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Stalls a throttled thread for its share of the period.
+ * @param sig The signal number.
+ */
+static void host_throttle_handler(int sig)
+{
+	host_sleep_us(HOST_THROTTLE_SLICE_US * (config.slowdown -1));
+}
+
+/**
+ * Reads a monotonic clock.
+ * @return The current time in microseconds.
+ */
+uint64_t host_now_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Sleeps for a while, carrying on after signals. Safe in signal handlers.
+ * @param us The number of microseconds.
+ */
+void host_sleep_us(const uint32_t us)
+{
+	struct timespec left;
+
+	left.tv_sec = us / 1000000;
+	left.tv_nsec = (long)(us % 1000000) * 1000;
+	while (nanosleep(&left, &left) < 0 && errno == EINTR)
+		;
+}
@@ -0,0 +1,63 @@
+#ifndef HOST_H
+#define HOST_H
+#include <stdint.h>
+#include <stdbool.h>
+
+//Slaves built for the host listen on a socket that the master reaches with
+//its unix: or tcp: transport (see master/transport.h). Every transaction is
+//a header of slave address, write length and read length, then the bytes
+//written. The slave answers with exactly the read length in bytes.
+#define HOST_ADDR_BYTE 0x0
+#define HOST_WRITE_LEN_BYTE 0x1
+#define HOST_READ_LEN_BYTE 0x2
+#define HOST_HEADER 0x3
+#define HOST_TRANSACTION_MAX 0xff
+
+//Writes to the general call address reach the device too, if it answers it.
+#define HOST_GENERAL_CALL_ADDR 0x0
+#define HOST_LISTEN_LEN 108
+
+//The bus a board would sit on. Each byte, the address included, takes nine
+//clocks. A fixed latency per transaction comes on top.
+#define HOST_DEFAULT_BUS_KHZ 100
+#define HOST_BITS_PER_BYTE 9
+
+//Throttled compute threads run for a slice, then sleep for the rest of
+//the period their slowdown makes up.
+#define HOST_THROTTLE_SLICE_US 2000
+
+//How long a firmware loop with nothing to do waits for the master before
+//going round again, and how long a yielding thread gives up the core.
+#define HOST_IDLE_WAIT_US 1000
+#define HOST_YIELD_US 100
+
+typedef struct
+{
+	char listen[HOST_LISTEN_LEN];
+	uint32_t bus_khz;
+	uint32_t latency_us;
+	uint32_t slowdown;
+	bool verbose;
+} host_config;
+
+//What a simulated I2C slave does with the master's transactions. All are
+//called on the bus thread, one transaction at a time. Devices that ignore
+//the general call address leave general NULL.
+typedef struct
+{
+	void (*write)(const uint8_t *src, const uint8_t len);
+	void (*read)(uint8_t *des, const uint8_t len);
+	void (*general)(const uint8_t *src, const uint8_t len);
+} host_device;
+
+bool host_parse_args(int argc, char **argv, const char *name);
+const host_config *host_get_config();
+bool host_serve(const uint8_t addr, const host_device *device);
+void host_notify();
+uint32_t host_get_activity();
+void host_wait_activity(const uint32_t seen, const uint32_t timeout_us);
+bool host_thread_start(void (*fn)());
+uint64_t host_now_us();
+void host_sleep_us(const uint32_t us);
+
+#endif
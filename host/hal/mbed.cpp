@@ -0,0 +1,282 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "mbed.h"
+#include "host.h"
+
+//The firmware's own main(), renamed when it is built for the host.
+int mbed_main();
+
+//The transaction the master is waiting on, if any, handed between the bus
+//thread and the firmware's main loop.
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_changed = PTHREAD_COND_INITIALIZER;
+static int pending = I2CSlave::NoData;
+static bool pending_done;
+static uint8_t pending_data[HOST_TRANSACTION_MAX];
+static uint8_t pending_len;
+
+static uint64_t started_us;
+
+/**
+ * Hands a transaction to the firmware and waits until it has been dealt with.
+ * @param kind The I2CSlave::receive() value the firmware sees.
+ */
+static void mbed_bus_transact(const int kind)
+{
+	pthread_mutex_lock(&pending_lock);
+	pending = kind;
+	pending_done = false;
+	pthread_cond_broadcast(&pending_changed);
+	while (! pending_done)
+		pthread_cond_wait(&pending_changed, &pending_lock);
+	pending = I2CSlave::NoData;
+	pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+ * Passes a write from the master to the firmware.
+ * @param src A pointer to the bytes written.
+ * @param len The number of bytes.
+ */
+static void mbed_bus_write(const uint8_t *src, const uint8_t len)
+{
+	memcpy(pending_data, src, len);
+	pending_len = len;
+	mbed_bus_transact(I2CSlave::WriteAddressed);
+}
+
+/**
+ * Passes a general call write from the master to the firmware. mbed's
+ * I2CSlave answers the general call address as well as its own.
+ * @param src A pointer to the bytes written.
+ * @param len The number of bytes.
+ */
+static void mbed_bus_general(const uint8_t *src, const uint8_t len)
+{
+	memcpy(pending_data, src, len);
+	pending_len = len;
+	mbed_bus_transact(I2CSlave::WriteGeneral);
+}
+
+/**
+ * Gets the firmware's answer to a read from the master. Bytes it doesn't
+ * write read as 0.
+ * @param des A pointer to len bytes used to store the answer.
+ * @param len The number of bytes.
+ */
+static void mbed_bus_read(uint8_t *des, const uint8_t len)
+{
+	memset(pending_data, 0, len);
+	pending_len = len;
+	mbed_bus_transact(I2CSlave::ReadAddressed);
+	memcpy(des, pending_data, len);
+}
+
+static const host_device mbed_bus = { mbed_bus_write, mbed_bus_read, mbed_bus_general };
+
+/**
+ * Finishes the pending transaction if it is of a kind, copying len bytes
+ * from src into it or out of it into des. General call writes are taken
+ * as writes.
+ * @param  kind The kind of transaction expected.
+ * @param  src  A pointer to bytes for a read, or NULL.
+ * @param  des  A pointer to storage for a write, or NULL.
+ * @param  len  The most bytes to copy.
+ * @return      0 on success, or -1 if no such transaction was pending.
+ */
+static int mbed_bus_finish(const int kind, const char *src, char *des, const int len)
+{
+	int result = -1;
+
+	pthread_mutex_lock(&pending_lock);
+	if ((pending == kind || (kind == I2CSlave::WriteAddressed && pending == I2CSlave::WriteGeneral)) && ! pending_done)
+	{
+		int count = len < pending_len ? len : pending_len;
+		if (src != NULL)
+			memcpy(pending_data, src, count);
+		if (des != NULL)
+		{
+			memcpy(des, pending_data, count);
+			memset(des + count, 0, len - count);
+		}
+		pending_done = true;
+		pthread_cond_broadcast(&pending_changed);
+		result = 0;
+	}
+	pthread_mutex_unlock(&pending_lock);
+
+	return result;
+}
+
+/**
+ * Creates an I2C slave. It listens once the firmware sets its address.
+ * @param sda Unused.
+ * @param scl Unused.
+ */
+I2CSlave::I2CSlave(PinName sda, PinName scl)
+{
+}
+
+/**
+ * Sets the bus clock. The host's is set on the command line.
+ * @param hz Unused.
+ */
+void I2CSlave::frequency(int hz)
+{
+}
+
+/**
+ * Sets the slave's address and starts answering the master.
+ * @param addr The 8-bit address, as mbed takes it.
+ */
+void I2CSlave::address(int addr)
+{
+	if (! host_serve(addr >> 1, &mbed_bus))
+		exit(1);
+}
+
+/**
+ * Checks whether the master is addressing the slave, waiting a little for
+ * it when it isn't so the firmware's main loop doesn't spin.
+ * @return NoData, ReadAddressed, WriteGeneral or WriteAddressed.
+ */
+int I2CSlave::receive()
+{
+	struct timespec until;
+	int result;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += (long)HOST_IDLE_WAIT_US * 1000;
+	until.tv_sec += until.tv_nsec / 1000000000;
+	until.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&pending_lock);
+	if (pending == NoData || pending_done)
+		pthread_cond_timedwait(&pending_changed, &pending_lock, &until);
+	result = pending_done ? NoData : pending;
+	pthread_mutex_unlock(&pending_lock);
+
+	return result;
+}
+
+/**
+ * Takes the bytes the master wrote. Room the master didn't fill is zeroed.
+ * @param  data   A pointer to length bytes used to store them.
+ * @param  length The size of data.
+ * @return        0 on success.
+ */
+int I2CSlave::read(char *data, int length)
+{
+	return mbed_bus_finish(WriteAddressed, NULL, data, length);
+}
+
+/**
+ * Takes a single byte the master wrote.
+ * @return The byte, or -1 if nothing was written.
+ */
+int I2CSlave::read()
+{
+	char data;
+	return mbed_bus_finish(WriteAddressed, NULL, &data, 1) == 0 ? (uint8_t)data : -1;
+}
+
+/**
+ * Answers the master's read.
+ * @param  data   A pointer to the bytes to send.
+ * @param  length The number of bytes.
+ * @return        0 on success.
+ */
+int I2CSlave::write(const char *data, int length)
+{
+	return mbed_bus_finish(ReadAddressed, data, NULL, length);
+}
+
+/**
+ * Answers the master's read with a single byte.
+ * @param  data The byte.
+ * @return      0 on success.
+ */
+int I2CSlave::write(int data)
+{
+	char byte = data;
+	return mbed_bus_finish(ReadAddressed, &byte, NULL, 1);
+}
+
+/**
+ * Releases the bus. Transactions end on their own on the host.
+ */
+void I2CSlave::stop()
+{
+}
+
+/**
+ * Starts the thread running a function.
+ * @param  fn The function.
+ * @return    0 on success.
+ */
+int Thread::start(void (*fn)())
+{
+	return host_thread_start(fn) ? 0 : -1;
+}
+
+/**
+ * Sleeps the calling thread.
+ * @param ms The number of milliseconds.
+ */
+void Thread::wait(int ms)
+{
+	host_sleep_us(ms * 1000);
+}
+
+/**
+ * Creates an unlocked mutex.
+ */
+Mutex::Mutex()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+/**
+ * Locks the mutex.
+ */
+void Mutex::lock()
+{
+	pthread_mutex_lock(&mutex);
+}
+
+/**
+ * Unlocks the mutex.
+ */
+void Mutex::unlock()
+{
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Reads the microsecond ticker, which wraps like the device's.
+ * @return The microseconds since the firmware started.
+ */
+uint32_t us_ticker_read()
+{
+	return host_now_us() - started_us;
+}
+
+/**
+ * Runs the mbed firmware once the host has read its command line.
+ * @param  argc The argument count.
+ * @param  argv The arguments.
+ * @return      1 if the slave couldn't start.
+ */
+int main(int argc, char **argv)
+{
+	if (! host_parse_args(argc, argv, argv[0]))
+		return 1;
+
+	started_us = host_now_us();
+	return mbed_main();
+}
@@ -0,0 +1,66 @@
+#ifndef MBED_H
+#define MBED_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "host.h"
+
+//Just enough of mbed OS 5 for the mbed firmware to run as a Linux process.
+//The firmware's main() is built as mbed_main() and run after the host has
+//read its command line.
+
+enum PinName
+{
+	p9,
+	p10,
+	p27,
+	p28
+};
+
+//An I2C slave the firmware polls, as on the device. A transaction from the
+//master waits until the firmware has picked it up with read() or answered
+//it with write().
+class I2CSlave
+{
+	public:
+		enum
+		{
+			NoData,
+			ReadAddressed,
+			WriteGeneral,
+			WriteAddressed
+		};
+
+		I2CSlave(PinName sda, PinName scl);
+		void frequency(int hz);
+		void address(int addr);
+		int receive();
+		int read(char *data, int length);
+		int read();
+		int write(const char *data, int length);
+		int write(int data);
+		void stop();
+};
+
+class Thread
+{
+	public:
+		int start(void (*fn)());
+		static void wait(int ms);
+};
+
+class Mutex
+{
+	public:
+		Mutex();
+		void lock();
+		void unlock();
+
+	private:
+		pthread_mutex_t mutex;
+};
+
+uint32_t us_ticker_read();
+
+#endif
@@ -0,0 +1,311 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "Particle.h"
+#include "I2CSlaveRK.h"
+#include "host.h"
+
+SerialPort Serial;
+TwoWire Wire;
+
+//The firmware has one I2C slave, which the bus hands transactions to.
+static I2CSlave *bus_device;
+
+static uint64_t started_us;
+
+/**
+ * Passes a write from the master to the register file.
+ * @param src A pointer to the bytes written.
+ * @param len The number of bytes.
+ */
+static void particle_bus_write(const uint8_t *src, const uint8_t len)
+{
+	bus_device->masterWrite(src, len);
+	host_notify();
+}
+
+/**
+ * Answers a read from the master out of the register file.
+ * @param des A pointer to len bytes used to store the answer.
+ * @param len The number of bytes.
+ */
+static void particle_bus_read(uint8_t *des, const uint8_t len)
+{
+	bus_device->masterRead(des, len);
+}
+
+//The firmware has the Photon answer general calls too, which land in the
+//register file like any other write.
+static const host_device particle_bus = { particle_bus_write, particle_bus_read, particle_bus_write };
+
+/**
+ * Creates a mutex.
+ * @param  mutex A pointer used to store the mutex.
+ * @return       0 on success.
+ */
+int os_mutex_create(os_mutex_t *mutex)
+{
+	pthread_mutex_t *m = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+
+	if (m == NULL || pthread_mutex_init(m, NULL) != 0)
+		return -1;
+	*mutex = m;
+	return 0;
+}
+
+/**
+ * Locks a mutex.
+ * @param  mutex The mutex.
+ * @return       0 on success.
+ */
+int os_mutex_lock(os_mutex_t mutex)
+{
+	return pthread_mutex_lock((pthread_mutex_t *)mutex);
+}
+
+/**
+ * Unlocks a mutex.
+ * @param  mutex The mutex.
+ * @return       0 on success.
+ */
+int os_mutex_unlock(os_mutex_t mutex)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+/**
+ * Lets other threads run. An idle compute thread calls this in a loop, so
+ * it gives up the core for a little while rather than spinning.
+ */
+void os_thread_yield()
+{
+	host_sleep_us(HOST_YIELD_US);
+}
+
+/**
+ * Gets the time since the firmware started.
+ * @return The time in milliseconds.
+ */
+unsigned long millis()
+{
+	return (host_now_us() - started_us) / 1000;
+}
+
+/**
+ * Gets the time since the firmware started.
+ * @return The time in microseconds.
+ */
+unsigned long micros()
+{
+	return host_now_us() - started_us;
+}
+
+/**
+ * Sleeps the calling thread.
+ * @param ms The number of milliseconds.
+ */
+void delay(unsigned long ms)
+{
+	host_sleep_us(ms * 1000);
+}
+
+/**
+ * Opens the serial port. Output goes to stdout.
+ * @param baud Unused.
+ */
+void SerialPort::begin(int baud)
+{
+}
+
+/**
+ * Writes formatted output to the serial port.
+ * @param format The printf format.
+ */
+void SerialPort::printf(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+/**
+ * Writes formatted output and a line ending to the serial port.
+ * @param format The printf format.
+ */
+void SerialPort::printlnf(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	::printf("\n");
+	fflush(stdout);
+}
+
+/**
+ * Starts a thread running a function.
+ * @param name Unused.
+ * @param fn   The function.
+ */
+Thread::Thread(const char *name, void (*fn)())
+{
+	if (! host_thread_start(fn))
+		fprintf(stderr, "Cannot start thread %s\n", name);
+}
+
+/**
+ * Creates an I2C slave with a register file.
+ * @param wire          Unused.
+ * @param addr          The slave's 7-bit address.
+ * @param num_registers The number of 32-bit registers.
+ */
+I2CSlave::I2CSlave(TwoWire &wire, uint8_t addr, size_t num_registers)
+{
+	this->addr = addr;
+	this->num_registers = num_registers;
+	registers = (uint32_t *)calloc(num_registers, sizeof(uint32_t));
+	selected = 0;
+	set_head = 0;
+	set_len = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+/**
+ * Starts answering the master.
+ */
+void I2CSlave::begin()
+{
+	bus_device = this;
+	if (! host_serve(addr, &particle_bus))
+		exit(1);
+}
+
+/**
+ * Checks whether the master has written a register since the last check.
+ * @param  reg_addr Used to store the first register of the write.
+ * @return          True if there was a write.
+ */
+bool I2CSlave::getRegisterSet(uint16_t &reg_addr)
+{
+	bool result = false;
+
+	pthread_mutex_lock(&lock);
+	if (set_len > 0)
+	{
+		reg_addr = set_queue[set_head];
+		set_head = (set_head +1) % I2CSLAVE_SET_QUEUE;
+		set_len--;
+		result = true;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return result;
+}
+
+/**
+ * Reads a register.
+ * @param  reg_addr The register.
+ * @return          Its value, or 0 if there is no such register.
+ */
+uint32_t I2CSlave::getRegister(uint16_t reg_addr)
+{
+	uint32_t result = 0;
+
+	pthread_mutex_lock(&lock);
+	if (reg_addr < num_registers)
+		result = registers[reg_addr];
+	pthread_mutex_unlock(&lock);
+
+	return result;
+}
+
+/**
+ * Sets a register for the master to read.
+ * @param reg_addr The register.
+ * @param value    The value.
+ */
+void I2CSlave::setRegister(uint16_t reg_addr, uint32_t value)
+{
+	pthread_mutex_lock(&lock);
+	if (reg_addr < num_registers)
+		registers[reg_addr] = value;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Carries out a write from the master: the register address, then any
+ * bytes to store from there on.
+ * @param src A pointer to the bytes written.
+ * @param len The number of bytes.
+ */
+void I2CSlave::masterWrite(const uint8_t *src, const uint8_t len)
+{
+	if (len < 2)
+		return;
+
+	pthread_mutex_lock(&lock);
+	selected = src[0] | (src[1] << 8);
+	for (uint8_t i=2; i<len; ++i)
+	{
+		size_t reg = selected + (i - 2) / 4;
+		uint8_t shift = ((i - 2) % 4) * 8;
+		if (reg < num_registers)
+			registers[reg] = (registers[reg] & ~(0xffu << shift)) | ((uint32_t)src[i] << shift);
+	}
+
+	//Only writes carrying data count as setting a register.
+	if (len > 2 && set_len < I2CSLAVE_SET_QUEUE)
+	{
+		set_queue[(set_head + set_len) % I2CSLAVE_SET_QUEUE] = selected;
+		set_len++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Answers a read from the master with the registers from the last
+ * addressed one on.
+ * @param des A pointer to len bytes used to store the answer.
+ * @param len The number of bytes.
+ */
+void I2CSlave::masterRead(uint8_t *des, const uint8_t len)
+{
+	pthread_mutex_lock(&lock);
+	for (uint8_t i=0; i<len; ++i)
+	{
+		size_t reg = selected + i / 4;
+		des[i] = reg < num_registers ? (registers[reg] >> ((i % 4) * 8)) & 0xff : 0x0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Runs the Photon firmware: setup() once, then loop() for as long as the
+ * process lives, waiting for the master whenever it has nothing to do.
+ * @param  argc The argument count.
+ * @param  argv The arguments.
+ * @return      1 if the slave couldn't start.
+ */
+int main(int argc, char **argv)
+{
+	if (! host_parse_args(argc, argv, argv[0]))
+		return 1;
+
+	started_us = host_now_us();
+	setup();
+
+	while (1)
+	{
+		uint32_t seen = host_get_activity();
+		loop();
+		host_wait_activity(seen, HOST_IDLE_WAIT_US);
+	}
+
+	return 0;
+}
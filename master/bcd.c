@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "bcd.h"
+
+/**
+ * Reads a digit from a packed buffer.
+ * @param  packed A pointer to the packed digits.
+ * @param  idx    The index of the digit, starting from 0.
+ * @return        The digit.
+ */
+uint8_t bcd_get(const uint8_t *packed, const uint32_t idx)
+{
+	return (idx & 0x1) ? packed[idx / 2] & 0xf : packed[idx / 2] >> 4;
+}
+
+/**
+ * Stores a digit in a packed buffer.
+ * @param packed A pointer to the packed digits.
+ * @param idx    The index of the digit, starting from 0.
+ * @param digit  The digit to store.
+ */
+void bcd_set(uint8_t *packed, const uint32_t idx, const uint8_t digit)
+{
+	if (idx & 0x1)
+		packed[idx / 2] = (packed[idx / 2] & 0xf0) | (digit & 0xf);
+	else
+		packed[idx / 2] = (packed[idx / 2] & 0x0f) | (digit << 4);
+}
+
+/**
+ * Unpacks digits to one a byte.
+ * @param  des    A pointer to count bytes used to store the digits.
+ * @param  packed A pointer to BCD_BYTES(count) packed bytes.
+ * @param  count  The number of digits to unpack.
+ * @return        False if a nibble isn't a decimal digit.
+ */
+bool bcd_unpack(uint8_t *des, const uint8_t *packed, const uint8_t count)
+{
+	for (uint8_t i=0; i<count; ++i)
+	{
+		des[i] = bcd_get(packed, i);
+		if (des[i] > 9)
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,15 @@
+#ifndef BCD_H
+#define BCD_H
+#include <stdint.h>
+#include <stdbool.h>
+
+//Decimal digits packed two a byte, the earlier digit in the high nibble. An
+//odd number of digits leaves BCD_FILL in the last low nibble.
+#define BCD_BYTES(count) (((count) + 1) / 2)
+#define BCD_FILL 0xf
+
+uint8_t bcd_get(const uint8_t *packed, const uint32_t idx);
+void bcd_set(uint8_t *packed, const uint32_t idx, const uint8_t digit);
+bool bcd_unpack(uint8_t *des, const uint8_t *packed, const uint8_t count);
+
+#endif
@@ -1,2 +1,2 @@
 #!/bin/bash
-gcc *.c -o bin/dca -lncurses
\ No newline at end of file
+gcc *.c lib/*.c -o bin/dca -lncurses -lm -lpthread
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include "bus.h"
+
+static i2c_bus buses[BUS_MAX_ADAPTERS];
+static uint8_t num_buses;
+static pthread_mutex_t buses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Finds an adapter that is already open. The caller holds buses_lock.
+ * @param  device The adapter's device path.
+ * @return        A pointer to the i2c_bus, or NULL if it isn't open.
+ */
+static i2c_bus *bus_find(const char *device)
+{
+	for (uint8_t i=0; i<num_buses; ++i)
+		if (buses[i].fd >= 0 && strcmp(buses[i].device, device) == 0)
+			return &buses[i];
+
+	return NULL;
+}
+
+/**
+ * Opens an I2C adapter, or shares it with the slaves already using it.
+ * @param  device The adapter's device path, e.g. /dev/i2c-1.
+ * @return        A pointer to the i2c_bus, or NULL if it couldn't be opened.
+ */
+i2c_bus *bus_open(const char *device)
+{
+	unsigned long funcs = 0;
+	i2c_bus *b;
+
+	if (strlen(device) >= BUS_DEVICE_LEN)
+		return NULL;
+
+	pthread_mutex_lock(&buses_lock);
+	if ((b = bus_find(device)) != NULL)
+	{
+		b->users++;
+		pthread_mutex_unlock(&buses_lock);
+		return b;
+	}
+
+	//Reuse the entry of an adapter every slave has let go of.
+	for (b = buses; b < buses + num_buses && b->fd >= 0; ++b)
+		;
+	if (b == buses + BUS_MAX_ADAPTERS)
+	{
+		pthread_mutex_unlock(&buses_lock);
+		return NULL;
+	}
+
+	//Request device access from the kernel.
+	if ((b->fd = open(device, O_RDWR)) < 0)
+	{
+		pthread_mutex_unlock(&buses_lock);
+		return NULL;
+	}
+
+	strcpy(b->device, device);
+	b->addr = BUS_NO_ADDR;
+	b->users = 1;
+	b->busy = false;
+	b->transactions = 0;
+	b->switches = 0;
+	memset(b->next_ticket, 0, sizeof(b->next_ticket));
+	memset(b->serving, 0, sizeof(b->serving));
+	memset(b->passed, 0, sizeof(b->passed));
+	memset(b->classes, 0, sizeof(b->classes));
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->turn, NULL);
+
+	//Combined transactions need an adapter that can do plain I2C messages.
+	b->combined = ioctl(b->fd, I2C_FUNCS, &funcs) >= 0 && (funcs & I2C_FUNC_I2C);
+
+	if (b == buses + num_buses)
+		num_buses++;
+	pthread_mutex_unlock(&buses_lock);
+
+	return b;
+}
+
+/**
+ * Points the adapter's plain reads and writes at a slave, unless it already
+ * is. The caller has the adapter.
+ * @param  b    A pointer to the i2c_bus.
+ * @param  addr The slave's 7-bit address.
+ * @return      True if the adapter is addressing the slave.
+ */
+static bool bus_address(i2c_bus *b, const uint8_t addr)
+{
+	if (b->addr == addr)
+		return true;
+
+	if (ioctl(b->fd, I2C_SLAVE, addr) < 0)
+	{
+		b->addr = BUS_NO_ADDR;
+		return false;
+	}
+
+	//The counters are read for reports under the lock, see bus_get_stats.
+	b->addr = addr;
+	pthread_mutex_lock(&b->lock);
+	b->switches++;
+	pthread_mutex_unlock(&b->lock);
+	return true;
+}
+
+/**
+ * Picks the class whose turn it is on the adapter: the first class with a
+ * transaction waiting, unless another has been passed over too often. The
+ * caller holds the adapter's lock.
+ * @param  b A pointer to the i2c_bus.
+ * @return   The BUS_CLASS, or BUS_CLASSES if nothing is waiting.
+ */
+static BUS_CLASS bus_next_class(const i2c_bus *b)
+{
+	BUS_CLASS result = BUS_CLASSES;
+
+	for (BUS_CLASS cls=0; cls<BUS_CLASSES; ++cls)
+	{
+		if (b->next_ticket[cls] == b->serving[cls])
+			continue;
+		if (b->passed[cls] >= BUS_FAIRNESS_LIMIT)
+			return cls;
+		if (result == BUS_CLASSES)
+			result = cls;
+	}
+
+	return result;
+}
+
+/**
+ * Waits for the adapter to be free and for a transaction's turn on it.
+ * @param b   A pointer to the i2c_bus.
+ * @param cls The transaction's class.
+ */
+static void bus_acquire(i2c_bus *b, const BUS_CLASS cls)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&b->lock);
+
+	uint32_t ticket = b->next_ticket[cls]++;
+	while (b->busy || bus_next_class(b) != cls || b->serving[cls] != ticket)
+		pthread_cond_wait(&b->turn, &b->lock);
+
+	b->busy = true;
+	b->serving[cls]++;
+	b->passed[cls] = 0;
+	for (BUS_CLASS other=0; other<BUS_CLASSES; ++other)
+		if (other != cls && b->next_ticket[other] != b->serving[other])
+			b->passed[other]++;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t wait_us = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+	b->classes[cls].grants++;
+	b->classes[cls].wait_us += wait_us;
+	if (wait_us > b->classes[cls].max_wait_us)
+		b->classes[cls].max_wait_us = wait_us;
+	b->transactions++;
+
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Hands the adapter on to whichever transaction's turn is next.
+ * @param b A pointer to the i2c_bus.
+ */
+static void bus_yield(i2c_bus *b)
+{
+	pthread_mutex_lock(&b->lock);
+	b->busy = false;
+	pthread_cond_broadcast(&b->turn);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Writes bytes to a slave on the adapter and then reads bytes back, with no
+ * other traffic on the adapter in between. Either part may be empty. Where
+ * the adapter allows it both parts are sent as one I2C_RDWR batch with a
+ * repeated START between them. The transaction waits its turn behind those
+ * of more urgent classes.
+ * @param  b       A pointer to the i2c_bus.
+ * @param  addr    The slave's 7-bit address.
+ * @param  cls     The transaction's BUS_CLASS.
+ * @param  src     A pointer to src_len bytes to write, or NULL.
+ * @param  src_len The number of bytes to write.
+ * @param  des     A pointer to des_len bytes used to store what was read, or NULL.
+ * @param  des_len The number of bytes to read.
+ * @return         True if every byte went through, otherwise false.
+ */
+bool bus_transact(i2c_bus *b, const uint8_t addr, const BUS_CLASS cls, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len)
+{
+	struct i2c_msg msgs[2];
+	uint8_t n = 0;
+	bool ok;
+
+	if (src_len > 0)
+		msgs[n++] = (struct i2c_msg){ .addr = addr, .flags = 0, .len = src_len, .buf = (uint8_t *)src };
+	if (des_len > 0)
+		msgs[n++] = (struct i2c_msg){ .addr = addr, .flags = I2C_M_RD, .len = des_len, .buf = des };
+	if (n > 0)
+		return bus_transact_msgs(b, msgs, n, cls);
+
+	//Nothing to send; only point the adapter at the slave.
+	bus_acquire(b, cls < BUS_CLASSES ? cls : BUS_CLASS_POLL);
+	ok = bus_address(b, addr);
+	bus_yield(b);
+	return ok;
+}
+
+/**
+ * Carries out a sequence of writes and reads, to one slave or several, with
+ * no other traffic on the adapter in between. Where the adapter allows it
+ * they are sent as one I2C_RDWR batch with a repeated START between each;
+ * otherwise they go out one after the other, stopping at the first that
+ * fails. The transaction waits its turn behind those of more urgent classes.
+ * @param  b    A pointer to the i2c_bus.
+ * @param  msgs A pointer to n messages, each with its own slave address.
+ * @param  n    The number of messages.
+ * @param  cls  The transaction's BUS_CLASS.
+ * @return      True if every byte of every message went through, otherwise false.
+ */
+bool bus_transact_msgs(i2c_bus *b, struct i2c_msg *msgs, const uint8_t n, const BUS_CLASS cls)
+{
+	bool ok = true;
+
+	bus_acquire(b, cls < BUS_CLASSES ? cls : BUS_CLASS_POLL);
+
+	//A lone message gains nothing from a batch, and plain reads and writes
+	//work on every adapter.
+	if (n > 1 && b->combined)
+	{
+		struct i2c_rdwr_ioctl_data batch = { .msgs = msgs, .nmsgs = n };
+
+		ok = ioctl(b->fd, I2C_RDWR, &batch) == n;
+	}
+	else
+	{
+		for (uint8_t i=0; i<n && ok; ++i)
+		{
+			if (! bus_address(b, msgs[i].addr))
+				ok = false;
+			else if (msgs[i].flags & I2C_M_RD)
+				ok = read(b->fd, msgs[i].buf, msgs[i].len) == msgs[i].len;
+			else
+				ok = write(b->fd, msgs[i].buf, msgs[i].len) == msgs[i].len;
+		}
+	}
+
+	bus_yield(b);
+	return ok;
+}
+
+/**
+ * Lets go of an adapter. It is closed once no slave is using it.
+ * @param b A pointer to the i2c_bus.
+ */
+void bus_release(i2c_bus *b)
+{
+	pthread_mutex_lock(&buses_lock);
+	if (b->users > 0 && --b->users == 0)
+	{
+		close(b->fd);
+		b->fd = -1;
+		pthread_cond_destroy(&b->turn);
+		pthread_mutex_destroy(&b->lock);
+	}
+	pthread_mutex_unlock(&buses_lock);
+}
+
+/**
+ * Gets the number of adapters opened so far, for bus_get_stats. Slaves may
+ * still be opening adapters from their driver threads.
+ * @return The number of adapters.
+ */
+uint8_t bus_count()
+{
+	pthread_mutex_lock(&buses_lock);
+	uint8_t count = num_buses;
+	pthread_mutex_unlock(&buses_lock);
+
+	return count;
+}
+
+/**
+ * Copies the traffic counters of an adapter, e.g. to report on them while
+ * its slaves are still using it.
+ * @param  idx The adapter's index, below bus_count().
+ * @param  des A pointer to the bus_stats used to store the copy.
+ * @return     True if the adapter is open, false if idx is out of range or
+ *             every slave has let go of it.
+ */
+bool bus_get_stats(const uint8_t idx, bus_stats *des)
+{
+	bool open = false;
+
+	pthread_mutex_lock(&buses_lock);
+	if (idx < num_buses && buses[idx].fd >= 0)
+	{
+		i2c_bus *b = &buses[idx];
+
+		pthread_mutex_lock(&b->lock);
+		strcpy(des->device, b->device);
+		des->transactions = b->transactions;
+		des->switches = b->switches;
+		memcpy(des->classes, b->classes, sizeof(des->classes));
+		pthread_mutex_unlock(&b->lock);
+		open = true;
+	}
+	pthread_mutex_unlock(&buses_lock);
+
+	return open;
+}
+
+/**
+ * Converts a BUS_CLASS to a readable name.
+ * @param  cls The BUS_CLASS.
+ * @return     The name.
+ */
+const char *bus_get_class_str(const BUS_CLASS cls)
+{
+	switch (cls)
+	{
+		case BUS_CLASS_FEED:
+			return "feed";
+			break;
+		case BUS_CLASS_RESULT:
+			return "result";
+			break;
+		case BUS_CLASS_ORDER:
+			return "order";
+			break;
+		case BUS_CLASS_POLL:
+			return "poll";
+			break;
+		default:
+			return "unknown";
+	}
+}
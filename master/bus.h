@@ -0,0 +1,89 @@
+#ifndef BUS_H
+#define BUS_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <linux/i2c.h>
+
+//Every slave on an I2C adapter shares one descriptor for it. A transaction
+//has the adapter to itself from its first byte to its last, so a register
+//select and the read behind it are never split by traffic to another slave,
+//and the slave address is only switched when it changes. Slaves on
+//different adapters never wait on each other.
+#define BUS_MAX_ADAPTERS 4
+#define BUS_DEVICE_LEN 64
+
+//The adapter isn't addressing any slave yet.
+#define BUS_NO_ADDR 0xff
+
+//Transactions waiting for an adapter go in order of class, and in the order
+//they arrived within a class. A waiting class passed over this many times
+//in a row is served next whatever its class, so polls still get through
+//while orders and fetches keep coming.
+#define BUS_FAIRNESS_LIMIT 8
+
+typedef enum
+{
+	//Orders to workers with nothing queued, which sit idle until they land.
+	BUS_CLASS_FEED,
+	//Fetching results and freeing the slots they were in.
+	BUS_CLASS_RESULT,
+	//Orders topping up a queue the worker is already busy with.
+	BUS_CLASS_ORDER,
+	//Status polls, pings and acks that weren't ready the first time.
+	BUS_CLASS_POLL,
+	BUS_CLASSES
+} BUS_CLASS;
+
+typedef struct
+{
+	uint32_t grants;
+	uint64_t wait_us;
+	uint32_t max_wait_us;
+} bus_class_stats;
+
+typedef struct
+{
+	char device[BUS_DEVICE_LEN];
+	int fd;
+	uint8_t addr;
+	//Whether the adapter can send a write and a read as one I2C_RDWR batch.
+	bool combined;
+	uint8_t users;
+	//The arbiter. Each class hands out tickets and serves them in order.
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	bool busy;
+	uint32_t next_ticket[BUS_CLASSES];
+	uint32_t serving[BUS_CLASSES];
+	uint32_t passed[BUS_CLASSES];
+	//Transactions carried, how often the slave address had to change, and
+	//how long each class waited for the adapter.
+	uint32_t transactions;
+	uint32_t switches;
+	bus_class_stats classes[BUS_CLASSES];
+} i2c_bus;
+
+//A copy of an adapter's traffic counters, taken while it may be in use.
+typedef struct
+{
+	char device[BUS_DEVICE_LEN];
+	uint32_t transactions;
+	uint32_t switches;
+	bus_class_stats classes[BUS_CLASSES];
+} bus_stats;
+
+i2c_bus *bus_open(const char *device);
+bool bus_transact(i2c_bus *b, const uint8_t addr, const BUS_CLASS cls, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len);
+bool bus_transact_msgs(i2c_bus *b, struct i2c_msg *msgs, const uint8_t n, const BUS_CLASS cls);
+void bus_release(i2c_bus *b);
+uint8_t bus_count();
+bool bus_get_stats(const uint8_t idx, bus_stats *des);
+const char *bus_get_class_str(const BUS_CLASS cls);
+static i2c_bus *bus_find(const char *device);
+static bool bus_address(i2c_bus *b, const uint8_t addr);
+static BUS_CLASS bus_next_class(const i2c_bus *b);
+static void bus_acquire(i2c_bus *b, const BUS_CLASS cls);
+static void bus_yield(i2c_bus *b);
+
+#endif
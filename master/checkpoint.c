@@ -0,0 +1,204 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "checkpoint.h"
+
+//The on-disk layout is a header, the session table, the workers and finally
+//a CRC32 over everything before it. A checkpoint is
+//first written to a temporary file and only renamed over the previous one
+//once it is safely on disk, so a crash never leaves a half-written file.
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t elapsed_ms;
+	uint32_t current_schedule;
+	uint32_t num_workers;
+} checkpoint_header;
+
+/**
+ * Calculates a CRC32 (IEEE 802.3) over a block of memory.
+ * @param  crc  The running CRC, 0 to begin.
+ * @param  data A pointer to the data.
+ * @param  len  The number of bytes.
+ * @return      The updated CRC.
+ */
+static uint32_t checkpoint_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+	crc = ~crc;
+	while (len--)
+	{
+		crc ^= *data++;
+		for (uint8_t i=0; i<8; ++i)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/**
+ * Writes a block of memory to a file descriptor and updates the running CRC.
+ * @param  fd   The file descriptor.
+ * @param  crc  A pointer to the running CRC.
+ * @param  data A pointer to the data.
+ * @param  len  The number of bytes.
+ * @return      True if every byte was written.
+ */
+static bool checkpoint_put(int fd, uint32_t *crc, const void *data, size_t len)
+{
+	*crc = checkpoint_crc32(*crc, data, len);
+	return write(fd, data, len) == (ssize_t)len;
+}
+
+/**
+ * Reads a block of memory from a file descriptor and updates the running CRC.
+ * @param  fd   The file descriptor.
+ * @param  crc  A pointer to the running CRC.
+ * @param  data A pointer to the destination.
+ * @param  len  The number of bytes.
+ * @return      True if every byte was read.
+ */
+static bool checkpoint_get(int fd, uint32_t *crc, void *data, size_t len)
+{
+	if (read(fd, data, len) != (ssize_t)len)
+		return false;
+	*crc = checkpoint_crc32(*crc, data, len);
+	return true;
+}
+
+/**
+ * Atomically replaces the checkpoint file at a given path.
+ * @param  path The checkpoint file path.
+ * @param  cp   A pointer to the checkpoint to write.
+ * @return      A CHECKPOINT_STATUS code.
+ */
+CHECKPOINT_STATUS checkpoint_write(const char *path, const checkpoint *cp)
+{
+	char tmp_path[256], dir_path[256];
+	checkpoint_header header;
+	uint32_t crc = 0;
+	int fd;
+	bool ok;
+
+	if (cp->num_workers > CHECKPOINT_MAX_WORKERS)
+		return CHECKPOINT_STATUS_ERR_TOO_LARGE;
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+		return CHECKPOINT_STATUS_ERR_OPEN;
+
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return CHECKPOINT_STATUS_ERR_OPEN;
+
+	header.magic = CHECKPOINT_MAGIC;
+	header.version = CHECKPOINT_VERSION;
+	header.elapsed_ms = cp->elapsed_ms;
+	header.current_schedule = cp->current_schedule;
+	header.num_workers = cp->num_workers;
+
+	ok = checkpoint_put(fd, &crc, &header, sizeof(header))
+		&& checkpoint_put(fd, &crc, &cp->sessions, sizeof(session_table))
+		&& checkpoint_put(fd, &crc, cp->workers, cp->num_workers * sizeof(checkpoint_worker));
+
+	ok = ok && write(fd, &crc, sizeof(crc)) == sizeof(crc);
+	ok = ok && fsync(fd) == 0;
+	close(fd);
+
+	if (! ok || rename(tmp_path, path) != 0)
+	{
+		unlink(tmp_path);
+		return CHECKPOINT_STATUS_ERR_WRITE;
+	}
+
+	//Make the rename itself durable.
+	strncpy(dir_path, path, sizeof(dir_path) -1);
+	dir_path[sizeof(dir_path) -1] = '\0';
+	if ((fd = open(dirname(dir_path), O_RDONLY)) >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+
+	return CHECKPOINT_STATUS_OK;
+}
+
+/**
+ * Reads and validates a checkpoint file.
+ * @param  path The checkpoint file path.
+ * @param  cp   A pointer to the checkpoint to fill.
+ * @return      A CHECKPOINT_STATUS code.
+ */
+CHECKPOINT_STATUS checkpoint_read(const char *path, checkpoint *cp)
+{
+	checkpoint_header header;
+	uint32_t crc = 0, stored_crc;
+	int fd;
+	CHECKPOINT_STATUS result = CHECKPOINT_STATUS_OK;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return CHECKPOINT_STATUS_ERR_OPEN;
+
+	if (! checkpoint_get(fd, &crc, &header, sizeof(header)))
+		result = CHECKPOINT_STATUS_ERR_READ;
+	else if (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION)
+		result = CHECKPOINT_STATUS_ERR_FORMAT;
+	else if (header.num_workers > CHECKPOINT_MAX_WORKERS)
+		result = CHECKPOINT_STATUS_ERR_TOO_LARGE;
+
+	if (result == CHECKPOINT_STATUS_OK)
+	{
+		cp->elapsed_ms = header.elapsed_ms;
+		cp->current_schedule = header.current_schedule;
+		cp->num_workers = header.num_workers;
+
+		if (! checkpoint_get(fd, &crc, &cp->sessions, sizeof(session_table))
+			|| ! checkpoint_get(fd, &crc, cp->workers, cp->num_workers * sizeof(checkpoint_worker))
+			|| read(fd, &stored_crc, sizeof(stored_crc)) != sizeof(stored_crc))
+			result = CHECKPOINT_STATUS_ERR_READ;
+		else if (stored_crc != crc)
+			result = CHECKPOINT_STATUS_ERR_CHECKSUM;
+		else if (cp->sessions.num_sessions > SESSION_MAX)
+			result = CHECKPOINT_STATUS_ERR_FORMAT;
+	}
+
+	close(fd);
+	return result;
+}
+
+/**
+ * Removes a checkpoint file once its session has completed.
+ * @param path The checkpoint file path.
+ */
+void checkpoint_remove(const char *path)
+{
+	unlink(path);
+}
+
+/**
+ * Converts a given CHECKPOINT_STATUS value to a user-friendly string of characters.
+ * @param  status The CHECKPOINT_STATUS code.
+ * @return        A readable string of characters.
+ */
+const char *checkpoint_get_status_str(const CHECKPOINT_STATUS status)
+{
+	switch (status)
+	{
+		case CHECKPOINT_STATUS_OK:
+			return "OK";
+		case CHECKPOINT_STATUS_ERR_OPEN:
+			return "The checkpoint file could not be opened";
+		case CHECKPOINT_STATUS_ERR_WRITE:
+			return "There was an error writing the checkpoint file";
+		case CHECKPOINT_STATUS_ERR_READ:
+			return "The checkpoint file is truncated";
+		case CHECKPOINT_STATUS_ERR_FORMAT:
+			return "The file is not a checkpoint of this version";
+		case CHECKPOINT_STATUS_ERR_CHECKSUM:
+			return "The checkpoint file is corrupt";
+		case CHECKPOINT_STATUS_ERR_TOO_LARGE:
+			return "The session is too large to checkpoint";
+		default:
+			return "Unknown status";
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+#include "session.h"
+
+#define CHECKPOINT_MAGIC 0x43414344
+#define CHECKPOINT_VERSION 4
+#define CHECKPOINT_MAX_WORKERS 64
+#define CHECKPOINT_NAME_LEN 16
+
+typedef enum
+{
+	CHECKPOINT_STATUS_OK,
+	CHECKPOINT_STATUS_ERR_OPEN,
+	CHECKPOINT_STATUS_ERR_WRITE,
+	CHECKPOINT_STATUS_ERR_READ,
+	CHECKPOINT_STATUS_ERR_FORMAT,
+	CHECKPOINT_STATUS_ERR_CHECKSUM,
+	CHECKPOINT_STATUS_ERR_TOO_LARGE
+} CHECKPOINT_STATUS;
+
+typedef struct
+{
+	char name[CHECKPOINT_NAME_LEN];
+	uint8_t type;
+	uint8_t queue_len;
+	uint8_t queue_session[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint32_t queue_idx[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint8_t queue_slot[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint32_t solved;
+	uint32_t errors;
+} checkpoint_worker;
+
+typedef struct
+{
+	//Milliseconds the sessions had been running, so deadlines carry over.
+	uint64_t elapsed_ms;
+	uint32_t current_schedule;
+	session_table sessions;
+	uint8_t num_workers;
+	checkpoint_worker workers[CHECKPOINT_MAX_WORKERS];
+} checkpoint;
+
+CHECKPOINT_STATUS checkpoint_write(const char *path, const checkpoint *cp);
+CHECKPOINT_STATUS checkpoint_read(const char *path, checkpoint *cp);
+void checkpoint_remove(const char *path);
+const char *checkpoint_get_status_str(const CHECKPOINT_STATUS status);
+
+#endif
@@ -1,14 +1,22 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include "scheduler.h"
 #include "i2c.h"
 #include "tui.h"
 #include "efp.h"
 #include "dca.h"
 #include "log.h"
+#include "local.h"
+#include "checkpoint.h"
+#include "session.h"
+#include "health.h"
+#include "driver.h"
+#include "mpsc.h"
 
 /**
  * Renders all logs into their appropriate columns.
@@ -17,21 +25,26 @@ static void log_render()
 {
 	char str_buffer[100];
 
+	log_lock();
 	tui_print_col(&mngr, 1, 0, "System");
 	for (int i=0; i<DCA_LOG_MAX_LINES; ++i)
 		tui_print_col(&mngr, 1, i + 2, system_log[i]);
 
 
 	tui_print_col(&mngr, 1, DCA_LOG_MAX_LINES + 3, "--------------------------");
-	sprintf(str_buffer, "Progress: %.02f percent", ((float)s.current_schedule / (float)WORK_MAX_REQUESTS) * 100);
-	tui_print_col(&mngr, 1, DCA_LOG_MAX_LINES + 5, str_buffer);
+	for (int i=0; i<sessions.num_sessions; ++i)
+	{
+		session *se = &sessions.sessions[i];
+		bool late = se->deadline_ms > 0 && se->done < se->num_jobs && dca_now_ms() - sessions_started_ms > se->deadline_ms;
+
+		sprintf(str_buffer, "%s: %.02f percent%s", se->name, ((float)se->done / (float)se->num_jobs) * 100, late ? " (late)" : "");
+		tui_print_col(&mngr, 1, DCA_LOG_MAX_LINES + 5 + i, str_buffer);
+	}
 
-	for (int i=0; i<2; ++i)
+	for (int i=0; i<s.num_workers; ++i)
 	{
-		sprintf(str_buffer, "Solved (%s): %i", i == 0 ? "photon" : "mbed", solved_by[i]);
-		tui_print_col(&mngr, 1, DCA_LOG_MAX_LINES + 6 + 2 * i, str_buffer);
-		sprintf(str_buffer, "Errors (%s): %i", i == 0 ? "photon" : "mbed", error_by[i]);
-		tui_print_col(&mngr, 1, DCA_LOG_MAX_LINES + 7 + 2 * i, str_buffer);
+		sprintf(str_buffer, "%s: solved %i, errors %i, %ums/job, %s", s.slaves[i]->name, solved_by[i], error_by[i], avg_job_ms[i], health_get_state_str(worker_health[i].state));
+		tui_print_col(&mngr, 1, DCA_LOG_MAX_LINES + 6 + sessions.num_sessions + i, str_buffer);
 	}
 
 	tui_print_col(&mngr, 2, 0, "Result (digits of Pi)");
@@ -42,238 +55,1209 @@ static void log_render()
 	tui_print_col(&mngr, 3, 1, "-------------------------");
 	for (int i=0; i<DCA_LOG_MAX_LINES; ++i)
 		tui_print_col(&mngr, 3, i + 2, i2c_log[i]);
+	log_unlock();
 
 	tui_print_borders(&mngr);
 	refresh();
 }
 
+/**
+ * Reads a monotonic clock.
+ * @return The current time in milliseconds.
+ */
+static uint64_t dca_now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Sets the number of local worker threads for the next session.
+ * @param count The number of workers, or a negative value for one per core less one.
+ */
+void dca_set_local_workers(const int count)
+{
+	local_worker_count = count;
+	if (local_worker_count > DCA_MAX_LOCAL_WORKERS)
+		local_worker_count = DCA_MAX_LOCAL_WORKERS;
+}
+
+/**
+ * Adds an I2C adapter with a photon and an mbed on it. Without any, the
+ * boards are looked for on DCA_I2C_BUS.
+ * @param  device The adapter's device path, e.g. /dev/i2c-3.
+ * @return        True if the adapter was added.
+ */
+bool dca_add_bus(const char *device)
+{
+	const char *target;
+
+	if (bus_device_count >= DCA_MAX_BUSES || strlen(device) >= BUS_DEVICE_LEN)
+		return false;
+	if (transport_parse(device, &target) != TRANSPORT_I2C || *target == '\0')
+		return false;
+
+	strcpy(bus_devices[bus_device_count++], device);
+	return true;
+}
+
+/**
+ * Adds a slave reached over a socket transport, given as unix:<path> or
+ * tcp:<host>:<port>, optionally followed by @ and the address it answers to.
+ * Slaves at DCA_HW_ADDR_MBED are polled as mbeds, others as photons.
+ * @param  spec The slave's target and address.
+ * @return      True if the slave was added.
+ */
+bool dca_add_remote_worker(const char *spec)
+{
+	const char *target;
+	const char *at = strrchr(spec, '@');
+	size_t len = at != NULL ? (size_t)(at - spec) : strlen(spec);
+	unsigned long addr = DCA_HW_ADDR_PHOTON;
+
+	if (remote_worker_count >= DCA_MAX_REMOTE_WORKERS || len >= TRANSPORT_TARGET_LEN)
+		return false;
+
+	if (at != NULL)
+	{
+		char *end;
+		addr = strtoul(at +1, &end, 0);
+		if (*end != '\0' || addr > 0x7f)
+			return false;
+	}
+
+	memcpy(remote_targets[remote_worker_count], spec, len);
+	remote_targets[remote_worker_count][len] = '\0';
+	if (transport_parse(remote_targets[remote_worker_count], &target) == TRANSPORT_I2C || *target == '\0')
+		return false;
+
+	remote_addrs[remote_worker_count++] = addr;
+	return true;
+}
+
+/**
+ * Sets where checkpoints are written and whether the next session resumes from one.
+ * @param path   The checkpoint file path.
+ * @param resume True to resume the session stored at path.
+ */
+void dca_set_checkpoint(const char *path, const bool resume)
+{
+	strncpy(checkpoint_path, path, sizeof(checkpoint_path) -1);
+	checkpoint_path[sizeof(checkpoint_path) -1] = '\0';
+	resume_session = resume;
+}
+
+/**
+ * Sets where the trace of every transaction and job is recorded.
+ * @param path The trace file path, or an empty string to record nothing.
+ */
+void dca_set_trace(const char *path)
+{
+	strncpy(trace_path, path, sizeof(trace_path) -1);
+	trace_path[sizeof(trace_path) -1] = '\0';
+}
+
+/**
+ * Injects faults into every transaction with the slaves once the run is
+ * under way, to see how it copes.
+ * @param  spec The fault profile's name, optionally followed by :seed.
+ * @return      True if the profile exists.
+ */
+bool dca_set_faults(const char *spec)
+{
+	fault_injection = fault_select(spec);
+	return fault_injection;
+}
+
+/**
+ * Signal handler for SIGINT and SIGTERM. The main loop notices the flag,
+ * writes a final checkpoint and shuts down cleanly.
+ * @param sig The signal number.
+ */
+static void dca_handle_interrupt(int sig)
+{
+	dca_interrupted = 1;
+}
+
+/**
+ * Writes the job store, results and every worker's queue to the checkpoint file.
+ * @return True if the checkpoint was written.
+ */
+bool dca_checkpoint_save()
+{
+	char str_buffer[100];
+	CHECKPOINT_STATUS cp_status;
+
+	cp.elapsed_ms = dca_now_ms() - sessions_started_ms;
+	cp.current_schedule = s.current_schedule;
+	cp.sessions = sessions;
+
+	cp.num_workers = s.num_workers;
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		checkpoint_worker *w = &cp.workers[i];
+		slave *sl = s.slaves[i];
+
+		strncpy(w->name, sl->name, CHECKPOINT_NAME_LEN -1);
+		w->name[CHECKPOINT_NAME_LEN -1] = '\0';
+		w->type = sl->type;
+		w->queue_len = sl->queue_len;
+		for (uint8_t x=0; x<sl->queue_len; ++x)
+		{
+			w->queue_session[x] = sl->queue_session[x];
+			w->queue_idx[x] = sl->queue_idx[x];
+			w->queue_slot[x] = sl->queue_slot[x];
+		}
+		w->solved = solved_by[i];
+		w->errors = error_by[i];
+	}
+
+	last_checkpoint_ms = dca_now_ms();
+	cp_status = checkpoint_write(checkpoint_path, &cp);
+	if (cp_status != CHECKPOINT_STATUS_OK)
+	{
+		sprintf(str_buffer, "Checkpoint failed: %.60s", checkpoint_get_status_str(cp_status));
+		log_append(system_log, str_buffer);
+		return false;
+	}
+
+	checkpoint_dirty = false;
+	return true;
+}
+
+/**
+ * Writes a checkpoint if the session changed and the interval has passed.
+ */
+void dca_checkpoint_tick()
+{
+	if (checkpoint_dirty && dca_now_ms() - last_checkpoint_ms >= DCA_CHECKPOINT_INTERVAL_MS)
+		dca_checkpoint_save();
+}
+
+/**
+ * Restores a session from the checkpoint file and reconciles the jobs that
+ * were in flight. Each I2C slave is asked what it holds in every recorded
+ * slot; jobs the slave still has are kept, everything else is released back
+ * to the job store. Local worker threads did not survive, so their jobs are
+ * always released.
+ * @return True if the session was restored.
+ */
+bool dca_checkpoint_restore()
+{
+	char str_buffer[100];
+	CHECKPOINT_STATUS cp_status;
+	bool slot_held[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint32_t kept = 0, released = 0;
+
+	cp_status = checkpoint_read(checkpoint_path, &cp);
+	if (cp_status != CHECKPOINT_STATUS_OK)
+	{
+		log_append(system_log, "Could not resume:");
+		log_append(system_log, checkpoint_get_status_str(cp_status));
+		return false;
+	}
+
+	if (cp.sessions.step_size != WORK_STEP_SIZE)
+	{
+		log_append(system_log, "Could not resume: checkpoint is for a different job size");
+		return false;
+	}
+
+	sessions = cp.sessions;
+	sessions_started_ms = dca_now_ms() - cp.elapsed_ms;
+
+	//Anything not confirmed by a worker below goes back to the queue.
+	for (uint8_t i=0; i<sessions.num_sessions; ++i)
+		for (uint32_t x=0; x<sessions.sessions[i].num_jobs; ++x)
+			session_release(&sessions.sessions[i], x);
+
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		slave *sl = s.slaves[i];
+		checkpoint_worker *w = NULL;
+
+		for (uint8_t x=0; x<cp.num_workers; ++x)
+			if (strncmp(cp.workers[x].name, sl->name, CHECKPOINT_NAME_LEN) == 0)
+				w = &cp.workers[x];
+
+		for (uint8_t slot=0; slot<SCHEDULER_MAX_QUEUE_DEPTH; ++slot)
+			slot_held[slot] = false;
+
+		if (w != NULL)
+		{
+			solved_by[i] = w->solved;
+			error_by[i] = w->errors;
+
+			for (uint8_t x=0; x<w->queue_len && sl->type == SCHEDULER_WORKER_I2C; ++x)
+			{
+				uint8_t progress;
+				uint32_t job, lease;
+				uint8_t slot = w->queue_slot[x];
+				session *se = session_get(&sessions, w->queue_session[x]);
+
+				if (slot >= dca_slave_slots(sl) || se == NULL || w->queue_idx[x] >= se->num_jobs || se->jobs[w->queue_idx[x]] != SESSION_JOB_FREE)
+					continue;
+				if (! efp_status_slot(sl->obj, slot, WORK_STEP_SIZE, &progress, &job, &lease, 100) || job != efp_wire_job(sl->obj, session_wire_job(se, w->queue_idx[x])))
+					continue;
+
+				//The job keeps the lease the slave holds it under, and new
+				//leases start past it.
+				if (lease > last_lease)
+					last_lease = lease;
+				scheduler_push_job(sl, se->id, w->queue_idx[x], slot, lease);
+				driver_adopt(&drivers[i], se->id, w->queue_idx[x], slot, se->partial[w->queue_idx[x]], worker_epoch[i], lease);
+				session_assign(se, w->queue_idx[x]);
+				slot_held[slot] = true;
+				++kept;
+			}
+
+			released += w->queue_len;
+		}
+
+		//Free whatever else the slave is holding.
+		if (sl->type == SCHEDULER_WORKER_I2C)
+			for (uint8_t slot=0; slot<dca_slave_slots(sl); ++slot)
+				if (! slot_held[slot])
+					dca_free_slot(sl, slot);
+
+		busy_since_ms[i] = dca_now_ms();
+	}
+
+	s.current_schedule = 0;
+	for (uint8_t i=0; i<sessions.num_sessions; ++i)
+		for (uint32_t x=0; x<sessions.sessions[i].num_jobs; ++x)
+			if (sessions.sessions[i].jobs[x] != SESSION_JOB_FREE)
+				s.current_schedule++;
+
+	sprintf(str_buffer, "Resumed: %u jobs in flight kept, %u released", kept, released - kept);
+	log_append(system_log, str_buffer);
+
+	//Later sessions from the menu start afresh.
+	resume_session = false;
+	checkpoint_dirty = true;
+	return true;
+}
+
+/**
+ * Adds a computation session for the next run from a command line specification.
+ * @param  spec name:first_digit:num_digits[:weight[:deadline_seconds]]
+ * @return      True if the session was added.
+ */
+bool dca_add_session(const char *spec)
+{
+	if (session_config.step_size == 0)
+		session_table_init(&session_config, WORK_STEP_SIZE, SESSION_POLICY_FAIR);
+
+	return session_add_spec(&session_config, spec);
+}
+
+/**
+ * Sets how workers are shared between sessions.
+ * @param policy The SESSION_POLICY to use.
+ */
+void dca_set_policy(const SESSION_POLICY policy)
+{
+	if (session_config.step_size == 0)
+		session_table_init(&session_config, WORK_STEP_SIZE, SESSION_POLICY_FAIR);
+
+	session_config.policy = policy;
+}
+
 /**
  * Reset the DCA static values for recomputation.
  */
 void dca_reset()
 {
-	for (int i=0; i<2; ++i)
+	for (int i=0; i<DCA_MAX_WORKERS; ++i)
 	{
 		error_by[i] = 0;
 		solved_by[i] = 0;
-		checksum_counter[i] = 0;
+		busy_since_ms[i] = 0;
+		avg_job_ms[i] = 0;
 	}
-	for (int i=0; i<WORK_STEP_SIZE * WORK_MAX_REQUESTS; ++i)
-		results[i] = 0;
-	for (int i=0; i<WORK_MAX_REQUESTS; ++i)
-		jobs[i] = 0;
+	dca_interrupted = 0;
+	stalled_since_ms = 0;
+	dca_stalled = false;
+	checkpoint_dirty = false;
+	last_checkpoint_ms = dca_now_ms();
 }
 
 /**
- * Ensure that the job store memory is initialised to 0x0.
+ * Creates the live session table from the configured sessions. Without any,
+ * a single session computes the first WORK_MAX_REQUESTS jobs of Pi.
  */
 void setup_jobs()
 {
-	for (int i=0; i<WORK_MAX_REQUESTS; ++i)
-		jobs[i] = 0x0;
+	if (session_config.num_sessions > 0)
+		sessions = session_config;
+	else
+	{
+		session_table_init(&sessions, WORK_STEP_SIZE, session_config.step_size ? session_config.policy : SESSION_POLICY_FAIR);
+		session_add(&sessions, "pi", 1, WORK_STEP_SIZE * WORK_MAX_REQUESTS, 1, 0);
+	}
+
+	sessions_started_ms = dca_now_ms();
 }
 
 /**
- * Create both the i2c_obj instances for Photon and Mbed.
+ * Create the i2c_obj instances for the photon and mbed on every adapter, and
+ * for the socket slaves. Boards on different adapters are driven in parallel.
  * @return True if the operation succeeded, false if errors occured.
  */
 bool setup_i2c_slaves()
 {
-	status = i2c_init(&slave_photon, "/dev/i2c-1", DCA_HW_ADDR_PHOTON, I2C_HW_PHOTON);
-	if (status != I2C_STATUS_OK)
+	char name[16];
+
+	efp_worker_count = 0;
+
+	if (bus_device_count == 0)
 	{
-		log_append(system_log, "Fatal I2C error on photon:");
-		log_append(system_log, i2c_get_status_str(status));
-		return false;
+		//Without a bus the master can still run its socket slaves.
+		if (! dca_connect(DCA_I2C_BUS, DCA_HW_ADDR_PHOTON, I2C_HW_PHOTON, "photon"))
+		{
+			if (status != I2C_STATUS_ERR_OPEN || remote_worker_count == 0)
+				return false;
+			log_append(system_log, "No I2C bus, using socket slaves only");
+		}
+		else if (! dca_connect(DCA_I2C_BUS, DCA_HW_ADDR_MBED, I2C_HW_MBED, "mbed"))
+			return false;
 	}
 
-	status = i2c_init(&slave_mbed, "/dev/i2c-1", DCA_HW_ADDR_MBED, I2C_HW_MBED);
+	//The boards on the first adapter keep their names, so checkpoints
+	//taken with a single bus still match up.
+	for (int i=0; i<bus_device_count; ++i)
+	{
+		char suffix[12] = "";
+
+		if (i > 0)
+			snprintf(suffix, sizeof(suffix), "%i", i);
+
+		//Names are cut to fit efp_names, though no adapter index gets near.
+		snprintf(name, sizeof(name), "photon%.9s", suffix);
+		if (! dca_connect(bus_devices[i], DCA_HW_ADDR_PHOTON, I2C_HW_PHOTON, name))
+			return false;
+		snprintf(name, sizeof(name), "mbed%.9s", suffix);
+		if (! dca_connect(bus_devices[i], DCA_HW_ADDR_MBED, I2C_HW_MBED, name))
+			return false;
+	}
+
+	for (int i=0; i<remote_worker_count; ++i)
+	{
+		sprintf(name, "remote%i", i);
+		if (! dca_connect(remote_targets[i], remote_addrs[i], remote_addrs[i] == DCA_HW_ADDR_MBED ? I2C_HW_MBED : I2C_HW_PHOTON, name))
+			return false;
+	}
+
+	dca_check_general_call();
+	return true;
+}
+
+/**
+ * Pings every slave that said it takes general calls with one broadcast.
+ * Those that don't answer, e.g. behind an adapter that won't send to the
+ * general call address, are sent cluster-wide commands one at a time.
+ */
+static void dca_check_general_call()
+{
+	char str_buffer[100];
+	i2c_obj *objs[DCA_MAX_EFP_WORKERS];
+	bool acked[DCA_MAX_EFP_WORKERS];
+	uint8_t count = 0;
+
+	for (int i=0; i<efp_worker_count; ++i)
+	{
+		objs[i] = &efp_slaves[i];
+		if (efp_slaves[i].general_call)
+			count++;
+	}
+	if (count == 0)
+		return;
+
+	sprintf(str_buffer, "%u of %u slaves answer general calls", efp_ping_all(objs, efp_worker_count, acked, 100), efp_worker_count);
+	log_append(system_log, str_buffer);
+
+	for (int i=0; i<efp_worker_count; ++i)
+		if (efp_slaves[i].general_call && ! acked[i])
+			efp_slaves[i].general_call = false;
+}
+
+/**
+ * Connects to the next EFP slave and negotiates with it.
+ * @param  target  The slave's I2C bus or socket target.
+ * @param  addr    The address the slave answers to.
+ * @param  hw_type The hardware type of the slave.
+ * @param  name    The slave's name.
+ * @return         True if the slave was connected.
+ */
+static bool dca_connect(const char *target, const uint8_t addr, const I2C_HW hw_type, const char *name)
+{
+	char str_buffer[100];
+	i2c_obj *obj = &efp_slaves[efp_worker_count];
+
+	status = i2c_init(obj, target, addr, hw_type);
+	obj->worker = efp_worker_count;
 	if (status != I2C_STATUS_OK)
 	{
-		log_append(system_log, "Fatal I2C error on mbed:");
+		sprintf(str_buffer, "Fatal error on %s:", name);
+		log_append(system_log, str_buffer);
 		log_append(system_log, i2c_get_status_str(status));
 		return false;
 	}
 
+	strcpy(efp_names[efp_worker_count], name);
+
+	//Upgraded slaves get the framed, checksummed protocol.
+	dca_negotiate(obj, name, &slave_caps[efp_worker_count]);
+	efp_worker_count++;
+	return true;
+}
+
+/**
+ * Settles the protocol version with a slave and logs what it reported, then
+ * calibrates how long it is left alone after writes.
+ * @param obj  A pointer to the slave's i2c_obj.
+ * @param name The slave's name.
+ * @param caps A pointer to the efp_caps used to store its capabilities.
+ */
+static void dca_negotiate(i2c_obj *obj, const char *name, efp_caps *caps)
+{
+	char str_buffer[100];
+
+	if (efp_negotiate(obj, caps, 100) < EFP_VERSION_2)
+		sprintf(str_buffer, "%s speaks EFP v1", name);
+	else if (caps->version == 0)
+		sprintf(str_buffer, "%s didn't say hello, assuming built-in settings", name);
+	else
+		sprintf(str_buffer, "%s: EFP v%u, %u digits a job, %u slots, %u us a digit", name, caps->version, caps->job_factor, caps->queue_depth, caps->us_per_digit);
+	log_append(system_log, str_buffer);
+
+	//Slaves that need time after each write get as little as works for them.
+	if (obj->settle_max_us > 0)
+	{
+		sprintf(str_buffer, "%s settles in %u us", name, efp_calibrate_settle(obj, 100));
+		log_append(system_log, str_buffer);
+	}
+}
+
+/**
+ * Determines if a slave can compute the sessions' jobs. Slaves that didn't
+ * describe themselves are assumed to match the master.
+ * @param  caps A pointer to the slave's capabilities.
+ * @param  name The slave's name, for the log.
+ * @return      True if the slave can be given work.
+ */
+static bool dca_caps_compatible(const efp_caps *caps, const char *name)
+{
+	char str_buffer[100];
+
+	if (caps->version == 0)
+		return true;
+
+	if (! (caps->job_types & EFP_JOB_TYPE_PI_DIGITS))
+		sprintf(str_buffer, "%s can't compute digits of pi, leaving it idle", name);
+	else if (caps->job_factor != WORK_STEP_SIZE || caps->result_bytes < BCD_BYTES(WORK_STEP_SIZE))
+		sprintf(str_buffer, "%s computes %u digits a job, not %u, leaving it idle", name, caps->job_factor, WORK_STEP_SIZE);
+	else
+		return true;
+
+	log_append(system_log, str_buffer);
+	return false;
+}
+
+/**
+ * Gets the number of job slots on an I2C slave, as it reported at connect
+ * time or DCA_SLAVE_QUEUE_DEPTH if it didn't.
+ * @param  sl A pointer to the slave.
+ * @return    The number of job slots the master uses.
+ */
+static uint8_t dca_slave_slots(const slave *sl)
+{
+	uint8_t depth = slave_caps[sl->idx].queue_depth > 0 ? slave_caps[sl->idx].queue_depth : DCA_SLAVE_QUEUE_DEPTH;
+	return depth < SCHEDULER_MAX_QUEUE_DEPTH ? depth : SCHEDULER_MAX_QUEUE_DEPTH;
+}
+
+/**
+ * Starts the local worker threads on the master, pinning each to its own
+ * core and leaving core 0 to the bus.
+ * @return True if the operation succeeded, false if errors occured.
+ */
+bool setup_local_workers()
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (local_worker_count < 0)
+		local_worker_count = local_default_worker_count();
+	if (local_worker_count > DCA_MAX_LOCAL_WORKERS)
+		local_worker_count = DCA_MAX_LOCAL_WORKERS;
+
+	for (int i=0; i<local_worker_count; ++i)
+	{
+		sprintf(local_names[i], "local%i", i);
+		if (! local_worker_start(&local_workers[i], i, cores > 1 ? (i +1) % cores : -1, WORK_STEP_SIZE))
+		{
+			log_append(system_log, "Fatal error starting local worker thread");
+			local_worker_count = i;
+			return false;
+		}
+	}
+
 	return true;
 }
 
 /**
  * Setup and intialise the scheduler instance.
+ * EFP slaves come first, followed by the local workers.
  * @return True if success.
  */
 bool setup_scheduler()
 {
-	s = scheduler_create(2, 25);
-	scheduler_set_slave_i2c(&s, 0, &slave_photon, "photon");
-	scheduler_set_slave_i2c(&s, 1, &slave_mbed, "mbed");
+	s = scheduler_create(efp_worker_count + local_worker_count, 25);
+
+	//Each slave gets as many jobs queued as it has slots, and a first
+	//estimate of its job time if it has measured its speed.
+	for (int i=0; i<efp_worker_count; ++i)
+	{
+		scheduler_set_slave_i2c(&s, i, &efp_slaves[i], efp_names[i]);
+		worker_queue_depth[i] = dca_slave_slots(s.slaves[i]);
+		worker_compatible[i] = dca_caps_compatible(&slave_caps[i], s.slaves[i]->name);
+		avg_job_ms[i] = slave_caps[i].us_per_digit * WORK_STEP_SIZE / 1000;
+	}
+
+	for (int i=0; i<local_worker_count; ++i)
+	{
+		scheduler_set_slave_local(&s, efp_worker_count + i, &local_workers[i], local_names[i]);
+		worker_queue_depth[efp_worker_count + i] = LOCAL_QUEUE_DEPTH;
+		worker_compatible[efp_worker_count + i] = true;
+	}
+
+	mpsc_init(&events);
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		health_init(&worker_health[i]);
+		dca_apply_health(s.slaves[i]);
+
+		worker_epoch[i] = 0;
+		probe_pending[i] = false;
+		trace_worker(i, s.slaves[i]->type, s.slaves[i]->name);
+		driver_init(&drivers[i], s.slaves[i], &events, s.slaves[i]->type == SCHEDULER_WORKER_I2C ? i2c_log : NULL, WORK_STEP_SIZE, DCA_CHECKSUM_OVERCOUNT);
+		if (s.slaves[i]->type == SCHEDULER_WORKER_I2C)
+			driver_apply_caps(&drivers[i], &slave_caps[i]);
+	}
 
 	return true;
 }
 
 /**
- * Gets the next job in the computation session.
- * @return The integer value of the next job index.
+ * Frees a job slot on an I2C slave, whether or not its job is done. Slaves
+ * from before CANCEL are sent a RESET, which their firmware also applied
+ * to running jobs.
+ * @param sl   A pointer to the slave.
+ * @param slot The job slot to free.
+ */
+static void dca_free_slot(slave *sl, const uint8_t slot)
+{
+	if (! efp_cancel_slot(sl->obj, slot, NULL, 100))
+		efp_reset_slot(sl->obj, slot, 100);
+}
+
+/**
+ * Frees every job slot on every slave, in case unclaimed computations exist
+ * from a previous session. Slaves that take general calls are cleared with
+ * one broadcast, the rest a slot at a time.
+ */
+void setup_slave_queues()
+{
+	i2c_obj *objs[DCA_MAX_EFP_WORKERS];
+	bool cleared[DCA_MAX_EFP_WORKERS];
+
+	for (int i=0; i<efp_worker_count; ++i)
+		objs[i] = &efp_slaves[i];
+	efp_cancel_all(objs, efp_worker_count, cleared, 100);
+
+	for (int8_t i=0; i<s.num_workers; ++i)
+		if (s.slaves[i]->type == SCHEDULER_WORKER_I2C && ! cleared[i])
+			for (uint8_t slot=0; slot<dca_slave_slots(s.slaves[i]); ++slot)
+				dca_free_slot(s.slaves[i], slot);
+}
+
+/**
+ * Starts a driver thread for every worker. Must be called once the jobs
+ * the workers already hold have been handed to their drivers.
+ * @return True if the operation succeeded, false if errors occured.
  */
-int job_get_next()
+bool setup_drivers()
 {
-	for (int i=0; i<WORK_MAX_REQUESTS; ++i)
-		if (jobs[i] == 0x0)
+	//Faults only start now, so every slave got through connecting.
+	for (int i=0; i<efp_worker_count && fault_injection; ++i)
+		fault_arm(&efp_slaves[i].fault, i);
+
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		if (! driver_start(&drivers[i]))
+		{
+			log_append(system_log, "Fatal error starting worker driver thread");
+			for (int8_t x=0; x<i; ++x)
+				driver_stop(&drivers[x]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Stops every driver thread, then handles whatever they reported on the way
+ * out so that the job queues match what the workers hold.
+ */
+void dca_stop_drivers()
+{
+	for (int8_t i=0; i<s.num_workers; ++i)
+		driver_stop(&drivers[i]);
+
+	dca_handle_events();
+}
+
+/**
+ * Decides whether a worker should be given one of the last jobs of the session.
+ * Once fewer jobs remain than there are workers, a worker only takes another
+ * job if it would not finish it far later than the fastest worker could.
+ * @param  sl A pointer to the slave.
+ * @return    True if the worker should be given work.
+ */
+bool worker_should_take_tail(slave *sl)
+{
+	uint64_t own_finish, best_finish = 0;
+
+	if (session_count_free(&sessions) >= s.num_workers || avg_job_ms[sl->idx] == 0)
+		return true;
+
+	own_finish = (uint64_t)(sl->queue_len +1) * avg_job_ms[sl->idx];
+
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		if (i == sl->idx || avg_job_ms[i] == 0)
+			continue;
+
+		uint64_t finish = (uint64_t)(s.slaves[i]->queue_len +1) * avg_job_ms[i];
+		if (best_finish == 0 || finish < best_finish)
+			best_finish = finish;
+	}
+
+	return best_finish == 0 || own_finish <= 2 * best_finish;
+}
+
+/**
+ * Hands out the lease for the next job assignment. EFP_NO_LEASE is skipped
+ * should the counter ever wrap.
+ * @return The lease.
+ */
+static uint32_t dca_next_lease()
+{
+	if (++last_lease == EFP_NO_LEASE)
+		++last_lease;
+
+	return last_lease;
+}
+
+/**
+ * Queues the next job on a given worker, taken from the session the
+ * scheduling policy says is most in need of a worker.
+ * @param  sl A pointer to the slave, which must have room in its queue.
+ * @return    True if a job was ordered, false if there is no work left or the order failed.
+ */
+bool dispatch_job(slave *sl)
+{
+	driver_request req;
+
+	session *se = session_pick(&sessions);
+	if (se == NULL || ! sl->enabled || ! worker_should_take_tail(sl))
+		return false;
+
+	int current_job = session_job_next(se);
+
+	//The driver places the order; the slot is filled in when it reports back.
+	req.type = DRIVER_REQ_ORDER;
+	req.session_id = se->id;
+	req.job_idx = current_job;
+	req.wire_job = session_wire_job(se, current_job);
+	req.first = se->partial[current_job];
+	req.epoch = worker_epoch[sl->idx];
+	req.lease = dca_next_lease();
+	if (! driver_post(&drivers[sl->idx], &req))
+		return false;
+
+	if (sl->queue_len == 0)
+		busy_since_ms[sl->idx] = dca_now_ms();
+	scheduler_push_job(sl, se->id, current_job, DRIVER_SLOT_PENDING, req.lease);
+
+	s.current_schedule++;
+	session_assign(se, current_job);
+	checkpoint_dirty = true;
+
+	return true;
+}
+
+/**
+ * Automatically dispatches jobs to workers that have room in their queue,
+ * topping each queue up so the slaves never wait on the bus for work.
+ */
+void auto_dispatch_work()
+{
+	for (int8_t i=0; i<s.num_workers; ++i)
+		while (! s.slaves[i]->busy && dispatch_job(s.slaves[i]))
+			;
+}
+
+/**
+ * Finds a job in a worker's queue.
+ * @param  sl         A pointer to the slave.
+ * @param  session_id The session the job belongs to.
+ * @param  job_idx    The job number within the session.
+ * @return            The position of the job in the queue, or -1 if it isn't queued.
+ */
+static int8_t dca_find_job(slave *sl, const uint8_t session_id, const uint32_t job_idx)
+{
+	for (uint8_t i=0; i<sl->queue_len; ++i)
+		if (sl->queue_session[i] == session_id && sl->queue_idx[i] == job_idx)
 			return i;
 
 	return -1;
 }
 
 /**
- * Automatically dispatches jobs to I2C slaves that are currently not busy.
+ * Checks that an event about a queued job comes from the assignment the
+ * queue holds, rather than an earlier one of the same job.
+ * @param  sl  A pointer to the slave.
+ * @param  pos The position of the job in the slave's queue.
+ * @param  ev  A pointer to the event.
+ * @return     True if the event's lease is the job's current one.
  */
-void auto_dispatch_work()
+static bool dca_lease_current(slave *sl, const int8_t pos, const driver_event *ev)
 {
 	char str_buffer[100];
-	int8_t current_slave = scheduler_get_free_slave_idx(&s, 500);
-	slave *sl;
 
-	int current_job = job_get_next();
+	if (sl->queue_lease[pos] == ev->lease)
+		return true;
+
+	sprintf(str_buffer, "Rejected a stale result for job %u from %s (lease %u, now %u)", ev->job_idx, sl->name, ev->lease, sl->queue_lease[pos]);
+	log_append(system_log, str_buffer);
+	return false;
+}
 
-	if (current_slave >= 0)
+/**
+ * Stores the digits a worker has finished of a job that is still running.
+ * @param sl A pointer to the slave.
+ * @param ev A pointer to the DRIVER_EVENT_PARTIAL event.
+ */
+static void dca_store_partial(slave *sl, const driver_event *ev)
+{
+	char str_buffer[100]; char str_concat_buffer[4];
+	session *se = session_get(&sessions, ev->session_id);
+
+	int8_t pos = dca_find_job(sl, ev->session_id, ev->job_idx);
+	if (pos < 0 || se == NULL || ! dca_lease_current(sl, pos, ev))
+		return;
+
+	session_store_digits(se, ev->job_idx, ev->first, ev->results, ev->count, WORK_STEP_SIZE);
+	checkpoint_dirty = true;
+
+	sprintf(str_buffer, "%s 0x%02x: ", se->name, ev->job_idx);
+	for (uint8_t x=0; x<se->partial[ev->job_idx]; ++x)
+	{
+		sprintf(str_concat_buffer, "%i", session_digit(se, ev->job_idx * WORK_STEP_SIZE + x));
+		strcat(str_buffer, str_concat_buffer);
+	}
+	strcat(str_buffer, " (partial)");
+	log_append(results_log, str_buffer);
+}
+
+/**
+ * Stores the results of a job a worker has finished.
+ * @param sl A pointer to the slave.
+ * @param ev A pointer to the DRIVER_EVENT_DONE event.
+ */
+static void dca_complete_job(slave *sl, const driver_event *ev)
+{
+	char str_buffer[100]; char str_concat_buffer[4];
+	int8_t pos = dca_find_job(sl, ev->session_id, ev->job_idx);
+	session *se = session_get(&sessions, ev->session_id);
+
+	if (pos < 0 || se == NULL || ! dca_lease_current(sl, pos, ev))
+		return;
+
+	//Digits handed over earlier may since have been lost, e.g. to a restore.
+	if (! session_complete(se, ev->job_idx, ev->first, ev->results, ev->count, WORK_STEP_SIZE))
+	{
+		sprintf(str_buffer, "%s finished job %u with digits missing. Releasing to queue\n", sl->name, ev->job_idx);
+		log_append(system_log, str_buffer);
+		dca_cancel_job(sl);
+		dca_record_failure(sl, false);
+		return;
+	}
+
+	sprintf(str_buffer, "The %s has finished\n", sl->name);
+	log_append(system_log, str_buffer);
+
+	sprintf(str_buffer, "%s 0x%02x: ", se->name, ev->job_idx);
+	for (uint8_t x=0; x<WORK_STEP_SIZE; ++x)
 	{
-		sl = scheduler_get_slave_by_idx(&s, current_slave);
-		scheduler_claim_slave(sl);
+		sprintf(str_concat_buffer, "%i", session_digit(se, ev->job_idx * WORK_STEP_SIZE + x));
+		strcat(str_buffer, str_concat_buffer);
+	}
+	log_append(results_log, str_buffer);
+	checkpoint_dirty = true;
+	scheduler_remove_job(sl, pos);
 
-		//Reset first.
-		efp_reset(sl->obj, 100);
+	//Solve stats. The next queued job starts being serviced now.
+	uint64_t now = dca_now_ms();
+	uint32_t job_ms = now - busy_since_ms[sl->idx];
+	avg_job_ms[sl->idx] = avg_job_ms[sl->idx] == 0 ? job_ms : (avg_job_ms[sl->idx] * 3 + job_ms) / 4;
+	busy_since_ms[sl->idx] = now;
 
-		str_buffer[0] = '\0';
-		sprintf(str_buffer, "Reset 0x%02x: ", sl->obj->addr);
-		i2c_reg_to_string(sl->obj, str_buffer);
-		log_append(i2c_log, str_buffer);
+	solved_by[sl->idx]++;
 
-		//Create work order.
-		if (! efp_order(sl->obj, current_job, EFP_ORDER_TIMEOUT))
+	if (health_record_success(&worker_health[sl->idx], job_ms))
+		dca_apply_health(sl);
+
+	sprintf(str_buffer, "Status: %i / %i\n", s.current_schedule, session_count_free(&sessions) + s.current_schedule);
+	log_append(system_log, str_buffer);
+}
+
+/**
+ * Handles a driver's report of a single event.
+ * @param ev A pointer to the event.
+ */
+static void dca_handle_event(const driver_event *ev)
+{
+	char str_buffer[100];
+	slave *sl = s.slaves[ev->worker];
+	int8_t pos;
+
+	if (ev->type == DRIVER_EVENT_PROBED)
+	{
+		probe_pending[sl->idx] = false;
+		if (health_record_probe(&worker_health[sl->idx], ev->ok, dca_now_ms()))
 		{
-			sprintf(str_buffer, "Timeout ordering %s to compute from %i", sl->name, current_job);
+			sprintf(str_buffer, "%s answered probes, now %s", sl->name, health_get_state_str(worker_health[sl->idx].state));
 			log_append(system_log, str_buffer);
-			scheduler_free_slave(sl);
-
-			error_by[(sl->obj->addr == DCA_HW_ADDR_PHOTON) ? 0 : 1]++;
-			return;
+			dca_apply_health(sl);
 		}
+		return;
+	}
+
+	//The jobs this is about have since been cancelled.
+	if (ev->epoch != worker_epoch[sl->idx])
+		return;
+
+	switch (ev->type)
+	{
+		case DRIVER_EVENT_ORDERED:
+			pos = dca_find_job(sl, ev->session_id, ev->job_idx);
+			if (pos >= 0 && sl->queue_lease[pos] == ev->lease)
+				sl->queue_slot[pos] = ev->slot;
+
+			sprintf(str_buffer, "Ordered %s to compute job %u in slot %i\n", sl->name, ev->job_idx, ev->slot);
+			log_append(system_log, str_buffer);
+		break;
+		case DRIVER_EVENT_ORDER_FAILED:
+			pos = dca_find_job(sl, ev->session_id, ev->job_idx);
+			if (pos >= 0 && sl->queue_lease[pos] == ev->lease)
+			{
+				session_release(session_get(&sessions, ev->session_id), ev->job_idx);
+				scheduler_remove_job(sl, pos);
+				s.current_schedule--;
+				checkpoint_dirty = true;
+			}
+
+			sprintf(str_buffer, "Timeout ordering %s to compute job %u", sl->name, ev->job_idx);
+			log_append(system_log, str_buffer);
+
+			error_by[sl->idx]++;
+			dca_record_failure(sl, true);
+		break;
+		case DRIVER_EVENT_DONE:
+			dca_complete_job(sl, ev);
+		break;
+		case DRIVER_EVENT_PARTIAL:
+			dca_store_partial(sl, ev);
+		break;
+		case DRIVER_EVENT_STATUS_FAILED:
+			//Every failed status poll has cost a full timeout on the bus.
+			dca_record_failure(sl, true);
+		break;
+		case DRIVER_EVENT_FETCH_FAILED:
+			sprintf(str_buffer, "An error occured fetching results from %s. Releasing to queue\n", sl->name);
+			log_append(system_log, str_buffer);
+			dca_cancel_job(sl);
+			dca_record_failure(sl, false);
+		break;
+		case DRIVER_EVENT_STALLED:
+			sprintf(str_buffer, "Timed out waiting for result with slave %s. Releasing jobs to queue.", sl->name);
+			log_append(system_log, str_buffer);
+			dca_cancel_job(sl);
+			dca_record_failure(sl, true);
+		break;
+		case DRIVER_EVENT_LEASE_LOST:
+			sprintf(str_buffer, "%s holds another assignment in slot %u. Releasing jobs to queue.", sl->name, ev->slot);
+			log_append(system_log, str_buffer);
+			dca_cancel_job(sl);
+			dca_record_failure(sl, false);
+		break;
+		case DRIVER_EVENT_PROBED:
+		break;
+	}
+}
 
-		str_buffer[0] = '\0';
-		sprintf(str_buffer, "Order 0x%02x: ", sl->obj->addr);
-		i2c_reg_to_string(sl->obj, str_buffer);
-		log_append(i2c_log, str_buffer);
+/**
+ * Handles everything the worker drivers have reported since the last call.
+ */
+void dca_handle_events()
+{
+	mpsc_node *node;
 
+	while ((node = mpsc_pop(&events)) != NULL)
+	{
+		driver_event *ev = (driver_event *)node;
+		dca_handle_event(ev);
+		free(ev);
+	}
+}
 
-		sl->current_idx = current_job;
+/**
+ * Cancels every queued job on a given worker and releases them back to
+ * the job store. Jobs behind a failed one would otherwise never be collected.
+ * @param sl A pointer to the slave.
+ */
+void dca_cancel_job(slave *sl)
+{
+	driver_request req;
+
+	for (uint8_t i=0; i<sl->queue_len; ++i)
+	{
+		session_release(session_get(&sessions, sl->queue_session[i]), sl->queue_idx[i]);
+		s.current_schedule--;
+	}
+	checkpoint_dirty = true;
 
-		sprintf(str_buffer, "Ordered %s to compute from start index %i\n", sl->name, current_job);
+	scheduler_free_slave(sl);
+
+	//Whatever the driver still reports about these jobs is stale now.
+	worker_epoch[sl->idx]++;
+	memset(&req, 0, sizeof(req));
+	req.type = DRIVER_REQ_CANCEL;
+	driver_post(&drivers[sl->idx], &req);
+
+	error_by[sl->idx]++;
+}
+
+/**
+ * Records a failed operation against a worker's health. A worker that gets
+ * quarantined has its queued jobs released so other workers pick them up.
+ * @param sl      A pointer to the slave.
+ * @param timeout True if the failure was a timeout rather than an error reply.
+ */
+void dca_record_failure(slave *sl, const bool timeout)
+{
+	char str_buffer[100];
+
+	if (! health_record_failure(&worker_health[sl->idx], timeout, dca_now_ms()))
+		return;
+
+	sprintf(str_buffer, "%s is now %s", sl->name, health_get_state_str(worker_health[sl->idx].state));
+	log_append(system_log, str_buffer);
+
+	if (! health_can_dispatch(&worker_health[sl->idx]) && sl->queue_len > 0)
+		dca_cancel_job(sl);
+
+	dca_apply_health(sl);
+}
+
+/**
+ * Applies a worker's circuit-breaker state to the scheduler: quarantined
+ * and incompatible workers are disabled and workers on probation get a
+ * single queue slot.
+ * @param sl A pointer to the slave.
+ */
+void dca_apply_health(slave *sl)
+{
+	health *h = &worker_health[sl->idx];
+
+	scheduler_set_enabled(sl, worker_compatible[sl->idx] && health_can_dispatch(h));
+	scheduler_set_queue_depth(sl, health_queue_limit(h, worker_queue_depth[sl->idx]));
+}
+
+/**
+ * Determines if any worker can ever be given jobs. Quarantined workers may
+ * still come back; incompatible ones never do.
+ * @return True if at least one worker is compatible with the sessions.
+ */
+static bool dca_any_compatible()
+{
+	for (int8_t i=0; i<s.num_workers; ++i)
+		if (worker_compatible[i])
+			return true;
+
+	return false;
+}
+
+/**
+ * Notices when no worker can take jobs while work is left, e.g. every slave
+ * is quarantined and there are no local workers. The run waits for a probe
+ * to bring a slave back, and gives up after DCA_STALL_TIMEOUT_MS the same
+ * way an interrupt does, so it can be resumed from the checkpoint.
+ */
+static void dca_check_stall()
+{
+	char str_buffer[100];
+	uint64_t now = dca_now_ms();
+
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		if (worker_compatible[i] && health_can_dispatch(&worker_health[i]))
+		{
+			if (stalled_since_ms > 0)
+				log_append(system_log, "A worker can take jobs again");
+			stalled_since_ms = 0;
+			return;
+		}
+	}
+
+	if (stalled_since_ms == 0)
+	{
+		stalled_since_ms = now;
+		log_append(system_log, "No worker can take jobs, waiting for a quarantined slave to answer a probe");
+	}
+	else if (now - stalled_since_ms >= DCA_STALL_TIMEOUT_MS)
+	{
+		sprintf(str_buffer, "No worker could take jobs for %us, giving up", DCA_STALL_TIMEOUT_MS / 1000);
 		log_append(system_log, str_buffer);
-		s.current_schedule++;
-		jobs[current_job] = 0x1;
-		checksum_counter[(sl->obj->addr == DCA_HW_ADDR_PHOTON) ? 0 : 1] = 0;
+		dca_stalled = true;
+		dca_interrupted = 1;
 	}
 }
 
 /**
- * Checks all busy I2C slaves for results.
- * If they are completed, fetches and stores the results.
+ * Has every quarantined I2C slave that is due a probe pinged by its driver.
+ * Slaves that answer are let back onto probation when the reply comes in.
  */
-void check_results()
+void dca_probe_workers()
 {
-	char str_buffer[100]; char str_concat_buffer[2];
+	driver_request req;
+	uint64_t now = dca_now_ms();
+
+	memset(&req, 0, sizeof(req));
+	req.type = DRIVER_REQ_PROBE;
+
 	for (int8_t i=0; i<s.num_workers; ++i)
 	{
-		if (! s.slaves[i]->busy)
+		slave *sl = s.slaves[i];
+		if (sl->type != SCHEDULER_WORKER_I2C || probe_pending[i] || ! health_probe_due(&worker_health[i], now))
 			continue;
 
-		uint8_t result;
+		probe_pending[i] = driver_post(&drivers[i], &req);
+	}
+}
 
-		if (efp_status(s.slaves[i]->obj, &result, 5000) && result == WORK_STEP_SIZE)
+/**
+ * Prints the ack latency of every EFP command sent to each type of I2C slave.
+ * Slaves of the same hardware type share their statistics.
+ */
+void dca_print_ack_stats()
+{
+	for (uint8_t hw=0; hw<EFP_HW_TYPES; ++hw)
+	{
+		for (uint8_t cmd=0; cmd<EFP_CMD_COUNT; ++cmd)
 		{
-			sprintf(str_buffer, "The %s has finished\n", s.slaves[i]->name);
-			log_append(system_log, str_buffer);
+			efp_ack_stats st;
+			efp_get_ack_stats(hw, cmd, &st);
+			if (st.count == 0 && st.timeouts == 0)
+				continue;
 
-			uint8_t step_results[WORK_STEP_SIZE];
+			printf("%s %s: %u acks, %u timeouts, %u corrupt, %u rejected, min %uus, avg %uus, max %uus\n", i2c_get_hw_str(hw), efp_get_cmd_str(cmd),
+				st.count, st.timeouts, st.corrupt, st.rejected, st.min_us, st.count > 0 ? (uint32_t)(st.total_us / st.count) : 0, st.max_us);
+		}
+	}
+}
 
-			if (efp_result_range(s.slaves[i]->obj, step_results, 1, WORK_STEP_SIZE, 100))
-			{
-				uint32_t idx = (s.slaves[i]->current_idx * WORK_STEP_SIZE);
-				sprintf(str_buffer, "Job 0x%02x: ", s.slaves[i]->current_idx);
-				for (uint8_t x=0; x<WORK_STEP_SIZE; ++x)
-				{
-					results[idx + x] = step_results[x];
-					sprintf(str_concat_buffer, "%i", step_results[x]);
-					strcat(str_buffer, str_concat_buffer);
-				}
-				log_append(results_log, str_buffer);
-
-				//Free up the slave.
-				efp_reset(s.slaves[i]->obj, 100);
-				scheduler_free_slave(s.slaves[i]);
-
-				//Solve stats.
-				solved_by[(s.slaves[i]->obj->addr == DCA_HW_ADDR_PHOTON) ? 0 : 1]++;
-
-				str_buffer[0] = '\0';
-				sprintf(str_buffer, "Reset 0x%02x: ", s.slaves[i]->obj->addr);
-				i2c_reg_to_string(s.slaves[i]->obj, str_buffer);
-				log_append(i2c_log, str_buffer);
-			}
-			else
-			{
-				sprintf(str_buffer, "An error occured fetching results from %s. Releasing to queue\n", s.slaves[i]->name);
-				log_append(system_log, str_buffer);
-				dca_cancel_job(s.slaves[i]);
-			}
-			str_buffer[0] = '\0';
-			sprintf(str_buffer, "Resu. 0x%02x: ", s.slaves[i]->obj->addr);
-			i2c_reg_to_string(s.slaves[i]->obj, str_buffer);
-			log_append(i2c_log, str_buffer);
+/**
+ * Prints how close each worker's predicted job finishing times were, and how
+ * many status polls it took to collect a job.
+ */
+void dca_print_prediction_stats()
+{
+	for (int8_t i=0; i<s.num_workers; ++i)
+	{
+		const driver_prediction_stats *st = driver_get_prediction_stats(&drivers[i]);
+		if (st->jobs == 0)
+			continue;
 
-			sprintf(str_buffer, "Status: %i / %i\n", s.current_schedule, WORK_MAX_REQUESTS);
-			log_append(system_log, str_buffer);
-		}
-		else
-		{
-			checksum_counter[(s.slaves[i]->obj->addr == DCA_HW_ADDR_PHOTON) ? 0 : 1]++;
-			if (checksum_counter[(s.slaves[i]->obj->addr == DCA_HW_ADDR_PHOTON) ? 0 : 1] > DCA_CHECKSUM_OVERCOUNT)
-			{
-				sprintf(str_buffer, "Timed out waiting for result with slave %s. Releasing job to queue.", s.slaves[i]->name);
-				log_append(system_log, str_buffer);
-				dca_cancel_job(s.slaves[i]);
-			}
-		}
+		printf("%s: %u of %u jobs predicted, mean error %lldms, bias %+lldms, %.1f status polls/job\n", s.slaves[i]->name, st->predicted, st->jobs,
+			st->predicted > 0 ? (long long)(st->abs_error_ms / st->predicted) : 0, st->predicted > 0 ? (long long)(st->bias_ms / st->predicted) : 0,
+			(float)st->status_polls / st->jobs);
+	}
+}
 
-		str_buffer[0] = '\0';
-		sprintf(str_buffer, "Stat. 0x%02x: ", s.slaves[i]->obj->addr);
-		i2c_reg_to_string(s.slaves[i]->obj, str_buffer);
-		log_append(i2c_log, str_buffer);
+/**
+ * Prints how busy each I2C adapter was, how often it had to switch between
+ * slaves, and how long each class of transaction waited for it.
+ */
+void dca_print_bus_stats()
+{
+	for (uint8_t i=0; i<bus_count(); ++i)
+	{
+		bus_stats b;
+		if (! bus_get_stats(i, &b))
+			continue;
 
-		usleep(10000);
+		printf("%s: %u transactions, %u address switches\n", b.device, b.transactions, b.switches);
 
+		for (BUS_CLASS cls=0; cls<BUS_CLASSES; ++cls)
+		{
+			const bus_class_stats *st = &b.classes[cls];
+			if (st->grants > 0)
+				printf("  %s: %u waited %lluus on average, %uus at most\n", bus_get_class_str(cls), st->grants,
+					(unsigned long long)(st->wait_us / st->grants), st->max_wait_us);
+		}
 	}
 }
 
 /**
- * Cancels a job on a given I2C slave.
- * @param sl A pointer to the slave.
+ * Prints what was injected into each slave's transactions, the bus time lost
+ * to them and how long the slaves took to hand in a job again afterwards,
+ * then the same over every slave.
  */
-void dca_cancel_job(slave *sl)
+void dca_print_fault_stats()
 {
-	char str_buffer[100];
+	fault_state total;
 
-	jobs[sl->current_idx] = 0x0;
+	if (! fault_injection)
+		return;
 
-	efp_reset(sl->obj, 100);
-	scheduler_free_slave(sl);
+	printf("Fault profile %s, seed %u\n", fault_get_profile()->name, fault_get_seed());
+	fault_init(&total);
+	for (int i=0; i<=efp_worker_count; ++i)
+	{
+		const fault_state *f = i < efp_worker_count ? &efp_slaves[i].fault : &total;
 
-	error_by[(sl->obj->addr == DCA_HW_ADDR_PHOTON) ? 0 : 1]++;
+		printf("%s: %u transactions, %u failed,", i < efp_worker_count ? efp_names[i] : "All slaves", f->transactions, f->failed);
+		for (FAULT_KIND kind=0; kind<FAULT_KINDS; ++kind)
+			printf(" %u %s,", f->injected[kind], fault_get_kind_str(kind));
+		printf(" %.1fms of bus time wasted, recovered %u times in %llums on average, %ums at most\n", f->wasted_us / 1000.0, f->recoveries,
+			f->recoveries > 0 ? (unsigned long long)(f->recovery_us / f->recoveries / 1000) : 0, f->max_recovery_us / 1000);
 
-	str_buffer[0] = '\0';
-	sprintf(str_buffer, "Reset 0x%02x: ", sl->obj->addr);
-	i2c_reg_to_string(sl->obj, str_buffer);
-	log_append(i2c_log, str_buffer);
+		if (i == efp_worker_count)
+			break;
+		total.transactions += f->transactions;
+		total.failed += f->failed;
+		for (FAULT_KIND kind=0; kind<FAULT_KINDS; ++kind)
+			total.injected[kind] += f->injected[kind];
+		total.wasted_us += f->wasted_us;
+		total.recoveries += f->recoveries;
+		total.recovery_us += f->recovery_us;
+		if (f->max_recovery_us > total.max_recovery_us)
+			total.max_recovery_us = f->max_recovery_us;
+	}
 }
 
 /**
@@ -288,39 +1272,134 @@ int dca_main()
 	dca_reset();
 
 	//log_append(system_log, "hello world");
+	if (trace_path[0] != '\0' && ! trace_open(trace_path))
+		log_append(system_log, "Cannot record the trace, carrying on without it");
+
 	log_append(system_log, "Setting up jobs");
 
 	setup_jobs();
 
-	log_append(system_log, "Setting up I2C devices");
+	log_append(system_log, "Connecting to slaves");
 	if (! setup_i2c_slaves())
 		return 1;
 
+	log_append(system_log, "Starting local workers");
+	if (! setup_local_workers())
+		return 1;
+
 	log_append(system_log, "Creating scheduler");
 	if (! setup_scheduler())
 		return 1;
 
-	while (job_get_next() > -1)
+	//Otherwise the run would wait for ever on slaves that will never take a job.
+	if (! dca_any_compatible())
+	{
+		log_append(system_log, "No worker can compute the sessions' jobs");
+		return 1;
+	}
+
+	if (resume_session)
+	{
+		log_append(system_log, "Resuming from checkpoint");
+		if (! dca_checkpoint_restore())
+			return 1;
+	}
+	else
+	{
+		log_append(system_log, "Clearing slave job queues");
+		setup_slave_queues();
+	}
+
+	log_append(system_log, "Starting worker drivers");
+	if (! setup_drivers())
+		return 1;
+
+	struct sigaction interrupt_action;
+	memset(&interrupt_action, 0, sizeof(interrupt_action));
+	interrupt_action.sa_handler = dca_handle_interrupt;
+	sigaction(SIGINT, &interrupt_action, NULL);
+	sigaction(SIGTERM, &interrupt_action, NULL);
+
+	while (session_count_free(&sessions) > 0 && ! dca_interrupted)
 	{
 		log_render();
+		dca_probe_workers();
 		auto_dispatch_work();
-		check_results();
+		dca_handle_events();
+		dca_check_stall();
+		dca_checkpoint_tick();
+		usleep(DCA_EVENT_POLL_US);
 	}
 
-	log_append(system_log, "All jobs have been scheduled. Waiting for remaining computations");
-	while (scheduler_get_free_slave_idx(&s, 500) == -1)
+	if (! dca_interrupted)
+		log_append(system_log, "All jobs have been scheduled. Waiting for remaining computations");
+	while ((! scheduler_all_idle(&s) || session_count_free(&sessions) > 0) && ! dca_interrupted)
 	{
 		log_render();
-		check_results();
-		usleep(5000);
+		//Jobs released by a quarantined worker still need a new home.
+		dca_probe_workers();
+		auto_dispatch_work();
+		dca_handle_events();
+		dca_check_stall();
+		dca_checkpoint_tick();
+		usleep(DCA_EVENT_POLL_US);
 	}
 
 	tui_end();
 
+	//The drivers free any finished slots left behind on the way out.
+	dca_stop_drivers();
+
+	if (dca_interrupted)
+	{
+		bool saved = dca_checkpoint_save();
+
+		for (int i=0; i<local_worker_count; ++i)
+			local_worker_stop(&local_workers[i]);
+		for (int i=0; i<efp_worker_count; ++i)
+			i2c_close(&efp_slaves[i]);
+		scheduler_destroy(&s);
+		trace_close();
+
+		const char *reason = dca_stalled ? "No worker could take jobs" : "Interrupted";
+		if (saved)
+			printf("%s. Session saved to %s, resume with -r.\n", reason, checkpoint_path);
+		else
+			printf("%s. The session could not be saved.\n", reason);
+		return 1;
+	}
+
+	dca_print_ack_stats();
+	dca_print_prediction_stats();
+	dca_print_bus_stats();
+	dca_print_fault_stats();
+
+	for (int i=0; i<local_worker_count; ++i)
+		local_worker_stop(&local_workers[i]);
+	for (int i=0; i<efp_worker_count; ++i)
+		i2c_close(&efp_slaves[i]);
+	scheduler_destroy(&s);
+
+	trace_close();
+	if (trace_get_dropped() > 0)
+		printf("The trace lost %llu records to a full ring\n", (unsigned long long)trace_get_dropped());
+	checkpoint_remove(checkpoint_path);
+
 	printf("Computation complete\n");
-	printf("Pi = 3.");
-	for (int i=0; i<((WORK_STEP_SIZE * WORK_MAX_REQUESTS) - WORK_STEP_SIZE); ++i)
-		printf("%u", results[i]);
+	for (uint8_t i=0; i<sessions.num_sessions; ++i)
+	{
+		session *se = &sessions.sessions[i];
+		uint32_t first_digit = se->first_job * WORK_STEP_SIZE +1;
+
+		if (first_digit == 1)
+			printf("%s: Pi = 3.", se->name);
+		else
+			printf("%s: digits of Pi from %u: ", se->name, first_digit);
+
+		for (uint32_t x=0; x<se->num_jobs * WORK_STEP_SIZE; ++x)
+			printf("%u", session_digit(se, x));
+		printf("\n");
+	}
 
 	printf("\n\nGoodbye.\n");
 
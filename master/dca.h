@@ -4,44 +4,177 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <signal.h>
 #include "scheduler.h"
 #include "tui.h"
 #include "i2c.h"
+#include "transport.h"
+#include "bus.h"
+#include "trace.h"
 #include "efp.h"
 #include "log.h"
+#include "local.h"
+#include "checkpoint.h"
+#include "session.h"
+#include "health.h"
+#include "driver.h"
+#include "mpsc.h"
+#include "bcd.h"
+#include "fault.h"
 
 #define WORK_STEP_SIZE 5
 #define WORK_MAX_REQUESTS 30
-#define EFP_ORDER_TIMEOUT 500
+
+//Assumed for slaves that don't answer HELLO. Must not exceed the
+//EFP_QUEUE_DEPTH compiled into them.
+#define DCA_SLAVE_QUEUE_DEPTH 3
 
 #define DCA_HW_ADDR_PHOTON 0x10
 #define DCA_HW_ADDR_MBED 0x50
 #define DCA_CHECKSUM_OVERCOUNT 100
 
-static i2c_obj slave_photon, slave_mbed;
+//How long the main loop sleeps between passes over the completion queue.
+#define DCA_EVENT_POLL_US 1000
+
+#define DCA_CHECKPOINT_INTERVAL_MS 10000
+
+//How long the run waits with work left and every worker quarantined or
+//incompatible before it saves a checkpoint and gives up.
+#define DCA_STALL_TIMEOUT_MS 300000
+#define DCA_CHECKPOINT_DEFAULT_PATH "dca.checkpoint"
+
+#define DCA_I2C_BUS "/dev/i2c-1"
+
+//A photon and an mbed on every I2C adapter, slaves reached over a socket
+//transport, plus local worker threads on the master.
+#define DCA_MAX_BUSES BUS_MAX_ADAPTERS
+#define DCA_BOARDS_PER_BUS 2
+#define DCA_NUM_I2C_WORKERS (DCA_MAX_BUSES * DCA_BOARDS_PER_BUS)
+#define DCA_MAX_REMOTE_WORKERS 8
+#define DCA_MAX_EFP_WORKERS (DCA_NUM_I2C_WORKERS + DCA_MAX_REMOTE_WORKERS)
+#define DCA_MAX_LOCAL_WORKERS 30
+#define DCA_MAX_WORKERS (DCA_MAX_EFP_WORKERS + DCA_MAX_LOCAL_WORKERS)
+
+//Every slave spoken to over EFP, the boards first, whatever its transport.
+static i2c_obj efp_slaves[DCA_MAX_EFP_WORKERS];
+static char efp_names[DCA_MAX_EFP_WORKERS][16];
+static int efp_worker_count;
+
+//The I2C adapters the boards are on, DCA_I2C_BUS unless given on the
+//command line.
+static char bus_devices[DCA_MAX_BUSES][BUS_DEVICE_LEN];
+static int bus_device_count;
+
+//Slaves given on the command line, with the address each answers to.
+static char remote_targets[DCA_MAX_REMOTE_WORKERS][TRANSPORT_TARGET_LEN];
+static uint8_t remote_addrs[DCA_MAX_REMOTE_WORKERS];
+static int remote_worker_count;
+
+//What each EFP slave reported about itself at connect time.
+static efp_caps slave_caps[DCA_MAX_EFP_WORKERS];
 static I2C_STATUS status;
 static scheduler s;
 
-static uint8_t results[WORK_STEP_SIZE * WORK_MAX_REQUESTS];
-static uint8_t jobs[WORK_MAX_REQUESTS];
+//Sessions given on the command line, copied into the live table for each run.
+static session_table session_config;
+static session_table sessions;
+static uint64_t sessions_started_ms;
 
 static char system_log[DCA_LOG_MAX_LINES][DCA_LOG_MAX_STR_LEN];
 static char results_log[DCA_LOG_MAX_LINES][DCA_LOG_MAX_STR_LEN];
 static char i2c_log[DCA_LOG_MAX_LINES][DCA_LOG_MAX_STR_LEN];
-static uint32_t solved_by[2];
-static uint32_t error_by[2];
-static unsigned int checksum_counter[2];
+static uint32_t solved_by[DCA_MAX_WORKERS];
+static uint32_t error_by[DCA_MAX_WORKERS];
+
+//Per-worker job service times, used to keep slow workers off the tail end.
+static uint64_t busy_since_ms[DCA_MAX_WORKERS];
+static uint32_t avg_job_ms[DCA_MAX_WORKERS];
+
+//Circuit-breaker state of each worker, and the queue depth it gets when healthy.
+static health worker_health[DCA_MAX_WORKERS];
+static uint8_t worker_queue_depth[DCA_MAX_WORKERS];
+
+//Workers whose jobs don't fit the sessions, e.g. a slave built with a
+//different job factor, are never given work.
+static bool worker_compatible[DCA_MAX_WORKERS];
+
+//The thread driving each worker and the queue they report back on. A
+//worker's epoch moves on whenever its jobs are cancelled, so that events
+//about jobs it no longer owns are dropped.
+static driver drivers[DCA_MAX_WORKERS];
+static mpsc_queue events;
+static uint32_t worker_epoch[DCA_MAX_WORKERS];
+static bool probe_pending[DCA_MAX_WORKERS];
+
+//Every job handed out gets a lease of its own. A result only counts if it
+//was reported under the lease its worker's queue holds for the job, so a
+//job given up on and handed out again is never credited twice.
+static uint32_t last_lease;
+
+//Whether slaves are armed with the fault profile picked with -F.
+static bool fault_injection;
+
+static local_worker local_workers[DCA_MAX_LOCAL_WORKERS];
+static char local_names[DCA_MAX_LOCAL_WORKERS][16];
+static int local_worker_count = -1;
+
+static checkpoint cp;
+static char checkpoint_path[256] = DCA_CHECKPOINT_DEFAULT_PATH;
+static bool resume_session;
+static char trace_path[256] = TRACE_DEFAULT_PATH;
+static bool checkpoint_dirty;
+static uint64_t last_checkpoint_ms;
+static volatile sig_atomic_t dca_interrupted;
+
+//When every worker stopped being able to take jobs, or 0 if one can.
+static uint64_t stalled_since_ms;
+static bool dca_stalled;
 
 static tui_mngr mngr;
 
 static void log_render();
 void setup_jobs();
 bool setup_i2c_slaves();
+bool setup_local_workers();
 bool setup_scheduler();
-int job_get_next();
+void setup_slave_queues();
+bool setup_drivers();
+bool worker_should_take_tail(slave *sl);
+bool dispatch_job(slave *sl);
 void auto_dispatch_work();
-void check_results();
+void dca_handle_events();
+void dca_stop_drivers();
 int dca_main();
 void dca_cancel_job(slave *sl);
+void dca_record_failure(slave *sl, const bool timeout);
+void dca_apply_health(slave *sl);
+void dca_probe_workers();
+void dca_print_ack_stats();
+void dca_print_prediction_stats();
+void dca_print_bus_stats();
+void dca_print_fault_stats();
+void dca_set_local_workers(const int count);
+bool dca_add_bus(const char *device);
+bool dca_add_remote_worker(const char *spec);
+bool dca_add_session(const char *spec);
+void dca_set_policy(const SESSION_POLICY policy);
+void dca_set_checkpoint(const char *path, const bool resume);
+void dca_set_trace(const char *path);
+bool dca_set_faults(const char *spec);
+bool dca_checkpoint_save();
+bool dca_checkpoint_restore();
+void dca_checkpoint_tick();
 static void dca_reset();
+static void dca_free_slot(slave *sl, const uint8_t slot);
+static bool dca_connect(const char *target, const uint8_t addr, const I2C_HW hw_type, const char *name);
+static void dca_negotiate(i2c_obj *obj, const char *name, efp_caps *caps);
+static void dca_check_general_call();
+static bool dca_caps_compatible(const efp_caps *caps, const char *name);
+static uint8_t dca_slave_slots(const slave *sl);
+static uint32_t dca_next_lease();
+static bool dca_lease_current(slave *sl, const int8_t pos, const driver_event *ev);
+static uint64_t dca_now_ms();
+static bool dca_any_compatible();
+static void dca_check_stall();
+static void dca_handle_interrupt(int sig);
 #endif
\ No newline at end of file
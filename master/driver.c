@@ -0,0 +1,777 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "driver.h"
+#include "scheduler.h"
+#include "efp.h"
+#include "local.h"
+#include "log.h"
+#include "mpsc.h"
+#include "trace.h"
+#include "fault.h"
+
+/**
+ * Reads a monotonic clock.
+ * @return The current time in milliseconds.
+ */
+static uint64_t driver_now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Predicts how long the front job has left to run.
+ * @param  d        A pointer to the driver.
+ * @param  progress The number of results the worker has computed so far.
+ * @return          The time left in milliseconds, or 0 without a measured rate.
+ */
+static uint64_t driver_left_ms(const driver *d, const uint8_t progress)
+{
+	if (progress >= d->step_size)
+		return 0;
+
+	return (uint64_t)(d->step_size - progress) * d->us_per_result / 1000;
+}
+
+/**
+ * Schedules the next status poll of the front job for shortly before it is
+ * predicted to finish. Long jobs that hand over digits as they go are polled
+ * every DRIVER_PARTIAL_INTERVAL_MS in the meantime. Without a measured rate
+ * the job is polled every pass.
+ * @param d        A pointer to the driver.
+ * @param progress The number of results the worker has computed so far.
+ * @param now      The current time in milliseconds.
+ * @return         The predicted finishing time, or 0 if there is no prediction.
+ */
+static uint64_t driver_schedule_poll(driver *d, const uint8_t progress, const uint64_t now)
+{
+	uint64_t left_ms, lead_ms;
+
+	if (d->us_per_result == 0 || progress >= d->step_size)
+	{
+		d->next_poll_ms = 0;
+		return 0;
+	}
+
+	left_ms = driver_left_ms(d, progress);
+	lead_ms = left_ms / DRIVER_PREDICT_LEAD_DIV;
+	if (lead_ms < DRIVER_PREDICT_MIN_LEAD_MS)
+		lead_ms = DRIVER_PREDICT_MIN_LEAD_MS;
+
+	d->next_poll_ms = left_ms > lead_ms ? now + left_ms - lead_ms : 0;
+	if (d->num_jobs > 0 && d->jobs[0].streaming && d->next_poll_ms > now + DRIVER_PARTIAL_INTERVAL_MS)
+		d->next_poll_ms = now + DRIVER_PARTIAL_INTERVAL_MS;
+	return now + left_ms;
+}
+
+/**
+ * Marks a job as the one the worker is computing now.
+ * @param d   A pointer to the driver.
+ * @param job A pointer to the job at the front of the queue.
+ * @param now The current time in milliseconds.
+ */
+static void driver_begin_job(driver *d, driver_job *job, const uint64_t now)
+{
+	job->started_ms = now;
+	job->predicted_ms = driver_schedule_poll(d, job->first, now);
+}
+
+/**
+ * Folds the service time of a collected job into the worker's measured rate,
+ * and records how far off its predicted finish was.
+ * @param d   A pointer to the driver.
+ * @param job A pointer to the collected job.
+ * @param now The current time in milliseconds.
+ */
+static void driver_measure_job(driver *d, const driver_job *job, const uint64_t now)
+{
+	d->stats.jobs++;
+
+	if (job->predicted_ms > 0)
+	{
+		int64_t error_ms = (int64_t)now - (int64_t)job->predicted_ms;
+
+		d->stats.predicted++;
+		d->stats.abs_error_ms += error_ms < 0 ? -error_ms : error_ms;
+		d->stats.bias_ms += error_ms;
+	}
+
+	if (job->started_ms == 0 || job->first >= d->step_size)
+		return;
+
+	uint32_t us_per_result = (now - job->started_ms) * 1000 / (d->step_size - job->first);
+	d->us_per_result = d->us_per_result == 0 ? us_per_result : (d->us_per_result * 3 + us_per_result) / 4;
+}
+
+/**
+ * Appends the register dump of the driven worker to the I2C log.
+ * Local workers have no registers, so nothing is logged for them.
+ * @param d      A pointer to the driver.
+ * @param prefix The short label of the operation that was performed.
+ */
+static void driver_log_registers(driver *d, const char *prefix)
+{
+	char str_buffer[100];
+
+	if (d->sl->type != SCHEDULER_WORKER_I2C || d->reg_log == NULL)
+		return;
+
+	sprintf(str_buffer, "%s 0x%02x: ", prefix, d->sl->obj->addr);
+	i2c_reg_to_string(d->sl->obj, str_buffer);
+	log_append(d->reg_log, str_buffer);
+}
+
+/**
+ * Posts an event about a job to the completion queue.
+ * @param d       A pointer to the driver.
+ * @param type    The DRIVER_EVENT.
+ * @param job     A pointer to the job the event is about, or NULL.
+ * @param ok      The outcome, for events that have one.
+ * @param results A pointer to the job's digits from the first one the main
+ *                loop doesn't have yet, or NULL.
+ * @param count   The number of digits.
+ */
+static void driver_post_event(driver *d, const DRIVER_EVENT type, const driver_job *job, const bool ok, const uint8_t *results, const uint8_t count)
+{
+	driver_event *ev = malloc(sizeof(driver_event));
+	if (ev == NULL)
+		return;
+
+	memset(ev, 0, sizeof(driver_event));
+	ev->worker = d->sl->idx;
+	ev->type = type;
+	ev->ok = ok;
+	if (job != NULL)
+	{
+		ev->epoch = job->epoch;
+		ev->session_id = job->session_id;
+		ev->job_idx = job->job_idx;
+		ev->slot = job->slot;
+		ev->lease = job->lease;
+		ev->first = job->fetched;
+	}
+	if (results != NULL)
+	{
+		ev->count = count;
+		memcpy(ev->results, results, count);
+	}
+
+	mpsc_push(d->events, &ev->node);
+}
+
+/**
+ * Frees a slot on the worker straight away.
+ * @param  d    A pointer to the driver.
+ * @param  slot The job slot to free.
+ * @return      True if the operation succeeded, otherwise false.
+ */
+static bool driver_reset(driver *d, const uint8_t slot)
+{
+	if (d->sl->type == SCHEDULER_WORKER_LOCAL)
+		return local_reset(d->sl->local, slot);
+
+	return efp_reset_slot(d->sl->obj, slot, DRIVER_RESULT_TIMEOUT_MS);
+}
+
+/**
+ * Frees a slot on the worker whether or not its job is done. Slaves from
+ * before CANCEL refuse it; they are sent a RESET instead from then on, which
+ * their firmware applied to running jobs too. A CANCEL that goes unanswered
+ * leaves the slot to be swept later.
+ * @param  d    A pointer to the driver.
+ * @param  slot The job slot to free.
+ * @return      True if the operation succeeded, otherwise false.
+ */
+static bool driver_cancel(driver *d, const uint8_t slot)
+{
+	bool refused;
+
+	if (d->sl->type == SCHEDULER_WORKER_LOCAL)
+		return local_cancel(d->sl->local, slot);
+
+	if (! d->no_cancel)
+	{
+		if (efp_cancel_slot(d->sl->obj, slot, &refused, DRIVER_RESULT_TIMEOUT_MS))
+			return true;
+		if (! refused)
+		{
+			d->strays = true;
+			return false;
+		}
+		d->no_cancel = true;
+	}
+
+	return efp_reset_slot(d->sl->obj, slot, DRIVER_RESULT_TIMEOUT_MS);
+}
+
+/**
+ * Sends a held back reset on its own, for when no order followed it.
+ * @param d A pointer to the driver.
+ */
+static void driver_flush_reset(driver *d)
+{
+	if (d->pending_reset < 0)
+		return;
+
+	driver_reset(d, d->pending_reset);
+	d->pending_reset = -1;
+}
+
+/**
+ * Frees the slot of a collected job. On I2C slaves the reset is held back
+ * so the worker's next order can carry it.
+ * @param d    A pointer to the driver.
+ * @param slot The job slot to free.
+ */
+static void driver_release(driver *d, const uint8_t slot)
+{
+	if (d->sl->type == SCHEDULER_WORKER_LOCAL)
+	{
+		local_reset(d->sl->local, slot);
+		return;
+	}
+
+	driver_flush_reset(d);
+	d->pending_reset = slot;
+	d->reset_idle_polls = 0;
+}
+
+/**
+ * Frees every slot on a slave that may hold jobs the driver lost track of,
+ * which would otherwise fill its queue for good. Only done while the driver
+ * has nothing queued on it, so none of its own jobs go too.
+ * @param d A pointer to the driver.
+ */
+static void driver_sweep(driver *d)
+{
+	if (! d->strays || d->num_jobs > 0)
+		return;
+
+	if (driver_cancel(d, EFP_SLOT_ALL))
+	{
+		d->strays = false;
+		d->pending_reset = -1;
+	}
+}
+
+/**
+ * Queues a job on the worker. A finished slot waiting to be freed on the
+ * slave is reset by the same order.
+ * @param  d     A pointer to the driver.
+ * @param  job   The job index.
+ * @param  first The first result to compute; earlier ones are already known.
+ * @param  lease The lease the job is handed out under.
+ * @param  slot  A pointer to a single byte location used to store the job slot.
+ * @return       True if the order succeeded, otherwise false.
+ */
+static bool driver_order(driver *d, const uint32_t job, const uint8_t first, const uint32_t lease, uint8_t *slot)
+{
+	if (d->sl->type == SCHEDULER_WORKER_LOCAL)
+		return local_order(d->sl->local, job, first, slot);
+
+	//A worker with nothing queued is waiting on this order.
+	d->sl->obj->idle = d->num_jobs == 0;
+	driver_sweep(d);
+	if (d->pending_reset < 0)
+		return efp_order_slot(d->sl->obj, job, first, lease, slot, DRIVER_ORDER_TIMEOUT_MS);
+
+	if (! efp_order_reset_slot(d->sl->obj, job, first, lease, d->pending_reset, slot, DRIVER_ORDER_TIMEOUT_MS))
+		return false;
+
+	d->pending_reset = -1;
+	return true;
+}
+
+/**
+ * Reads the progress of a queued job on the worker, and its results if it
+ * has finished and the worker can send them along with the status.
+ * @param  d           A pointer to the driver.
+ * @param  slot        The job slot to query.
+ * @param  des         A pointer to a single byte location used to store the progress.
+ * @param  results     A pointer to step_size bytes used to store the results.
+ * @param  has_results A pointer to a flag set if results were stored.
+ * @param  lease       A pointer to a location used to store the lease the
+ *                     worker holds the job under, or EFP_NO_LEASE.
+ * @return             True if the operation succeeded, otherwise false.
+ */
+static bool driver_status(driver *d, const uint8_t slot, uint8_t *des, uint8_t *results, bool *has_results, uint32_t *lease)
+{
+	if (d->sl->type == SCHEDULER_WORKER_LOCAL)
+	{
+		*has_results = false;
+		*lease = EFP_NO_LEASE;
+		return local_status(d->sl->local, slot, des);
+	}
+
+	return efp_status_results_slot(d->sl->obj, slot, des, results, d->step_size, has_results, lease, DRIVER_STATUS_TIMEOUT_MS);
+}
+
+/**
+ * Fetches a range of results of a job from the worker. The job only has to
+ * have got as far as end_idx.
+ * @param  d         A pointer to the driver.
+ * @param  slot      The job slot holding the results.
+ * @param  des       A pointer to the location used to store the results.
+ * @param  start_idx The first result index, starting from 1.
+ * @param  end_idx   The final result index.
+ * @param  lease     The lease the job was handed out under.
+ * @return           True if the operation succeeded, otherwise false.
+ */
+static bool driver_results(driver *d, const uint8_t slot, uint8_t *des, const uint8_t start_idx, const uint8_t end_idx, const uint32_t lease)
+{
+	if (d->sl->type == SCHEDULER_WORKER_LOCAL)
+		return local_result_range(d->sl->local, slot, des, start_idx, end_idx);
+
+	return efp_result_range_slot(d->sl->obj, slot, des, start_idx, end_idx, lease, DRIVER_RESULT_TIMEOUT_MS);
+}
+
+/**
+ * Cancels every job the driver knows about, running or not, and forgets them.
+ * @param d A pointer to the driver.
+ */
+static void driver_drop_jobs(driver *d)
+{
+	for (uint8_t i=0; i<d->num_jobs; ++i)
+	{
+		if (! driver_cancel(d, d->jobs[i].slot))
+			d->strays = true;
+		trace_job(TRACE_JOB_DROPPED, d->sl->idx, d->jobs[i].session_id, d->jobs[i].job_idx, false, 0);
+	}
+	d->num_jobs = 0;
+	d->waiting_polls = 0;
+	d->next_poll_ms = 0;
+	driver_flush_reset(d);
+
+	driver_log_registers(d, "Reset");
+}
+
+/**
+ * Carries out one request from the main loop.
+ * @param d   A pointer to the driver.
+ * @param req A pointer to the request.
+ */
+static void driver_handle(driver *d, const driver_request *req)
+{
+	driver_job job;
+
+	switch (req->type)
+	{
+		case DRIVER_REQ_ORDER:
+			job.session_id = req->session_id;
+			job.job_idx = req->job_idx;
+			job.epoch = req->epoch;
+			job.lease = req->lease;
+			job.slot = DRIVER_SLOT_PENDING;
+			job.first = req->first < d->step_size ? req->first : 0;
+			job.fetched = job.first;
+			job.streaming = true;
+			job.started_ms = 0;
+			job.predicted_ms = 0;
+
+			if (d->num_jobs >= SCHEDULER_MAX_QUEUE_DEPTH || ! driver_order(d, req->wire_job, job.first, job.lease, &job.slot))
+			{
+				//The slave may have queued the job and lost only its reply.
+				if (d->sl->type != SCHEDULER_WORKER_LOCAL)
+					d->strays = true;
+				trace_job(TRACE_JOB_ORDERED, d->sl->idx, job.session_id, job.job_idx, false, 0);
+				driver_post_event(d, DRIVER_EVENT_ORDER_FAILED, &job, false, NULL, 0);
+				break;
+			}
+			trace_job(TRACE_JOB_ORDERED, d->sl->idx, job.session_id, job.job_idx, true, 0);
+
+			driver_log_registers(d, "Order");
+			if (d->num_jobs == 0)
+				driver_begin_job(d, &job, driver_now_ms());
+			d->jobs[d->num_jobs++] = job;
+			driver_post_event(d, DRIVER_EVENT_ORDERED, &job, true, NULL, 0);
+		break;
+		case DRIVER_REQ_CANCEL:
+			driver_drop_jobs(d);
+		break;
+		case DRIVER_REQ_PROBE:
+		{
+			bool ok = d->sl->type != SCHEDULER_WORKER_I2C || efp_ping(d->sl->obj, DRIVER_PING_TIMEOUT_MS);
+			driver_log_registers(d, "Probe");
+			driver_post_event(d, DRIVER_EVENT_PROBED, NULL, ok, NULL, 0);
+		}
+		break;
+	}
+}
+
+/**
+ * Checks whether the front job has run so far past its predicted finish
+ * that it can be given up on. Only jobs under a lease are, since only their
+ * results can be told apart should the worker report after all.
+ * @param  d   A pointer to the driver.
+ * @param  job A pointer to the front job.
+ * @param  now The current time in milliseconds.
+ * @return     True if the job has overrun.
+ */
+static bool driver_overran(const driver *d, const driver_job *job, const uint64_t now)
+{
+	if (job->lease == EFP_NO_LEASE || ! d->sl->obj->leases || job->started_ms == 0 || job->predicted_ms <= job->started_ms)
+		return false;
+
+	return now - job->started_ms > (job->predicted_ms - job->started_ms) * DRIVER_OVERRUN_MUL + DRIVER_OVERRUN_MIN_MS;
+}
+
+/**
+ * Checks the job at the front of the worker's queue. Workers compute their
+ * queue in order, so later jobs are never finished first.
+ * @param d A pointer to the driver.
+ */
+static void driver_poll(driver *d)
+{
+	uint8_t progress;
+	uint8_t results[DRIVER_MAX_RESULTS];
+	bool has_results;
+	uint32_t lease;
+	driver_job job = d->jobs[0];
+
+	bool status_ok = driver_status(d, job.slot, &progress, results, &has_results, &lease);
+	uint64_t now = driver_now_ms();
+	driver_log_registers(d, "Stat.");
+	d->stats.status_polls++;
+
+	//The slot holds some other assignment, so this one is lost, e.g. the
+	//slave restarted and the slot has since been filled by a later order.
+	if (status_ok && d->sl->type == SCHEDULER_WORKER_I2C && d->sl->obj->leases && job.lease != EFP_NO_LEASE && lease != job.lease)
+	{
+		driver_post_event(d, DRIVER_EVENT_LEASE_LOST, &job, false, NULL, 0);
+		driver_drop_jobs(d);
+		return;
+	}
+
+	if (status_ok && progress == d->step_size)
+	{
+		//Only the digits the main loop doesn't have yet are handed over.
+		uint8_t count = d->step_size - job.fetched;
+
+		if (has_results)
+			memmove(results, &results[job.fetched], count);
+		else if (count > 0 && ! driver_results(d, job.slot, results, job.fetched +1, d->step_size, job.lease))
+		{
+			//The main loop releases the jobs; the slave forgets them here.
+			driver_post_event(d, DRIVER_EVENT_FETCH_FAILED, &job, false, NULL, 0);
+			driver_drop_jobs(d);
+			return;
+		}
+
+		driver_log_registers(d, "Resu.");
+		trace_job(TRACE_JOB_DONE, d->sl->idx, job.session_id, job.job_idx, true, job.started_ms > 0 ? (now - job.started_ms) * 1000 : 0);
+		driver_post_event(d, DRIVER_EVENT_DONE, &job, true, results, count);
+		if (d->sl->type == SCHEDULER_WORKER_I2C)
+			fault_recovered(&d->sl->obj->fault, trace_now_us());
+		driver_release(d, job.slot);
+		driver_measure_job(d, &job, now);
+
+		//The worker moved straight on to the next queued job.
+		for (uint8_t i=1; i<d->num_jobs; ++i)
+			d->jobs[i -1] = d->jobs[i];
+		d->num_jobs--;
+		d->waiting_polls = 0;
+		if (d->num_jobs > 0)
+			driver_begin_job(d, &d->jobs[0], now);
+		return;
+	}
+
+	//A long job hands over what it has finished so far, so less is lost
+	//should the worker fail before it is done. Slaves that can't are left be.
+	if (status_ok && job.streaming && progress > job.fetched && driver_left_ms(d, progress) >= DRIVER_PARTIAL_INTERVAL_MS)
+	{
+		if (driver_results(d, job.slot, results, job.fetched +1, progress, job.lease))
+		{
+			driver_log_registers(d, "Part.");
+			driver_post_event(d, DRIVER_EVENT_PARTIAL, &job, true, results, progress - job.fetched);
+			d->jobs[0].fetched = progress;
+		}
+		else
+			d->jobs[0].streaming = false;
+	}
+
+	//Stay off the bus until the job is close to done.
+	if (status_ok)
+		driver_schedule_poll(d, progress, now);
+	else
+		d->next_poll_ms = 0;
+
+	if (d->sl->type != SCHEDULER_WORKER_I2C)
+		return;
+
+	//Every failed status poll has cost a full timeout on the bus.
+	if (! status_ok)
+		driver_post_event(d, DRIVER_EVENT_STATUS_FAILED, &job, false, NULL, 0);
+
+	if (++d->waiting_polls > d->stall_polls || driver_overran(d, &job, now))
+	{
+		driver_post_event(d, DRIVER_EVENT_STALLED, &job, false, NULL, 0);
+		driver_drop_jobs(d);
+	}
+}
+
+/**
+ * Takes the oldest request from the driver's inbox.
+ * @param  d   A pointer to the driver.
+ * @param  req A pointer to store the request in.
+ * @return     False if the inbox is empty.
+ */
+static bool driver_take(driver *d, driver_request *req)
+{
+	bool taken = false;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->inbox_len > 0)
+	{
+		*req = d->inbox[d->inbox_head];
+		d->inbox_head = (d->inbox_head +1) % DRIVER_INBOX_SIZE;
+		d->inbox_len--;
+		taken = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return taken;
+}
+
+/**
+ * Calibrates the slave's settle delay again, starting from where errors
+ * have left it.
+ * @param d A pointer to the driver.
+ */
+static void driver_calibrate(driver *d)
+{
+	i2c_obj *obj = d->sl->obj;
+
+	if (obj->settle_max_us > 0)
+		efp_calibrate_settle(obj, DRIVER_PING_TIMEOUT_MS);
+	d->next_settle_ms = driver_now_ms() + DRIVER_SETTLE_INTERVAL_MS;
+}
+
+/**
+ * Sleeps until a request arrives or it is time to poll the worker again.
+ * While the front job is far from its predicted finish the driver sleeps
+ * until it is close, unless a held back reset still needs flushing.
+ * @param  d A pointer to the driver.
+ * @return   True if the inbox still is empty.
+ */
+static bool driver_wait(driver *d)
+{
+	struct timespec until;
+	uint64_t poll_us = d->sl->type == SCHEDULER_WORKER_I2C ? DRIVER_I2C_POLL_US : DRIVER_LOCAL_POLL_US;
+	bool idle;
+
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	if (d->num_jobs > 0 && d->pending_reset < 0)
+	{
+		uint64_t now_ms = (uint64_t)until.tv_sec * 1000 + until.tv_nsec / 1000000;
+		if (d->next_poll_ms > now_ms + poll_us / 1000)
+			poll_us = (d->next_poll_ms - now_ms) * 1000;
+	}
+	until.tv_sec += poll_us / 1000000;
+	until.tv_nsec += (poll_us % 1000000) * 1000;
+	until.tv_sec += until.tv_nsec / 1000000000;
+	until.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->inbox_len == 0 && d->running)
+		pthread_cond_timedwait(&d->wake, &d->lock, &until);
+	idle = d->inbox_len == 0;
+	pthread_mutex_unlock(&d->lock);
+
+	return idle;
+}
+
+/**
+ * The driver thread. Handles requests as they arrive and polls the front
+ * job in between.
+ * @param  arg A pointer to the driver.
+ * @return     NULL.
+ */
+static void *driver_thread(void *arg)
+{
+	driver *d = arg;
+	driver_request req;
+
+	while (d->running)
+	{
+		if (driver_take(d, &req))
+		{
+			driver_handle(d, &req);
+			continue;
+		}
+
+		if (d->num_jobs > 0 && driver_now_ms() >= d->next_poll_ms)
+			driver_poll(d);
+
+		if (d->sl->type == SCHEDULER_WORKER_I2C && driver_now_ms() >= d->next_settle_ms)
+			driver_calibrate(d);
+
+		//A held back reset waits one quiet poll for an order to carry it.
+		if (driver_wait(d) && d->pending_reset >= 0 && ++d->reset_idle_polls > 1)
+			driver_flush_reset(d);
+	}
+
+	//Leave no finished slots behind for the next run to trip over.
+	driver_flush_reset(d);
+	return NULL;
+}
+
+/**
+ * Prepares a driver for a worker. The driver isn't started.
+ * @param d           A pointer to the driver.
+ * @param sl          A pointer to the slave to drive.
+ * @param events      A pointer to the completion queue to post events to.
+ * @param reg_log     The log to dump registers to, or NULL.
+ * @param step_size   The number of results in a job.
+ * @param stall_polls How many status polls of an I2C job may pass without it
+ *                    finishing before it is given up on.
+ */
+void driver_init(driver *d, slave *sl, mpsc_queue *events, char (*reg_log)[DCA_LOG_MAX_STR_LEN], const uint8_t step_size, const uint32_t stall_polls)
+{
+	d->sl = sl;
+	d->events = events;
+	d->reg_log = reg_log;
+	d->step_size = step_size > DRIVER_MAX_RESULTS ? DRIVER_MAX_RESULTS : step_size;
+	d->stall_polls = stall_polls;
+	d->running = false;
+	d->inbox_head = 0;
+	d->inbox_len = 0;
+	d->num_jobs = 0;
+	d->pending_reset = -1;
+	d->reset_idle_polls = 0;
+	d->no_cancel = false;
+	d->strays = false;
+	d->waiting_polls = 0;
+	d->us_per_result = 0;
+	d->next_poll_ms = 0;
+	d->next_settle_ms = driver_now_ms() + DRIVER_SETTLE_INTERVAL_MS;
+	memset(&d->stats, 0, sizeof(d->stats));
+}
+
+/**
+ * Hands a job the worker already holds to a driver that isn't running yet,
+ * e.g. one kept when resuming from a checkpoint.
+ * @param d          A pointer to the driver.
+ * @param session_id The session the job belongs to.
+ * @param job_idx    The job number within the session.
+ * @param slot       The job slot the worker holds it in.
+ * @param fetched    The number of leading digits the main loop already has.
+ * @param epoch      The epoch the main loop knows the job by.
+ * @param lease      The lease the worker reported holding the job under.
+ */
+void driver_adopt(driver *d, const uint8_t session_id, const uint32_t job_idx, const uint8_t slot, const uint8_t fetched, const uint32_t epoch, const uint32_t lease)
+{
+	if (d->num_jobs >= SCHEDULER_MAX_QUEUE_DEPTH)
+		return;
+
+	d->jobs[d->num_jobs].session_id = session_id;
+	d->jobs[d->num_jobs].job_idx = job_idx;
+	d->jobs[d->num_jobs].slot = slot;
+	d->jobs[d->num_jobs].first = 0;
+	d->jobs[d->num_jobs].fetched = fetched < d->step_size ? fetched : 0;
+	d->jobs[d->num_jobs].streaming = true;
+	d->jobs[d->num_jobs].epoch = epoch;
+	d->jobs[d->num_jobs].lease = lease;
+	d->jobs[d->num_jobs].started_ms = 0;
+	d->jobs[d->num_jobs].predicted_ms = 0;
+	d->num_jobs++;
+}
+
+/**
+ * Fits a driver that isn't running yet to what its slave reported at
+ * connect time. A measured speed seeds the first job's prediction. Slaves
+ * that didn't answer HELLO predate CANCEL too, so they get RESET instead.
+ * @param d    A pointer to the driver.
+ * @param caps A pointer to the slave's capabilities.
+ */
+void driver_apply_caps(driver *d, const efp_caps *caps)
+{
+	d->no_cancel = caps->version == 0;
+	if (caps->us_per_digit > 0)
+		d->us_per_result = caps->us_per_digit;
+}
+
+/**
+ * Starts the driver thread.
+ * @param  d A pointer to an initialised driver.
+ * @return   True if the thread was started.
+ */
+bool driver_start(driver *d)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&d->wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	d->running = true;
+	if (pthread_create(&d->thread, NULL, driver_thread, d) != 0)
+	{
+		d->running = false;
+		pthread_cond_destroy(&d->wake);
+		pthread_mutex_destroy(&d->lock);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Stops the driver thread once its current transaction is done, and waits
+ * for it to exit. Requests still in the inbox are dropped.
+ * @param d A pointer to the driver.
+ */
+void driver_stop(driver *d)
+{
+	if (! d->running)
+		return;
+
+	pthread_mutex_lock(&d->lock);
+	d->running = false;
+	pthread_cond_signal(&d->wake);
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_join(d->thread, NULL);
+	pthread_cond_destroy(&d->wake);
+	pthread_mutex_destroy(&d->lock);
+}
+
+/**
+ * Posts a request to the driver and wakes it.
+ * @param  d   A pointer to the driver.
+ * @param  req A pointer to the request, which is copied.
+ * @return     False if the inbox is full.
+ */
+bool driver_post(driver *d, const driver_request *req)
+{
+	bool posted = false;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->inbox_len < DRIVER_INBOX_SIZE)
+	{
+		d->inbox[(d->inbox_head + d->inbox_len) % DRIVER_INBOX_SIZE] = *req;
+		d->inbox_len++;
+		posted = true;
+		pthread_cond_signal(&d->wake);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return posted;
+}
+
+/**
+ * Gets how well the driver predicted when its jobs would finish.
+ * @param  d A pointer to the driver, which should be stopped.
+ * @return   A pointer to the prediction statistics.
+ */
+const driver_prediction_stats *driver_get_prediction_stats(const driver *d)
+{
+	return &d->stats;
+}
@@ -0,0 +1,172 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "scheduler.h"
+#include "mpsc.h"
+#include "log.h"
+#include "efp.h"
+
+//Every worker is driven by its own thread, which does all of that worker's
+//ORDER, STATUS, RESULT and RESET traffic. The main loop posts requests to a
+//driver and reads what happened back off a shared completion queue, so a
+//slow slave only ever holds up its own thread.
+#define DRIVER_INBOX_SIZE 16
+#define DRIVER_MAX_RESULTS 32
+
+#define DRIVER_ORDER_TIMEOUT_MS 500
+#define DRIVER_STATUS_TIMEOUT_MS 5000
+#define DRIVER_RESULT_TIMEOUT_MS 100
+#define DRIVER_PING_TIMEOUT_MS 100
+
+//How long a driver waits for requests between status polls.
+#define DRIVER_I2C_POLL_US 10000
+#define DRIVER_LOCAL_POLL_US 1000
+
+//How far ahead of a job's predicted finish polling starts, as a fraction of
+//the time left, and the shortest lead used.
+#define DRIVER_PREDICT_LEAD_DIV 8
+#define DRIVER_PREDICT_MIN_LEAD_MS 20
+
+//Jobs predicted to run at least this long have their finished digits
+//collected as they go, at most this far apart.
+#define DRIVER_PARTIAL_INTERVAL_MS 2000
+
+//How often a slave that needs time after writes has that delay calibrated
+//again, so it comes back down after errors pushed it up.
+#define DRIVER_SETTLE_INTERVAL_MS 60000
+
+//Jobs on slaves that echo leases are given up on once they have run this
+//many times longer than predicted, plus a grace period, however few polls
+//that took. A late result can't be credited to the wrong assignment, so
+//there is no need to wait out stall_polls.
+#define DRIVER_OVERRUN_MUL 3
+#define DRIVER_OVERRUN_MIN_MS 500
+
+//A job slot the worker hasn't reported yet.
+#define DRIVER_SLOT_PENDING 0xff
+
+typedef enum
+{
+	DRIVER_REQ_ORDER,
+	DRIVER_REQ_CANCEL,
+	DRIVER_REQ_PROBE
+} DRIVER_REQ;
+
+typedef struct
+{
+	DRIVER_REQ type;
+	uint8_t session_id;
+	uint32_t job_idx;
+	uint32_t wire_job;
+	//How many leading digits of the job are already known.
+	uint8_t first;
+	uint32_t epoch;
+	uint32_t lease;
+} driver_request;
+
+typedef enum
+{
+	DRIVER_EVENT_ORDERED,
+	DRIVER_EVENT_ORDER_FAILED,
+	DRIVER_EVENT_DONE,
+	DRIVER_EVENT_PARTIAL,
+	DRIVER_EVENT_STATUS_FAILED,
+	DRIVER_EVENT_FETCH_FAILED,
+	DRIVER_EVENT_STALLED,
+	DRIVER_EVENT_LEASE_LOST,
+	DRIVER_EVENT_PROBED
+} DRIVER_EVENT;
+
+typedef struct
+{
+	mpsc_node node;
+	uint8_t worker;
+	DRIVER_EVENT type;
+	uint32_t epoch;
+	uint8_t session_id;
+	uint32_t job_idx;
+	uint8_t slot;
+	uint32_t lease;
+	bool ok;
+	//Digits first to first + count -1 of the job.
+	uint8_t first;
+	uint8_t count;
+	uint8_t results[DRIVER_MAX_RESULTS];
+} driver_event;
+
+typedef struct
+{
+	uint8_t session_id;
+	uint32_t job_idx;
+	uint8_t slot;
+	uint32_t epoch;
+	//The lease the job was handed out under, which a slave that echoes
+	//leases must report for the slot, or EFP_NO_LEASE.
+	uint32_t lease;
+	//The digit the worker was ordered to start from, how many leading digits
+	//the main loop has, and whether the worker can hand over digits before
+	//the job is done.
+	uint8_t first;
+	uint8_t fetched;
+	bool streaming;
+	//When the worker started on the job, and when it is predicted to finish,
+	//or 0 while no prediction can be made.
+	uint64_t started_ms;
+	uint64_t predicted_ms;
+} driver_job;
+
+typedef struct
+{
+	uint32_t jobs;
+	uint32_t predicted;
+	uint32_t status_polls;
+	uint64_t abs_error_ms;
+	int64_t bias_ms;
+} driver_prediction_stats;
+
+typedef struct
+{
+	slave *sl;
+	mpsc_queue *events;
+	char (*reg_log)[DCA_LOG_MAX_STR_LEN];
+	uint8_t step_size;
+	uint32_t stall_polls;
+
+	volatile bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	driver_request inbox[DRIVER_INBOX_SIZE];
+	uint8_t inbox_head;
+	uint8_t inbox_len;
+
+	//Owned by the driver thread once it is running.
+	driver_job jobs[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint8_t num_jobs;
+	int16_t pending_reset;
+	uint8_t reset_idle_polls;
+	//Set if the slave doesn't know CANCEL, by its caps or by refusing one.
+	bool no_cancel;
+	//Set when the slave may hold jobs the driver has lost track of, after a
+	//cancel or an order went unanswered. They are swept once the driver's
+	//own queue is empty.
+	bool strays;
+	uint32_t waiting_polls;
+	//Measured service rate, and when the front job is next worth polling.
+	uint32_t us_per_result;
+	uint64_t next_poll_ms;
+	uint64_t next_settle_ms;
+	driver_prediction_stats stats;
+} driver;
+
+void driver_init(driver *d, slave *sl, mpsc_queue *events, char (*reg_log)[DCA_LOG_MAX_STR_LEN], const uint8_t step_size, const uint32_t stall_polls);
+void driver_adopt(driver *d, const uint8_t session_id, const uint32_t job_idx, const uint8_t slot, const uint8_t fetched, const uint32_t epoch, const uint32_t lease);
+void driver_apply_caps(driver *d, const efp_caps *caps);
+bool driver_start(driver *d);
+void driver_stop(driver *d);
+bool driver_post(driver *d, const driver_request *req);
+const driver_prediction_stats *driver_get_prediction_stats(const driver *d);
+
+#endif
@@ -1,34 +1,493 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "efp.h"
+#include "bcd.h"
+
+//Per hardware type poll strategy. The Photon answers from its system thread
+//within a few hundred microseconds, so it is polled around its usual reply
+//time. The mbed has usually processed the command during the settle delay
+//in i2c_write_reg, and the backoff covers whatever calibration trimmed off it.
+static efp_poll_config poll_config[EFP_HW_TYPES] =
+{
+	[I2C_HW_PHOTON] = { EFP_POLL_EXPECTED, 100, 2000 },
+	[I2C_HW_MBED] = { EFP_POLL_BACKOFF, 1000, 20000 }
+};
+
+static efp_ack_stats ack_stats[EFP_HW_TYPES][EFP_CMD_COUNT];
+
+//Every driver thread talking to slaves of a hardware type shares its poll
+//strategy and statistics, so they are only touched under this lock.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//How urgent each command is on a shared adapter. Orders to idle slaves are
+//sent ahead of everything else, see efp_command_payload.
+static const BUS_CLASS cmd_class[EFP_CMD_COUNT] =
+{
+	[EFP_CMD_PING] = BUS_CLASS_POLL,
+	[EFP_CMD_ORDER] = BUS_CLASS_ORDER,
+	[EFP_CMD_STATUS] = BUS_CLASS_POLL,
+	[EFP_CMD_RESULT] = BUS_CLASS_RESULT,
+	[EFP_CMD_RESET] = BUS_CLASS_RESULT,
+	[EFP_CMD_RESULT_BLOCK] = BUS_CLASS_RESULT,
+	[EFP_CMD_CANCEL] = BUS_CLASS_RESULT,
+	[EFP_CMD_HELLO] = BUS_CLASS_POLL
+};
+
+//CRC-8 with polynomial x^8 + x^2 + x + 1 (0x07), as used by the SMBus PEC.
+static const uint8_t crc8_table[256] =
+{
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+	0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+	0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+	0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+	0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+	0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+	0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+	0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+	0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+	0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3
+};
+
+/**
+ * Returns the current value of the monotonic clock in microseconds.
+ * @return The number of microseconds since some unspecified starting point.
+ */
+static uint64_t efp_now_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 /**
- * Spin-lock and wait for an I2C slave to reply by setting the ACK bit.
- * @param  obj        A pointer to the i2c_obj we are waiting for.
- * @param  timeout_ns The number of nanoseconds before timeout occurs.
- * @return            True if the operation succeeded, false if a timeout occurred.
+ * Folds a completed (or timed out) ack wait into the command's statistics.
+ * @param stats      A pointer to the command's efp_ack_stats.
+ * @param latency_us The time from the command being written to its ack.
+ * @param acked      False if the wait timed out.
  */
-static bool efp_wait_ack(i2c_obj *obj, const uint32_t timeout_ns)
+static void efp_record_ack(efp_ack_stats *stats, const uint32_t latency_us, const bool acked)
 {
-	struct timespec time_begin, time_current;
+	pthread_mutex_lock(&stats_lock);
+	if (! acked)
+	{
+		stats->timeouts++;
+		pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+
+	if (stats->count == 0 || latency_us < stats->min_us)
+		stats->min_us = latency_us;
+	if (latency_us > stats->max_us)
+		stats->max_us = latency_us;
+
+	stats->count++;
+	stats->total_us += latency_us;
 
-	clock_gettime(CLOCK_REALTIME, &time_begin);
+	//Weight recent replies 1/8 so the expected latency follows the slave's load.
+	if (stats->count == 1)
+		stats->avg_us = latency_us;
+	else
+		stats->avg_us = stats->avg_us + ((int32_t)latency_us - (int32_t)stats->avg_us) / 8;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Counts a reply that had to be read again or a request that had to be sent
+ * again in the command's statistics.
+ * @param stats  A pointer to the command's efp_ack_stats.
+ * @param result EFP_REPLY_CORRUPT or EFP_REPLY_REJECTED.
+ */
+static void efp_record_retry(efp_ack_stats *stats, const EFP_REPLY result)
+{
+	pthread_mutex_lock(&stats_lock);
+	if (result == EFP_REPLY_CORRUPT)
+		stats->corrupt++;
+	else
+		stats->rejected++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Encodes a request as a version 2 frame.
+ * @param  frame   A pointer to at least EFP_V2_HEADER + len +1 bytes to store the frame in.
+ * @param  seq     The request's sequence number.
+ * @param  cmd     The EFP_CMD to send.
+ * @param  data    The request's data value.
+ * @param  arg     The value of the argument byte, i.e. the job slot.
+ * @param  payload A pointer to len payload bytes, or NULL.
+ * @param  len     The number of payload bytes.
+ * @return         The length of the frame in bytes.
+ */
+uint8_t efp_encode_request(uint8_t *frame, const uint8_t seq, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t *payload, const uint8_t len)
+{
+	frame[EFP_V2_MAGIC_BYTE] = EFP_V2_MAGIC;
+	frame[EFP_V2_LEN_BYTE] = len;
+	frame[EFP_V2_SEQ_BYTE] = seq;
+	frame[EFP_V2_CMD_BYTE] = cmd;
+	frame[EFP_V2_ACK_BYTE] = 0x0;
+	frame[EFP_V2_ARG_BYTE] = arg;
+	for (uint8_t i=0; i<4; ++i)
+		frame[EFP_V2_DATA_BYTE + i] = (data >> (i * 8)) & 0xff;
+	for (uint8_t i=0; i<len; ++i)
+		frame[EFP_V2_HEADER + i] = payload[i];
+	frame[EFP_V2_HEADER + len] = efp_crc8(frame, EFP_V2_HEADER + len);
+
+	return EFP_V2_HEADER + len + 1;
+}
+
+/**
+ * Writes a request to an I2C slave in the wire format of its protocol version.
+ * Version 1 only carries the low byte of data, and no payload.
+ * @param  obj     A pointer to the i2c_obj.
+ * @param  cmd     The EFP_CMD to send.
+ * @param  data    The request's data value.
+ * @param  arg     The value of the argument byte, i.e. the job slot.
+ * @param  payload A pointer to len payload bytes, or NULL.
+ * @param  len     The number of payload bytes.
+ * @return         True if the request was written, otherwise false.
+ */
+static bool efp_write_request(i2c_obj *obj, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t *payload, const uint8_t len)
+{
+	if (obj->version < EFP_VERSION_2)
+	{
+		i2c_set_reg_data(obj, EFP_CMD_REGISTER_BYTE, cmd);
+		i2c_set_reg_data(obj, EFP_CMD_REGISTER_SLAVE_ACK_BYTE, 0x0);
+		i2c_set_reg_data(obj, EFP_CMD_REGISTER_DATA_BYTE, data & 0xff);
+		i2c_set_reg_data(obj, EFP_CMD_REGISTER_ARG_BYTE, arg);
+
+		return i2c_write_reg(obj) == I2C_STATUS_OK;
+	}
+
+	uint8_t frame[EFP_V2_HEADER + EFP_PAYLOAD_MAX + 1];
+	uint8_t frame_len = efp_encode_request(frame, obj->seq, cmd, data, arg, payload, len);
+
+	return i2c_write_block(obj, frame, frame_len) == I2C_STATUS_OK;
+}
+
+/**
+ * Reads a slave's reply once and decodes it.
+ * @param  obj         A pointer to the i2c_obj.
+ * @param  payload_len The most payload bytes the reply may carry.
+ * @param  reply       A pointer to the efp_message used to store the reply.
+ * @return             An EFP_REPLY code.
+ */
+static EFP_REPLY efp_read_reply(i2c_obj *obj, const uint8_t payload_len, efp_message *reply)
+{
+	uint8_t block[I2C_BLOCK_MAX];
 
-	//Busy wait for a response.
-	while (obj->reg[EFP_CMD_REGISTER_SLAVE_ACK_BYTE -1] == 0x0)
+	if (obj->version < EFP_VERSION_2)
 	{
-		i2c_read_reg(obj);
+		const uint8_t *b = obj->reg;
+		I2C_STATUS status;
+		if (payload_len == 0)
+			status = i2c_read_reg(obj);
+		else
+		{
+			status = i2c_read_block(obj, block, EFP_RESULT_BLOCK_HEADER + payload_len);
+			b = block;
+		}
+		if (status != I2C_STATUS_OK)
+			return EFP_REPLY_ERROR;
+
+		reply->cmd = b[EFP_CMD_REGISTER_BYTE -1];
+		reply->ack = b[EFP_CMD_REGISTER_SLAVE_ACK_BYTE -1];
+		reply->data = b[EFP_CMD_REGISTER_DATA_BYTE -1];
+		reply->arg = b[EFP_CMD_REGISTER_ARG_BYTE -1];
+		reply->len = payload_len;
+		for (uint8_t i=0; i<payload_len; ++i)
+			reply->payload[i] = b[EFP_RESULT_BLOCK_HEADER + i];
+
+		return reply->ack == 0x0 ? EFP_REPLY_PENDING : EFP_REPLY_READY;
+	}
+
+	if (i2c_read_block(obj, block, EFP_V2_HEADER + payload_len + 1) != I2C_STATUS_OK)
+		return EFP_REPLY_ERROR;
+
+	return efp_decode_reply(block, obj->seq, payload_len, reply);
+}
+
+/**
+ * Decodes a version 2 reply frame read back from a slave.
+ * @param  block       A pointer to EFP_V2_HEADER + payload_len +1 bytes read.
+ * @param  seq         The sequence number of the request being answered.
+ * @param  payload_len The most payload bytes the reply may carry.
+ * @param  reply       A pointer to the efp_message used to store the reply.
+ * @return             An EFP_REPLY code.
+ */
+EFP_REPLY efp_decode_reply(const uint8_t *block, const uint8_t seq, const uint8_t payload_len, efp_message *reply)
+{
+	//Until the slave has handled the request, the registers hold either
+	//the request itself or the reply to an earlier one.
+	if (block[EFP_V2_MAGIC_BYTE] != EFP_V2_MAGIC || block[EFP_V2_SEQ_BYTE] != seq)
+		return EFP_REPLY_PENDING;
+
+	uint8_t len = block[EFP_V2_LEN_BYTE];
+	if (len > payload_len || efp_crc8(block, EFP_V2_HEADER + len) != block[EFP_V2_HEADER + len])
+		return EFP_REPLY_CORRUPT;
+
+	reply->cmd = block[EFP_V2_CMD_BYTE];
+	reply->ack = block[EFP_V2_ACK_BYTE];
+	reply->arg = block[EFP_V2_ARG_BYTE];
+	reply->data = 0x0;
+	for (int8_t i=3; i>=0; --i)
+		reply->data = (reply->data << 8) | block[EFP_V2_DATA_BYTE + i];
+	reply->len = len;
+	for (uint8_t i=0; i<len; ++i)
+		reply->payload[i] = block[EFP_V2_HEADER + i];
+
+	if (reply->ack == 0x0)
+		return EFP_REPLY_PENDING;
+	if (reply->ack == EFP_ACK_BAD_FRAME)
+		return EFP_REPLY_REJECTED;
+	return EFP_REPLY_READY;
+}
+
+/**
+ * Waits for an I2C slave to reply to a request. Between reads the bus is
+ * left idle according to the poll strategy of the slave's hardware type, so
+ * one slave's wait does not starve transactions with the others. A corrupt
+ * reply is read again straight away, up to EFP_CORRUPT_REREADS times in a
+ * row; failed transfers always wait, as a slave that doesn't answer won't
+ * answer any sooner for being asked again.
+ * @param  obj         A pointer to the i2c_obj we are waiting for.
+ * @param  cmd         The EFP_CMD being acknowledged, for latency statistics.
+ * @param  payload_len The most payload bytes the reply may carry.
+ * @param  reply       A pointer to the efp_message used to store the reply.
+ * @param  deadline    The monotonic time in microseconds at which to give up.
+ * @return             EFP_REPLY_READY or EFP_REPLY_REJECTED, or EFP_REPLY_PENDING on timeout.
+ */
+static EFP_REPLY efp_wait_reply(i2c_obj *obj, const EFP_CMD cmd, const uint8_t payload_len, efp_message *reply, const uint64_t deadline)
+{
+	efp_ack_stats *stats = &ack_stats[obj->hw_type][cmd];
+	uint64_t time_begin = efp_now_us();
+	efp_poll_config poll;
+	uint32_t avg_us;
+	uint8_t rereads = 0;
+
+	pthread_mutex_lock(&stats_lock);
+	poll = poll_config[obj->hw_type];
+	avg_us = stats->count > 0 ? stats->avg_us : 0;
+	pthread_mutex_unlock(&stats_lock);
+	uint32_t delay_us = poll.initial_us;
+
+	//Most replies take about as long as the last few did, so there is no
+	//point reading before then.
+	if (poll.strategy == EFP_POLL_EXPECTED && avg_us > 0)
+	{
+		uint32_t expected_us = avg_us * 3 / 4;
+		if (expected_us > poll.max_us)
+			expected_us = poll.max_us;
+		if (time_begin + expected_us < deadline)
+			usleep(expected_us);
+	}
+
+	while (1)
+	{
+		EFP_REPLY result = efp_read_reply(obj, payload_len, reply);
+
+		uint64_t now = efp_now_us();
+		if (result == EFP_REPLY_READY || result == EFP_REPLY_REJECTED)
+		{
+			efp_record_ack(stats, now - time_begin, true);
+			return result;
+		}
+
+		if (now >= deadline)
+		{
+			efp_record_ack(stats, now - time_begin, false);
+			return EFP_REPLY_PENDING;
+		}
+
+		if (result == EFP_REPLY_CORRUPT)
+		{
+			efp_record_retry(stats, result);
+			if (rereads++ < EFP_CORRUPT_REREADS)
+				continue;
+		}
+		rereads = 0;
+
+		//Reads for an ack that wasn't ready wait behind more useful traffic.
+		obj->bus_class = BUS_CLASS_POLL;
+
+		if (poll.strategy == EFP_POLL_IMMEDIATE && result == EFP_REPLY_PENDING)
+			continue;
+
+		//Never sleep past the deadline; one last read happens there.
+		uint32_t sleep_us = delay_us;
+		if (now + sleep_us > deadline)
+			sleep_us = deadline - now;
+		usleep(sleep_us);
+
+		delay_us *= 2;
+		if (delay_us > poll.max_us)
+			delay_us = poll.max_us;
+	}
+}
+
+/**
+ * Writes a command to an I2C slave and waits for it to be acknowledged.
+ * Requests the slave rejects as corrupt are resent at once under a new
+ * sequence number.
+ * @param  obj         A pointer to the i2c_obj.
+ * @param  cmd         The EFP_CMD to send.
+ * @param  data        The request's data value.
+ * @param  arg         The value of the argument byte, i.e. the job slot.
+ * @param  payload_len The most payload bytes the reply may carry.
+ * @param  reply       A pointer to the efp_message used to store the reply.
+ * @param  timeout_ms  The number of milliseconds before timeout occurs.
+ * @return             True if the slave replied with EFP_ACK_OK, otherwise false.
+ */
+static bool efp_command(i2c_obj *obj, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t payload_len, efp_message *reply, const uint32_t timeout_ms)
+{
+	return efp_command_payload(obj, cmd, data, arg, NULL, 0, payload_len, reply, timeout_ms);
+}
+
+/**
+ * Sends a request with a payload and waits for the reply, as efp_command.
+ * Version 1 slaves never see the payload.
+ * @param  obj         A pointer to the i2c_obj.
+ * @param  cmd         The EFP_CMD to send.
+ * @param  data        The request's data value.
+ * @param  arg         The value of the argument byte, i.e. the job slot.
+ * @param  req_payload A pointer to req_len payload bytes, or NULL.
+ * @param  req_len     The number of request payload bytes.
+ * @param  payload_len The most payload bytes the reply may carry.
+ * @param  reply       A pointer to the efp_message used to store the reply.
+ * @param  timeout_ms  The number of milliseconds before timeout occurs.
+ * @return             True if the slave replied with EFP_ACK_OK, otherwise false.
+ */
+static bool efp_command_payload(i2c_obj *obj, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t *req_payload, const uint8_t req_len, const uint8_t payload_len, efp_message *reply, const uint32_t timeout_ms)
+{
+	uint64_t deadline = efp_now_us() + (uint64_t)timeout_ms * 1000;
 
-		clock_gettime(CLOCK_REALTIME, &time_current);
-		if ((time_current.tv_nsec - time_begin.tv_nsec) > timeout_ns)
+	if (payload_len > EFP_PAYLOAD_MAX || req_len > EFP_PAYLOAD_MAX)
+		return false;
+
+	obj->cmd = cmd;
+	for (uint8_t attempt=0; attempt<EFP_V2_ATTEMPTS; ++attempt)
+	{
+		obj->bus_class = cmd == EFP_CMD_ORDER && obj->idle ? BUS_CLASS_FEED : cmd_class[cmd];
+		obj->seq++;
+		if (! efp_write_request(obj, cmd, data, arg, req_payload, req_len))
 			return false;
+
+		//The request and the first read of its reply are never batched into
+		//one bus transaction: the read would land before the slave could
+		//have acked, and the mbed needs its settle time after a write.
+		//
+		//A request the slave never saw or couldn't read usually means it
+		//wasn't given long enough to settle after the last one.
+		EFP_REPLY result = efp_wait_reply(obj, cmd, payload_len, reply, deadline);
+		if (result == EFP_REPLY_READY)
+			return reply->ack == EFP_ACK_OK;
+		i2c_settle_backoff(obj);
+		if (result == EFP_REPLY_PENDING)
+			return false;
+
+		efp_record_retry(&ack_stats[obj->hw_type][cmd], EFP_REPLY_REJECTED);
+	}
+
+	return false;
+}
+
+/**
+ * Computes the CRC-8 (SMBus PEC) of a block of bytes.
+ * @param  data A pointer to the bytes.
+ * @param  len  The number of bytes.
+ * @return      The CRC.
+ */
+uint8_t efp_crc8(const uint8_t *data, const uint8_t len)
+{
+	uint8_t crc = 0x0;
+	for (uint8_t i=0; i<len; ++i)
+		crc = crc8_table[crc ^ data[i]];
+	return crc;
+}
+
+/**
+ * Finds out what a slave can do. A HELLO in the v2 format gets its
+ * capabilities; v2 slaves from before HELLO reject it and are pinged
+ * instead. Slaves that don't understand the frame never acknowledge it and
+ * are left on version 1.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  caps       A pointer to the efp_caps used to store the capabilities,
+ *                    left zeroed if the slave didn't report them.
+ * @param  timeout_ms The number of milliseconds to wait for a v2 reply.
+ * @return            The protocol version the slave will be spoken to in.
+ */
+uint8_t efp_negotiate(i2c_obj *obj, efp_caps *caps, const uint32_t timeout_ms)
+{
+	efp_message reply;
+
+	obj->version = EFP_VERSION_2;
+	obj->general_call = false;
+	obj->leases = false;
+	if (efp_hello(obj, caps, timeout_ms))
+	{
+		if (caps->version < EFP_VERSION_2)
+			obj->version = caps->version;
+		obj->general_call = obj->version >= EFP_VERSION_2 && (caps->features & EFP_FEATURE_GENERAL_CALL);
+		obj->leases = obj->version >= EFP_VERSION_2 && (caps->features & EFP_FEATURE_LEASE);
+		return obj->version;
 	}
 
+	if (! efp_command(obj, EFP_CMD_PING, 0x0, 0x0, 0, &reply, timeout_ms))
+		obj->version = EFP_VERSION_1;
+
+	return obj->version;
+}
+
+/**
+ * Asks a version 2 slave to describe itself.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  caps       A pointer to the efp_caps used to store the capabilities.
+ *                    It is zeroed if the slave doesn't answer.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if the slave described itself, otherwise false.
+ */
+bool efp_hello(i2c_obj *obj, efp_caps *caps, const uint32_t timeout_ms)
+{
+	efp_message reply;
+
+	memset(caps, 0, sizeof(efp_caps));
+	if (obj->version < EFP_VERSION_2 || ! efp_command(obj, EFP_CMD_HELLO, 0x0, 0x0, EFP_CAPS_LEN, &reply, timeout_ms) || reply.len < EFP_CAPS_MIN_LEN)
+		return false;
+
+	caps->version = reply.payload[EFP_CAPS_VERSION_BYTE];
+	caps->job_factor = reply.payload[EFP_CAPS_JOB_FACTOR_BYTE];
+	caps->queue_depth = reply.payload[EFP_CAPS_QUEUE_DEPTH_BYTE];
+	caps->job_types = reply.payload[EFP_CAPS_JOB_TYPES_BYTE];
+	caps->kernels = reply.payload[EFP_CAPS_KERNELS_BYTE];
+	caps->result_bytes = reply.payload[EFP_CAPS_RESULT_BYTES_BYTE];
+	caps->features = reply.len > EFP_CAPS_FEATURES_BYTE ? reply.payload[EFP_CAPS_FEATURES_BYTE] : 0x0;
+	caps->us_per_digit = reply.data;
+
 	return true;
 }
 
+/**
+ * Reduces a job index to what the slave's protocol version can carry, for
+ * comparing against the job a slave echoes back.
+ * @param  obj A pointer to the i2c_obj.
+ * @param  job The job index.
+ * @return     The job index as the slave sees it.
+ */
+uint32_t efp_wire_job(const i2c_obj *obj, const uint32_t job)
+{
+	return obj->version < EFP_VERSION_2 ? (job & 0xff) : job;
+}
+
 /**
  * Pings an I2C slave device and waits for a response.
  * @param  obj        A pointer to the i2c_obj.
@@ -37,14 +496,53 @@ static bool efp_wait_ack(i2c_obj *obj, const uint32_t timeout_ns)
  */
 bool efp_ping(i2c_obj *obj, const uint32_t timeout_ms)
 {
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_BYTE, EFP_CMD_PING);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_SLAVE_ACK_BYTE, 0x0);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_DATA_BYTE, 0x0);
+	efp_message reply;
+	return efp_command(obj, EFP_CMD_PING, 0x0, 0x0, 0, &reply, timeout_ms);
+}
 
-	if (i2c_write_reg(obj) != I2C_STATUS_OK)
-		return false;
+/**
+ * Determines if a slave answers every one of a few pings at its current
+ * settle delay.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  timeout_ms The number of milliseconds before each ping times out.
+ * @return            True if every ping was answered.
+ */
+static bool efp_settle_reliable(i2c_obj *obj, const uint32_t timeout_ms)
+{
+	for (uint8_t i=0; i<EFP_SETTLE_PINGS; ++i)
+		if (! efp_ping(obj, timeout_ms))
+			return false;
 
-	return efp_wait_ack(obj, timeout_ms * 1000000);
+	return true;
+}
+
+/**
+ * Finds the shortest delay after writes that a slave still reliably answers
+ * behind, halving the current delay until pings start failing. The delay
+ * kept is the last one that worked plus a margin. Errors during the run
+ * back it off again, so calling this periodically lets the delay follow the
+ * slave both ways.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  timeout_ms The number of milliseconds before each ping times out.
+ * @return            The settle delay in microseconds now used.
+ */
+uint32_t efp_calibrate_settle(i2c_obj *obj, const uint32_t timeout_ms)
+{
+	uint32_t good_us = obj->settle_us;
+
+	while (good_us > 0)
+	{
+		//Below the step size a delay is no better than none.
+		uint32_t trial_us = good_us / 2 < I2C_SETTLE_STEP_US ? 0 : good_us / 2;
+		obj->settle_us = trial_us;
+		if (! efp_settle_reliable(obj, timeout_ms))
+			break;
+		good_us = trial_us;
+	}
+
+	good_us += good_us / EFP_SETTLE_MARGIN_DIV;
+	obj->settle_us = good_us < obj->settle_max_us ? good_us : obj->settle_max_us;
+	return obj->settle_us;
 }
 
 /**
@@ -56,14 +554,8 @@ bool efp_ping(i2c_obj *obj, const uint32_t timeout_ms)
  */
 bool efp_order(i2c_obj *obj, const uint8_t n_val, const uint32_t timeout_ms)
 {
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_BYTE, EFP_CMD_ORDER);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_SLAVE_ACK_BYTE, 0x0);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_DATA_BYTE, n_val);
-
-	if (i2c_write_reg(obj) != I2C_STATUS_OK)
-		return false;
-
-	return efp_wait_ack(obj, timeout_ms * 1000000);
+	uint8_t slot;
+	return efp_order_slot(obj, n_val, 0, EFP_NO_LEASE, &slot, timeout_ms);
 }
 
 /**
@@ -75,78 +567,558 @@ bool efp_order(i2c_obj *obj, const uint8_t n_val, const uint32_t timeout_ms)
  */
 bool efp_status(i2c_obj *obj, uint8_t *des, const uint32_t timeout_ms)
 {
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_BYTE, EFP_CMD_STATUS);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_SLAVE_ACK_BYTE, 0x0);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_DATA_BYTE, 0x0);
+	return efp_status_slot(obj, 0x0, 0, des, NULL, NULL, timeout_ms);
+}
+
+/**
+ * Request a single byte job result from the I2C slave
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  des        A pointer to a single byte location used to store the result.
+ * @param  req_idx    The job number index to requested.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if the operation succeeded, otherwise false.
+ */
+bool efp_result_single(i2c_obj *obj, uint8_t *des, const uint8_t req_idx, const uint32_t timeout_ms)
+{
+	return efp_result_single_slot(obj, 0x0, des, req_idx, timeout_ms);
+}
 
-	if (i2c_write_reg(obj) != I2C_STATUS_OK)
+/**
+ * Requests a range of result from an I2C slave. Reads them byte by byte.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  des        A pointer to a single byte location used to store the result.
+ * @param  start_idx  The job number index to start from.
+ * @param  end_idx    The final job unmber index.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if the operation succeeded, otherwise false.
+ */
+bool efp_result_range(i2c_obj *obj, uint8_t *des, uint8_t start_idx, const uint8_t end_idx, const uint32_t timeout_ms)
+{
+	return efp_result_range_slot(obj, 0x0, des, start_idx, end_idx, EFP_NO_LEASE, timeout_ms);
+}
+
+/**
+ * Requests an I2C slave to reset it job order.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True the operation succeeded, otherwise false.
+ */
+bool efp_reset(i2c_obj *obj, const uint32_t timeout_ms)
+{
+	return efp_reset_slot(obj, 0x0, timeout_ms);
+}
+
+/**
+ * Builds the payload of a version 2 ORDER: the first digit to compute, then
+ * the lease on slaves that echo one. Orders for a whole job to slaves
+ * without leases carry no payload at all.
+ * @param  obj     A pointer to the i2c_obj.
+ * @param  first   The first result to compute.
+ * @param  lease   The lease the job is ordered under, or EFP_NO_LEASE.
+ * @param  payload A pointer to at least 1 + EFP_LEASE_LEN bytes to store the payload in.
+ * @return         The payload length in bytes.
+ */
+static uint8_t efp_order_payload(const i2c_obj *obj, const uint8_t first, const uint32_t lease, uint8_t *payload)
+{
+	payload[0] = first;
+	if (! obj->leases || lease == EFP_NO_LEASE)
+		return first > 0 ? 1 : 0;
+
+	for (uint8_t i=0; i<EFP_LEASE_LEN; ++i)
+		payload[EFP_ORDER_LEASE_BYTE + i] = (lease >> (i * 8)) & 0xff;
+	return EFP_ORDER_LEASE_BYTE + EFP_LEASE_LEN;
+}
+
+/**
+ * Queues a job order on an I2C slave and waits for acknowledgement.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  job        The job order value. Version 1 slaves only see the low byte.
+ * @param  first      The first result to compute, for a job whose earlier results
+ *                    are already known. Version 1 slaves compute them all.
+ * @param  lease      The lease the job is ordered under, or EFP_NO_LEASE. Only
+ *                    slaves with EFP_FEATURE_LEASE are sent it.
+ * @param  slot       A pointer to a single byte location used to store the job slot
+ *                    the slave queued the order in.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if the order suceeded, false on timeout or if the slave's queue is full.
+ */
+bool efp_order_slot(i2c_obj *obj, const uint32_t job, const uint8_t first, const uint32_t lease, uint8_t *slot, const uint32_t timeout_ms)
+{
+	efp_message reply;
+	uint8_t payload[1 + EFP_LEASE_LEN];
+	uint8_t len = efp_order_payload(obj, first, lease, payload);
+
+	if (! efp_command_payload(obj, EFP_CMD_ORDER, job, 0x0, payload, len, 0, &reply, timeout_ms))
 		return false;
 
-	if (! efp_wait_ack(obj, timeout_ms * 1000000))
+	*slot = reply.arg;
+	return true;
+}
+
+/**
+ * Frees a finished job slot and queues a new job order in one command.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  job        The job order value. Version 1 slaves only see the low byte.
+ * @param  first      The first result to compute. Version 1 slaves compute them all.
+ * @param  lease      The lease the job is ordered under, or EFP_NO_LEASE.
+ * @param  reset_slot The finished job slot to free first.
+ * @param  slot       A pointer to a single byte location used to store the job slot
+ *                    the slave queued the order in.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if the order suceeded, false on timeout, if reset_slot was
+ *                    not finished or if the slave's queue is full.
+ */
+bool efp_order_reset_slot(i2c_obj *obj, const uint32_t job, const uint8_t first, const uint32_t lease, const uint8_t reset_slot, uint8_t *slot, const uint32_t timeout_ms)
+{
+	efp_message reply;
+	uint8_t payload[1 + EFP_LEASE_LEN];
+	uint8_t len = efp_order_payload(obj, first, lease, payload);
+
+	if (! efp_command_payload(obj, EFP_CMD_ORDER, job, EFP_ORDER_RESET_FLAG | reset_slot, payload, len, 0, &reply, timeout_ms))
 		return false;
 
-	*des = obj->reg[EFP_CMD_REGISTER_DATA_BYTE -1];
+	*slot = reply.arg;
 	return true;
 }
 
 /**
- * Request a single byte job result from the I2C slave
+ * Takes the lease a slave echoed off the end of a reply's payload, leaving
+ * the bytes before it. A payload only ends with a lease if it is exactly
+ * EFP_LEASE_LEN longer than what it otherwise carries, so replies about
+ * jobs ordered without a lease read as before.
+ * @param  obj   A pointer to the i2c_obj the reply came from.
+ * @param  reply A pointer to the reply.
+ * @param  len   The number of payload bytes the reply carries besides the lease.
+ * @return       The lease, or EFP_NO_LEASE if the reply carried none.
+ */
+static uint32_t efp_strip_lease(const i2c_obj *obj, efp_message *reply, const uint8_t len)
+{
+	uint32_t lease = EFP_NO_LEASE;
+
+	if (! obj->leases || reply->len != len + EFP_LEASE_LEN)
+		return EFP_NO_LEASE;
+
+	for (uint8_t i=0; i<EFP_LEASE_LEN; ++i)
+		lease |= (uint32_t)reply->payload[len + i] << (i * 8);
+	reply->len = len;
+
+	return lease;
+}
+
+/**
+ * Splits a STATUS reply into the job's progress and the job it echoes.
+ * Version 2 has room for the whole job index in the data field, so the two
+ * swap places compared to version 1.
+ * @param obj   A pointer to the i2c_obj.
+ * @param reply A pointer to the STATUS reply.
+ * @param des   A pointer to a single byte location used to store the progress.
+ * @param job   A pointer to a location used to store the job, or NULL.
+ */
+static void efp_parse_status(const i2c_obj *obj, const efp_message *reply, uint8_t *des, uint32_t *job)
+{
+	*des = obj->version < EFP_VERSION_2 ? reply->data : reply->arg;
+	if (job != NULL)
+		*job = obj->version < EFP_VERSION_2 ? reply->arg : reply->data;
+}
+
+/**
+ * Request the progress of a queued job and wait for acknowledgement.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  slot       The job slot to query.
+ * @param  count      The number of results in a job, so a finished job's
+ *                    results fit in the reply.
+ * @param  des        A pointer to a single byte location used to store the result.
+ * @param  job        A pointer to a location used to store the job order value
+ *                    held in the slot, or NULL.
+ * @param  lease      A pointer to a location used to store the lease the job
+ *                    was ordered under, or NULL. EFP_NO_LEASE if it had none.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if operation succeeded, false on timeout or if the slot is empty.
+ */
+bool efp_status_slot(i2c_obj *obj, const uint8_t slot, const uint8_t count, uint8_t *des, uint32_t *job, uint32_t *lease, const uint32_t timeout_ms)
+{
+	efp_message reply;
+	uint8_t digits_len = obj->version < EFP_VERSION_2 ? 0 : efp_digits_len(obj, count);
+
+	if (! efp_command(obj, EFP_CMD_STATUS, 0x0, slot, digits_len + (obj->leases ? EFP_LEASE_LEN : 0), &reply, timeout_ms))
+		return false;
+
+	efp_parse_status(obj, &reply, des, job);
+	if (lease != NULL)
+		*lease = efp_strip_lease(obj, &reply, reply.cmd == EFP_CMD_RESULT_BLOCK ? digits_len : 0);
+	return true;
+}
+
+/**
+ * Gets how many payload bytes a reply carrying a run of digits takes up.
+ * Version 2 frames carry packed BCD; version 1 result blocks a digit a byte.
+ * @param  obj   A pointer to the i2c_obj.
+ * @param  count The number of digits.
+ * @return       The payload length in bytes.
+ */
+static uint8_t efp_digits_len(const i2c_obj *obj, const uint8_t count)
+{
+	return obj->version < EFP_VERSION_2 ? count : BCD_BYTES(count);
+}
+
+/**
+ * Copies the digits out of a reply's payload.
+ * @param  obj   A pointer to the i2c_obj the reply came from.
+ * @param  reply A pointer to the reply.
+ * @param  des   A pointer to count bytes used to store the digits.
+ * @param  count The number of digits.
+ * @return       False if the payload is short or holds something other than digits.
+ */
+static bool efp_copy_digits(const i2c_obj *obj, const efp_message *reply, uint8_t *des, const uint8_t count)
+{
+	if (reply->len < efp_digits_len(obj, count))
+		return false;
+
+	if (obj->version >= EFP_VERSION_2)
+		return bcd_unpack(des, reply->payload, count);
+
+	for (uint8_t i=0; i<count; ++i)
+		des[i] = reply->payload[i];
+	return true;
+}
+
+/**
+ * Request the progress of a queued job, collecting its results in the same
+ * transaction if it has finished. The slave marks a reply carrying results
+ * by answering with EFP_CMD_RESULT_BLOCK in the command byte.
+ * @param  obj         A pointer to the i2c_obj.
+ * @param  slot        The job slot to query.
+ * @param  des         A pointer to a single byte location used to store the progress.
+ * @param  results     A pointer to count bytes used to store the results.
+ * @param  count       The number of results in a job.
+ * @param  has_results A pointer to a flag set if results were stored.
+ * @param  lease       A pointer to a location used to store the lease the job
+ *                     was ordered under. EFP_NO_LEASE if it had none.
+ * @param  timeout_ms  The number of milliseconds before timeout occurs.
+ * @return             True if operation succeeded, false on timeout or if the slot is empty.
+ */
+bool efp_status_results_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, uint8_t *results, const uint8_t count, bool *has_results, uint32_t *lease, const uint32_t timeout_ms)
+{
+	efp_message reply;
+	uint8_t digits_len = efp_digits_len(obj, count);
+
+	*has_results = false;
+	if (! efp_command(obj, EFP_CMD_STATUS, 0x0, slot, digits_len + (obj->leases ? EFP_LEASE_LEN : 0), &reply, timeout_ms))
+		return false;
+
+	efp_parse_status(obj, &reply, des, NULL);
+	*lease = efp_strip_lease(obj, &reply, reply.cmd == EFP_CMD_RESULT_BLOCK ? digits_len : 0);
+	if (reply.cmd == EFP_CMD_RESULT_BLOCK && *des >= count)
+		*has_results = efp_copy_digits(obj, &reply, results, count);
+
+	return true;
+}
+
+/**
+ * Request a single byte result of a queued job from the I2C slave.
  * @param  obj        A pointer to the i2c_obj.
+ * @param  slot       The job slot holding the result.
  * @param  des        A pointer to a single byte location used to store the result.
  * @param  req_idx    The job number index to requested.
  * @param  timeout_ms The number of milliseconds before timeout occurs.
  * @return            True if the operation succeeded, otherwise false.
  */
-bool efp_result_single(i2c_obj *obj, uint8_t *des, const uint8_t req_idx, const uint32_t timeout_ms)
+bool efp_result_single_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, const uint8_t req_idx, const uint32_t timeout_ms)
+{
+	efp_message reply;
+	if (! efp_command(obj, EFP_CMD_RESULT, req_idx, slot, 0, &reply, timeout_ms))
+		return false;
+
+	*des = reply.data;
+	return true;
+}
+
+/**
+ * Requests a range of results of a queued job in one block transfer. The
+ * slave replies with the digits from start_idx to end_idx, however far the
+ * job has got by then.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  slot       The job slot holding the results.
+ * @param  des        A pointer to at least end_idx - start_idx + 1 bytes used to store the results.
+ * @param  start_idx  The job number index to start from.
+ * @param  end_idx    The final job unmber index.
+ * @param  lease      The lease the job was ordered under, or EFP_NO_LEASE. A
+ *                    slot holding any other assignment is refused.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True if the operation succeeded, otherwise false.
+ */
+bool efp_result_block_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, const uint8_t start_idx, const uint8_t end_idx, const uint32_t lease, const uint32_t timeout_ms)
 {
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_BYTE, EFP_CMD_RESULT);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_SLAVE_ACK_BYTE, 0x0);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_DATA_BYTE, req_idx);
+	efp_message reply;
+	uint8_t count = end_idx - start_idx + 1;
+	uint8_t payload[1];
 
-	if (i2c_write_reg(obj) != I2C_STATUS_OK)
+	if (end_idx < start_idx)
 		return false;
 
-	if (! efp_wait_ack(obj, timeout_ms * 1000000))
+	payload[EFP_RESULT_BLOCK_END_BYTE] = end_idx;
+	if (! efp_command_payload(obj, EFP_CMD_RESULT_BLOCK, start_idx, slot, payload, sizeof(payload), efp_digits_len(obj, count) + (obj->leases ? EFP_LEASE_LEN : 0), &reply, timeout_ms))
 		return false;
 
-	*des = obj->reg[EFP_CMD_REGISTER_DATA_BYTE -1];
-	return true;
+	//The data field holds how many digits the slave put in the block.
+	if (reply.data < count)
+		return false;
+
+	uint32_t echoed = efp_strip_lease(obj, &reply, efp_digits_len(obj, reply.data));
+	if (lease != EFP_NO_LEASE && echoed != lease)
+		return false;
+
+	return efp_copy_digits(obj, &reply, des, count);
 }
 
 /**
- * Requests a range of result from an I2C slave. Reads them byte by byte.
+ * Requests a range of results of a queued job. Uses a single block transfer
+ * where the slave supports it, otherwise reads them byte by byte.
  * @param  obj        A pointer to the i2c_obj.
+ * @param  slot       The job slot holding the results.
  * @param  des        A pointer to a single byte location used to store the result.
  * @param  start_idx  The job number index to start from.
  * @param  end_idx    The final job unmber index.
+ * @param  lease      The lease the job was ordered under, or EFP_NO_LEASE.
  * @param  timeout_ms The number of milliseconds before timeout occurs.
  * @return            True if the operation succeeded, otherwise false.
  */
-bool efp_result_range(i2c_obj *obj, uint8_t *des, uint8_t start_idx, const uint8_t end_idx, const uint32_t timeout_ms)
+bool efp_result_range_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, uint8_t start_idx, const uint8_t end_idx, const uint32_t lease, const uint32_t timeout_ms)
 {
+	if (efp_result_block_slot(obj, slot, des, start_idx, end_idx, lease, timeout_ms))
+		return true;
+
+	//Single results carry no lease, and every slave that echoes one has
+	//RESULT_BLOCK, so a refused block is never read around.
+	if (obj->leases && lease != EFP_NO_LEASE)
+		return false;
+
 	uint8_t i = 0;
 	do
 	{
-		if (! efp_result_single(obj, &des[i], start_idx, timeout_ms))
+		if (! efp_result_single_slot(obj, slot, &des[i], start_idx, timeout_ms))
 			return false;
 		++i;
 	} while (++start_idx <= end_idx);
+
+	return true;
 }
 
 /**
- * Requests an I2C slave to reset it job order.
+ * Requests an I2C slave to free a job slot once its results are collected.
  * @param  obj        A pointer to the i2c_obj.
+ * @param  slot       The job slot to free.
  * @param  timeout_ms The number of milliseconds before timeout occurs.
  * @return            True the operation succeeded, otherwise false.
  */
-bool efp_reset(i2c_obj *obj, const uint32_t timeout_ms)
+bool efp_reset_slot(i2c_obj *obj, const uint8_t slot, const uint32_t timeout_ms)
 {
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_BYTE, EFP_CMD_RESET);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_SLAVE_ACK_BYTE, 0x0);
-	i2c_set_reg_data(obj, EFP_CMD_REGISTER_DATA_BYTE, 0x0);
+	efp_message reply;
+	return efp_command(obj, EFP_CMD_RESET, 0x0, slot, 0, &reply, timeout_ms);
+}
 
-	if (i2c_write_reg(obj) != I2C_STATUS_OK)
-		return false;
+/**
+ * Requests an I2C slave to abandon the job in a slot, finished or not, and
+ * free the slot. The slave acknowledges before its compute thread has let go
+ * of the job. Slaves only free a slot by RESET once its job is done.
+ * @param  obj        A pointer to the i2c_obj.
+ * @param  slot       The job slot to free.
+ * @param  refused    A pointer to a flag set if the slave answered with
+ *                    EFP_ACK_ERR, as slaves from before CANCEL do, rather
+ *                    than not answering in time. May be NULL.
+ * @param  timeout_ms The number of milliseconds before timeout occurs.
+ * @return            True the operation succeeded, otherwise false.
+ */
+bool efp_cancel_slot(i2c_obj *obj, const uint8_t slot, bool *refused, const uint32_t timeout_ms)
+{
+	efp_message reply;
+	reply.ack = 0x0;
+
+	bool ok = efp_command(obj, EFP_CMD_CANCEL, 0x0, slot, 0, &reply, timeout_ms);
+	if (refused != NULL)
+		*refused = ! ok && reply.ack == EFP_ACK_ERR;
+	return ok;
+}
+
+/**
+ * Sends a command to many slaves with as few writes as possible, then
+ * collects each slave's ack. Slaves sharing an I2C adapter get one write to
+ * the general call address between them; socket slaves get one each. Only
+ * slaves with general_call set take part, and none of them may be in use
+ * by another thread.
+ * @param  objs       An array of count pointers to i2c_obj.
+ * @param  count      The number of slaves.
+ * @param  cmd        The EFP_CMD to send.
+ * @param  data       The request's data value.
+ * @param  arg        The value of the argument byte, e.g. EFP_SLOT_ALL.
+ * @param  acked      An array of count flags, set for each slave that replied
+ *                    with EFP_ACK_OK. Slaves left unset should be sent the
+ *                    command on their own.
+ * @param  timeout_ms The number of milliseconds before every ack not yet
+ *                    collected times out.
+ * @return            The number of slaves that acked.
+ */
+uint8_t efp_broadcast(i2c_obj **objs, const uint8_t count, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, bool *acked, const uint32_t timeout_ms)
+{
+	uint8_t frame[EFP_V2_HEADER + 1];
+	uint32_t settle_us = 0;
+	uint8_t seq = 0x0;
+	uint8_t result = 0;
+	bool clash = true;
+
+	//Every slave reads the same sequence number, so it must be new to all of them.
+	while (clash)
+	{
+		seq++;
+		clash = false;
+		for (uint8_t i=0; i<count; ++i)
+			clash |= objs[i]->general_call && objs[i]->seq == seq;
+	}
+	uint8_t len = efp_encode_request(frame, seq, cmd, data, arg, NULL, 0);
+
+	//Until the acks are collected, acked says who the frame reached.
+	for (uint8_t i=0; i<count; ++i)
+	{
+		i2c_obj *obj = objs[i];
+
+		acked[i] = false;
+		if (! obj->general_call)
+			continue;
+
+		obj->seq = seq;
+		obj->cmd = cmd;
+		obj->bus_class = cmd_class[cmd];
+
+		//Slaves on an adapter already written to have the frame.
+		int16_t shared = -1;
+		for (uint8_t x=0; x<i && obj->link.bus != NULL; ++x)
+			if (objs[x]->general_call && objs[x]->link.bus == obj->link.bus)
+				shared = x;
+
+		if (shared >= 0)
+			acked[i] = acked[shared];
+		else
+			acked[i] = i2c_broadcast_block(obj, frame, len) == I2C_STATUS_OK;
+
+		if (acked[i] && obj->settle_us > settle_us)
+			settle_us = obj->settle_us;
+	}
+
+	//One settle delay covers every slave that was written to.
+	if (settle_us > 0)
+		usleep(settle_us);
+
+	uint64_t deadline = efp_now_us() + (uint64_t)timeout_ms * 1000;
+	for (uint8_t i=0; i<count; ++i)
+	{
+		efp_message reply;
+
+		if (! acked[i])
+			continue;
+
+		EFP_REPLY reply_result = efp_wait_reply(objs[i], cmd, 0, &reply, deadline);
+		acked[i] = reply_result == EFP_REPLY_READY && reply.ack == EFP_ACK_OK;
+		if (reply_result != EFP_REPLY_READY)
+			i2c_settle_backoff(objs[i]);
+		if (acked[i])
+			result++;
+	}
+
+	return result;
+}
+
+/**
+ * Pings many slaves at once, see efp_broadcast.
+ * @param  objs       An array of count pointers to i2c_obj.
+ * @param  count      The number of slaves.
+ * @param  acked      An array of count flags, set for each slave that answered.
+ * @param  timeout_ms The number of milliseconds before the acks time out.
+ * @return            The number of slaves that answered.
+ */
+uint8_t efp_ping_all(i2c_obj **objs, const uint8_t count, bool *acked, const uint32_t timeout_ms)
+{
+	return efp_broadcast(objs, count, EFP_CMD_PING, 0x0, 0x0, acked, timeout_ms);
+}
+
+/**
+ * Frees every job slot on many slaves at once, running jobs included, see
+ * efp_broadcast.
+ * @param  objs       An array of count pointers to i2c_obj.
+ * @param  count      The number of slaves.
+ * @param  acked      An array of count flags, set for each slave that was cleared.
+ * @param  timeout_ms The number of milliseconds before the acks time out.
+ * @return            The number of slaves that were cleared.
+ */
+uint8_t efp_cancel_all(i2c_obj **objs, const uint8_t count, bool *acked, const uint32_t timeout_ms)
+{
+	return efp_broadcast(objs, count, EFP_CMD_CANCEL, 0x0, EFP_SLOT_ALL, acked, timeout_ms);
+}
+
+/**
+ * Sets how acks are polled for on slaves of one hardware type.
+ * @param hw         The hardware type.
+ * @param strategy   The EFP_POLL strategy.
+ * @param initial_us The first delay between reads, doubled after each read.
+ * @param max_us     The longest delay between reads.
+ */
+void efp_set_poll(const I2C_HW hw, const EFP_POLL strategy, const uint32_t initial_us, const uint32_t max_us)
+{
+	pthread_mutex_lock(&stats_lock);
+	poll_config[hw].strategy = strategy;
+	poll_config[hw].initial_us = initial_us > 0 ? initial_us : 1;
+	poll_config[hw].max_us = max_us > poll_config[hw].initial_us ? max_us : poll_config[hw].initial_us;
+	pthread_mutex_unlock(&stats_lock);
+}
 
-	return efp_wait_ack(obj, timeout_ms * 1000000);
+/**
+ * Copies the ack latency statistics of a command on one hardware type, as
+ * they stand while driver threads may still be adding to them.
+ * @param hw  The hardware type.
+ * @param cmd The EFP_CMD.
+ * @param des A pointer to the efp_ack_stats used to store the copy.
+ */
+void efp_get_ack_stats(const I2C_HW hw, const EFP_CMD cmd, efp_ack_stats *des)
+{
+	pthread_mutex_lock(&stats_lock);
+	*des = ack_stats[hw][cmd];
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Converts a given EFP_CMD value to a user-friendly string of characters.
+ * @param  cmd The EFP_CMD.
+ * @return     A readable string of characters.
+ */
+const char *efp_get_cmd_str(const EFP_CMD cmd)
+{
+	switch (cmd)
+	{
+		case EFP_CMD_PING:
+			return "PING";
+			break;
+		case EFP_CMD_ORDER:
+			return "ORDER";
+			break;
+		case EFP_CMD_STATUS:
+			return "STATUS";
+			break;
+		case EFP_CMD_RESULT:
+			return "RESULT";
+			break;
+		case EFP_CMD_RESET:
+			return "RESET";
+			break;
+		case EFP_CMD_RESULT_BLOCK:
+			return "RESULT_BLOCK";
+			break;
+		case EFP_CMD_CANCEL:
+			return "CANCEL";
+			break;
+		case EFP_CMD_HELLO:
+			return "HELLO";
+			break;
+		default:
+			return "Unknown command";
+			break;
+	}
 }
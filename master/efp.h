@@ -9,6 +9,87 @@
 #define EFP_CMD_REGISTER_BYTE 0x1
 #define EFP_CMD_REGISTER_SLAVE_ACK_BYTE 0x2
 #define EFP_CMD_REGISTER_DATA_BYTE 0x3
+#define EFP_CMD_REGISTER_ARG_BYTE 0x4
+
+//A RESULT_BLOCK reply is this many header bytes followed by the digits.
+#define EFP_RESULT_BLOCK_HEADER 0x4
+
+//Set in an ORDER's arg byte to free the finished job slot in the low bits
+//before queueing, saving a separate RESET.
+#define EFP_ORDER_RESET_FLAG 0x80
+
+#define EFP_ACK_OK 0x1
+#define EFP_ACK_ERR 0x2
+//A version 2 slave received a frame that failed its checks and ignored it.
+#define EFP_ACK_BAD_FRAME 0x3
+
+#define EFP_VERSION_1 0x1
+#define EFP_VERSION_2 0x2
+
+//Version 2 frames, in both directions, are a fixed header followed by len
+//payload bytes and a CRC-8 of everything before it:
+//magic, len, seq, cmd, ack, arg, data (32-bit little endian), payload, crc.
+//Result digits in a payload are packed BCD, two a byte.
+#define EFP_V2_MAGIC 0xe2
+#define EFP_V2_MAGIC_BYTE 0x0
+#define EFP_V2_LEN_BYTE 0x1
+#define EFP_V2_SEQ_BYTE 0x2
+#define EFP_V2_CMD_BYTE 0x3
+#define EFP_V2_ACK_BYTE 0x4
+#define EFP_V2_ARG_BYTE 0x5
+#define EFP_V2_DATA_BYTE 0x6
+#define EFP_V2_HEADER 0xa
+
+//A HELLO reply describes the slave: these payload bytes, and in the data
+//field the microseconds a digit took on its last job (0 if none yet).
+#define EFP_CAPS_VERSION_BYTE 0x0
+#define EFP_CAPS_JOB_FACTOR_BYTE 0x1
+#define EFP_CAPS_QUEUE_DEPTH_BYTE 0x2
+#define EFP_CAPS_JOB_TYPES_BYTE 0x3
+#define EFP_CAPS_KERNELS_BYTE 0x4
+#define EFP_CAPS_RESULT_BYTES_BYTE 0x5
+#define EFP_CAPS_FEATURES_BYTE 0x6
+#define EFP_CAPS_LEN 0x7
+
+//Slaves from before the features byte describe themselves in this many.
+#define EFP_CAPS_MIN_LEN 0x6
+
+//Bits of the job types, kernels and features bytes.
+#define EFP_JOB_TYPE_PI_DIGITS 0x1
+#define EFP_KERNEL_PLOUFFE 0x1
+#define EFP_FEATURE_GENERAL_CALL 0x1
+#define EFP_FEATURE_LEASE 0x2
+
+//Slaves with EFP_FEATURE_GENERAL_CALL take version 2 frames written to the
+//general call address, so one write reaches every such slave on a bus. Each
+//replies as to an addressed command and the master reads the replies one
+//slave at a time. RESET and CANCEL with EFP_SLOT_ALL apply to every slot.
+#define EFP_SLOT_ALL 0xff
+
+//Slaves with EFP_FEATURE_LEASE take a lease after the first digit byte of a
+//version 2 ORDER: a 32-bit little endian token naming that one assignment of
+//the job. STATUS and RESULT_BLOCK replies about the slot end with it, so a
+//result is only ever credited to the assignment that produced it.
+#define EFP_ORDER_LEASE_BYTE 0x1
+#define EFP_LEASE_LEN 0x4
+#define EFP_NO_LEASE 0x0
+
+//A version 2 RESULT_BLOCK carries the index of the last digit wanted, so the
+//reply is no longer than the read sized for it while the job runs on.
+#define EFP_RESULT_BLOCK_END_BYTE 0x0
+
+//How many times a request the slave rejected as corrupt is sent.
+#define EFP_V2_ATTEMPTS 3
+//How many corrupt replies in a row are read again at once, before waiting
+//as for a reply that isn't ready.
+#define EFP_CORRUPT_REREADS 2
+
+#define EFP_PAYLOAD_MAX (I2C_BLOCK_MAX - EFP_V2_HEADER - 1)
+
+//Settle calibration pings this many times at each delay it tries, and keeps
+//this fraction of the shortest working delay on top as a margin.
+#define EFP_SETTLE_PINGS 4
+#define EFP_SETTLE_MARGIN_DIV 4
 
 typedef enum
 {
@@ -16,14 +97,113 @@ typedef enum
 	EFP_CMD_ORDER = 0x1,
 	EFP_CMD_STATUS = 0x2,
 	EFP_CMD_RESULT = 0x3,
-	EFP_CMD_RESET = 0x4
+	EFP_CMD_RESET = 0x4,
+	EFP_CMD_RESULT_BLOCK = 0x5,
+	EFP_CMD_CANCEL = 0x6,
+	EFP_CMD_HELLO = 0x7,
+	EFP_CMD_COUNT
 } EFP_CMD;
 
-static bool efp_wait_ack(i2c_obj *obj, const uint32_t timeout_ns);
+#define EFP_HW_TYPES 2
+
+//How the master waits for a slave to acknowledge a command.
+typedef enum
+{
+	EFP_POLL_IMMEDIATE, //Read back to back until the ack arrives.
+	EFP_POLL_BACKOFF, //Sleep between reads, doubling the delay each time.
+	EFP_POLL_EXPECTED //Sleep for most of the command's usual latency first, then back off.
+} EFP_POLL;
+
+typedef struct
+{
+	EFP_POLL strategy;
+	uint32_t initial_us;
+	uint32_t max_us;
+} efp_poll_config;
+
+//A decoded reply, whichever protocol version it arrived in.
+typedef struct
+{
+	uint8_t cmd;
+	uint8_t ack;
+	uint8_t arg;
+	uint32_t data;
+	uint8_t len;
+	uint8_t payload[EFP_PAYLOAD_MAX];
+} efp_message;
+
+//What a slave reported about itself at connect time. Slaves from before
+//HELLO leave everything 0, and the master falls back to its built-in
+//assumptions.
+typedef struct
+{
+	uint8_t version;
+	uint8_t job_factor;
+	uint8_t queue_depth;
+	uint8_t job_types;
+	uint8_t kernels;
+	uint8_t result_bytes;
+	uint8_t features;
+	uint32_t us_per_digit;
+} efp_caps;
+
+typedef enum
+{
+	EFP_REPLY_PENDING,
+	EFP_REPLY_READY,
+	EFP_REPLY_CORRUPT,
+	EFP_REPLY_REJECTED,
+	//The transfer itself failed, e.g. the slave didn't answer.
+	EFP_REPLY_ERROR
+} EFP_REPLY;
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t timeouts;
+	uint32_t corrupt;
+	uint32_t rejected;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t avg_us;
+	uint64_t total_us;
+} efp_ack_stats;
+
+uint8_t efp_encode_request(uint8_t *frame, const uint8_t seq, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t *payload, const uint8_t len);
+static bool efp_write_request(i2c_obj *obj, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t *payload, const uint8_t len);
+static EFP_REPLY efp_read_reply(i2c_obj *obj, const uint8_t payload_len, efp_message *reply);
+EFP_REPLY efp_decode_reply(const uint8_t *block, const uint8_t seq, const uint8_t payload_len, efp_message *reply);
+static EFP_REPLY efp_wait_reply(i2c_obj *obj, const EFP_CMD cmd, const uint8_t payload_len, efp_message *reply, const uint64_t deadline);
+static bool efp_command(i2c_obj *obj, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t payload_len, efp_message *reply, const uint32_t timeout_ms);
+static bool efp_command_payload(i2c_obj *obj, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, const uint8_t *req_payload, const uint8_t req_len, const uint8_t payload_len, efp_message *reply, const uint32_t timeout_ms);
+uint8_t efp_crc8(const uint8_t *data, const uint8_t len);
+uint8_t efp_negotiate(i2c_obj *obj, efp_caps *caps, const uint32_t timeout_ms);
+bool efp_hello(i2c_obj *obj, efp_caps *caps, const uint32_t timeout_ms);
+uint32_t efp_wire_job(const i2c_obj *obj, const uint32_t job);
 bool efp_ping(i2c_obj *obj, const uint32_t timeout_ms);
+static bool efp_settle_reliable(i2c_obj *obj, const uint32_t timeout_ms);
+uint32_t efp_calibrate_settle(i2c_obj *obj, const uint32_t timeout_ms);
 bool efp_order(i2c_obj *obj, const uint8_t n_val, const uint32_t timeout_ms);
 bool efp_status(i2c_obj *obj, uint8_t *des, const uint32_t timeout_ms);
 bool efp_result_single(i2c_obj *obj, uint8_t *des, const uint8_t req_idx, const uint32_t timeout_ms);
 bool efp_result_range(i2c_obj *obj, uint8_t *des, uint8_t start_idx, const uint8_t end_idx, const uint32_t timeout_ms);
 bool efp_reset(i2c_obj *obj, const uint32_t timeout_ms);
+static uint8_t efp_order_payload(const i2c_obj *obj, const uint8_t first, const uint32_t lease, uint8_t *payload);
+static uint8_t efp_digits_len(const i2c_obj *obj, const uint8_t count);
+static uint32_t efp_strip_lease(const i2c_obj *obj, efp_message *reply, const uint8_t len);
+bool efp_order_slot(i2c_obj *obj, const uint32_t job, const uint8_t first, const uint32_t lease, uint8_t *slot, const uint32_t timeout_ms);
+bool efp_order_reset_slot(i2c_obj *obj, const uint32_t job, const uint8_t first, const uint32_t lease, const uint8_t reset_slot, uint8_t *slot, const uint32_t timeout_ms);
+bool efp_status_slot(i2c_obj *obj, const uint8_t slot, const uint8_t count, uint8_t *des, uint32_t *job, uint32_t *lease, const uint32_t timeout_ms);
+bool efp_status_results_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, uint8_t *results, const uint8_t count, bool *has_results, uint32_t *lease, const uint32_t timeout_ms);
+bool efp_result_single_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, const uint8_t req_idx, const uint32_t timeout_ms);
+bool efp_result_range_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, uint8_t start_idx, const uint8_t end_idx, const uint32_t lease, const uint32_t timeout_ms);
+bool efp_result_block_slot(i2c_obj *obj, const uint8_t slot, uint8_t *des, const uint8_t start_idx, const uint8_t end_idx, const uint32_t lease, const uint32_t timeout_ms);
+bool efp_reset_slot(i2c_obj *obj, const uint8_t slot, const uint32_t timeout_ms);
+bool efp_cancel_slot(i2c_obj *obj, const uint8_t slot, bool *refused, const uint32_t timeout_ms);
+uint8_t efp_broadcast(i2c_obj **objs, const uint8_t count, const EFP_CMD cmd, const uint32_t data, const uint8_t arg, bool *acked, const uint32_t timeout_ms);
+uint8_t efp_ping_all(i2c_obj **objs, const uint8_t count, bool *acked, const uint32_t timeout_ms);
+uint8_t efp_cancel_all(i2c_obj **objs, const uint8_t count, bool *acked, const uint32_t timeout_ms);
+void efp_set_poll(const I2C_HW hw, const EFP_POLL strategy, const uint32_t initial_us, const uint32_t max_us);
+void efp_get_ack_stats(const I2C_HW hw, const EFP_CMD cmd, efp_ack_stats *des);
+const char *efp_get_cmd_str(const EFP_CMD cmd);
 #endif
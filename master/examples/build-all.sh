@@ -3,4 +3,5 @@
 ./build-scheduler-example.sh
 ./build-i2c-example.sh
 ./build-efp-example.sh
+./build-efp-frame-example.sh
 echo Build complete. See ../bin.
@@ -0,0 +1,5 @@
+#!/bin/bash
+cd ../
+mkdir -p bin/
+gcc i2c.c efp.c bcd.c transport.c bus.c trace.c fault.c examples/efp-frame-example.c -o bin/efp-frame-example -lpthread
+cd examples/
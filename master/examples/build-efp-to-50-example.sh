@@ -1,6 +1,6 @@
 #!/bin/bash
 cd ../
 mkdir -p bin/
-gcc i2c.c efp.c examples/efp-to-50-example-mbed.c -o bin/efp-to-50-example-mbed
-gcc i2c.c efp.c examples/efp-to-50-example-photon.c -o bin/efp-to-50-example-photon
+gcc i2c.c efp.c bcd.c transport.c bus.c trace.c fault.c examples/efp-to-50-example-mbed.c -o bin/efp-to-50-example-mbed -lpthread
+gcc i2c.c efp.c bcd.c transport.c bus.c trace.c fault.c examples/efp-to-50-example-photon.c -o bin/efp-to-50-example-photon -lpthread
 cd examples/
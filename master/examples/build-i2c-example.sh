@@ -1,5 +1,5 @@
 #!/bin/bash
 cd ../
 mkdir -p bin/
-gcc i2c.c examples/i2c-example.c -o bin/i2c-example
+gcc i2c.c transport.c bus.c trace.c fault.c examples/i2c-example.c -o bin/i2c-example
 cd examples/
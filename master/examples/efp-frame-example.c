@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "../efp.h"
+#include "../bcd.h"
+
+static int failures = 0;
+
+/**
+ * Prints the outcome of one check, counting it if it failed.
+ * @param name The check's name.
+ * @param ok   Whether it passed.
+ */
+static void check(const char *name, const bool ok)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", name);
+	if (! ok)
+		failures++;
+}
+
+/**
+ * Builds the frame a slave replies with, as the firmware does: a request
+ * frame carrying the ack, with its CRC taken over again.
+ * @param  frame   A pointer to at least EFP_V2_HEADER + len +1 bytes.
+ * @param  seq     The sequence number of the request being answered.
+ * @param  ack     The EFP_ACK code.
+ * @param  payload A pointer to len payload bytes, or NULL.
+ * @param  len     The number of payload bytes.
+ * @return         The length of the frame in bytes.
+ */
+static uint8_t encode_reply(uint8_t *frame, const uint8_t seq, const uint8_t ack, const uint8_t *payload, const uint8_t len)
+{
+	uint8_t frame_len = efp_encode_request(frame, seq, EFP_CMD_RESULT_BLOCK, 0x12345678, 0x2, payload, len);
+	frame[EFP_V2_ACK_BYTE] = ack;
+	frame[EFP_V2_HEADER + len] = efp_crc8(frame, EFP_V2_HEADER + len);
+	return frame_len;
+}
+
+/**
+ * Packs digits as the slaves do, with BCD_FILL after an odd count.
+ * @param  packed A pointer to BCD_BYTES(count) bytes used to store them.
+ * @param  digits A pointer to count digits, one a byte.
+ * @param  count  The number of digits.
+ * @return        The number of packed bytes.
+ */
+static uint8_t pack_digits(uint8_t *packed, const uint8_t *digits, const uint8_t count)
+{
+	for (uint8_t i=0; i<count; ++i)
+		bcd_set(packed, i, digits[i]);
+	if (count & 0x1)
+		bcd_set(packed, count, BCD_FILL);
+	return BCD_BYTES(count);
+}
+
+int main()
+{
+	uint8_t frame[EFP_V2_HEADER + EFP_PAYLOAD_MAX + 1];
+	uint8_t payload[3] = { 0x14, 0x15, 0x9f };
+	efp_message reply;
+	uint8_t frame_len;
+	bool all_caught = true;
+	uint8_t digits[6] = { 1, 4, 1, 5, 9, 2 };
+	uint8_t packed[BCD_BYTES(6)];
+	uint8_t unpacked[6];
+	char name[50];
+
+	//A reply comes back as it was sent.
+	frame_len = encode_reply(frame, 7, EFP_ACK_OK, payload, sizeof(payload));
+	check("reply decodes", efp_decode_reply(frame, 7, sizeof(payload), &reply) == EFP_REPLY_READY);
+	check("reply fields survive", reply.cmd == EFP_CMD_RESULT_BLOCK && reply.ack == EFP_ACK_OK && reply.arg == 0x2 && reply.data == 0x12345678);
+	check("reply payload survives", reply.len == sizeof(payload) && memcmp(reply.payload, payload, sizeof(payload)) == 0);
+
+	//Registers still holding an older frame aren't a reply yet.
+	check("stale sequence number is pending", efp_decode_reply(frame, 8, sizeof(payload), &reply) == EFP_REPLY_PENDING);
+
+	//Every single bit flip past the magic and sequence bytes is caught.
+	for (uint8_t byte=0; byte<frame_len; ++byte)
+	{
+		if (byte == EFP_V2_MAGIC_BYTE || byte == EFP_V2_SEQ_BYTE)
+			continue;
+		for (uint8_t bit=0; bit<8; ++bit)
+		{
+			frame[byte] ^= 1 << bit;
+			if (efp_decode_reply(frame, 7, sizeof(payload), &reply) == EFP_REPLY_READY)
+				all_caught = false;
+			frame[byte] ^= 1 << bit;
+		}
+	}
+	check("corrupted bytes are never taken for a reply", all_caught);
+
+	//A reply longer than the read sized for it is cut off, so its CRC was
+	//never read and it can't be trusted.
+	check("oversized len is corrupt", efp_decode_reply(frame, 7, sizeof(payload) -1, &reply) == EFP_REPLY_CORRUPT);
+
+	frame_len = encode_reply(frame, 7, EFP_ACK_BAD_FRAME, NULL, 0);
+	check("rejected request is reported", efp_decode_reply(frame, 7, 0, &reply) == EFP_REPLY_REJECTED);
+
+	frame_len = encode_reply(frame, 7, 0x0, NULL, 0);
+	check("unacknowledged request is pending", efp_decode_reply(frame, 7, 0, &reply) == EFP_REPLY_PENDING);
+
+	//Odd and even digit counts pack and unpack alike, also through a frame.
+	for (uint8_t count=1; count<=sizeof(digits); ++count)
+	{
+		uint8_t packed_len = pack_digits(packed, digits, count);
+
+		sprintf(name, "%u digits pack into %u bytes", count, packed_len);
+		check(name, packed_len == (count + 1) / 2);
+
+		memset(unpacked, 0xff, sizeof(unpacked));
+		sprintf(name, "%u digits unpack", count);
+		check(name, bcd_unpack(unpacked, packed, count) && memcmp(unpacked, digits, count) == 0);
+
+		if (count & 0x1)
+		{
+			sprintf(name, "fill after %u digits isn't a digit", count);
+			check(name, bcd_get(packed, count) == BCD_FILL && ! bcd_unpack(unpacked, packed, count + 1));
+		}
+
+		encode_reply(frame, 9, EFP_ACK_OK, packed, packed_len);
+		memset(unpacked, 0xff, sizeof(unpacked));
+		sprintf(name, "%u packed digits survive a frame", count);
+		check(name, efp_decode_reply(frame, 9, packed_len, &reply) == EFP_REPLY_READY && reply.len == packed_len &&
+			bcd_unpack(unpacked, reply.payload, count) && memcmp(unpacked, digits, count) == 0);
+	}
+
+	printf("%i checks failed\n", failures);
+	return failures > 0;
+}
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fault.h"
+
+//The profiles to choose from with -F. Rates are per million transactions;
+//a run of a few hundred digits makes a few hundred transactions a slave.
+static const fault_profile profiles[] =
+{
+	{ "none",    { 0,     0,     0,     0    }, 0,     0    },
+	{ "drops",   { 20000, 0,     0,     0    }, 0,     0    },
+	{ "corrupt", { 0,     20000, 0,     0    }, 0,     0    },
+	{ "delays",  { 0,     0,     50000, 0    }, 20000, 0    },
+	{ "hangs",   { 0,     0,     0,     2000 }, 0,     2000 },
+	{ "mixed",   { 10000, 10000, 20000, 1000 }, 10000, 1000 }
+};
+
+static const fault_profile *profile = &profiles[0];
+static uint32_t seed = FAULT_DEFAULT_SEED;
+
+/**
+ * Picks the fault profile every slave is armed with.
+ * @param  spec The profile's name, optionally followed by :seed.
+ * @return      True if the profile exists and the seed is a number.
+ */
+bool fault_select(const char *spec)
+{
+	char name[FAULT_NAME_LEN];
+	const char *colon = strchr(spec, ':');
+	size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+	uint32_t new_seed = FAULT_DEFAULT_SEED;
+
+	if (len >= FAULT_NAME_LEN)
+		return false;
+	memcpy(name, spec, len);
+	name[len] = '\0';
+
+	if (colon != NULL)
+	{
+		char *end;
+		new_seed = strtoul(colon +1, &end, 0);
+		if (*(colon +1) == '\0' || *end != '\0')
+			return false;
+	}
+
+	for (uint8_t i=0; i<sizeof(profiles) / sizeof(profiles[0]); ++i)
+	{
+		if (strcmp(profiles[i].name, name) != 0)
+			continue;
+
+		profile = &profiles[i];
+		seed = new_seed;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Gets the profile slaves are armed with.
+ * @return A pointer to the fault_profile.
+ */
+const fault_profile *fault_get_profile()
+{
+	return profile;
+}
+
+/**
+ * Gets the seed the slaves' fault streams start from.
+ * @return The seed.
+ */
+uint32_t fault_get_seed()
+{
+	return seed;
+}
+
+/**
+ * Clears a slave's fault state. Nothing is injected until it is armed.
+ * @param f A pointer to the fault_state.
+ */
+void fault_init(fault_state *f)
+{
+	memset(f, 0, sizeof(fault_state));
+}
+
+/**
+ * Starts injecting faults into a slave's transactions under the selected
+ * profile. The slave's stream depends only on the seed and its index.
+ * @param f      A pointer to the fault_state.
+ * @param worker The slave's worker index.
+ */
+void fault_arm(fault_state *f, const uint8_t worker)
+{
+	fault_init(f);
+	f->rng = ((uint64_t)seed << 8 | worker) * 0x9e3779b97f4a7c15ULL;
+	f->armed = true;
+}
+
+/**
+ * Draws the next number of a slave's stream, by splitmix64.
+ * @param  f A pointer to the fault_state.
+ * @return   The number.
+ */
+static uint64_t fault_rand(fault_state *f)
+{
+	uint64_t z = (f->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * Decides what happens to a slave's next transaction. A slave that was hung
+ * stays that way until its hang is over; every transaction draws from the
+ * stream all the same, so a hang doesn't shift the faults that follow it.
+ * @param  f      A pointer to the fault_state.
+ * @param  now_us The current time in microseconds.
+ * @return        The FAULT_KIND to inject, or FAULT_KINDS for none.
+ */
+FAULT_KIND fault_next(fault_state *f, const uint64_t now_us)
+{
+	FAULT_KIND result = FAULT_KINDS;
+	uint32_t roll, threshold = 0;
+
+	if (! f->armed)
+		return FAULT_KINDS;
+
+	f->transactions++;
+	roll = fault_rand(f) % FAULT_PPM;
+	for (FAULT_KIND kind=0; kind<FAULT_KINDS && result == FAULT_KINDS; ++kind)
+	{
+		threshold += profile->ppm[kind];
+		if (roll < threshold)
+			result = kind;
+	}
+
+	if (now_us < f->hang_until_us)
+		return FAULT_HANG;
+	if (result == FAULT_KINDS)
+		return FAULT_KINDS;
+
+	f->injected[result]++;
+	if (f->unrecovered_us == 0)
+		f->unrecovered_us = now_us;
+	if (result == FAULT_HANG)
+		f->hang_until_us = now_us + (uint64_t)profile->hang_ms * 1000;
+
+	return result;
+}
+
+/**
+ * Flips one bit, chosen from the slave's stream, of a transaction's bytes.
+ * @param f     A pointer to the fault_state.
+ * @param bytes A pointer to the bytes.
+ * @param len   The number of bytes.
+ */
+void fault_corrupt(fault_state *f, uint8_t *bytes, const uint8_t len)
+{
+	if (len == 0)
+		return;
+
+	uint32_t bit = fault_rand(f) % (len * 8);
+	bytes[bit / 8] ^= 1 << (bit % 8);
+}
+
+/**
+ * Records how a transaction went, counting its bus time as wasted if it
+ * failed or was corrupted.
+ * @param f          A pointer to the fault_state.
+ * @param kind       The FAULT_KIND injected, or FAULT_KINDS for none.
+ * @param ok         Whether every byte went through.
+ * @param elapsed_us How long the transaction took.
+ */
+void fault_record(fault_state *f, const FAULT_KIND kind, const bool ok, const uint32_t elapsed_us)
+{
+	if (! f->armed)
+		return;
+
+	if (! ok)
+		f->failed++;
+	if (! ok || kind == FAULT_CORRUPT || kind == FAULT_DELAY)
+		f->wasted_us += kind == FAULT_DELAY && ok ? profile->delay_us : elapsed_us;
+}
+
+/**
+ * Notes that a slave handed in a finished job, which ends its recovery from
+ * the faults that struck since the last one.
+ * @param f      A pointer to the fault_state.
+ * @param now_us The current time in microseconds.
+ */
+void fault_recovered(fault_state *f, const uint64_t now_us)
+{
+	if (f->unrecovered_us == 0 || now_us < f->unrecovered_us)
+		return;
+
+	uint32_t latency_us = now_us - f->unrecovered_us;
+	f->recoveries++;
+	f->recovery_us += latency_us;
+	if (latency_us > f->max_recovery_us)
+		f->max_recovery_us = latency_us;
+	f->unrecovered_us = 0;
+}
+
+/**
+ * Converts a FAULT_KIND to a readable name.
+ * @param  kind The FAULT_KIND.
+ * @return      The name.
+ */
+const char *fault_get_kind_str(const FAULT_KIND kind)
+{
+	switch (kind)
+	{
+		case FAULT_DROP:
+			return "dropped";
+			break;
+		case FAULT_CORRUPT:
+			return "corrupted";
+			break;
+		case FAULT_DELAY:
+			return "delayed";
+			break;
+		case FAULT_HANG:
+			return "hung";
+			break;
+		default:
+			return "unknown";
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef FAULT_H
+#define FAULT_H
+#include <stdint.h>
+#include <stdbool.h>
+
+//Faults injected under the I2C layer, so that every read and write the
+//master makes can be dropped, corrupted, delayed or met by a hung slave.
+//Each slave draws from a stream of its own, seeded from the profile's seed
+//and the slave's worker index, so the n-th transaction of a slave meets
+//the same fault in every run with the same seed, however its driver thread
+//happens to be scheduled. Nothing is injected until a slave is armed, so
+//connecting and negotiating always go through.
+#define FAULT_NAME_LEN 16
+#define FAULT_PPM 1000000
+#define FAULT_DEFAULT_SEED 1
+
+typedef enum
+{
+	//The bytes never make it: a write doesn't reach the slave, a read is lost.
+	FAULT_DROP,
+	//One bit of what was written or read is flipped.
+	FAULT_CORRUPT,
+	//The transaction goes through late, as if the slave stretched the clock.
+	FAULT_DELAY,
+	//The slave stops answering for a while, though it carries on computing.
+	FAULT_HANG,
+	FAULT_KINDS
+} FAULT_KIND;
+
+typedef struct
+{
+	char name[FAULT_NAME_LEN];
+	//The chance of each kind of fault, per million transactions.
+	uint32_t ppm[FAULT_KINDS];
+	uint32_t delay_us;
+	uint32_t hang_ms;
+} fault_profile;
+
+typedef struct
+{
+	bool armed;
+	uint64_t rng;
+	uint64_t hang_until_us;
+	//What was injected, and the bus time spent on transactions that failed
+	//or carried corrupted bytes, injected delays included.
+	uint32_t transactions;
+	uint32_t failed;
+	uint32_t injected[FAULT_KINDS];
+	uint64_t wasted_us;
+	//When the earliest fault the slave hasn't recovered from struck, or 0.
+	//A slave has recovered once it hands in a finished job again.
+	uint64_t unrecovered_us;
+	uint32_t recoveries;
+	uint64_t recovery_us;
+	uint32_t max_recovery_us;
+} fault_state;
+
+bool fault_select(const char *spec);
+const fault_profile *fault_get_profile();
+uint32_t fault_get_seed();
+void fault_init(fault_state *f);
+void fault_arm(fault_state *f, const uint8_t worker);
+FAULT_KIND fault_next(fault_state *f, const uint64_t now_us);
+void fault_corrupt(fault_state *f, uint8_t *bytes, const uint8_t len);
+void fault_record(fault_state *f, const FAULT_KIND kind, const bool ok, const uint32_t elapsed_us);
+void fault_recovered(fault_state *f, const uint64_t now_us);
+const char *fault_get_kind_str(const FAULT_KIND kind);
+static uint64_t fault_rand(fault_state *f);
+
+#endif
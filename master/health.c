@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "health.h"
+
+//Weight of the newest sample in the exponentially weighted rates.
+#define HEALTH_EWMA_ALPHA 0.2f
+
+/**
+ * Moves a worker to a new circuit-breaker state and resets the streak
+ * counting towards the next transition.
+ * @param  h     A pointer to the health record.
+ * @param  state The new HEALTH_STATE.
+ * @return       True if the state changed.
+ */
+static bool health_set_state(health *h, const HEALTH_STATE state)
+{
+	if (h->state == state)
+		return false;
+
+	h->state = state;
+	h->streak = 0;
+	return true;
+}
+
+/**
+ * Initialises a health record for a worker that is assumed to be healthy.
+ * @param h A pointer to the health record.
+ */
+void health_init(health *h)
+{
+	h->state = HEALTH_HEALTHY;
+	h->successes = 0;
+	h->failures = 0;
+	h->timeouts = 0;
+	h->success_rate = 1.0f;
+	h->timeout_rate = 0.0f;
+	h->latency_ms = 0;
+	h->baseline_ms = 0;
+	h->consecutive_failures = 0;
+	h->streak = 0;
+	h->probe_interval_ms = HEALTH_PROBE_INTERVAL_MS;
+	h->next_probe_ms = 0;
+}
+
+/**
+ * Records a job that completed successfully.
+ * A worker on probation becomes healthy after enough of these in a row,
+ * while a healthy worker whose latency has drifted is put on probation.
+ * @param  h          A pointer to the health record.
+ * @param  latency_ms How long the job took.
+ * @return            True if the state changed.
+ */
+bool health_record_success(health *h, const uint32_t latency_ms)
+{
+	h->successes++;
+	h->consecutive_failures = 0;
+	h->success_rate += HEALTH_EWMA_ALPHA * (1.0f - h->success_rate);
+	h->timeout_rate -= HEALTH_EWMA_ALPHA * h->timeout_rate;
+
+	h->latency_ms = h->latency_ms == 0 ? latency_ms : (h->latency_ms * 3 + latency_ms) / 4;
+	if (h->baseline_ms == 0 || latency_ms < h->baseline_ms)
+		h->baseline_ms = latency_ms;
+
+	if (h->state == HEALTH_PROBATION && ++h->streak >= HEALTH_PROBATION_SUCCESSES)
+		return health_set_state(h, HEALTH_HEALTHY);
+
+	if (h->state == HEALTH_HEALTHY && h->baseline_ms > 0 && h->latency_ms > HEALTH_DRIFT_FACTOR * h->baseline_ms)
+	{
+		//Judge recovery against the drifted latency, otherwise the worker
+		//could never leave probation.
+		h->baseline_ms = h->latency_ms;
+		return health_set_state(h, HEALTH_PROBATION);
+	}
+
+	return false;
+}
+
+/**
+ * Records a failed operation. Repeated failures, a failure on probation or a
+ * poor success rate quarantine the worker; a single failure puts a healthy
+ * worker on probation.
+ * @param  h       A pointer to the health record.
+ * @param  timeout True if the failure was a timeout rather than an error reply.
+ * @param  now_ms  The current time in milliseconds.
+ * @return         True if the state changed.
+ */
+bool health_record_failure(health *h, const bool timeout, const uint64_t now_ms)
+{
+	h->failures++;
+	h->consecutive_failures++;
+	h->success_rate -= HEALTH_EWMA_ALPHA * h->success_rate;
+	if (timeout)
+	{
+		h->timeouts++;
+		h->timeout_rate += HEALTH_EWMA_ALPHA * (1.0f - h->timeout_rate);
+	}
+
+	if (h->state == HEALTH_QUARANTINED)
+		return false;
+
+	if (h->state == HEALTH_PROBATION || h->consecutive_failures >= HEALTH_QUARANTINE_FAILURES || h->success_rate < HEALTH_MIN_SUCCESS_RATE)
+	{
+		h->probe_interval_ms = HEALTH_PROBE_INTERVAL_MS;
+		h->next_probe_ms = now_ms + h->probe_interval_ms;
+		return health_set_state(h, HEALTH_QUARANTINED);
+	}
+
+	return health_set_state(h, HEALTH_PROBATION);
+}
+
+/**
+ * Records the outcome of a ping sent to a quarantined worker. Failed probes
+ * back off exponentially; enough successes in a row move it to probation.
+ * @param  h      A pointer to the health record.
+ * @param  ok     True if the worker answered.
+ * @param  now_ms The current time in milliseconds.
+ * @return        True if the state changed.
+ */
+bool health_record_probe(health *h, const bool ok, const uint64_t now_ms)
+{
+	if (! ok)
+	{
+		h->streak = 0;
+		h->probe_interval_ms *= 2;
+		if (h->probe_interval_ms > HEALTH_PROBE_INTERVAL_MAX_MS)
+			h->probe_interval_ms = HEALTH_PROBE_INTERVAL_MAX_MS;
+		h->next_probe_ms = now_ms + h->probe_interval_ms;
+		return false;
+	}
+
+	h->next_probe_ms = now_ms + HEALTH_PROBE_INTERVAL_MS;
+	if (++h->streak < HEALTH_PROBE_SUCCESSES)
+		return false;
+
+	h->consecutive_failures = 0;
+	h->success_rate = HEALTH_MIN_SUCCESS_RATE;
+	return health_set_state(h, HEALTH_PROBATION);
+}
+
+/**
+ * Determines if a worker may be given jobs.
+ * @param  h A pointer to the health record.
+ * @return   False while the worker is quarantined.
+ */
+bool health_can_dispatch(const health *h)
+{
+	return h->state != HEALTH_QUARANTINED;
+}
+
+/**
+ * Determines if a quarantined worker is due another probe.
+ * @param  h      A pointer to the health record.
+ * @param  now_ms The current time in milliseconds.
+ * @return        True if a ping should be sent.
+ */
+bool health_probe_due(const health *h, const uint64_t now_ms)
+{
+	return h->state == HEALTH_QUARANTINED && now_ms >= h->next_probe_ms;
+}
+
+/**
+ * Limits how many jobs a worker may have queued for its state.
+ * Workers on probation get one job at a time.
+ * @param  h     A pointer to the health record.
+ * @param  depth The worker's full queue depth.
+ * @return       The queue depth to use.
+ */
+uint8_t health_queue_limit(const health *h, const uint8_t depth)
+{
+	return h->state == HEALTH_HEALTHY ? depth : 1;
+}
+
+/**
+ * Converts a given HEALTH_STATE value to a user-friendly string of characters.
+ * @param  state The HEALTH_STATE.
+ * @return       A readable string of characters.
+ */
+const char *health_get_state_str(const HEALTH_STATE state)
+{
+	switch (state)
+	{
+		case HEALTH_HEALTHY:
+			return "healthy";
+		case HEALTH_PROBATION:
+			return "probation";
+		case HEALTH_QUARANTINED:
+			return "quarantined";
+		default:
+			return "unknown";
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+#include <stdint.h>
+#include <stdbool.h>
+
+//Consecutive failures before a worker is quarantined.
+#define HEALTH_QUARANTINE_FAILURES 3
+//Successful jobs on probation before a worker is healthy again.
+#define HEALTH_PROBATION_SUCCESSES 3
+//Successful pings before a quarantined worker is put on probation.
+#define HEALTH_PROBE_SUCCESSES 2
+#define HEALTH_PROBE_INTERVAL_MS 2000
+#define HEALTH_PROBE_INTERVAL_MAX_MS 60000
+//A worker whose job latency drifts past this multiple of its best is put on probation.
+#define HEALTH_DRIFT_FACTOR 3
+#define HEALTH_MIN_SUCCESS_RATE 0.5f
+
+typedef enum
+{
+	HEALTH_HEALTHY,
+	HEALTH_PROBATION,
+	HEALTH_QUARANTINED
+} HEALTH_STATE;
+
+typedef struct
+{
+	HEALTH_STATE state;
+	uint32_t successes;
+	uint32_t failures;
+	uint32_t timeouts;
+	//Exponentially weighted over recent operations, 0 to 1.
+	float success_rate;
+	float timeout_rate;
+	uint32_t latency_ms;
+	uint32_t baseline_ms;
+	uint8_t consecutive_failures;
+	uint8_t streak;
+	uint32_t probe_interval_ms;
+	uint64_t next_probe_ms;
+} health;
+
+void health_init(health *h);
+bool health_record_success(health *h, const uint32_t latency_ms);
+bool health_record_failure(health *h, const bool timeout, const uint64_t now_ms);
+bool health_record_probe(health *h, const bool ok, const uint64_t now_ms);
+bool health_can_dispatch(const health *h);
+bool health_probe_due(const health *h, const uint64_t now_ms);
+uint8_t health_queue_limit(const health *h, const uint8_t depth);
+const char *health_get_state_str(const HEALTH_STATE state);
+
+#endif
@@ -1,32 +1,40 @@
 #include <stdint.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <linux/i2c-dev.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
 #include <string.h>
 #include "i2c.h"
+#include "trace.h"
 
 /**
  * Initialises an i2c object.
  * @param  obj     A pointer to the i2c_obj struct.
- * @param  device  The name of the device.
+ * @param  device  The name of the device, or a socket target as for transport_open.
  * @param  addr    The I2C hardware address of the device (8-bit).
  * @param  hw_type The hardware type of the device. Must be set.
  * @return         An I2C_STATUS code.
  */
 I2C_STATUS i2c_init(i2c_obj *obj, const char *device, const uint32_t addr, const I2C_HW hw_type)
 {
-	//We only have 32 bytes to store the device name.
-	if (strlen(device) > 31)
+	//We only have so many bytes to store the device name.
+	if (strlen(device) > sizeof(obj->device) -1)
 		return I2C_STATUS_ERR_INVALID_DEVICE_NAME;
 	else
 		strcpy(obj->device, device);
 
 	obj->addr = addr;
 	obj->hw_type = hw_type;
+	obj->version = 0x1;
+	obj->seq = 0x0;
+	obj->general_call = false;
+	obj->leases = false;
+	obj->worker = TRACE_NO_WORKER;
+	obj->cmd = TRACE_NO_CMD;
+	obj->bus_class = BUS_CLASS_POLL;
+	obj->idle = true;
+	fault_init(&obj->fault);
+	obj->settle_max_us = hw_type == I2C_HW_MBED ? I2C_MBED_SETTLE_US : 0;
+	obj->settle_us = obj->settle_max_us;
 
 	//Reset the registers.
 	obj->reg[0] = 0x0;
@@ -36,18 +44,110 @@ I2C_STATUS i2c_init(i2c_obj *obj, const char *device, const uint32_t addr, const
 	obj->reg[4] = 0x0;
 	obj->reg[5] = 0x0;
 
-	//Request device access from the kernel.
-	if ((obj->fh = open(obj->device, O_RDWR)) < 0)
-		return I2C_STATUS_ERR_OPEN;
-
-	//Set I2C slave mode on the file descriptor.
-	if (ioctl(obj->fh, I2C_SLAVE, obj->addr) < 0)
-		return I2C_STATUS_ERR_IOCTL;
+	switch (transport_open(&obj->link, obj->device, obj->addr))
+	{
+		case TRANSPORT_STATUS_OK:
+			break;
+		case TRANSPORT_STATUS_ERR_TARGET:
+			return I2C_STATUS_ERR_INVALID_DEVICE_NAME;
+		case TRANSPORT_STATUS_ERR_SETUP:
+			return I2C_STATUS_ERR_IOCTL;
+		default:
+			return I2C_STATUS_ERR_OPEN;
+	}
 
 	return I2C_STATUS_OK;
 
 }
 
+/**
+ * Carries out a transaction with the device in its current bus class, and
+ * records it in the trace. Once the device is armed for fault injection,
+ * the transaction may be dropped, corrupted, delayed or refused by a hung
+ * slave first.
+ * @param  obj     A pointer to the i2c_obj.
+ * @param  src     A pointer to src_len bytes to write, or NULL.
+ * @param  src_len The number of bytes to write.
+ * @param  des     A pointer to des_len bytes used to store what was read, or NULL.
+ * @param  des_len The number of bytes to read.
+ * @return         True if every byte went through, otherwise false.
+ */
+static bool i2c_transact(i2c_obj *obj, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len)
+{
+	uint64_t start_us = trace_now_us();
+	FAULT_KIND fault = fault_next(&obj->fault, start_us);
+	uint8_t corrupted[I2C_BLOCK_MAX + I2C_SELECT_LEN];
+	bool ok;
+
+	obj->link.bus_class = obj->bus_class;
+	switch (fault)
+	{
+		case FAULT_HANG:
+			ok = false;
+		break;
+		case FAULT_DROP:
+			//A dropped write never reaches the slave; a dropped read is
+			//carried out and lost.
+			if (des_len > 0)
+				transport_transact(&obj->link, src, src_len, des, des_len);
+			ok = false;
+		break;
+		case FAULT_CORRUPT:
+			if (des_len == 0 && src_len <= sizeof(corrupted))
+			{
+				memcpy(corrupted, src, src_len);
+				fault_corrupt(&obj->fault, corrupted, src_len);
+				ok = transport_transact(&obj->link, corrupted, src_len, des, des_len);
+			}
+			else if ((ok = transport_transact(&obj->link, src, src_len, des, des_len)))
+				fault_corrupt(&obj->fault, des, des_len);
+		break;
+		case FAULT_DELAY:
+			usleep(fault_get_profile()->delay_us);
+			ok = transport_transact(&obj->link, src, src_len, des, des_len);
+		break;
+		default:
+			ok = transport_transact(&obj->link, src, src_len, des, des_len);
+	}
+
+	fault_record(&obj->fault, fault, ok, trace_now_us() - start_us);
+	trace_bus(obj->worker, obj->cmd, start_us, ok, src, src_len, des, des_len);
+	return ok;
+}
+
+/**
+ * Reads bytes from the slave starting at its first register. The register
+ * select and the read go out as one transaction, so no other slave on the
+ * adapter gets a turn between them. Where the device allows it they are
+ * also batched into one combined transfer; otherwise the adapter carries
+ * them out one after the other.
+ * @param  obj A pointer to the i2c_obj.
+ * @param  des A pointer to len bytes used to store what was read.
+ * @param  len The number of bytes to read.
+ * @return     An I2C_STATUS code.
+ */
+static I2C_STATUS i2c_read(i2c_obj *obj, uint8_t *des, const uint8_t len)
+{
+	uint8_t select[I2C_SELECT_LEN] = { 0x0, 0x0 };
+	bool ok;
+
+	//Mbed doesn't like the start condition raised.
+	//This could be clock-speed related or a bug in the I2C slave
+	//driver for Mbed.
+	if (obj->hw_type == I2C_HW_MBED)
+		ok = i2c_transact(obj, NULL, 0, des, len);
+	else
+		ok = i2c_transact(obj, select, I2C_SELECT_LEN, des, len);
+
+	if (! ok)
+	{
+		i2c_settle_backoff(obj);
+		return I2C_STATUS_ERR_READ_REG;
+	}
+
+	return I2C_STATUS_OK;
+}
+
 /**
  * Reads the registers of a given slave i2c_obj.
  * @param  obj A pointer to the i2c_obj.
@@ -63,16 +163,34 @@ I2C_STATUS i2c_read_reg(i2c_obj *obj)
 	obj->reg[4] = 0x0;
 	obj->reg[5] = 0x0;
 
-	//Mbed doesn't like the start condition raised.
-	//This could be clock-speed related or a bug in the I2C slave
-	//driver for Mbed.
-	if (obj->hw_type != I2C_HW_MBED)
-	{
-		if (write(obj->fh, obj->reg, 2) != 2)
-			return I2C_STATUS_ERR_WRITE_REG;
-	}
-	if (read(obj->fh, obj->reg, 6) != 6)
-		return I2C_STATUS_ERR_READ_REG;
+	return i2c_read(obj, obj->reg, 6);
+}
+
+/**
+ * Reads a block of bytes from the slave in a single transaction, starting at
+ * its first register. The leading bytes are also copied into the i2c_obj
+ * register so the usual register accessors still see the reply header.
+ * @param  obj A pointer to the i2c_obj.
+ * @param  des A pointer to at least len bytes used to store the block.
+ * @param  len The number of bytes to read, at most I2C_BLOCK_MAX.
+ * @return     An I2C_STATUS code.
+ */
+I2C_STATUS i2c_read_block(i2c_obj *obj, uint8_t *des, const uint8_t len)
+{
+	if (len > I2C_BLOCK_MAX)
+		return I2C_STATUS_ERR_REG_OUT_OF_BOUNDS;
+
+	for (uint8_t i=0; i<len; ++i)
+		des[i] = 0x0;
+	for (uint8_t i=0; i<6; ++i)
+		obj->reg[i] = 0x0;
+
+	I2C_STATUS result = i2c_read(obj, des, len);
+	if (result != I2C_STATUS_OK)
+		return result;
+
+	for (uint8_t i=0; i<6 && i<len; ++i)
+		obj->reg[i] = des[i];
 
 	return I2C_STATUS_OK;
 }
@@ -89,17 +207,101 @@ I2C_STATUS i2c_write_reg(i2c_obj *obj)
 	obj->reg[1] = 0x0;
 
 	//Write the data.
-	if (write(obj->fh, obj->reg, 6) != 6)
-    	return I2C_STATUS_ERR_WRITE_REG;
+	if (! i2c_transact(obj, obj->reg, 6, NULL, 0))
+	{
+		i2c_settle_backoff(obj);
+		return I2C_STATUS_ERR_WRITE_REG;
+	}
 
 	//Mbed is unreliable in testing without giving it time to process.
 	//Again, could be clock-speed related...
-	if (obj->hw_type == I2C_HW_MBED)
-		usleep(250000);
+	if (obj->settle_us > 0)
+		usleep(obj->settle_us);
 
 	return I2C_STATUS_OK;
 }
 
+/**
+ * Writes a block of bytes to the slave in a single transaction, starting at
+ * its first register.
+ * @param  obj A pointer to the i2c_obj.
+ * @param  src A pointer to the len bytes to write.
+ * @param  len The number of bytes to write, at most I2C_BLOCK_MAX.
+ * @return     An I2C_STATUS code.
+ */
+I2C_STATUS i2c_write_block(i2c_obj *obj, const uint8_t *src, const uint8_t len)
+{
+	uint8_t buffer[I2C_BLOCK_MAX + 2];
+
+	if (len > I2C_BLOCK_MAX)
+		return I2C_STATUS_ERR_REG_OUT_OF_BOUNDS;
+
+	//Register select, as in i2c_write_reg.
+	buffer[0] = 0x0;
+	buffer[1] = 0x0;
+	for (uint8_t i=0; i<len; ++i)
+		buffer[i + 2] = src[i];
+
+	if (! i2c_transact(obj, buffer, len + 2, NULL, 0))
+	{
+		i2c_settle_backoff(obj);
+		return I2C_STATUS_ERR_WRITE_REG;
+	}
+
+	//See i2c_write_reg.
+	if (obj->settle_us > 0)
+		usleep(obj->settle_us);
+
+	return I2C_STATUS_OK;
+}
+
+/**
+ * Writes a block of bytes to the general call address on the device's bus,
+ * reaching every slave there that answers it, starting at their
+ * I2C_BROADCAST_REG register. Unlike i2c_write_block the caller leaves the slaves to settle,
+ * since one delay covers all of them.
+ * @param  obj A pointer to the i2c_obj of any slave on the bus.
+ * @param  src A pointer to the len bytes to write.
+ * @param  len The number of bytes to write, at most I2C_BLOCK_MAX.
+ * @return     An I2C_STATUS code.
+ */
+I2C_STATUS i2c_broadcast_block(i2c_obj *obj, const uint8_t *src, const uint8_t len)
+{
+	uint8_t buffer[I2C_BLOCK_MAX + 2];
+	uint64_t start_us = trace_now_us();
+	bool ok;
+
+	if (len > I2C_BLOCK_MAX)
+		return I2C_STATUS_ERR_REG_OUT_OF_BOUNDS;
+
+	//The slaves keep a register window of its own for broadcasts, as
+	//register 0 would make the forbidden general call byte 0x00.
+	buffer[0] = I2C_BROADCAST_REG & 0xff;
+	buffer[1] = I2C_BROADCAST_REG >> 8;
+	for (uint8_t i=0; i<len; ++i)
+		buffer[i + 2] = src[i];
+
+	obj->link.bus_class = obj->bus_class;
+	ok = transport_broadcast(&obj->link, buffer, len + 2);
+	trace_bus(obj->worker, obj->cmd, start_us, ok, buffer, len + 2, NULL, 0);
+
+	return ok ? I2C_STATUS_OK : I2C_STATUS_ERR_WRITE_REG;
+}
+
+/**
+ * Lengthens the delay after writes to a device that has just misbehaved,
+ * up to its maximum. Devices that never settle are left alone.
+ * @param obj A pointer to the i2c_obj.
+ */
+void i2c_settle_backoff(i2c_obj *obj)
+{
+	if (obj->settle_max_us == 0)
+		return;
+
+	uint32_t settle_us = obj->settle_us * 2 + I2C_SETTLE_STEP_US;
+	obj->settle_us = settle_us < obj->settle_max_us ? settle_us : obj->settle_max_us;
+}
+
 /**
  * Sets a given register byte number with a given value on an i2c_obj.
  * @param  obj         A pointer to the i2c_obj.
@@ -117,12 +319,12 @@ I2C_STATUS i2c_set_reg_data(i2c_obj *obj, const uint8_t byte_number, const uint8
 }
 
 /**
- * Closes off the I2C connection from kernel.
+ * Closes off the connection to the device.
  * @param obj A pointer to the i2c_obj.
  */
 void i2c_close(i2c_obj *obj)
 {
-	close(obj->fh);
+	transport_close(&obj->link);
 }
 
 /**
@@ -161,6 +363,27 @@ const char *i2c_get_status_str(const I2C_STATUS status)
 	}
 }
 
+/**
+ * Converts a given I2C_HW value to the name of the hardware.
+ * @param  hw The I2C_HW type.
+ * @return    A readable string of characters.
+ */
+const char *i2c_get_hw_str(const I2C_HW hw)
+{
+	switch (hw)
+	{
+		case I2C_HW_PHOTON:
+			return "Photon";
+			break;
+		case I2C_HW_MBED:
+			return "mbed";
+			break;
+		default:
+			return "Unknown hardware";
+			break;
+	}
+}
+
 /**
  * Converts a given i2c_obj's registers to a string of characters in hexidecimal.
  * @param obj  A pointer to the i2c_obj.
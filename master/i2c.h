@@ -1,6 +1,27 @@
 #ifndef I2C_H
 #define I2C_H
 #include <stdint.h>
+#include <stdbool.h>
+#include "transport.h"
+#include "fault.h"
+
+//The largest single read transaction, matching the slaves' Wire buffers.
+#define I2C_BLOCK_MAX 32
+
+//Register select bytes written ahead of every read and write.
+#define I2C_SELECT_LEN 2
+
+//The register general call writes select, low byte first. The byte after
+//the general call address may not be 0x00, and 0x04, 0x06 and odd values
+//have meanings of their own to other devices, which ignore anything else.
+#define I2C_BROADCAST_REG 0x10
+
+//The mbed misses requests that arrive before it has handled the last one,
+//so it is left alone for a while after every write. This is the delay it
+//starts from and never exceeds; efp_calibrate_settle finds the shortest one
+//that works, and errors back it off by doubling plus a step.
+#define I2C_MBED_SETTLE_US 250000
+#define I2C_SETTLE_STEP_US 1000
 
 typedef enum
 {
@@ -21,19 +42,46 @@ typedef enum
 
 typedef struct
 {
-	char device[32];
+	char device[TRANSPORT_TARGET_LEN];
 	uint32_t addr;
-	uint32_t fh;
+	transport link;
 	uint8_t reg[6];
 	I2C_HW hw_type;
+	//How long to leave the device alone after a write, and the most it is
+	//backed off to. A device with no maximum is never made to wait.
+	uint32_t settle_us;
+	uint32_t settle_max_us;
+	//The EFP protocol version spoken to the device, its last sequence number,
+	//whether it takes commands sent to the general call address and whether
+	//it echoes the lease each job was ordered under.
+	uint8_t version;
+	uint8_t seq;
+	bool general_call;
+	bool leases;
+	//Who the device is and what it is doing, for the trace.
+	uint8_t worker;
+	uint8_t cmd;
+	//How urgent its transactions are on a shared adapter, and whether it has
+	//nothing queued, which makes orders to it the most urgent of all.
+	uint8_t bus_class;
+	bool idle;
+	//The faults injected into its transactions, for testing.
+	fault_state fault;
 } i2c_obj;
 
 I2C_STATUS i2c_init(i2c_obj *obj, const char *device, const uint32_t addr, const I2C_HW hw_type);
 I2C_STATUS i2c_read_reg(i2c_obj *obj);
 I2C_STATUS i2c_write_reg(i2c_obj *obj);
+I2C_STATUS i2c_read_block(i2c_obj *obj, uint8_t *des, const uint8_t len);
+I2C_STATUS i2c_write_block(i2c_obj *obj, const uint8_t *src, const uint8_t len);
+I2C_STATUS i2c_broadcast_block(i2c_obj *obj, const uint8_t *src, const uint8_t len);
+void i2c_settle_backoff(i2c_obj *obj);
 I2C_STATUS i2c_set_reg_data(i2c_obj *obj, const uint8_t byte_number, const uint8_t val);
 void i2c_close(i2c_obj *obj);
 const char *i2c_get_status_str(const I2C_STATUS status);
+const char *i2c_get_hw_str(const I2C_HW hw);
 void i2c_reg_to_string(const i2c_obj *obj, char *dest);
+static bool i2c_transact(i2c_obj *obj, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len);
+static I2C_STATUS i2c_read(i2c_obj *obj, uint8_t *des, const uint8_t len);
 
 #endif
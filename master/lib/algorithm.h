@@ -10,6 +10,7 @@ int pow_mod(int a, int b, int m);
 bool is_prime(int n);
 int next_prime(int n);
 int get_nth_digit(unsigned int n);
+int get_nth_digit_cancellable(unsigned int n, volatile const bool *cancel);
 void get_nth_series(unsigned int start, unsigned int end, short *store);
 
 #endif
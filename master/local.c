@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "local.h"
+#include "lib/algorithm.h"
+
+/**
+ * Finds the oldest queued job that is waiting to be computed.
+ * The caller must hold the worker's lock.
+ * @param  lw A pointer to the local_worker.
+ * @return    The slot number of the job, or -1 if there is nothing to do.
+ */
+static int8_t local_next_job(local_worker *lw)
+{
+	int8_t result = -1;
+	uint8_t oldest_age = 0x0;
+
+	for (uint8_t slot=0; slot<LOCAL_QUEUE_DEPTH; ++slot)
+	{
+		if (lw->slots[slot].mode != LOCAL_MODE_WORK)
+			continue;
+
+		uint8_t age = lw->next_ticket - lw->slots[slot].ticket;
+		if (result < 0 || age > oldest_age)
+		{
+			result = slot;
+			oldest_age = age;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * The computation thread of a local worker.
+ * Sleeps until a job is queued, then computes it digit by digit with the
+ * same kernel the slaves run.
+ * @param  arg A pointer to the local_worker.
+ * @return     NULL.
+ */
+static void *local_compute(void *arg)
+{
+	local_worker *lw = (local_worker *)arg;
+
+	pthread_mutex_lock(&lw->lock);
+	while (lw->running)
+	{
+		int8_t slot = local_next_job(lw);
+		if (slot < 0)
+		{
+			pthread_cond_wait(&lw->work_ready, &lw->lock);
+			continue;
+		}
+
+		local_job_slot *job = &lw->slots[slot];
+		uint8_t ticket = job->ticket;
+		unsigned int n = job->start_idx * lw->job_factor +1 + job->progress;
+
+		lw->computing = slot;
+		lw->cancel_computing = false;
+
+		while (job->progress < lw->job_factor)
+		{
+			pthread_mutex_unlock(&lw->lock);
+			int digit = get_nth_digit_cancellable(n++, &lw->cancel_computing);
+			pthread_mutex_lock(&lw->lock);
+
+			//The slot was cancelled and possibly reused while we were computing.
+			if (digit < 0 || ! lw->running || job->mode != LOCAL_MODE_WORK || job->ticket != ticket)
+				break;
+
+			job->results[job->progress++] = digit;
+		}
+
+		lw->computing = -1;
+		if (job->mode == LOCAL_MODE_WORK && job->ticket == ticket && job->progress == lw->job_factor)
+			job->mode = LOCAL_MODE_DONE;
+	}
+	pthread_mutex_unlock(&lw->lock);
+
+	return NULL;
+}
+
+/**
+ * Determines the default number of local workers: one per core, leaving a
+ * core free for the master's own bus traffic.
+ * @return The number of local workers to start.
+ */
+int local_default_worker_count()
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores <= 1)
+		return 0;
+
+	return (int)cores -1;
+}
+
+/**
+ * Initialises a local worker and starts its computation thread pinned to a core.
+ * @param  lw         A pointer to the local_worker.
+ * @param  id         The worker number.
+ * @param  cpu        The core to pin the thread to, or -1 to leave it unpinned.
+ * @param  job_factor The number of digits in each job.
+ * @return            True if the thread was started, otherwise false.
+ */
+bool local_worker_start(local_worker *lw, const uint8_t id, const int cpu, const uint8_t job_factor)
+{
+	if (job_factor > LOCAL_MAX_JOB_FACTOR)
+		return false;
+
+	lw->id = id;
+	lw->cpu = cpu;
+	lw->job_factor = job_factor;
+	lw->running = true;
+	lw->next_ticket = 0x0;
+	lw->computing = -1;
+	lw->cancel_computing = false;
+
+	for (uint8_t slot=0; slot<LOCAL_QUEUE_DEPTH; ++slot)
+	{
+		lw->slots[slot].mode = LOCAL_MODE_IDLE;
+		lw->slots[slot].progress = 0x0;
+	}
+
+	pthread_mutex_init(&lw->lock, NULL);
+	pthread_cond_init(&lw->work_ready, NULL);
+
+	if (pthread_create(&lw->thread, NULL, local_compute, lw) != 0)
+		return false;
+
+	if (cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(lw->thread, sizeof(cpu_set_t), &set);
+	}
+
+	return true;
+}
+
+/**
+ * Stops a local worker's thread, abandoning any job in progress.
+ * @param lw A pointer to the local_worker.
+ */
+void local_worker_stop(local_worker *lw)
+{
+	pthread_mutex_lock(&lw->lock);
+	lw->running = false;
+	lw->cancel_computing = true;
+	pthread_cond_signal(&lw->work_ready);
+	pthread_mutex_unlock(&lw->lock);
+
+	pthread_join(lw->thread, NULL);
+	pthread_cond_destroy(&lw->work_ready);
+	pthread_mutex_destroy(&lw->lock);
+}
+
+/**
+ * Queues a job order on a local worker.
+ * @param  lw    A pointer to the local_worker.
+ * @param  n_val The job order value.
+ * @param  first The first result to compute; earlier ones are already known.
+ * @param  slot  A pointer to a single byte location used to store the job slot.
+ * @return       True if the order was queued, false if the queue is full.
+ */
+bool local_order(local_worker *lw, const uint32_t n_val, const uint8_t first, uint8_t *slot)
+{
+	bool result = false;
+
+	pthread_mutex_lock(&lw->lock);
+	for (uint8_t i=0; i<LOCAL_QUEUE_DEPTH; ++i)
+	{
+		if (lw->slots[i].mode != LOCAL_MODE_IDLE)
+			continue;
+
+		lw->slots[i].ticket = lw->next_ticket++;
+		lw->slots[i].start_idx = n_val;
+		lw->slots[i].progress = first < lw->job_factor ? first : 0x0;
+		lw->slots[i].mode = LOCAL_MODE_WORK;
+		*slot = i;
+		result = true;
+
+		pthread_cond_signal(&lw->work_ready);
+		break;
+	}
+	pthread_mutex_unlock(&lw->lock);
+
+	return result;
+}
+
+/**
+ * Reads the progress of a queued job.
+ * @param  lw   A pointer to the local_worker.
+ * @param  slot The job slot to query.
+ * @param  des  A pointer to a single byte location used to store the progress.
+ * @return      True if the slot exists, otherwise false.
+ */
+bool local_status(local_worker *lw, const uint8_t slot, uint8_t *des)
+{
+	if (slot >= LOCAL_QUEUE_DEPTH)
+		return false;
+
+	pthread_mutex_lock(&lw->lock);
+	*des = lw->slots[slot].progress;
+	pthread_mutex_unlock(&lw->lock);
+
+	return true;
+}
+
+/**
+ * Copies a range of results of a job. Results the job has already computed
+ * can be copied before it finishes.
+ * @param  lw        A pointer to the local_worker.
+ * @param  slot      The job slot holding the results.
+ * @param  des       A pointer to the location used to store the results.
+ * @param  start_idx The first result index, starting from 1.
+ * @param  end_idx   The final result index.
+ * @return           True if the range has been computed, otherwise false.
+ */
+bool local_result_range(local_worker *lw, const uint8_t slot, uint8_t *des, uint8_t start_idx, const uint8_t end_idx)
+{
+	bool result = false;
+
+	if (slot >= LOCAL_QUEUE_DEPTH || start_idx < 1 || end_idx > lw->job_factor)
+		return false;
+
+	pthread_mutex_lock(&lw->lock);
+	if (lw->slots[slot].mode != LOCAL_MODE_IDLE && end_idx <= lw->slots[slot].progress)
+	{
+		for (uint8_t i=0; start_idx<=end_idx; ++i, ++start_idx)
+			des[i] = lw->slots[slot].results[start_idx -1];
+		result = true;
+	}
+	pthread_mutex_unlock(&lw->lock);
+
+	return result;
+}
+
+/**
+ * Frees the slot of a finished job, as RESET does on the slaves.
+ * @param  lw   A pointer to the local_worker.
+ * @param  slot The job slot to free.
+ * @return      True if the slot held a finished job, otherwise false.
+ */
+bool local_reset(local_worker *lw, const uint8_t slot)
+{
+	bool result = false;
+
+	if (slot >= LOCAL_QUEUE_DEPTH)
+		return false;
+
+	pthread_mutex_lock(&lw->lock);
+	if (lw->slots[slot].mode == LOCAL_MODE_DONE)
+	{
+		lw->slots[slot].mode = LOCAL_MODE_IDLE;
+		result = true;
+	}
+	pthread_mutex_unlock(&lw->lock);
+
+	return result;
+}
+
+/**
+ * Frees a job slot whatever it holds. A job still being computed in the
+ * slot is abandoned straight away.
+ * @param  lw   A pointer to the local_worker.
+ * @param  slot The job slot to free.
+ * @return      True if the slot exists, otherwise false.
+ */
+bool local_cancel(local_worker *lw, const uint8_t slot)
+{
+	if (slot >= LOCAL_QUEUE_DEPTH)
+		return false;
+
+	pthread_mutex_lock(&lw->lock);
+	lw->slots[slot].mode = LOCAL_MODE_IDLE;
+	if (lw->computing == slot)
+		lw->cancel_computing = true;
+	pthread_mutex_unlock(&lw->lock);
+
+	return true;
+}
@@ -0,0 +1,53 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+//Local workers mirror the EFP slot interface so the scheduler can treat a
+//thread on the master exactly like an I2C slave.
+#define LOCAL_QUEUE_DEPTH 2
+#define LOCAL_MAX_JOB_FACTOR 32
+
+typedef enum
+{
+	LOCAL_MODE_IDLE,
+	LOCAL_MODE_WORK,
+	LOCAL_MODE_DONE
+} LOCAL_MODE;
+
+typedef struct
+{
+	LOCAL_MODE mode;
+	uint8_t ticket;
+	uint32_t start_idx;
+	uint8_t progress;
+	uint8_t results[LOCAL_MAX_JOB_FACTOR];
+} local_job_slot;
+
+typedef struct
+{
+	uint8_t id;
+	int cpu;
+	uint8_t job_factor;
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	local_job_slot slots[LOCAL_QUEUE_DEPTH];
+	uint8_t next_ticket;
+	//The slot being computed, and a flag the kernel checks to give up on it.
+	int8_t computing;
+	volatile bool cancel_computing;
+} local_worker;
+
+int local_default_worker_count();
+bool local_worker_start(local_worker *lw, const uint8_t id, const int cpu, const uint8_t job_factor);
+void local_worker_stop(local_worker *lw);
+bool local_order(local_worker *lw, const uint32_t n_val, const uint8_t first, uint8_t *slot);
+bool local_status(local_worker *lw, const uint8_t slot, uint8_t *des);
+bool local_result_range(local_worker *lw, const uint8_t slot, uint8_t *des, uint8_t start_idx, const uint8_t end_idx);
+bool local_reset(local_worker *lw, const uint8_t slot);
+bool local_cancel(local_worker *lw, const uint8_t slot);
+
+#endif
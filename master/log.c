@@ -1,6 +1,10 @@
 #include <string.h>
+#include <pthread.h>
 #include "log.h"
 
+//Worker driver threads append to the logs while the main loop renders them.
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Appends a given string to the END of a given array of strings and
  * pushes string in the array from top to bottom.
@@ -12,8 +16,26 @@ void log_append(char dest[][DCA_LOG_MAX_STR_LEN], const char *src)
 	if (strlen(src) > (DCA_LOG_MAX_STR_LEN -1))
 		return;
 
+	log_lock();
 	for (int i=0; i<DCA_LOG_MAX_LINES -1; ++i)
 		strcpy(dest[i], dest[i +1]);
 
 	strcpy(dest[DCA_LOG_MAX_LINES -1], src);
+	log_unlock();
+}
+
+/**
+ * Locks all logs, so they can be read without lines shifting under the reader.
+ */
+void log_lock()
+{
+	pthread_mutex_lock(&log_mutex);
+}
+
+/**
+ * Unlocks all logs.
+ */
+void log_unlock()
+{
+	pthread_mutex_unlock(&log_mutex);
 }
@@ -6,5 +6,7 @@
 #define DCA_LOG_MAX_LINES 25
 
 void log_append(char dest[][DCA_LOG_MAX_STR_LEN], const char *src);
+void log_lock();
+void log_unlock();
 
 #endif
\ No newline at end of file
@@ -1,9 +1,76 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
 #include "dca.h"
 
 int main(int argc, char **argv)
 {
 	char c, res;
+	int opt;
+
+	char *checkpoint_file = DCA_CHECKPOINT_DEFAULT_PATH;
+	bool resume = false;
+
+	//-w sets the number of local worker threads on the master.
+	//-c sets the checkpoint file, and -r resumes the session saved in it.
+	//-s adds a computation session, -p picks how sessions share the workers.
+	//-t adds a slave reached over a socket, -b an I2C adapter with boards on it.
+	//-T sets the trace file, or turns the trace off when given "".
+	//-F injects faults into the slaves' transactions, e.g. -F drops:7.
+	while ((opt = getopt(argc, argv, "w:c:rs:p:t:b:T:F:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'w':
+				dca_set_local_workers(atoi(optarg));
+				break;
+			case 'c':
+				checkpoint_file = optarg;
+				break;
+			case 'r':
+				resume = true;
+				break;
+			case 's':
+				if (! dca_add_session(optarg))
+				{
+					printf("Invalid session %s, expected name:first_digit:num_digits[:weight[:deadline_seconds]]\n", optarg);
+					return 1;
+				}
+				break;
+			case 't':
+				if (! dca_add_remote_worker(optarg))
+				{
+					printf("Invalid slave %s, expected unix:path or tcp:host:port, optionally followed by @address\n", optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if (! dca_add_bus(optarg))
+				{
+					printf("Invalid I2C bus %s, expected a device path such as /dev/i2c-1\n", optarg);
+					return 1;
+				}
+				break;
+			case 'T':
+				dca_set_trace(optarg);
+				break;
+			case 'F':
+				if (! dca_set_faults(optarg))
+				{
+					printf("Invalid fault profile %s, expected none, drops, corrupt, delays, hangs or mixed, optionally followed by :seed\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+				dca_set_policy(strcmp(optarg, "edf") == 0 ? SESSION_POLICY_EDF : SESSION_POLICY_FAIR);
+				break;
+			default:
+				printf("Usage: %s [-w local_workers] [-c checkpoint_file] [-r] [-s session]... [-p fair|edf] [-t slave]... [-b i2c_bus]... [-T trace_file] [-F fault_profile[:seed]]\n", argv[0]);
+				return 1;
+		}
+	}
+	dca_set_checkpoint(checkpoint_file, resume);
 
 	while (c != '2')
 	{
@@ -13,4 +80,4 @@ int main(int argc, char **argv)
 			res = dca_main();
 	}
 	return res;
-}
\ No newline at end of file
+}
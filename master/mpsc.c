@@ -0,0 +1,74 @@
+#include <stddef.h>
+#include <stdatomic.h>
+#include "mpsc.h"
+
+/**
+ * Initialises an empty queue.
+ * @param q A pointer to the mpsc_queue.
+ */
+void mpsc_init(mpsc_queue *q)
+{
+	atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+	q->tail = &q->stub;
+}
+
+/**
+ * Adds a node to the queue. Safe to call from any number of threads at once,
+ * and never blocks.
+ * @param q    A pointer to the mpsc_queue.
+ * @param node A pointer to the node, which must not already be queued.
+ */
+void mpsc_push(mpsc_queue *q, mpsc_node *node)
+{
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+	//Claim the head first, then link the previous head to us. Between the two
+	//the consumer sees a break in the list and simply stops there.
+	mpsc_node *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/**
+ * Removes the oldest node from the queue. Must only be called from the
+ * consuming thread.
+ * @param  q A pointer to the mpsc_queue.
+ * @return   The node, or NULL if the queue is empty or a push is half done.
+ */
+mpsc_node *mpsc_pop(mpsc_queue *q)
+{
+	mpsc_node *tail = q->tail;
+	mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	//Step over the stub node.
+	if (tail == &q->stub)
+	{
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	//The tail is the last linked node. If it isn't the head, a producer is
+	//between its two steps; try again later.
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+
+	//Put the stub back behind the last node so it can be handed out.
+	mpsc_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
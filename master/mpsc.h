@@ -0,0 +1,24 @@
+#ifndef MPSC_H
+#define MPSC_H
+#include <stdatomic.h>
+
+//An intrusive, lock-free, multi-producer single-consumer queue. Items embed
+//an mpsc_node as their first member. Any thread may push; only one thread
+//may pop.
+typedef struct mpsc_node
+{
+	_Atomic(struct mpsc_node *) next;
+} mpsc_node;
+
+typedef struct
+{
+	_Atomic(mpsc_node *) head;
+	mpsc_node *tail;
+	mpsc_node stub;
+} mpsc_queue;
+
+void mpsc_init(mpsc_queue *q);
+void mpsc_push(mpsc_queue *q, mpsc_node *node);
+mpsc_node *mpsc_pop(mpsc_queue *q);
+
+#endif
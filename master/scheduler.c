@@ -26,6 +26,9 @@ scheduler scheduler_create(const uint8_t num_workers, const uint32_t end_schedul
 		result.slaves[i]->idx = i;
 		result.slaves[i]->addr = i;
 		result.slaves[i]->busy = false;
+		result.slaves[i]->enabled = true;
+		result.slaves[i]->queue_depth = 1;
+		result.slaves[i]->queue_len = 0;
 	}
 
 	return result;
@@ -40,10 +43,25 @@ scheduler scheduler_create(const uint8_t num_workers, const uint32_t end_schedul
  */
 void scheduler_set_slave_i2c(scheduler *s, const uint8_t idx, i2c_obj *obj, char *name)
 {
+	s->slaves[idx]->type = SCHEDULER_WORKER_I2C;
 	s->slaves[idx]->obj = obj;
 	s->slaves[idx]->name = name;
 }
 
+/**
+ * Sets a local worker thread for a given scheduler slot.
+ * @param s    A pointer to the scheduler.
+ * @param idx  The slave index to set.
+ * @param lw   A pointer to the started local_worker for association.
+ * @param name A string name of the worker
+ */
+void scheduler_set_slave_local(scheduler *s, const uint8_t idx, local_worker *lw, char *name)
+{
+	s->slaves[idx]->type = SCHEDULER_WORKER_LOCAL;
+	s->slaves[idx]->local = lw;
+	s->slaves[idx]->name = name;
+}
+
 /**
  * Finds a slave that is doing nothing.
  * @param  s          A pointer to the scheduler.
@@ -59,7 +77,7 @@ int8_t scheduler_get_free_slave_idx(scheduler *s, uint32_t timeout_ms)
 	while (rough_time_passed < timeout_ms)
 	{
 		for (int8_t i=0; i<s->num_workers; ++i)
-			if (! s->slaves[i]->busy)
+			if (! s->slaves[i]->busy && s->slaves[i]->enabled)
 				return i;
 		usleep(SIG_SLEEP_TIME_MS);
 		rough_time_passed += SIG_SLEEP_TIME_MS;
@@ -91,14 +109,111 @@ void scheduler_claim_slave(slave *sl)
 }
 
 /**
- * Free a slave for accepting more work.
+ * Free a slave for accepting more work. Forgets any queued jobs.
  * @param sl A pointer to the slave.
  */
 void scheduler_free_slave(slave *sl)
 {
+	sl->queue_len = 0;
 	sl->busy = false;
 }
 
+/**
+ * Enables or disables a slave. Disabled slaves are skipped when looking for
+ * a free slave.
+ * @param sl      A pointer to the slave.
+ * @param enabled True to allow the slave to be given work.
+ */
+void scheduler_set_enabled(slave *sl, const bool enabled)
+{
+	sl->enabled = enabled;
+}
+
+/**
+ * Sets how many jobs a slave may have queued before it is considered busy.
+ * @param sl    A pointer to the slave.
+ * @param depth The queue depth, clamped to SCHEDULER_MAX_QUEUE_DEPTH.
+ */
+void scheduler_set_queue_depth(slave *sl, const uint8_t depth)
+{
+	sl->queue_depth = depth;
+	if (sl->queue_depth > SCHEDULER_MAX_QUEUE_DEPTH)
+		sl->queue_depth = SCHEDULER_MAX_QUEUE_DEPTH;
+	if (sl->queue_depth < 1)
+		sl->queue_depth = 1;
+
+	sl->busy = (sl->queue_len >= sl->queue_depth);
+}
+
+/**
+ * Appends a job to the back of a slave's queue.
+ * The slave becomes busy once its queue is full.
+ * @param sl         A pointer to the slave.
+ * @param session_id The session the job belongs to.
+ * @param job_idx    The job index that was ordered.
+ * @param slot       The slot the slave is holding the job in.
+ * @param lease      The lease the job was handed out under.
+ */
+void scheduler_push_job(slave *sl, const uint8_t session_id, const uint32_t job_idx, const uint8_t slot, const uint32_t lease)
+{
+	if (sl->queue_len >= SCHEDULER_MAX_QUEUE_DEPTH)
+		return;
+
+	sl->queue_session[sl->queue_len] = session_id;
+	sl->queue_idx[sl->queue_len] = job_idx;
+	sl->queue_slot[sl->queue_len] = slot;
+	sl->queue_lease[sl->queue_len] = lease;
+	sl->queue_len++;
+
+	sl->busy = (sl->queue_len >= sl->queue_depth);
+}
+
+/**
+ * Removes the job at the front of a slave's queue.
+ * @param sl A pointer to the slave.
+ */
+void scheduler_pop_job(slave *sl)
+{
+	scheduler_remove_job(sl, 0);
+}
+
+/**
+ * Removes a job from anywhere in the slave's queue, keeping the order of the
+ * jobs behind it.
+ * @param sl    A pointer to the slave.
+ * @param index The position of the job in the queue.
+ */
+void scheduler_remove_job(slave *sl, const uint8_t index)
+{
+	if (index >= sl->queue_len)
+		return;
+
+	for (uint8_t i=index +1; i<sl->queue_len; ++i)
+	{
+		sl->queue_session[i -1] = sl->queue_session[i];
+		sl->queue_idx[i -1] = sl->queue_idx[i];
+		sl->queue_slot[i -1] = sl->queue_slot[i];
+		sl->queue_lease[i -1] = sl->queue_lease[i];
+	}
+	sl->queue_len--;
+
+	sl->busy = (sl->queue_len >= sl->queue_depth);
+}
+
+/**
+ * Determines if every slave has finished all of its queued jobs.
+ * @param  s A pointer to the scheduler.
+ * @return   True if no slave has any queued jobs.
+ */
+bool scheduler_all_idle(scheduler *s)
+{
+	for (int8_t i=0; i<s->num_workers; ++i)
+		if (s->slaves[i]->queue_len > 0)
+			return false;
+
+	return true;
+}
+
 /**
  * Destroys a scheduler instance.
  * @param s A pointer to the scheduler to destroy.
@@ -3,16 +3,38 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "i2c.h"
+#include "local.h"
+
+//Upper bound on the number of jobs a single slave can have queued.
+#define SCHEDULER_MAX_QUEUE_DEPTH 8
+
+typedef enum
+{
+	SCHEDULER_WORKER_I2C,
+	SCHEDULER_WORKER_LOCAL
+} SCHEDULER_WORKER;
 
 typedef struct {
 	uint8_t idx;
+	SCHEDULER_WORKER type;
 	uint8_t addr;
 	//When gcc uses -O1 or higher optimsiations, this gets optimised out
 	//and deadlock can occur. MUST be defined volatile.
 	volatile bool busy;
+	//Disabled slaves are never handed out, e.g. while quarantined.
+	bool enabled;
 	i2c_obj *obj;
+	local_worker *local;
 	char *name;
-	uint32_t current_idx;
+	uint8_t queue_depth;
+	uint8_t queue_len;
+	//Jobs in the order they were given to the slave, the session each belongs
+	//to, the slot the slave reported holding each of them in and the lease
+	//each was handed out under.
+	uint8_t queue_session[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint32_t queue_idx[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint8_t queue_slot[SCHEDULER_MAX_QUEUE_DEPTH];
+	uint32_t queue_lease[SCHEDULER_MAX_QUEUE_DEPTH];
 } slave;
 
 typedef struct {
@@ -24,10 +46,17 @@ typedef struct {
 
 scheduler scheduler_create(const uint8_t num_workers, const uint32_t end_schedule);
 void scheduler_set_slave_i2c(scheduler *s, const uint8_t idx, i2c_obj *obj, char *name);
+void scheduler_set_slave_local(scheduler *s, const uint8_t idx, local_worker *lw, char *name);
 int8_t scheduler_get_free_slave_idx(scheduler *s, uint32_t timeout_ms);
 slave *scheduler_get_slave_by_idx(scheduler *s, int8_t idx);
 void scheduler_claim_slave(slave *sl);
 void scheduler_free_slave(slave *sl);
+void scheduler_set_enabled(slave *sl, const bool enabled);
+void scheduler_set_queue_depth(slave *sl, const uint8_t depth);
+void scheduler_push_job(slave *sl, const uint8_t session_id, const uint32_t job_idx, const uint8_t slot, const uint32_t lease);
+void scheduler_pop_job(slave *sl);
+void scheduler_remove_job(slave *sl, const uint8_t index);
+bool scheduler_all_idle(scheduler *s);
 void scheduler_destroy(scheduler *s);
 
 #endif
@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "session.h"
+#include "bcd.h"
+
+/**
+ * Initialises an empty session table.
+ * @param t         A pointer to the session_table.
+ * @param step_size The number of digits in each job.
+ * @param policy    How workers are shared between sessions.
+ */
+void session_table_init(session_table *t, const uint8_t step_size, const SESSION_POLICY policy)
+{
+	memset(t, 0, sizeof(session_table));
+	t->step_size = step_size;
+	t->policy = policy;
+}
+
+/**
+ * Adds a computation session over a range of digits.
+ * The range is widened to whole jobs.
+ * @param  t           A pointer to the session_table.
+ * @param  name        A short name for the session.
+ * @param  first_digit The first digit to compute, starting from 1.
+ * @param  num_digits  The number of digits to compute.
+ * @param  weight      The session's share of the workers relative to other sessions.
+ * @param  deadline_ms Milliseconds after the start the session should be done by, or 0.
+ * @return             A pointer to the new session, or NULL if the range is not addressable.
+ */
+session *session_add(session_table *t, const char *name, const uint32_t first_digit, const uint32_t num_digits, const uint32_t weight, const uint64_t deadline_ms)
+{
+	session *se;
+	uint32_t first_job, last_job;
+
+	if (t->num_sessions >= SESSION_MAX || first_digit < 1 || num_digits < 1)
+		return NULL;
+
+	first_job = (first_digit -1) / t->step_size;
+	last_job = (first_digit + num_digits -2) / t->step_size;
+	if (last_job >= SESSION_MAX_JOBS)
+		return NULL;
+
+	se = &t->sessions[t->num_sessions];
+	memset(se, 0, sizeof(session));
+	se->id = t->num_sessions;
+	strncpy(se->name, name, SESSION_NAME_LEN -1);
+	se->type = SESSION_TYPE_PI_DIGITS;
+	se->first_job = first_job;
+	se->num_jobs = last_job - first_job +1;
+	se->weight = weight > 0 ? weight : 1;
+	se->deadline_ms = deadline_ms;
+
+	t->num_sessions++;
+	return se;
+}
+
+/**
+ * Adds a session from a command line specification of the form
+ * name:first_digit:num_digits[:weight[:deadline_seconds]].
+ * @param  t    A pointer to the session_table.
+ * @param  spec The specification string.
+ * @return      True if the session was added.
+ */
+bool session_add_spec(session_table *t, const char *spec)
+{
+	char name[SESSION_NAME_LEN];
+	unsigned int first_digit, num_digits, weight = 1, deadline_s = 0;
+
+	if (sscanf(spec, "%15[^:]:%u:%u:%u:%u", name, &first_digit, &num_digits, &weight, &deadline_s) < 3)
+		return false;
+
+	return session_add(t, name, first_digit, num_digits, weight, (uint64_t)deadline_s * 1000) != NULL;
+}
+
+/**
+ * Returns a pointer to the session for a given id.
+ * @param  t  A pointer to the session_table.
+ * @param  id The session id.
+ * @return    A pointer to the session if it exists. Otherwise, NULL.
+ */
+session *session_get(session_table *t, const uint8_t id)
+{
+	if (id < t->num_sessions)
+		return &t->sessions[id];
+	return (session *)NULL;
+}
+
+/**
+ * Determines if session a should be served before session b.
+ * Under SESSION_POLICY_EDF the earliest deadline goes first and sessions
+ * without one fall back to fair sharing. Fair sharing serves the session
+ * with the fewest dispatched jobs relative to its weight.
+ * @param  policy The table's policy.
+ * @param  a      A pointer to a session.
+ * @param  b      A pointer to the session to compare against.
+ * @return        True if a goes first.
+ */
+static bool session_before(const SESSION_POLICY policy, const session *a, const session *b)
+{
+	if (policy == SESSION_POLICY_EDF && a->deadline_ms != b->deadline_ms)
+	{
+		if (a->deadline_ms == 0)
+			return false;
+		if (b->deadline_ms == 0)
+			return true;
+		return a->deadline_ms < b->deadline_ms;
+	}
+
+	return a->served * b->weight < b->served * a->weight;
+}
+
+/**
+ * Picks the session the next worker should serve.
+ * @param  t A pointer to the session_table.
+ * @return   A pointer to the session, or NULL if no session has unassigned jobs.
+ */
+session *session_pick(session_table *t)
+{
+	session *result = NULL;
+
+	for (uint8_t i=0; i<t->num_sessions; ++i)
+	{
+		session *se = &t->sessions[i];
+		if (session_job_next(se) < 0)
+			continue;
+		if (result == NULL || session_before(t->policy, se, result))
+			result = se;
+	}
+
+	return result;
+}
+
+/**
+ * Gets the next unassigned job of a session.
+ * @param  se A pointer to the session.
+ * @return    The job number within the session, or -1 if there is none.
+ */
+int session_job_next(const session *se)
+{
+	for (uint32_t i=0; i<se->num_jobs; ++i)
+		if (se->jobs[i] == SESSION_JOB_FREE)
+			return i;
+
+	return -1;
+}
+
+/**
+ * Counts the unassigned jobs over every session.
+ * @param  t A pointer to the session_table.
+ * @return   The number of unassigned jobs.
+ */
+uint32_t session_count_free(const session_table *t)
+{
+	uint32_t result = 0;
+
+	for (uint8_t i=0; i<t->num_sessions; ++i)
+		for (uint32_t x=0; x<t->sessions[i].num_jobs; ++x)
+			if (t->sessions[i].jobs[x] == SESSION_JOB_FREE)
+				++result;
+
+	return result;
+}
+
+/**
+ * Determines if every job of every session has its results.
+ * @param  t A pointer to the session_table.
+ * @return   True if all sessions are complete.
+ */
+bool session_all_done(const session_table *t)
+{
+	for (uint8_t i=0; i<t->num_sessions; ++i)
+		if (t->sessions[i].done < t->sessions[i].num_jobs)
+			return false;
+
+	return true;
+}
+
+/**
+ * Marks a job as given to a worker.
+ * @param se  A pointer to the session.
+ * @param job The job number within the session.
+ */
+void session_assign(session *se, const uint32_t job)
+{
+	se->jobs[job] = SESSION_JOB_ASSIGNED;
+	se->served++;
+}
+
+/**
+ * Releases an assigned job back to the session so it is dispatched again.
+ * @param se  A pointer to the session.
+ * @param job The job number within the session.
+ */
+void session_release(session *se, const uint32_t job)
+{
+	if (se->jobs[job] != SESSION_JOB_ASSIGNED)
+		return;
+
+	se->jobs[job] = SESSION_JOB_FREE;
+	if (se->served > 0)
+		se->served--;
+}
+
+/**
+ * Stores digits of a job that hasn't finished yet. They are kept if the job
+ * is released, so whichever worker takes it next can skip them. Digits that
+ * would leave a gap after those already known are ignored.
+ * @param se        A pointer to the session.
+ * @param job       The job number within the session.
+ * @param first     The index of the first digit within the job, starting from 0.
+ * @param digits    A pointer to the digits.
+ * @param count     The number of digits.
+ * @param step_size The number of digits in the job.
+ */
+void session_store_digits(session *se, const uint32_t job, const uint8_t first, const uint8_t *digits, const uint8_t count, const uint8_t step_size)
+{
+	if (se->jobs[job] == SESSION_JOB_DONE || first > se->partial[job] || first + count > step_size)
+		return;
+
+	for (uint8_t i=0; i<count; ++i)
+		bcd_set(se->results, job * step_size + first + i, digits[i]);
+	if (first + count > se->partial[job])
+		se->partial[job] = first + count;
+}
+
+/**
+ * Stores the last digits of a finished job and marks it done.
+ * @param  se        A pointer to the session.
+ * @param  job       The job number within the session.
+ * @param  first     The index of the first digit given, starting from 0.
+ * @param  digits    A pointer to the rest of the job's digits.
+ * @param  count     The number of digits given.
+ * @param  step_size The number of digits in the job.
+ * @return           False if some of the job's digits are still missing.
+ */
+bool session_complete(session *se, const uint32_t job, const uint8_t first, const uint8_t *digits, const uint8_t count, const uint8_t step_size)
+{
+	if (se->jobs[job] == SESSION_JOB_DONE)
+		return true;
+
+	session_store_digits(se, job, first, digits, count, step_size);
+	if (se->partial[job] < step_size)
+		return false;
+
+	se->jobs[job] = SESSION_JOB_DONE;
+	se->done++;
+	return true;
+}
+
+/**
+ * Converts a session's job number to the job index ordered from a worker.
+ * @param  se  A pointer to the session.
+ * @param  job The job number within the session.
+ * @return     The global job index.
+ */
+uint32_t session_wire_job(const session *se, const uint32_t job)
+{
+	return se->first_job + job;
+}
+
+/**
+ * Gets a computed digit of a session.
+ * @param  se  A pointer to the session.
+ * @param  idx The index of the digit within the session, starting from 0.
+ * @return     The digit.
+ */
+uint8_t session_digit(const session *se, const uint32_t idx)
+{
+	return bcd_get(se->results, idx);
+}
@@ -0,0 +1,71 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "bcd.h"
+
+#define SESSION_MAX 8
+#define SESSION_NAME_LEN 16
+//Job indexes travel to the slaves as a single byte.
+#define SESSION_MAX_JOBS 256
+#define SESSION_MAX_STEP 32
+
+#define SESSION_JOB_FREE 0x0
+#define SESSION_JOB_ASSIGNED 0x1
+#define SESSION_JOB_DONE 0x2
+
+typedef enum
+{
+	SESSION_TYPE_PI_DIGITS
+} SESSION_TYPE;
+
+typedef enum
+{
+	SESSION_POLICY_FAIR,
+	SESSION_POLICY_EDF
+} SESSION_POLICY;
+
+typedef struct
+{
+	uint8_t id;
+	char name[SESSION_NAME_LEN];
+	SESSION_TYPE type;
+	//The first job's global index; job n computes digits from (first_job + n) * step + 1.
+	uint32_t first_job;
+	uint32_t num_jobs;
+	uint32_t weight;
+	//Milliseconds after the table was started, or 0 for no deadline.
+	uint64_t deadline_ms;
+	uint64_t served;
+	uint32_t done;
+	uint8_t jobs[SESSION_MAX_JOBS];
+	//How many leading digits of each job are already stored.
+	uint8_t partial[SESSION_MAX_JOBS];
+	//Packed BCD, two digits a byte.
+	uint8_t results[BCD_BYTES(SESSION_MAX_JOBS * SESSION_MAX_STEP)];
+} session;
+
+typedef struct
+{
+	uint8_t num_sessions;
+	uint8_t step_size;
+	SESSION_POLICY policy;
+	session sessions[SESSION_MAX];
+} session_table;
+
+void session_table_init(session_table *t, const uint8_t step_size, const SESSION_POLICY policy);
+session *session_add(session_table *t, const char *name, const uint32_t first_digit, const uint32_t num_digits, const uint32_t weight, const uint64_t deadline_ms);
+bool session_add_spec(session_table *t, const char *spec);
+session *session_get(session_table *t, const uint8_t id);
+session *session_pick(session_table *t);
+int session_job_next(const session *se);
+uint32_t session_count_free(const session_table *t);
+bool session_all_done(const session_table *t);
+void session_assign(session *se, const uint32_t job);
+void session_release(session *se, const uint32_t job);
+void session_store_digits(session *se, const uint32_t job, const uint8_t first, const uint8_t *digits, const uint8_t count, const uint8_t step_size);
+bool session_complete(session *se, const uint32_t job, const uint8_t first, const uint8_t *digits, const uint8_t count, const uint8_t step_size);
+uint32_t session_wire_job(const session *se, const uint32_t job);
+uint8_t session_digit(const session *se, const uint32_t idx);
+
+#endif
@@ -0,0 +1,5 @@
+#!/bin/bash
+cd ../
+mkdir -p bin/
+gcc -O2 tools/trace-replay.c session.c scheduler.c bcd.c efp.c i2c.c transport.c bus.c trace.c fault.c -o bin/trace-replay -lpthread
+cd tools/
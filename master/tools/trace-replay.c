@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "../trace.h"
+#include "../scheduler.h"
+#include "../session.h"
+#include "../efp.h"
+
+//Reads a trace recorded by the master, reports what the bus and workers did,
+//then replays the run: the same workers, with the job times they were
+//recorded at, dispatched by the master's session and scheduler code. Run it
+//before and after a scheduler change to compare them on a real trace.
+
+#define REPLAY_MAX_WORKERS 64
+#define REPLAY_MAX_JOBS 4096
+#define REPLAY_MAX_STALLS 20
+
+typedef struct
+{
+	char name[TRACE_BYTES + 1];
+	uint8_t type;
+	bool seen;
+	//What the worker did while recorded.
+	uint32_t transactions;
+	uint32_t failed;
+	uint64_t bus_us;
+	uint32_t cmd_count[EFP_CMD_COUNT];
+	uint64_t cmd_us[EFP_CMD_COUNT];
+	uint32_t cmd_max_us[EFP_CMD_COUNT];
+	uint32_t ordered;
+	uint32_t order_failed;
+	uint32_t dropped;
+	uint8_t outstanding;
+	uint8_t depth;
+	//How long each job it finished was at the front of its queue.
+	uint32_t job_us[REPLAY_MAX_JOBS];
+	uint32_t num_jobs;
+	//Where the replay has got to.
+	uint32_t next_job;
+	uint64_t busy_until_us;
+	uint32_t replayed;
+} replay_worker;
+
+static replay_worker workers[REPLAY_MAX_WORKERS];
+static uint8_t num_workers;
+static uint32_t session_jobs[SESSION_MAX];
+
+/**
+ * Reads a trace file and tallies it up per worker, printing the slowest
+ * transactions as it goes.
+ * @param  path     The trace file path.
+ * @param  stall_us Transactions taking at least this long are printed.
+ * @param  span_us  A pointer used to store the time from the first order to the last finished job.
+ * @return          True if the file could be read.
+ */
+static bool replay_read(const char *path, const uint32_t stall_us, uint64_t *span_us)
+{
+	FILE *f = fopen(path, "rb");
+	trace_header header;
+	trace_record rec;
+	uint64_t first_us = 0, last_us = 0;
+	uint32_t stalls = 0;
+
+	if (f == NULL || fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != TRACE_VERSION || header.record_size != sizeof(trace_record))
+	{
+		printf("%s is not a trace this tool can read\n", path);
+		if (f != NULL)
+			fclose(f);
+		return false;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1)
+	{
+		if (rec.worker >= REPLAY_MAX_WORKERS)
+			continue;
+
+		replay_worker *w = &workers[rec.worker];
+		if (rec.worker >= num_workers)
+			num_workers = rec.worker +1;
+
+		switch (rec.kind)
+		{
+			case TRACE_WORKER:
+				memcpy(w->name, rec.bytes, rec.len);
+				w->name[rec.len] = '\0';
+				w->type = rec.cmd;
+				w->seen = true;
+			break;
+			case TRACE_BUS:
+				w->transactions++;
+				w->bus_us += rec.latency_us;
+				if (! rec.ok)
+					w->failed++;
+				if (rec.cmd < EFP_CMD_COUNT)
+				{
+					w->cmd_count[rec.cmd]++;
+					w->cmd_us[rec.cmd] += rec.latency_us;
+					if (rec.latency_us > w->cmd_max_us[rec.cmd])
+						w->cmd_max_us[rec.cmd] = rec.latency_us;
+				}
+				if (rec.latency_us >= stall_us && stalls++ < REPLAY_MAX_STALLS)
+					printf("Stall at %.3fs: worker %u, %s, %u bytes written, %u read, %uus%s\n", rec.time_us / 1e6, rec.worker,
+						rec.cmd < EFP_CMD_COUNT ? efp_get_cmd_str(rec.cmd) : "no command", rec.write_len, rec.read_len, rec.latency_us, rec.ok ? "" : ", failed");
+			break;
+			case TRACE_JOB_ORDERED:
+				if (! rec.ok)
+				{
+					w->order_failed++;
+					break;
+				}
+				if (first_us == 0)
+					first_us = rec.time_us;
+				w->ordered++;
+				if (++w->outstanding > w->depth)
+					w->depth = w->outstanding;
+				if (rec.session_id < SESSION_MAX && rec.job +1 > session_jobs[rec.session_id])
+					session_jobs[rec.session_id] = rec.job +1;
+			break;
+			case TRACE_JOB_DONE:
+				if (w->outstanding > 0)
+					w->outstanding--;
+				if (w->num_jobs < REPLAY_MAX_JOBS)
+					w->job_us[w->num_jobs++] = rec.latency_us;
+				last_us = rec.time_us;
+			break;
+			case TRACE_JOB_DROPPED:
+				if (w->outstanding > 0)
+					w->outstanding--;
+				w->dropped++;
+			break;
+		}
+	}
+
+	if (stalls > REPLAY_MAX_STALLS)
+		printf("... and %u more stalls\n", stalls - REPLAY_MAX_STALLS);
+
+	*span_us = last_us > first_us ? last_us - first_us : 0;
+	fclose(f);
+	return true;
+}
+
+/**
+ * Prints what each worker did while recorded.
+ */
+static void replay_print_workers()
+{
+	for (uint8_t i=0; i<num_workers; ++i)
+	{
+		replay_worker *w = &workers[i];
+		uint64_t job_us = 0;
+
+		if (! w->seen)
+			continue;
+
+		for (uint32_t x=0; x<w->num_jobs; ++x)
+			job_us += w->job_us[x];
+
+		printf("%s: %u jobs done, %u dropped, %u orders failed, mean job %.1fms, queue depth %u\n", w->name, w->num_jobs, w->dropped, w->order_failed,
+			w->num_jobs > 0 ? job_us / 1e3 / w->num_jobs : 0.0, w->depth);
+		if (w->transactions == 0)
+			continue;
+
+		printf("  %u transactions, %u failed, %.3fs on the bus\n", w->transactions, w->failed, w->bus_us / 1e6);
+		for (uint8_t cmd=0; cmd<EFP_CMD_COUNT; ++cmd)
+			if (w->cmd_count[cmd] > 0)
+				printf("  %-12s %6u transactions, mean %6lluus, max %6uus\n", efp_get_cmd_str(cmd), w->cmd_count[cmd],
+					(unsigned long long)(w->cmd_us[cmd] / w->cmd_count[cmd]), w->cmd_max_us[cmd]);
+	}
+}
+
+/**
+ * Gets a worker's mean recorded job time.
+ * @param  w A pointer to the worker.
+ * @return   The mean in microseconds, or 0 if it finished no jobs.
+ */
+static uint64_t replay_mean_job_us(const replay_worker *w)
+{
+	uint64_t total = 0;
+
+	for (uint32_t i=0; i<w->num_jobs; ++i)
+		total += w->job_us[i];
+	return w->num_jobs > 0 ? total / w->num_jobs : 0;
+}
+
+/**
+ * Gets how long it took to place an order with a worker, so an idle
+ * worker's next job starts that much after it is dispatched.
+ * @param  w A pointer to the worker.
+ * @return   The mean time of an ORDER transaction in microseconds.
+ */
+static uint64_t replay_order_us(const replay_worker *w)
+{
+	return w->cmd_count[EFP_CMD_ORDER] > 0 ? w->cmd_us[EFP_CMD_ORDER] / w->cmd_count[EFP_CMD_ORDER] : 0;
+}
+
+/**
+ * Decides whether a worker takes one of the last jobs, as the master's
+ * worker_should_take_tail does, from the workers' recorded job times.
+ * @param  s    A pointer to the scheduler.
+ * @param  t    A pointer to the session table.
+ * @param  idx  The worker's index.
+ * @return      True if the worker should be given work.
+ */
+static bool replay_take_tail(scheduler *s, const session_table *t, const uint8_t idx)
+{
+	uint64_t own_finish, best_finish = 0;
+
+	if (session_count_free(t) >= s->num_workers || replay_mean_job_us(&workers[idx]) == 0)
+		return true;
+
+	own_finish = (uint64_t)(s->slaves[idx]->queue_len +1) * replay_mean_job_us(&workers[idx]);
+	for (uint8_t i=0; i<s->num_workers; ++i)
+	{
+		uint64_t mean = replay_mean_job_us(&workers[i]);
+		if (i == idx || mean == 0)
+			continue;
+
+		uint64_t finish = (uint64_t)(s->slaves[i]->queue_len +1) * mean;
+		if (best_finish == 0 || finish < best_finish)
+			best_finish = finish;
+	}
+
+	return best_finish == 0 || own_finish <= 2 * best_finish;
+}
+
+/**
+ * Replays the recorded jobs. Each worker takes its recorded job times in
+ * order, starting over when it runs out. It starts its next job as soon as
+ * the last one is done, or once the order has gone through if it was idle.
+ * @param  step_size The number of digits in a job.
+ * @param  depth     The queue depth to give every worker, or 0 for what each was recorded with.
+ * @param  policy    How workers are shared between sessions.
+ * @return           The time the replayed run took, in microseconds.
+ */
+static uint64_t replay_run(const uint8_t step_size, const uint8_t depth, const SESSION_POLICY policy)
+{
+	session_table t;
+	scheduler s = scheduler_create(num_workers, 0);
+	uint8_t digits[SESSION_MAX_STEP];
+	uint64_t now_us = 0;
+	char name[SESSION_NAME_LEN];
+
+	memset(digits, 0, sizeof(digits));
+	session_table_init(&t, step_size, policy);
+	for (uint8_t i=0; i<SESSION_MAX; ++i)
+	{
+		if (session_jobs[i] == 0)
+			continue;
+		sprintf(name, "session%u", i);
+		session_add(&t, name, 1, session_jobs[i] * step_size, 1, 0);
+	}
+
+	for (uint8_t i=0; i<num_workers; ++i)
+	{
+		scheduler_set_enabled(s.slaves[i], workers[i].seen && workers[i].num_jobs > 0);
+		scheduler_set_queue_depth(s.slaves[i], depth > 0 ? depth : (workers[i].depth > 0 ? workers[i].depth : 1));
+		workers[i].next_job = 0;
+		workers[i].busy_until_us = 0;
+		workers[i].replayed = 0;
+	}
+
+	while (! session_all_done(&t))
+	{
+		uint64_t next_us = 0;
+		int16_t next = -1;
+
+		//Top every queue up, as the master's dispatcher does.
+		for (uint8_t i=0; i<num_workers; ++i)
+		{
+			slave *sl = s.slaves[i];
+
+			while (sl->enabled && ! sl->busy && replay_take_tail(&s, &t, i))
+			{
+				session *se = session_pick(&t);
+				if (se == NULL)
+					break;
+
+				int job = session_job_next(se);
+				if (sl->queue_len == 0)
+					workers[i].busy_until_us = now_us + replay_order_us(&workers[i]) + workers[i].job_us[workers[i].next_job++ % workers[i].num_jobs];
+				scheduler_push_job(sl, se->id, job, 0, EFP_NO_LEASE);
+				session_assign(se, job);
+			}
+
+			if (sl->queue_len > 0 && (next < 0 || workers[i].busy_until_us < next_us))
+			{
+				next = i;
+				next_us = workers[i].busy_until_us;
+			}
+		}
+
+		if (next < 0)
+			break;
+
+		//The worker hands in its front job and moves on to the next.
+		slave *sl = s.slaves[next];
+		now_us = next_us;
+		session_complete(session_get(&t, sl->queue_session[0]), sl->queue_idx[0], 0, digits, step_size, step_size);
+		scheduler_pop_job(sl);
+		workers[next].replayed++;
+		if (sl->queue_len > 0)
+			workers[next].busy_until_us = now_us + workers[next].job_us[workers[next].next_job++ % workers[next].num_jobs];
+	}
+
+	scheduler_destroy(&s);
+	return now_us;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	uint8_t step_size = 5, depth = 0;
+	uint32_t stall_us = 10000;
+	SESSION_POLICY policy = SESSION_POLICY_FAIR;
+	uint64_t span_us, replay_us;
+	uint32_t total_jobs = 0;
+
+	//-j sets the digits in a job, -q the queue depth the replay gives every
+	//worker, -p the session policy and -s how slow a transaction is a stall.
+	while ((opt = getopt(argc, argv, "j:q:p:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'j':
+				step_size = atoi(optarg);
+				break;
+			case 'q':
+				depth = atoi(optarg);
+				break;
+			case 'p':
+				policy = strcmp(optarg, "edf") == 0 ? SESSION_POLICY_EDF : SESSION_POLICY_FAIR;
+				break;
+			case 's':
+				stall_us = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if (optind != argc -1 || step_size == 0 || step_size > SESSION_MAX_STEP || depth > SCHEDULER_MAX_QUEUE_DEPTH)
+	{
+		printf("Usage: %s [-j digits_per_job] [-q queue_depth] [-p fair|edf] [-s stall_us] trace_file\n", argv[0]);
+		return 1;
+	}
+
+	if (! replay_read(argv[optind], stall_us, &span_us))
+		return 1;
+
+	replay_print_workers();
+	for (uint8_t i=0; i<SESSION_MAX; ++i)
+		total_jobs += session_jobs[i];
+	if (total_jobs == 0 || span_us == 0)
+	{
+		printf("No finished jobs to replay\n");
+		return 0;
+	}
+
+	replay_us = replay_run(step_size, depth, policy);
+
+	printf("\nRecorded: %u jobs in %.3fs, %.1f digits/s\n", total_jobs, span_us / 1e6, total_jobs * step_size / (span_us / 1e6));
+	printf("Replayed: %u jobs in %.3fs, %.1f digits/s\n", total_jobs, replay_us / 1e6, replay_us > 0 ? total_jobs * step_size / (replay_us / 1e6) : 0.0);
+	for (uint8_t i=0; i<num_workers; ++i)
+		if (workers[i].seen && workers[i].num_jobs > 0)
+			printf("  %s: %u jobs\n", workers[i].name, workers[i].replayed);
+
+	return 0;
+}
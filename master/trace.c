@@ -0,0 +1,279 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+//A bounded multi-producer ring. Each slot's sequence number says whose turn
+//it is: a producer may fill slot pos once it reads pos, and the flusher may
+//take it once it reads pos +1.
+static trace_slot ring[TRACE_RING_SIZE];
+static _Atomic(uint64_t) ring_head;
+static uint64_t ring_tail;
+static _Atomic(uint64_t) dropped;
+static atomic_bool recording;
+
+static FILE *trace_file;
+static uint64_t started_us;
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static bool flusher_running;
+
+/**
+ * Reads a monotonic clock.
+ * @return The current time in microseconds.
+ */
+uint64_t trace_now_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Starts recording to a file, replacing whatever it held. A trace already
+ * being recorded is closed first.
+ * @param  path The trace file path.
+ * @return      True if recording started.
+ */
+bool trace_open(const char *path)
+{
+	trace_header header;
+
+	trace_close();
+	if ((trace_file = fopen(path, "wb")) == NULL)
+		return false;
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(trace_record);
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+	{
+		fclose(trace_file);
+		return false;
+	}
+
+	for (uint32_t i=0; i<TRACE_RING_SIZE; ++i)
+		atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+	atomic_store(&ring_head, 0);
+	ring_tail = 0;
+	atomic_store(&dropped, 0);
+	started_us = trace_now_us();
+
+	flusher_running = true;
+	if (pthread_create(&flusher, NULL, trace_thread, NULL) != 0)
+	{
+		fclose(trace_file);
+		return false;
+	}
+
+	atomic_store(&recording, true);
+	return true;
+}
+
+/**
+ * Stops recording, writing out everything recorded so far.
+ */
+void trace_close()
+{
+	if (! atomic_exchange(&recording, false))
+		return;
+
+	pthread_mutex_lock(&flusher_lock);
+	flusher_running = false;
+	pthread_cond_signal(&flusher_wake);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+
+	trace_flush();
+	fclose(trace_file);
+}
+
+/**
+ * Puts a record in the ring, or counts it as dropped if the ring is full.
+ * Safe to call from any number of threads at once, and never blocks.
+ * @param rec A pointer to the record, which is copied.
+ */
+static void trace_push(const trace_record *rec)
+{
+	uint64_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	trace_slot *slot;
+
+	while (1)
+	{
+		slot = &ring[pos & (TRACE_RING_SIZE -1)];
+		int64_t turn = (int64_t)atomic_load_explicit(&slot->seq, memory_order_acquire) - (int64_t)pos;
+
+		if (turn == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos +1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (turn < 0)
+		{
+			//The flusher hasn't taken this slot yet from the last lap.
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	}
+
+	slot->rec = *rec;
+	atomic_store_explicit(&slot->seq, pos +1, memory_order_release);
+}
+
+/**
+ * Writes out the records in the ring, in the order they were claimed. Must
+ * only be called from one thread at a time.
+ * @return True if the file took every record.
+ */
+static bool trace_flush()
+{
+	bool ok = true;
+
+	while (1)
+	{
+		trace_slot *slot = &ring[ring_tail & (TRACE_RING_SIZE -1)];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring_tail +1)
+			break;
+
+		if (fwrite(&slot->rec, sizeof(trace_record), 1, trace_file) != 1)
+			ok = false;
+		atomic_store_explicit(&slot->seq, ring_tail + TRACE_RING_SIZE, memory_order_release);
+		ring_tail++;
+	}
+
+	fflush(trace_file);
+	return ok;
+}
+
+/**
+ * The flusher thread. Writes the ring out every TRACE_FLUSH_MS.
+ * @param  arg Unused.
+ * @return     NULL.
+ */
+static void *trace_thread(void *arg)
+{
+	struct timespec until;
+
+	pthread_mutex_lock(&flusher_lock);
+	while (flusher_running)
+	{
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += (long)TRACE_FLUSH_MS * 1000000;
+		until.tv_sec += until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until);
+
+		pthread_mutex_unlock(&flusher_lock);
+		trace_flush();
+		pthread_mutex_lock(&flusher_lock);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+
+	return NULL;
+}
+
+/**
+ * Records a transaction with a slave.
+ * @param worker   The index of the worker the slave is.
+ * @param cmd      The EFP command the transaction was part of, or TRACE_NO_CMD.
+ * @param start_us When the transaction started, from trace_now_us.
+ * @param ok       Whether every byte went through.
+ * @param src      A pointer to the bytes written, or NULL.
+ * @param src_len  The number of bytes written.
+ * @param des      A pointer to the bytes read, or NULL.
+ * @param des_len  The number of bytes read.
+ */
+void trace_bus(const uint8_t worker, const uint8_t cmd, const uint64_t start_us, const bool ok, const uint8_t *src, const uint8_t src_len, const uint8_t *des, const uint8_t des_len)
+{
+	trace_record rec;
+	const uint8_t *bytes = src_len > 0 ? src : des;
+	uint8_t len = src_len > 0 ? src_len : des_len;
+
+	if (! atomic_load_explicit(&recording, memory_order_relaxed))
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time_us = start_us - started_us;
+	rec.latency_us = trace_now_us() - start_us;
+	rec.kind = TRACE_BUS;
+	rec.worker = worker;
+	rec.cmd = cmd;
+	rec.ok = ok;
+	rec.write_len = src_len;
+	rec.read_len = des_len;
+	rec.len = len < TRACE_BYTES ? len : TRACE_BYTES;
+	if (bytes != NULL)
+		memcpy(rec.bytes, bytes, rec.len);
+
+	trace_push(&rec);
+}
+
+/**
+ * Records a worker joining, so a trace can be read without the run's log.
+ * @param worker The worker's index.
+ * @param type   The worker's SCHEDULER_WORKER type.
+ * @param name   The worker's name. Only the first TRACE_BYTES characters are kept.
+ */
+void trace_worker(const uint8_t worker, const uint8_t type, const char *name)
+{
+	trace_record rec;
+
+	if (! atomic_load_explicit(&recording, memory_order_relaxed))
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time_us = trace_now_us() - started_us;
+	rec.kind = TRACE_WORKER;
+	rec.worker = worker;
+	rec.cmd = type;
+	rec.ok = true;
+	rec.len = strlen(name) < TRACE_BYTES ? strlen(name) : TRACE_BYTES;
+	memcpy(rec.bytes, name, rec.len);
+
+	trace_push(&rec);
+}
+
+/**
+ * Records something that happened to a job on a worker.
+ * @param kind       TRACE_JOB_ORDERED, TRACE_JOB_DONE or TRACE_JOB_DROPPED.
+ * @param worker     The worker's index.
+ * @param session_id The session the job belongs to.
+ * @param job        The job number within the session.
+ * @param ok         The outcome.
+ * @param latency_us How long the job took, for TRACE_JOB_DONE.
+ */
+void trace_job(const TRACE_KIND kind, const uint8_t worker, const uint8_t session_id, const uint32_t job, const bool ok, const uint32_t latency_us)
+{
+	trace_record rec;
+
+	if (! atomic_load_explicit(&recording, memory_order_relaxed))
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time_us = trace_now_us() - started_us;
+	rec.latency_us = latency_us;
+	rec.job = job;
+	rec.kind = kind;
+	rec.worker = worker;
+	rec.cmd = TRACE_NO_CMD;
+	rec.ok = ok;
+	rec.session_id = session_id;
+
+	trace_push(&rec);
+}
+
+/**
+ * Gets the number of records lost to a full ring since the trace opened.
+ * @return The number of records.
+ */
+uint64_t trace_get_dropped()
+{
+	return atomic_load(&dropped);
+}
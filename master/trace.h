@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <pthread.h>
+
+//A binary record of every transaction with the slaves and of every job
+//handed to a worker. Recording never blocks: records go into a lock-free
+//ring, and a thread of its own writes them out to the trace file. Should
+//the ring fill up, records are dropped and counted instead.
+//
+//The file is a trace_header followed by trace_records, in the byte order
+//of the master. tools/trace-replay reads it back.
+#define TRACE_MAGIC "DCAT"
+#define TRACE_VERSION 0x1
+#define TRACE_DEFAULT_PATH "dca.trace"
+
+//Must be a power of two.
+#define TRACE_RING_SIZE 4096
+#define TRACE_FLUSH_MS 100
+
+//How many of a transaction's bytes are kept: the start of what was
+//written, or of what was read back if nothing was.
+#define TRACE_BYTES 8
+
+#define TRACE_NO_CMD 0xff
+#define TRACE_NO_WORKER 0xff
+
+typedef enum
+{
+	//A transaction with a slave. cmd is the EFP command it was part of.
+	TRACE_BUS,
+	//A worker joined; bytes holds its name and cmd its SCHEDULER_WORKER type.
+	TRACE_WORKER,
+	//A job was queued on a worker, or the order failed.
+	TRACE_JOB_ORDERED,
+	//A worker handed in a finished job. latency_us is how long it was at
+	//the front of the worker's queue.
+	TRACE_JOB_DONE,
+	//A worker's jobs were given up on and went back to the queue.
+	TRACE_JOB_DROPPED
+} TRACE_KIND;
+
+typedef struct
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t record_size;
+} trace_header;
+
+typedef struct
+{
+	//Microseconds since the trace was opened.
+	uint64_t time_us;
+	uint32_t latency_us;
+	//The job index of job records.
+	uint32_t job;
+	uint8_t kind;
+	uint8_t worker;
+	uint8_t cmd;
+	uint8_t ok;
+	uint8_t write_len;
+	uint8_t read_len;
+	uint8_t session_id;
+	uint8_t len;
+	uint8_t bytes[TRACE_BYTES];
+} trace_record;
+
+typedef struct
+{
+	_Atomic(uint64_t) seq;
+	trace_record rec;
+} trace_slot;
+
+bool trace_open(const char *path);
+void trace_close();
+uint64_t trace_now_us();
+void trace_bus(const uint8_t worker, const uint8_t cmd, const uint64_t start_us, const bool ok, const uint8_t *src, const uint8_t src_len, const uint8_t *des, const uint8_t des_len);
+void trace_worker(const uint8_t worker, const uint8_t type, const char *name);
+void trace_job(const TRACE_KIND kind, const uint8_t worker, const uint8_t session_id, const uint32_t job, const bool ok, const uint32_t latency_us);
+uint64_t trace_get_dropped();
+static void trace_push(const trace_record *rec);
+static bool trace_flush();
+static void *trace_thread(void *arg);
+
+#endif
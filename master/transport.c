@@ -0,0 +1,376 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "transport.h"
+#include "bus.h"
+
+static const transport_ops ops[TRANSPORT_TYPES] =
+{
+	[TRANSPORT_I2C] = { transport_i2c_open, transport_i2c_transact, transport_i2c_close },
+	[TRANSPORT_UNIX] = { transport_unix_open, transport_socket_transact, transport_fd_close },
+	[TRANSPORT_TCP] = { transport_tcp_open, transport_socket_transact, transport_fd_close }
+};
+
+/**
+ * Works out which transport a target specification names.
+ * @param  spec   The target, e.g. /dev/i2c-1, unix:/tmp/slave.sock or tcp:host:7000.
+ * @param  target A pointer used to store where the transport's own target starts.
+ * @return        The TRANSPORT_TYPE.
+ */
+TRANSPORT_TYPE transport_parse(const char *spec, const char **target)
+{
+	if (strncmp(spec, TRANSPORT_UNIX_PREFIX, strlen(TRANSPORT_UNIX_PREFIX)) == 0)
+	{
+		*target = spec + strlen(TRANSPORT_UNIX_PREFIX);
+		return TRANSPORT_UNIX;
+	}
+
+	if (strncmp(spec, TRANSPORT_TCP_PREFIX, strlen(TRANSPORT_TCP_PREFIX)) == 0)
+	{
+		*target = spec + strlen(TRANSPORT_TCP_PREFIX);
+		return TRANSPORT_TCP;
+	}
+
+	*target = spec;
+	return TRANSPORT_I2C;
+}
+
+/**
+ * Opens a transport to a slave.
+ * @param  t    A pointer to the transport.
+ * @param  spec The target specification, as for transport_parse.
+ * @param  addr The slave's 7-bit address.
+ * @return      A TRANSPORT_STATUS code.
+ */
+TRANSPORT_STATUS transport_open(transport *t, const char *spec, const uint8_t addr)
+{
+	t->fd = -1;
+	t->addr = addr;
+	t->bus = NULL;
+	t->bus_class = BUS_CLASS_POLL;
+	if (strlen(spec) >= TRANSPORT_TARGET_LEN)
+		return TRANSPORT_STATUS_ERR_TARGET;
+
+	strcpy(t->target, spec);
+	return transport_connect(t);
+}
+
+/**
+ * Opens the transport's target, leaving it closed if that fails.
+ * @param  t A pointer to the transport.
+ * @return   A TRANSPORT_STATUS code.
+ */
+static TRANSPORT_STATUS transport_connect(transport *t)
+{
+	const char *target;
+	TRANSPORT_STATUS result;
+
+	t->type = transport_parse(t->target, &target);
+	t->caps = 0x0;
+	if (*target == '\0')
+		return TRANSPORT_STATUS_ERR_TARGET;
+
+	result = ops[t->type].open(t, target);
+	if (result != TRANSPORT_STATUS_OK)
+		transport_close(t);
+	return result;
+}
+
+/**
+ * Writes bytes to the slave and then reads bytes back. Either part may be
+ * empty. Where the transport has TRANSPORT_CAP_COMBINED both parts go out
+ * as one transaction; otherwise they are separate. A socket that failed is
+ * connected again first.
+ * @param  t       A pointer to the transport.
+ * @param  src     A pointer to src_len bytes to write, or NULL.
+ * @param  src_len The number of bytes to write.
+ * @param  des     A pointer to des_len bytes used to store what was read, or NULL.
+ * @param  des_len The number of bytes to read.
+ * @return         True if every byte went through, otherwise false.
+ */
+bool transport_transact(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len)
+{
+	//Sockets come back once the slave is listening again.
+	if (t->fd < 0 && (t->type == TRANSPORT_I2C || transport_connect(t) != TRANSPORT_STATUS_OK))
+		return false;
+
+	if (ops[t->type].transact(t, src, src_len, des, des_len))
+		return true;
+
+	if (t->type != TRANSPORT_I2C)
+		transport_close(t);
+	return false;
+}
+
+/**
+ * Writes bytes to the general call address over the slave's transport,
+ * instead of to the slave's own address.
+ * @param  t       A pointer to the transport.
+ * @param  src     A pointer to src_len bytes to write.
+ * @param  src_len The number of bytes to write.
+ * @return         True if every byte went through, i.e. some slave answered.
+ */
+bool transport_broadcast(transport *t, const uint8_t *src, const uint8_t src_len)
+{
+	uint8_t addr = t->addr;
+	bool ok;
+
+	t->addr = TRANSPORT_GENERAL_CALL_ADDR;
+	ok = transport_transact(t, src, src_len, NULL, 0);
+	t->addr = addr;
+
+	return ok;
+}
+
+/**
+ * Gets what a transport can do.
+ * @param  t A pointer to the transport.
+ * @return   The TRANSPORT_CAP bits.
+ */
+uint32_t transport_caps(const transport *t)
+{
+	return t->caps;
+}
+
+/**
+ * Closes a transport. Closing one that never opened does nothing.
+ * @param t A pointer to the transport.
+ */
+void transport_close(transport *t)
+{
+	if (t->fd < 0)
+		return;
+
+	ops[t->type].close(t);
+	t->fd = -1;
+}
+
+/**
+ * Converts a TRANSPORT_TYPE to a readable name.
+ * @param  type The TRANSPORT_TYPE.
+ * @return      The name.
+ */
+const char *transport_get_type_str(const TRANSPORT_TYPE type)
+{
+	switch (type)
+	{
+		case TRANSPORT_I2C:
+			return "i2c";
+			break;
+		case TRANSPORT_UNIX:
+			return "unix";
+			break;
+		case TRANSPORT_TCP:
+			return "tcp";
+			break;
+		default:
+			return "unknown";
+	}
+}
+
+/**
+ * Opens an I2C adapter, shared with the other slaves on it, and checks the
+ * slave can be addressed on it.
+ * @param  t      A pointer to the transport.
+ * @param  target The adapter's device path.
+ * @return        A TRANSPORT_STATUS code.
+ */
+static TRANSPORT_STATUS transport_i2c_open(transport *t, const char *target)
+{
+	if ((t->bus = bus_open(target)) == NULL)
+		return TRANSPORT_STATUS_ERR_OPEN;
+	t->fd = t->bus->fd;
+
+	//An empty transaction only sets the slave address.
+	if (! bus_transact(t->bus, t->addr, BUS_CLASS_POLL, NULL, 0, NULL, 0))
+		return TRANSPORT_STATUS_ERR_SETUP;
+
+	if (t->bus->combined)
+		t->caps |= TRANSPORT_CAP_COMBINED;
+
+	return TRANSPORT_STATUS_OK;
+}
+
+/**
+ * Carries out a transaction on the slave's I2C adapter, once it is the
+ * transaction's turn.
+ * @param  t       A pointer to the transport.
+ * @param  src     A pointer to src_len bytes to write, or NULL.
+ * @param  src_len The number of bytes to write.
+ * @param  des     A pointer to des_len bytes used to store what was read, or NULL.
+ * @param  des_len The number of bytes to read.
+ * @return         True if every byte went through, otherwise false.
+ */
+static bool transport_i2c_transact(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len)
+{
+	return bus_transact(t->bus, t->addr, t->bus_class, src, src_len, des, des_len);
+}
+
+/**
+ * Connects to a slave listening on a Unix domain socket.
+ * @param  t      A pointer to the transport.
+ * @param  target The socket's path.
+ * @return        A TRANSPORT_STATUS code.
+ */
+static TRANSPORT_STATUS transport_unix_open(transport *t, const char *target)
+{
+	struct sockaddr_un sa;
+
+	if (strlen(target) >= sizeof(sa.sun_path))
+		return TRANSPORT_STATUS_ERR_TARGET;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, target);
+
+	if ((t->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return TRANSPORT_STATUS_ERR_OPEN;
+	if (connect(t->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return TRANSPORT_STATUS_ERR_OPEN;
+
+	return transport_socket_setup(t) ? TRANSPORT_STATUS_OK : TRANSPORT_STATUS_ERR_SETUP;
+}
+
+/**
+ * Connects to a slave listening on a TCP port.
+ * @param  t      A pointer to the transport.
+ * @param  target The host and port, separated by the last colon.
+ * @return        A TRANSPORT_STATUS code.
+ */
+static TRANSPORT_STATUS transport_tcp_open(transport *t, const char *target)
+{
+	char host[TRANSPORT_TARGET_LEN];
+	struct addrinfo hints, *found, *ai;
+	const char *port = strrchr(target, ':');
+	int flag = 1;
+
+	if (port == NULL || port == target || port[1] == '\0')
+		return TRANSPORT_STATUS_ERR_TARGET;
+
+	memcpy(host, target, port - target);
+	host[port - target] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port +1, &hints, &found) != 0)
+		return TRANSPORT_STATUS_ERR_TARGET;
+
+	for (ai = found; ai != NULL; ai = ai->ai_next)
+	{
+		if ((t->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		if (connect(t->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(t->fd);
+		t->fd = -1;
+	}
+	freeaddrinfo(found);
+
+	if (t->fd < 0)
+		return TRANSPORT_STATUS_ERR_OPEN;
+
+	//Transactions are a few dozen bytes and wait on each other, so
+	//coalescing them only adds latency.
+	if (setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
+		return TRANSPORT_STATUS_ERR_SETUP;
+
+	return transport_socket_setup(t) ? TRANSPORT_STATUS_OK : TRANSPORT_STATUS_ERR_SETUP;
+}
+
+/**
+ * Sets up a connected socket for transactions. A slave that stops
+ * answering fails the transaction instead of hanging its driver thread.
+ * @param  t A pointer to the transport.
+ * @return   True if the socket could be set up.
+ */
+static bool transport_socket_setup(transport *t)
+{
+	struct timeval timeout;
+
+	timeout.tv_sec = TRANSPORT_SOCKET_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (TRANSPORT_SOCKET_TIMEOUT_MS % 1000) * 1000;
+
+	if (setsockopt(t->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+		setsockopt(t->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+		return false;
+
+	//Both halves of a transaction travel in one request, so they are
+	//always combined.
+	t->caps |= TRANSPORT_CAP_COMBINED;
+	return true;
+}
+
+/**
+ * Carries out a transaction with a slave over a socket.
+ * @param  t       A pointer to the transport.
+ * @param  src     A pointer to src_len bytes to write, or NULL.
+ * @param  src_len The number of bytes to write.
+ * @param  des     A pointer to des_len bytes used to store what was read, or NULL.
+ * @param  des_len The number of bytes to read.
+ * @return         True if every byte went through, otherwise false.
+ */
+static bool transport_socket_transact(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len)
+{
+	uint8_t request[TRANSPORT_SOCKET_HEADER + TRANSPORT_SOCKET_MAX];
+	uint32_t len = TRANSPORT_SOCKET_HEADER + src_len;
+	uint32_t done = 0;
+
+	request[TRANSPORT_SOCKET_ADDR_BYTE] = t->addr;
+	request[TRANSPORT_SOCKET_WRITE_LEN_BYTE] = src_len;
+	request[TRANSPORT_SOCKET_READ_LEN_BYTE] = des_len;
+	if (src_len > 0)
+		memcpy(request + TRANSPORT_SOCKET_HEADER, src, src_len);
+
+	//Never raise SIGPIPE over a slave that went away.
+	while (done < len)
+	{
+		ssize_t sent = send(t->fd, request + done, len - done, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		done += sent;
+	}
+
+	for (done = 0; done < des_len; )
+	{
+		ssize_t got = recv(t->fd, des + done, des_len - done, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+
+	return true;
+}
+
+/**
+ * Lets go of the slave's I2C adapter.
+ * @param t A pointer to the transport.
+ */
+static void transport_i2c_close(transport *t)
+{
+	bus_release(t->bus);
+	t->bus = NULL;
+}
+
+/**
+ * Closes a transport's file descriptor.
+ * @param t A pointer to the transport.
+ */
+static void transport_fd_close(transport *t)
+{
+	close(t->fd);
+}
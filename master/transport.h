@@ -0,0 +1,95 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "bus.h"
+
+//A transport carries a slave's register traffic. The I2C transport reaches
+//boards through /dev/i2c-*. The socket transports reach slaves running as
+//processes, on the master or on other machines, so the cluster isn't bound
+//by the bandwidth of one bus. Slaves on the same adapter share it, see bus.h.
+//
+//Targets are a device path for I2C, unix:<path> or tcp:<host>:<port>.
+#define TRANSPORT_UNIX_PREFIX "unix:"
+#define TRANSPORT_TCP_PREFIX "tcp:"
+#define TRANSPORT_TARGET_LEN 64
+
+//On a socket every transaction is a header of slave address, write length
+//and read length, then the bytes to write. The slave answers with exactly
+//the read length in bytes. Writes and reads are the same bytes an I2C
+//master would send and receive, register select included.
+#define TRANSPORT_SOCKET_ADDR_BYTE 0x0
+#define TRANSPORT_SOCKET_WRITE_LEN_BYTE 0x1
+#define TRANSPORT_SOCKET_READ_LEN_BYTE 0x2
+#define TRANSPORT_SOCKET_HEADER 0x3
+#define TRANSPORT_SOCKET_MAX 0xff
+
+//How long a socket slave has to answer before the transaction fails. A
+//failed socket is closed, since a late answer would put it out of step,
+//and connected again on the next transaction.
+#define TRANSPORT_SOCKET_TIMEOUT_MS 1000
+
+//Writes to the general call address reach every slave that answers it: on
+//an I2C adapter every such slave on the bus, on a socket the slave at the
+//other end.
+#define TRANSPORT_GENERAL_CALL_ADDR 0x0
+
+//A write followed by a read can go out as one transaction, with nothing
+//from anyone else in between.
+#define TRANSPORT_CAP_COMBINED 0x1
+
+typedef enum
+{
+	TRANSPORT_STATUS_OK,
+	TRANSPORT_STATUS_ERR_TARGET,
+	TRANSPORT_STATUS_ERR_OPEN,
+	TRANSPORT_STATUS_ERR_SETUP
+} TRANSPORT_STATUS;
+
+typedef enum
+{
+	TRANSPORT_I2C,
+	TRANSPORT_UNIX,
+	TRANSPORT_TCP,
+	TRANSPORT_TYPES
+} TRANSPORT_TYPE;
+
+typedef struct
+{
+	TRANSPORT_TYPE type;
+	char target[TRANSPORT_TARGET_LEN];
+	int fd;
+	uint8_t addr;
+	uint32_t caps;
+	//The adapter an I2C transport shares with the other slaves on it, and
+	//the BUS_CLASS its next transaction waits for the adapter in.
+	i2c_bus *bus;
+	uint8_t bus_class;
+} transport;
+
+//What every kind of transport implements.
+typedef struct
+{
+	TRANSPORT_STATUS (*open)(transport *t, const char *target);
+	bool (*transact)(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len);
+	void (*close)(transport *t);
+} transport_ops;
+
+TRANSPORT_TYPE transport_parse(const char *spec, const char **target);
+TRANSPORT_STATUS transport_open(transport *t, const char *spec, const uint8_t addr);
+bool transport_transact(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len);
+bool transport_broadcast(transport *t, const uint8_t *src, const uint8_t src_len);
+uint32_t transport_caps(const transport *t);
+void transport_close(transport *t);
+const char *transport_get_type_str(const TRANSPORT_TYPE type);
+static TRANSPORT_STATUS transport_connect(transport *t);
+static TRANSPORT_STATUS transport_i2c_open(transport *t, const char *target);
+static bool transport_i2c_transact(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len);
+static TRANSPORT_STATUS transport_unix_open(transport *t, const char *target);
+static TRANSPORT_STATUS transport_tcp_open(transport *t, const char *target);
+static bool transport_socket_setup(transport *t);
+static bool transport_socket_transact(transport *t, const uint8_t *src, const uint8_t src_len, uint8_t *des, const uint8_t des_len);
+static void transport_i2c_close(transport *t);
+static void transport_fd_close(transport *t);
+
+#endif
@@ -15,11 +15,73 @@
 #define EFP_CMD_REGISTER_BYTE 0x0
 #define EFP_CMD_REGISTER_SLAVE_ACK_BYTE 0x1
 #define EFP_CMD_REGISTER_DATA_BYTE 0x2
+#define EFP_CMD_REGISTER_ARG_BYTE 0x3
 #define EFP_SLAVE_ADDR 0x10
 #define EFP_SLAVE_REGISTERS 0x2
 #define EFP_JOB_FACTOR 0x5
+//Results are kept and sent as packed BCD: two digits a byte, the earlier one
+//in the high nibble. Version 1 result blocks stay a digit a byte.
+#define EFP_RESULT_BYTES ((EFP_JOB_FACTOR + 1) / 2)
+#define EFP_DIGIT_FILL 0xf
+#define EFP_QUEUE_DEPTH 0x3
+#define EFP_REGISTER_SIZE 0x6
+#define EFP_RESULT_BLOCK_HEADER 0x4
+#define EFP_RESULT_BLOCK_SIZE (EFP_RESULT_BLOCK_HEADER + EFP_JOB_FACTOR)
+#define EFP_ORDER_RESET_FLAG 0x80
 #define EFP_ACK_OK 0x1
 #define EFP_ACK_ERR 0x2
+#define EFP_ACK_BAD_FRAME 0x3
+
+//Version 2 frames: magic, len, seq, cmd, ack, arg, data (32-bit little
+//endian), payload, then a CRC-8 of everything before it.
+#define EFP_V2_MAGIC 0xe2
+#define EFP_V2_MAGIC_BYTE 0x0
+#define EFP_V2_LEN_BYTE 0x1
+#define EFP_V2_SEQ_BYTE 0x2
+#define EFP_V2_CMD_BYTE 0x3
+#define EFP_V2_ACK_BYTE 0x4
+#define EFP_V2_ARG_BYTE 0x5
+#define EFP_V2_DATA_BYTE 0x6
+#define EFP_V2_HEADER 0xa
+
+//A HELLO reply describes the slave so the master can fit its settings to
+//it. The payload holds these bytes, and the data field the measured
+//microseconds a digit took on the last job, or 0 before the first job.
+#define EFP_VERSION 0x2
+#define EFP_CAPS_VERSION_BYTE 0x0
+#define EFP_CAPS_JOB_FACTOR_BYTE 0x1
+#define EFP_CAPS_QUEUE_DEPTH_BYTE 0x2
+#define EFP_CAPS_JOB_TYPES_BYTE 0x3
+#define EFP_CAPS_KERNELS_BYTE 0x4
+#define EFP_CAPS_RESULT_BYTES_BYTE 0x5
+#define EFP_CAPS_FEATURES_BYTE 0x6
+#define EFP_CAPS_LEN 0x7
+#define EFP_JOB_TYPE_PI_DIGITS 0x1
+#define EFP_KERNEL_PLOUFFE 0x1
+#define EFP_FEATURE_GENERAL_CALL 0x1
+#define EFP_FEATURE_LEASE 0x2
+
+//General call writes reach every slave on the bus, and are handled as if
+//they were addressed. RESET and CANCEL with EFP_SLOT_ALL apply to every slot.
+#define EFP_SLOT_ALL 0xff
+
+//A version 2 ORDER may carry a 32-bit little endian lease after the first
+//digit byte. STATUS and RESULT_BLOCK replies about a leased slot end with
+//it, so the master can tell its results from those of a reassigned job.
+#define EFP_ORDER_LEASE_BYTE 0x1
+#define EFP_LEASE_LEN 0x4
+#define EFP_NO_LEASE 0x0
+
+//A version 2 RESULT_BLOCK may carry the index of the last digit wanted, and
+//the reply stops there however far the job has got.
+#define EFP_RESULT_BLOCK_END_BYTE 0x0
+
+#define EFP_PAYLOAD_MAX (EFP_RESULT_BYTES + EFP_LEASE_LEN > EFP_CAPS_LEN ? EFP_RESULT_BYTES + EFP_LEASE_LEN : EFP_CAPS_LEN)
+#define EFP_V2_FRAME_MAX (EFP_V2_HEADER + EFP_PAYLOAD_MAX + 1)
+
+//Writes from the master start with two register select bytes.
+#define EFP_INPUT_SIZE (2 + EFP_V2_FRAME_MAX)
+#define EFP_REPLY_SIZE (EFP_V2_FRAME_MAX > EFP_RESULT_BLOCK_SIZE ? EFP_V2_FRAME_MAX : EFP_RESULT_BLOCK_SIZE)
 
 typedef enum
 {
@@ -27,7 +89,10 @@ typedef enum
 	EFP_CMD_ORDER = 0x1,
 	EFP_CMD_STATUS = 0x2,
 	EFP_CMD_RESULT = 0x3,
-	EFP_CMD_RESET = 0x4
+	EFP_CMD_RESET = 0x4,
+	EFP_CMD_RESULT_BLOCK = 0x5,
+	EFP_CMD_CANCEL = 0x6,
+	EFP_CMD_HELLO = 0x7
 } EFP_CMD;
 
 typedef enum
@@ -40,9 +105,33 @@ typedef enum
 typedef struct
 {
 	EFP_MODE mode;
-	uint8_t current_job_start_idx;
-	uint8_t current_job_progress;
-	uint8_t current_job_results[EFP_JOB_FACTOR];
+	uint8_t ticket;
+	uint32_t start_idx;
+	uint8_t progress;
+	uint8_t results[EFP_RESULT_BYTES];
+	uint32_t lease;
+} efp_job_slot;
+
+//A command or reply, whichever protocol version it arrived in.
+typedef struct
+{
+	uint8_t cmd;
+	uint8_t ack;
+	uint8_t arg;
+	uint32_t data;
+	uint8_t len;
+	uint8_t payload[EFP_PAYLOAD_MAX];
+} efp_message;
+
+typedef struct
+{
+	efp_job_slot slots[EFP_QUEUE_DEPTH];
+	uint8_t next_ticket;
+	//The slot being computed, and a flag the kernel checks to give up on it.
+	int8_t computing;
+	volatile bool cancel_computing;
+	//How long a digit took on the last job finished, for HELLO replies.
+	uint32_t us_per_digit;
 	uint16_t reg_val;
 	char registers[6];
 } efp_slave;
@@ -51,35 +140,214 @@ typedef struct
 Thread compute_thread;
 
 /**
-* Sets the current job index of the efp slave.
-* @param slave     A pointer to the efp_slave
-* @param start_idx The start index for the job group
+* Reads a digit from a packed BCD result buffer.
+* @param  packed A pointer to the packed digits.
+* @param  idx    The index of the digit, starting from 0.
+* @return        The digit.
+*/
+uint8_t efp_get_digit(const uint8_t *packed, const uint8_t idx)
+{
+	return (idx & 0x1) ? packed[idx / 2] & 0xf : packed[idx / 2] >> 4;
+}
+
+/**
+* Stores a digit in a packed BCD result buffer.
+* @param packed A pointer to the packed digits.
+* @param idx    The index of the digit, starting from 0.
+* @param digit  The digit to store.
+*/
+void efp_set_digit(uint8_t *packed, const uint8_t idx, const uint8_t digit)
+{
+	if (idx & 0x1)
+	packed[idx / 2] = (packed[idx / 2] & 0xf0) | (digit & 0xf);
+	else
+	packed[idx / 2] = (packed[idx / 2] & 0x0f) | (digit << 4);
+}
+
+/**
+* Packs a run of digits from a packed BCD buffer into a new buffer, so the
+* first digit lands in the high nibble of des[0].
+* @param  des    A pointer to at least (count + 1) / 2 bytes to store the digits in.
+* @param  packed A pointer to the packed digits.
+* @param  first  The index of the first digit to copy.
+* @param  count  The number of digits to copy.
+* @return        The number of bytes stored.
+*/
+uint8_t efp_pack_digits(uint8_t *des, const uint8_t *packed, const uint8_t first, const uint8_t count)
+{
+	uint8_t len = (count + 1) / 2;
+
+	des[len -1] = EFP_DIGIT_FILL;
+	for (uint8_t i=0; i<count; ++i)
+	efp_set_digit(des, i, efp_get_digit(packed, first + i));
+
+	return len;
+}
+
+/**
+* Queues a job on the first free slot of the efp slave.
+* @param  slave     A pointer to the efp_slave
+* @param  start_idx The start index for the job group
+* @param  first     The first digit to compute; the master already has the ones before it.
+* @param  lease     The lease the master ordered the job under, or EFP_NO_LEASE.
+* @return           The slot number the job was queued in, or -1 if the queue is full.
+*/
+int8_t efp_queue_job(efp_slave *slave, const uint32_t start_idx, const uint8_t first, const uint32_t lease)
+{
+	for (uint8_t slot=0; slot<EFP_QUEUE_DEPTH; ++slot)
+	{
+		if (slave->slots[slot].mode != EFP_MODE_IDLE)
+		continue;
+
+		slave->slots[slot].ticket = slave->next_ticket++;
+		slave->slots[slot].start_idx = start_idx;
+		slave->slots[slot].progress = first;
+		slave->slots[slot].lease = lease;
+		for (uint8_t i=0; i<EFP_RESULT_BYTES; ++i)
+		slave->slots[slot].results[i] = 0x0;
+		slave->slots[slot].mode = EFP_MODE_WORK;
+		return slot;
+	}
+
+	return -1;
+}
+
+/**
+* Finds the oldest queued job that is waiting to be computed and marks it
+* as the one being computed.
+* @param  slave A pointer to the efp_slave
+* @return       The slot number of the job, or -1 if there is nothing to do.
+*/
+int8_t efp_next_job(efp_slave *slave)
+{
+	int8_t result = -1;
+	uint8_t oldest_age = 0x0;
+
+	for (uint8_t slot=0; slot<EFP_QUEUE_DEPTH; ++slot)
+	{
+		if (slave->slots[slot].mode != EFP_MODE_WORK)
+		continue;
+
+		//Tickets wrap, so compare by age relative to the next ticket.
+		uint8_t age = slave->next_ticket - slave->slots[slot].ticket;
+		if (result < 0 || age > oldest_age)
+		{
+			result = slot;
+			oldest_age = age;
+		}
+	}
+
+	slave->computing = result;
+	slave->cancel_computing = false;
+	return result;
+}
+
+/**
+* Stores the next digit of a job being computed. This is the compute thread's
+* safe point: a job cancelled while the digit was being computed is left be.
+* @param  slave  A pointer to the efp_slave
+* @param  slot   The job slot number
+* @param  ticket The ticket the job had when the compute thread picked it up
+* @param  digit  The digit
+* @return        False if the job was cancelled and the compute thread should drop it.
+*/
+bool efp_store_digit(efp_slave *slave, const uint8_t slot, const uint8_t ticket, const uint8_t digit)
+{
+	efp_job_slot *job = &slave->slots[slot];
+	if (job->mode != EFP_MODE_WORK || job->ticket != ticket || job->progress >= EFP_JOB_FACTOR)
+	return false;
+
+	efp_set_digit(job->results, job->progress, digit);
+	job->progress++;
+	return true;
+}
+
+/**
+* Set a job slot to computation done status, unless the job was cancelled.
+* @param slave  A pointer to the efp_slave
+* @param slot   The job slot number
+* @param ticket The ticket the job had when the compute thread picked it up
 */
-void efp_set_job(efp_slave *slave, const uint8_t start_idx)
+void efp_set_done(efp_slave *slave, const uint8_t slot, const uint8_t ticket)
 {
-	slave->current_job_start_idx = start_idx;
-	slave->current_job_progress = 0x0;
-	for (uint8_t i=0; i<EFP_JOB_FACTOR; ++i)
-	slave->current_job_results[i] = 0x0;
-	slave->mode = EFP_MODE_WORK;
+	if (slave->slots[slot].mode == EFP_MODE_WORK && slave->slots[slot].ticket == ticket)
+	slave->slots[slot].mode = EFP_MODE_DONE;
 }
 
 /**
-* Set the slave to computation done status.
+* Set a job slot to idle status, freeing it for another job.
 * @param slave A pointer to the efp_slave
+* @param slot  The job slot number
 */
-void efp_set_done(efp_slave *slave)
+void efp_set_idle(efp_slave *slave, const uint8_t slot)
 {
-	slave->mode = EFP_MODE_DONE;
+	slave->slots[slot].mode = EFP_MODE_IDLE;
 }
 
 /**
-* Set the slave to idle status.
+* Frees a job slot only if its job is done, so the results can't be lost to
+* a reset meant for another job.
+* @param  slave A pointer to the efp_slave
+* @param  slot  The job slot number
+* @return       False if the slot holds no finished job; it is left untouched.
+*/
+bool efp_reset_job(efp_slave *slave, const uint8_t slot)
+{
+	if (slave->slots[slot].mode != EFP_MODE_DONE)
+	return false;
+
+	slave->slots[slot].mode = EFP_MODE_IDLE;
+	return true;
+}
+
+/**
+* Frees a job slot whatever it holds. A job being computed in the slot is
+* given up on at the kernel's next check.
 * @param slave A pointer to the efp_slave
+* @param slot  The job slot number
+*/
+void efp_cancel_job(efp_slave *slave, const uint8_t slot)
+{
+	slave->slots[slot].mode = EFP_MODE_IDLE;
+	if (slave->computing == slot)
+	slave->cancel_computing = true;
+}
+
+/**
+* Reads the lease an ORDER was sent under.
+* @param  msg A pointer to the decoded ORDER.
+* @return     The lease, or EFP_NO_LEASE if the master didn't send one.
+*/
+uint32_t efp_read_lease(const efp_message *msg)
+{
+	uint32_t lease = EFP_NO_LEASE;
+
+	if (msg->len < EFP_ORDER_LEASE_BYTE + EFP_LEASE_LEN)
+	return EFP_NO_LEASE;
+
+	for (uint8_t i=0; i<EFP_LEASE_LEN; ++i)
+	lease |= (uint32_t)msg->payload[EFP_ORDER_LEASE_BYTE + i] << (i * 8);
+
+	return lease;
+}
+
+/**
+* Ends a reply's payload with the lease of the job it is about. Jobs ordered
+* without one add nothing.
+* @param  job     A pointer to the job slot the reply is about.
+* @param  payload A pointer to the reply's payload, with room for the lease.
+* @param  len     The number of payload bytes already stored.
+* @return         The payload length with the lease.
 */
-void efp_set_idle(efp_slave *slave)
+uint8_t efp_append_lease(const efp_job_slot *job, uint8_t *payload, const uint8_t len)
 {
-	slave->mode = EFP_MODE_IDLE;
+	if (job->lease == EFP_NO_LEASE)
+	return len;
+
+	for (uint8_t i=0; i<EFP_LEASE_LEN; ++i)
+	payload[len + i] = (job->lease >> (i * 8)) & 0xff;
+
+	return len + EFP_LEASE_LEN;
 }
 
 /**
@@ -173,11 +441,14 @@ int next_prime(int n)
 }
 
 /**
-* Finds the nth digit of Pi.
-* @param n The digit number to find.
-* @return The integer representation of the digit.
+* Finds the nth digit of Pi, giving up early if asked to. The flag is
+* checked once per prime, so a cancel takes effect long before the digit
+* would be done.
+* @param n      The digit number to find.
+* @param cancel A pointer to a flag set to give up, or NULL.
+* @return The integer representation of the digit, or -1 if cancelled.
 */
-int get_nth_digit(unsigned int n)
+int get_nth_digit_cancellable(unsigned int n, volatile const bool *cancel)
 {
 	int av, a, vmax, N, num, den, k, kq, kq2, t, v, s, i, result;
 	double sum = 0;
@@ -185,6 +456,9 @@ int get_nth_digit(unsigned int n)
 	N = (int)((n + 20) * log(10.0) / log(2.0));
 
 	for (a = 3; a <= (2 * N); a = next_prime(a)) {
+		if (cancel != NULL && *cancel)
+		return -1;
+
 		av = 1;
 		s = 0;
 		num = 1;
@@ -249,7 +523,7 @@ int get_nth_digit(unsigned int n)
 	while(result >= 10)
 	result = result / 10;
 
-	return (uint8_t)result;
+	return result;
 
 }
 
@@ -261,7 +535,8 @@ void compute()
 {
 	while (1)
 	{
-		if (slave_efp.mode != EFP_MODE_WORK)
+		int8_t slot = efp_next_job(&slave_efp);
+		if (slot < 0)
 		{
 			//printf("Waiting for work...\r\n");
 			Thread::wait(50);
@@ -270,50 +545,328 @@ void compute()
 			continue;
 		}
 
-		int start = slave_efp.current_job_start_idx * EFP_JOB_FACTOR +1;
+		efp_job_slot *job = &slave_efp.slots[slot];
+		uint8_t ticket = job->ticket;
+		int start = job->start_idx * EFP_JOB_FACTOR +1;
 		int end = start + (EFP_JOB_FACTOR -1);
-		int n = start;
-		printf("Computing %i to %i\r\n", start, end);
+		int n = start + job->progress;
+		bool cancelled = false;
+		uint8_t first = job->progress;
+		uint32_t started_us = us_ticker_read();
+		printf("Computing %i to %i in slot %i\r\n", n, end, slot);
 		//Thread::wait(500);
 
-		for (slave_efp.current_job_progress=0; n<=end; ++slave_efp.current_job_progress)
+		for (; n<=end && ! cancelled; ++n)
 		{
-			slave_efp.current_job_results[slave_efp.current_job_progress] = get_nth_digit(n++);
+			int digit = get_nth_digit_cancellable(n, &slave_efp.cancel_computing);
+			cancelled = digit < 0 || ! efp_store_digit(&slave_efp, slot, ticket, digit);
 			//os_thread_yield();
-			//printf("Result: %u\r\n", slave_efp.current_job_results[slave_efp.current_job_progress]);
 		}
 
+		if (cancelled)
+		{
+			printf("Job in slot %i was cancelled.\r\n", slot);
+			continue;
+		}
 
-		slave_efp.mode = EFP_MODE_DONE;
+		efp_set_done(&slave_efp, slot, ticket);
+		if (EFP_JOB_FACTOR > first)
+		slave_efp.us_per_digit = (us_ticker_read() - started_us) / (EFP_JOB_FACTOR - first);
 		printf("Digit computation done.\r\n");
 		for (int x=0; x<EFP_JOB_FACTOR; ++x)
-		printf("%i", slave_efp.current_job_results[x]);
+		printf("%i", efp_get_digit(job->results, x));
 		printf("\r\n");
 		//os_thread_yield();
 
 	}
 }
 
+/**
+* Computes the CRC-8 (SMBus PEC, polynomial 0x07) of a block of bytes.
+* @param  data A pointer to the bytes.
+* @param  len  The number of bytes.
+* @return      The CRC.
+*/
+uint8_t efp_crc8(const uint8_t *data, const uint8_t len)
+{
+	uint8_t crc = 0x0;
+	for (uint8_t i=0; i<len; ++i)
+	{
+		crc ^= data[i];
+		for (uint8_t bit=0; bit<8; ++bit)
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+	}
+	return crc;
+}
+
+/**
+* Decodes a version 2 frame written by the master.
+* @param  frame A pointer to at least EFP_V2_FRAME_MAX bytes holding the frame.
+* @param  msg   A pointer to the efp_message to store the command in.
+* @param  seq   A pointer to store the frame's sequence number in.
+* @return       False if the frame is malformed or fails its CRC.
+*/
+bool efp_decode_frame(const uint8_t *frame, efp_message *msg, uint8_t *seq)
+{
+	uint8_t len = frame[EFP_V2_LEN_BYTE];
+
+	*seq = frame[EFP_V2_SEQ_BYTE];
+	if (frame[EFP_V2_MAGIC_BYTE] != EFP_V2_MAGIC || len > EFP_PAYLOAD_MAX)
+	return false;
+	if (efp_crc8(frame, EFP_V2_HEADER + len) != frame[EFP_V2_HEADER + len])
+	return false;
+
+	msg->cmd = frame[EFP_V2_CMD_BYTE];
+	msg->ack = frame[EFP_V2_ACK_BYTE];
+	msg->arg = frame[EFP_V2_ARG_BYTE];
+	msg->data = 0x0;
+	for (int8_t i=3; i>=0; --i)
+	msg->data = (msg->data << 8) | frame[EFP_V2_DATA_BYTE + i];
+	msg->len = len;
+	for (uint8_t i=0; i<len; ++i)
+	msg->payload[i] = frame[EFP_V2_HEADER + i];
+
+	return true;
+}
+
+/**
+* Encodes a reply as a version 2 frame.
+* @param  frame A pointer to at least EFP_V2_FRAME_MAX bytes to store the frame in.
+* @param  msg   A pointer to the reply.
+* @param  seq   The sequence number of the command being answered.
+* @return       The length of the frame in bytes.
+*/
+uint8_t efp_encode_frame(uint8_t *frame, const efp_message *msg, const uint8_t seq)
+{
+	frame[EFP_V2_MAGIC_BYTE] = EFP_V2_MAGIC;
+	frame[EFP_V2_LEN_BYTE] = msg->len;
+	frame[EFP_V2_SEQ_BYTE] = seq;
+	frame[EFP_V2_CMD_BYTE] = msg->cmd;
+	frame[EFP_V2_ACK_BYTE] = msg->ack;
+	frame[EFP_V2_ARG_BYTE] = msg->arg;
+	for (uint8_t i=0; i<4; ++i)
+	frame[EFP_V2_DATA_BYTE + i] = (msg->data >> (i * 8)) & 0xff;
+	for (uint8_t i=0; i<msg->len; ++i)
+	frame[EFP_V2_HEADER + i] = msg->payload[i];
+	frame[EFP_V2_HEADER + msg->len] = efp_crc8(frame, EFP_V2_HEADER + msg->len);
+
+	return EFP_V2_HEADER + msg->len + 1;
+}
+
+/**
+* Carries out a command from the master against the job queue. The reply
+* starts as a copy of the request, so fields a command doesn't answer in
+* are echoed back unchanged.
+* @param  req   A pointer to the decoded request
+* @param  reply A pointer to the efp_message to store the reply in
+* @return       False if the command is unknown.
+*/
+bool efp_execute(const efp_message *req, efp_message *reply)
+{
+	//The arg byte selects the job slot that STATUS, RESULT, RESET and CANCEL
+	//commands refer to.
+	uint8_t slot = req->arg;
+
+	*reply = *req;
+	reply->ack = EFP_ACK_ERR;
+	reply->len = 0x0;
+
+	switch (req->cmd)
+	{
+		case EFP_CMD_PING:
+			printf("Ping!\r\n");
+			reply->ack = EFP_ACK_OK;
+		break;
+		case EFP_CMD_ORDER:
+		{
+			printf("Work order\r\n");
+
+			uint32_t work_value = req->data;
+			printf("Requested work value is: %lu\r\n", (unsigned long)work_value);
+
+			//The master can free the job it just collected in the same
+			//order, saving a write and its settle delay.
+			if (slot & EFP_ORDER_RESET_FLAG)
+			{
+				slot &= ~EFP_ORDER_RESET_FLAG;
+				if (slot >= EFP_QUEUE_DEPTH || ! efp_reset_job(&slave_efp, slot))
+				{
+					printf("Can only reset when done\r\n");
+					break;
+				}
+			}
+
+			//A version 2 order for a job whose first digits the master already
+			//has names the first digit to compute in its payload.
+			uint8_t first = req->len > 0 && req->payload[0] < EFP_JOB_FACTOR ? req->payload[0] : 0x0;
+
+			int8_t queued_slot = efp_queue_job(&slave_efp, work_value, first, efp_read_lease(req));
+			if (queued_slot < 0)
+			{
+				printf("Cannot accept work, job queue is full.\r\n");
+			}
+			else
+			{
+				//Tell the master which slot to poll for this job.
+				reply->arg = queued_slot;
+				reply->ack = EFP_ACK_OK;
+			}
+		}
+		break;
+		case EFP_CMD_STATUS:
+			printf("Check status\r\n");
+			if (slot >= EFP_QUEUE_DEPTH || slave_efp.slots[slot].mode == EFP_MODE_IDLE)
+			{
+				printf("There is no job in the requested slot.\r\n");
+			}
+			else
+			{
+				//Echo the job held in the slot so the master can tell it apart
+				//from a job it ordered before a restart.
+				reply->arg = slave_efp.slots[slot].progress;
+				reply->data = slave_efp.slots[slot].start_idx;
+
+				//A finished job's results ride along, marked by the command byte.
+				if (slave_efp.slots[slot].mode == EFP_MODE_DONE)
+				{
+					for (uint8_t x=0; x<EFP_RESULT_BYTES; ++x)
+					reply->payload[x] = slave_efp.slots[slot].results[x];
+					reply->len = EFP_RESULT_BYTES;
+					reply->cmd = EFP_CMD_RESULT_BLOCK;
+				}
+				reply->len = efp_append_lease(&slave_efp.slots[slot], reply->payload, reply->len);
+				reply->ack = EFP_ACK_OK;
+			}
+		break;
+		case EFP_CMD_RESULT:
+		case EFP_CMD_RESULT_BLOCK:
+			printf("Request result\r\n");
+			if (slot >= EFP_QUEUE_DEPTH || slave_efp.slots[slot].mode == EFP_MODE_IDLE)
+			{
+				printf("There is no job in the requested slot.\r\n");
+			}
+			else if (req->data > EFP_JOB_FACTOR || req->data == 0)
+			{
+				printf("The requested result index is greater than EFP job factor. No buffer overflows here!\r\n");
+			}
+			else if (req->data > slave_efp.slots[slot].progress)
+			{
+				//Digits finished so far can be collected while the job runs, but no more.
+				printf("Cannot give results still being computed\r\n");
+			}
+			else if (req->cmd == EFP_CMD_RESULT)
+			{
+				reply->data = efp_get_digit(slave_efp.slots[slot].results, req->data -1);
+				reply->ack = EFP_ACK_OK;
+			}
+			else
+			{
+				//Every digit from the requested one to the last one finished, or
+				//the last one asked for, so the master needs one read.
+				uint8_t end = slave_efp.slots[slot].progress;
+				if (req->len > EFP_RESULT_BLOCK_END_BYTE && req->payload[EFP_RESULT_BLOCK_END_BYTE] >= req->data && req->payload[EFP_RESULT_BLOCK_END_BYTE] < end)
+					end = req->payload[EFP_RESULT_BLOCK_END_BYTE];
+				reply->data = end - req->data +1;
+				reply->len = efp_pack_digits(reply->payload, slave_efp.slots[slot].results, req->data -1, reply->data);
+				reply->len = efp_append_lease(&slave_efp.slots[slot], reply->payload, reply->len);
+				reply->ack = EFP_ACK_OK;
+			}
+		break;
+		case EFP_CMD_RESET:
+			printf("Reset\r\n");
+			if (slot == EFP_SLOT_ALL)
+			{
+				//Every finished job is freed; the rest are left be.
+				for (uint8_t x=0; x<EFP_QUEUE_DEPTH; ++x)
+					efp_reset_job(&slave_efp, x);
+				reply->ack = EFP_ACK_OK;
+				break;
+			}
+			if (slot >= EFP_QUEUE_DEPTH)
+			{
+				printf("The requested slot is greater than EFP queue depth.\r\n");
+				break;
+			}
+
+			//A job still being computed is only freed by CANCEL.
+			if (! efp_reset_job(&slave_efp, slot))
+			printf("Can only reset when done\r\n");
+			else
+			reply->ack = EFP_ACK_OK;
+		break;
+		case EFP_CMD_CANCEL:
+			printf("Cancel\r\n");
+			if (slot == EFP_SLOT_ALL)
+			{
+				for (uint8_t x=0; x<EFP_QUEUE_DEPTH; ++x)
+					efp_cancel_job(&slave_efp, x);
+				reply->ack = EFP_ACK_OK;
+				break;
+			}
+			if (slot >= EFP_QUEUE_DEPTH)
+			{
+				printf("The requested slot is greater than EFP queue depth.\r\n");
+				break;
+			}
+
+			//The slot is free at once. The compute thread gives up on the job
+			//at the kernel's next check. Cancelling an idle slot succeeds so
+			//a retried cancel is harmless.
+			efp_cancel_job(&slave_efp, slot);
+			reply->ack = EFP_ACK_OK;
+		break;
+		case EFP_CMD_HELLO:
+			printf("Hello\r\n");
+			reply->payload[EFP_CAPS_VERSION_BYTE] = EFP_VERSION;
+			reply->payload[EFP_CAPS_JOB_FACTOR_BYTE] = EFP_JOB_FACTOR;
+			reply->payload[EFP_CAPS_QUEUE_DEPTH_BYTE] = EFP_QUEUE_DEPTH;
+			reply->payload[EFP_CAPS_JOB_TYPES_BYTE] = EFP_JOB_TYPE_PI_DIGITS;
+			reply->payload[EFP_CAPS_KERNELS_BYTE] = EFP_KERNEL_PLOUFFE;
+			reply->payload[EFP_CAPS_RESULT_BYTES_BYTE] = EFP_RESULT_BYTES;
+			reply->payload[EFP_CAPS_FEATURES_BYTE] = EFP_FEATURE_GENERAL_CALL | EFP_FEATURE_LEASE;
+			reply->len = EFP_CAPS_LEN;
+			reply->data = slave_efp.us_per_digit;
+			reply->ack = EFP_ACK_OK;
+		break;
+		default:
+			return false;
+		break;
+	}
+
+	return true;
+}
+
 /**
 * The main entrypoint for Mbed.
 * @return int     The status code.
 */
 int main() {
 	//Setup an input buffer used for parsing.
-	char input_buffer[6];
+	char input_buffer[EFP_INPUT_SIZE];
 
-	//And our own 6 byte register.
+	//And our own 6 byte register, with room behind it for a result block
+	//or a version 2 frame.
 	//Mbed doesn't have the luxury of in-built I2C registers like Photon,
 	//so instead we replicate it.
-	char r1[6];
+	char r1[EFP_REPLY_SIZE];
+	efp_message req, reply;
+	uint8_t seq;
+
+	//How many bytes of r1 the next read sends back. Only a result block
+	//reply is longer than the plain register.
+	int reply_len = EFP_REGISTER_SIZE;
+
+	//Version 2 replies stay readable until the next command, so the master
+	//can read a corrupted one again.
+	bool keep_reply = false;
+
+	slave_efp.computing = -1;
 
 	//Init register.
-	r1[0] = 0x00;
-	r1[1] = 0x00;
-	r1[2] = 0x00;
-	r1[3] = 0x00;
-	r1[4] = 0x00;
-	r1[5] = 0x00;
+	for (int i=0; i<EFP_REPLY_SIZE; ++i)
+		r1[i] = 0x00;
+	for (int i=0; i<EFP_INPUT_SIZE; ++i)
+		input_buffer[i] = 0x00;
 
 	compute_thread.start(compute);
 
@@ -331,89 +884,99 @@ int main() {
 			//The master has requested data.
 			case I2CSlave::ReadAddressed:
 				//Write the contents of register 1 over I2C.
-				slave.write(r1, 6);
+				slave.write(r1, reply_len);
+
+				if (keep_reply)
+					break;
 
 				//Reset the register back to 0.
-				for (int i=0; i<6; ++i)
+				for (int i=0; i<EFP_REPLY_SIZE; ++i)
 					r1[i] = 0x0;
+				reply_len = EFP_REGISTER_SIZE;
 
 			break;
-			//The master has written data.
+			//The master has written data, to us or to every slave on the bus.
+			//mbed's I2CSlave answers the general call address as well as its
+			//own, and a broadcast command is handled as an addressed one. The
+			//two register select bytes are skipped whatever they hold, so the
+			//master's broadcast register reads like register 0.
+			case I2CSlave::WriteGeneral:
 			case I2CSlave::WriteAddressed:
 				//Read the data into the input buffer directly.
-				slave.read(input_buffer, 6);
-
-				//Move them to the efp register.
-				for (int i=0; i<6; ++i) {
-					r1[i] = input_buffer[i];
-				}
+				slave.read(input_buffer, EFP_INPUT_SIZE);
 
 				printf("Command received from master!\r\n");
-				switch (r1[EFP_CMD_REGISTER_BYTE +2])
+
+				//Upgraded masters start every frame with the version 2 magic byte.
+				if ((uint8_t)input_buffer[2] == EFP_V2_MAGIC)
 				{
-					case EFP_CMD_PING:
-						printf("Ping!\r\n");
-						r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_OK;
+					if (! efp_decode_frame((uint8_t *)&input_buffer[2], &req, &seq))
+					{
+						printf("Corrupt frame received\r\n");
+						reply.cmd = input_buffer[2 + EFP_V2_CMD_BYTE];
+						reply.ack = EFP_ACK_BAD_FRAME;
+						reply.arg = 0x0;
+						reply.data = 0x0;
+						reply.len = 0x0;
+					}
+					else if (! efp_execute(&req, &reply))
+					{
+						reply.ack = EFP_ACK_ERR;
+					}
+
+					//Always send a full frame's worth; the CRC marks where it ends.
+					for (int i=0; i<EFP_REPLY_SIZE; ++i)
+						r1[i] = 0x0;
+					efp_encode_frame((uint8_t *)r1, &reply, seq);
+					reply_len = EFP_V2_FRAME_MAX;
+					keep_reply = true;
+
+					slave.stop();
 					break;
-					case EFP_CMD_ORDER:
-						printf("Work order\r\n");
-
-						if (slave_efp.mode != EFP_MODE_IDLE)
-						{
-							printf("Cannot accept work, not in idle mode.\r\n");
-							r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_ERR;
-						}
-						else
-						{
-							uint8_t work_value = r1[EFP_CMD_REGISTER_DATA_BYTE + 2];
-							printf("Requested work value is: %u\r\n", work_value);
+				}
 
-							efp_set_job(&slave_efp, work_value);
-							r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_OK;
-						}
+				//Move them to the efp register.
+				for (int i=0; i<6; ++i) {
+					r1[i] = input_buffer[i];
+				}
+				keep_reply = false;
 
-					break;
-					case EFP_CMD_STATUS:
-						printf("Check status\r\n");
-						r1[EFP_CMD_REGISTER_DATA_BYTE] = slave_efp.current_job_progress;
-						r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_OK;
-					break;
-					case EFP_CMD_RESULT:
-						printf("Request result\r\n");
-						if (slave_efp.mode != EFP_MODE_DONE)
-						{
-							printf("Cannot give results while still computing\r\n");
-							r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_ERR;
-						}
-						else
-						{
-							uint8_t idxRequested = r1[EFP_CMD_REGISTER_DATA_BYTE + 2];
-							if (idxRequested > EFP_JOB_FACTOR || idxRequested <= 0)
-							{
-								printf("The requested result index is greater than EFP job factor. No buffer overflows here!\r\n");
-								r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_ERR;
-							}
-							else
-							{
-								r1[EFP_CMD_REGISTER_DATA_BYTE] = slave_efp.current_job_results[idxRequested -1];
-								r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_OK;
-							}
-						}
+				req.cmd = r1[EFP_CMD_REGISTER_BYTE + 2];
+				req.ack = r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE + 2];
+				req.data = (uint8_t)r1[EFP_CMD_REGISTER_DATA_BYTE + 2];
+				req.arg = r1[EFP_CMD_REGISTER_ARG_BYTE + 2];
+				req.len = 0x0;
 
-					break;
-					case EFP_CMD_RESET:
-						printf("Reset\r\n");
-						if (slave_efp.mode != EFP_MODE_DONE)
-						{
-							printf("Can only reset when done\r\n");
-							r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_ERR;
-						}
-						else
+				//HELLO only exists in version 2, whose frames have room for it.
+				if (req.cmd != EFP_CMD_HELLO && efp_execute(&req, &reply))
+				{
+					r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = reply.ack;
+
+					if (reply.ack == EFP_ACK_OK && req.cmd == EFP_CMD_STATUS)
+					{
+						//A version 1 STATUS reply has the progress in the data byte
+						//and the job echo in the arg byte. Status replies are always
+						//block sized so the master can read them in one go.
+						r1[EFP_CMD_REGISTER_DATA_BYTE] = reply.arg;
+						r1[EFP_CMD_REGISTER_ARG_BYTE] = reply.data;
+						for (uint8_t x=0; x<EFP_JOB_FACTOR; ++x)
+							r1[EFP_RESULT_BLOCK_HEADER + x] = reply.len > 0 ? efp_get_digit(reply.payload, x) : 0x0;
+						if (reply.cmd == EFP_CMD_RESULT_BLOCK)
+							r1[EFP_CMD_REGISTER_BYTE] = EFP_CMD_RESULT_BLOCK;
+						reply_len = EFP_RESULT_BLOCK_SIZE;
+					}
+					else if (reply.ack == EFP_ACK_OK)
+					{
+						r1[EFP_CMD_REGISTER_DATA_BYTE] = reply.data;
+						r1[EFP_CMD_REGISTER_ARG_BYTE] = reply.arg;
+						//The data byte holds how many digits a result block carries.
+						if (reply.len > 0)
 						{
-							r1[EFP_CMD_REGISTER_SLAVE_ACK_BYTE] = EFP_ACK_OK;
+							for (uint8_t x=0; x<reply.data; ++x)
+								r1[EFP_RESULT_BLOCK_HEADER + x] = efp_get_digit(reply.payload, x);
+							reply_len = EFP_RESULT_BLOCK_HEADER + reply.data;
 						}
-						slave_efp.mode = EFP_MODE_IDLE;
-					break;
+					}
 				}
 
 				slave.stop();
@@ -421,7 +984,7 @@ int main() {
 			}
 
 			//Clear our input buffer before we loop back again.
-			for(int i = 0; i < 10; i++)
+			for(int i = 0; i < EFP_INPUT_SIZE; i++)
 				input_buffer[i] = 0;
 	}
 }
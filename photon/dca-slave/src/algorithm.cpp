@@ -107,6 +107,19 @@ int next_prime(int n)
  * @return The integer representation of the digit.
  */
 uint8_t get_nth_digit(unsigned int n)
+{
+	return (uint8_t)get_nth_digit_cancellable(n, NULL);
+}
+
+/**
+ * Finds the nth digit of Pi, giving up early if asked to. The flag is
+ * checked once per prime, so a cancel takes effect long before the digit
+ * would be done.
+ * @param n      The digit number to find.
+ * @param cancel A pointer to a flag set to give up, or NULL.
+ * @return The integer representation of the digit, or -1 if cancelled.
+ */
+int get_nth_digit_cancellable(unsigned int n, volatile const bool *cancel)
 {
 	int av, a, vmax, N, num, den, k, kq, kq2, t, v, s, i, result;
 	double sum = 0;
@@ -114,6 +127,9 @@ uint8_t get_nth_digit(unsigned int n)
 	N = (int)((n + 20) * log(10) / log(2));
 
 	for (a = 3; a <= (2 * N); a = next_prime(a)) {
+		if (cancel != NULL && *cancel)
+			return -1;
+
 		av = 1;
 		s = 0;
 		num = 1;
@@ -178,6 +194,6 @@ uint8_t get_nth_digit(unsigned int n)
 		while(result >= 10)
 			result = result / 10;
 
-	return (uint8_t)result;
+	return result;
 
 }
\ No newline at end of file
@@ -11,5 +11,6 @@ int pow_mod(int a, int b, int m);
 bool is_prime(int n);
 int next_prime(int n);
 uint8_t get_nth_digit(unsigned int n);
+int get_nth_digit_cancellable(unsigned int n, volatile const bool *cancel);
 
 #endif
\ No newline at end of file
@@ -3,7 +3,7 @@
 #include "algorithm.h"
 #include "efp.h"
 
-static I2CSlave device(Wire, EFP_SLAVE_ADDR, EFP_SLAVE_REGISTERS);
+static I2CSlave device(Wire, EFP_SLAVE_ADDR, EFP_DEVICE_REGISTERS);
 static efp_slave slave;
 
 //Allow application level system thread interrupts.
@@ -14,118 +14,315 @@ SYSTEM_THREAD(ENABLED);
 static Thread *compute_thread;
 
 /**
- * The photon initialiser function.
+ * Carries out a command from the master against the job queue. The reply
+ * starts as a copy of the request, so fields a command doesn't answer in
+ * are echoed back unchanged.
+ * @param  req   A pointer to the decoded request
+ * @param  reply A pointer to the efp_message to store the reply in
+ * @return       False if the command is unknown.
  */
-void setup()
+static bool efp_execute(const efp_message *req, efp_message *reply)
 {
-	efp_slave_init(&slave);
+	//The arg byte selects the job slot that STATUS, RESULT, RESET and CANCEL
+	//commands refer to.
+	uint8_t slot = req->arg;
 
-	//For debugging purposes.
-	Serial.begin(9600);
-	device.begin();
-	compute_thread = new Thread("compute_thread", compute);
-}
+	*reply = *req;
+	reply->ack = EFP_ACK_ERR;
+	reply->len = 0x0;
 
-/**
- * The main system thread loop.
- * Mostly checks for I2C changes and dispatches actions.
- * @return void
- */
-void loop()
-{
-	//If there I2C register has not been written by the master, there is nothing
-	//to do in this main thread.
-	if(! device.getRegisterSet(slave.reg_val))
-		return;
-
-	//At this point, the I2C register has been updated by the master.
-	efp_slave_parse_registers(device.getRegister(slave.reg_val), &slave, 0x0);
-	Serial.printf("Command received from master: ");
-
-	//The I2C master writes 32 bits at a time. Each byte represents some context.
-	//EFP_CMD_REGISTER_BYTE represents byte 1, which is the command the master has
-	//given for action.
-	switch (efp_get_register_byte(&slave, EFP_CMD_REGISTER_BYTE))
+	switch (req->cmd)
 	{
 		case EFP_CMD_PING:
 			Serial.printlnf("Ping");
-			efp_set_ack(&slave, EFP_ACK_OK);
-			device.setRegister(0x0, efp_pack_registers(&slave));
+			reply->ack = EFP_ACK_OK;
 		break;
 		case EFP_CMD_ORDER:
+		{
 			Serial.printlnf("Work order");
 
-			if (slave.mode != EFP_MODE_IDLE)
+			//The requested work value is stored in the data field.
+			uint32_t work_value = req->data;
+			Serial.printlnf("Requested work value is: %lu", (unsigned long)work_value);
+
+			//The master can free the job it just collected in the same order.
+			if (slot & EFP_ORDER_RESET_FLAG)
 			{
-				Serial.printlnf("Cannot accept work, not in idle mode.");
-				efp_set_ack(&slave, EFP_ACK_ERR);
+				slot &= ~EFP_ORDER_RESET_FLAG;
+				if (slot >= EFP_QUEUE_DEPTH || ! efp_reset_job(&slave, slot))
+				{
+					Serial.printlnf("Can only reset when done");
+					break;
+				}
+			}
+
+			//A version 2 order for a job whose first digits the master already
+			//has names the first digit to compute in its payload.
+			uint8_t first = req->len > 0 && req->payload[0] < EFP_JOB_FACTOR ? req->payload[0] : 0x0;
+
+			int8_t queued_slot = efp_queue_job(&slave, work_value, first, efp_read_lease(req));
+			if (queued_slot < 0)
+			{
+				Serial.printlnf("Cannot accept work, job queue is full.");
 			}
 			else
 			{
-				//The requested work value is stored in the third byte, as notified in EFP_CMD_REGISTER_DATA_BYTE.
-				uint8_t work_value = efp_get_register_byte(&slave, EFP_CMD_REGISTER_DATA_BYTE);
-				Serial.printlnf("Requested work value is: %u", work_value);
-
-				efp_set_job(&slave, work_value);
-				efp_set_ack(&slave, EFP_ACK_OK);
+				//Tell the master which slot to poll for this job.
+				reply->arg = queued_slot;
+				reply->ack = EFP_ACK_OK;
 			}
-
-			device.setRegister(0x0, efp_pack_registers(&slave));
-
+		}
 		break;
 		case EFP_CMD_STATUS:
 			Serial.printlnf("Check status");
-			efp_set_register_byte(&slave, EFP_CMD_REGISTER_DATA_BYTE, slave.current_job_progress);
-			efp_set_ack(&slave, EFP_ACK_OK);
-			device.setRegister(0x0, efp_pack_registers(&slave));
+			if (slot >= EFP_QUEUE_DEPTH || slave.slots[slot].mode == EFP_MODE_IDLE)
+			{
+				Serial.printlnf("There is no job in the requested slot.");
+			}
+			else
+			{
+				//Echo the job held in the slot so the master can tell it apart
+				//from a job it ordered before a restart.
+				reply->arg = slave.slots[slot].progress;
+				reply->data = slave.slots[slot].start_idx;
+
+				//A finished job's results ride along, saving the RESULT round-trips.
+				//The command byte tells the master they are there.
+				if (slave.slots[slot].mode == EFP_MODE_DONE)
+				{
+					for (uint8_t i=0; i<EFP_RESULT_BYTES; ++i)
+						reply->payload[i] = slave.slots[slot].results[i];
+					reply->len = EFP_RESULT_BYTES;
+					reply->cmd = EFP_CMD_RESULT_BLOCK;
+				}
+				reply->len = efp_append_lease(&slave.slots[slot], reply->payload, reply->len);
+				reply->ack = EFP_ACK_OK;
+			}
 		break;
 		case EFP_CMD_RESULT:
+		case EFP_CMD_RESULT_BLOCK:
 			Serial.printlnf("Request result");
-			if (slave.mode != EFP_MODE_DONE)
+			if (slot >= EFP_QUEUE_DEPTH || slave.slots[slot].mode == EFP_MODE_IDLE)
+			{
+				Serial.printlnf("There is no job in the requested slot.");
+			}
+			else if (req->data > EFP_JOB_FACTOR || req->data == 0)
+			{
+				Serial.printlnf("The requested result index is greater than EFP job factor. No buffer overflows here!");
+			}
+			else if (req->data > slave.slots[slot].progress)
+			{
+				//Digits finished so far can be collected while the job runs, but no more.
+				Serial.printlnf("Cannot give results still being computed");
+			}
+			else if (req->cmd == EFP_CMD_RESULT)
 			{
-				Serial.printlnf("Cannot give results while still computing");
-				efp_set_ack(&slave, EFP_ACK_ERR);
+				//The master will iteratively retrieve results as it needs them.
+				reply->data = efp_get_digit(slave.slots[slot].results, req->data -1);
+				reply->ack = EFP_ACK_OK;
 			}
 			else
 			{
-				//Write the requested result number to the data byte of the slave register.
-				//The master will iteratively retrieve this as it needs it.
-				uint8_t idxRequested = efp_get_register_byte(&slave, EFP_CMD_REGISTER_DATA_BYTE);
-				if (idxRequested > EFP_JOB_FACTOR || idxRequested <= 0)
-				{
-					Serial.printlnf("The requested result index is greater than EFP job factor. No buffer overflows here!");
-					efp_set_ack(&slave, EFP_ACK_ERR);
-				}
-				else
-				{
-					efp_set_register_byte(&slave, EFP_CMD_REGISTER_DATA_BYTE, slave.current_job_results[idxRequested -1]);
-					efp_set_ack(&slave, EFP_ACK_OK);
-				}
+				//Every digit from the requested one to the last one finished, or
+				//the last one asked for, so the master collects them with one read.
+				uint8_t end = slave.slots[slot].progress;
+				if (req->len > EFP_RESULT_BLOCK_END_BYTE && req->payload[EFP_RESULT_BLOCK_END_BYTE] >= req->data && req->payload[EFP_RESULT_BLOCK_END_BYTE] < end)
+					end = req->payload[EFP_RESULT_BLOCK_END_BYTE];
+				reply->data = end - req->data +1;
+				reply->len = efp_pack_digits(reply->payload, slave.slots[slot].results, req->data -1, reply->data);
+				reply->len = efp_append_lease(&slave.slots[slot], reply->payload, reply->len);
+				reply->ack = EFP_ACK_OK;
 			}
-			device.setRegister(0x0, efp_pack_registers(&slave));
-
 		break;
 		case EFP_CMD_RESET:
 			Serial.printlnf("Reset");
-			if (slave.mode != EFP_MODE_DONE)
+			if (slot == EFP_SLOT_ALL)
 			{
-				Serial.printlnf("Can only reset when done");
-				efp_set_ack(&slave, EFP_ACK_ERR);
+				//Every finished job is freed; the rest are left be.
+				for (uint8_t i=0; i<EFP_QUEUE_DEPTH; ++i)
+					efp_reset_job(&slave, i);
+				reply->ack = EFP_ACK_OK;
+				break;
+			}
+			if (slot >= EFP_QUEUE_DEPTH)
+			{
+				Serial.printlnf("The requested slot is greater than EFP queue depth.");
+				break;
 			}
+
+			//A job still being computed is only freed by CANCEL.
+			if (! efp_reset_job(&slave, slot))
+				Serial.printlnf("Can only reset when done");
 			else
+				reply->ack = EFP_ACK_OK;
+		break;
+		case EFP_CMD_CANCEL:
+			Serial.printlnf("Cancel");
+			if (slot == EFP_SLOT_ALL)
+			{
+				for (uint8_t i=0; i<EFP_QUEUE_DEPTH; ++i)
+					efp_cancel_job(&slave, i);
+				reply->ack = EFP_ACK_OK;
+				break;
+			}
+			if (slot >= EFP_QUEUE_DEPTH)
 			{
-				efp_set_ack(&slave, EFP_ACK_OK);
+				Serial.printlnf("The requested slot is greater than EFP queue depth.");
+				break;
 			}
-			efp_set_idle(&slave);
-			device.setRegister(0x0, efp_pack_registers(&slave));
 
+			//The slot is free at once. The compute thread gives up on the job
+			//at the kernel's next check. Cancelling an idle slot succeeds so
+			//a retried cancel is harmless.
+			efp_cancel_job(&slave, slot);
+			reply->ack = EFP_ACK_OK;
+		break;
+		case EFP_CMD_HELLO:
+			Serial.printlnf("Hello");
+			reply->len = efp_get_caps(&slave, reply->payload, &reply->data);
+			reply->ack = EFP_ACK_OK;
 		break;
 		default:
 			//Unless there's some serious interference going on, this should never happen.
-			Serial.printlnf("Unknown command byte received: 0x%02x", slave.registers[EFP_CMD_REGISTER_BYTE]);
+			Serial.printlnf("Unknown command byte received: 0x%02x", req->cmd);
+			return false;
 		break;
 	}
 
+	return true;
+}
+
+/**
+ * Handles a command written in the original 4-byte register format.
+ */
+static void efp_handle_v1()
+{
+	efp_message req, reply;
+
+	efp_slave_parse_registers(device.getRegister(slave.reg_val), &slave);
+
+	//The I2C master writes 32 bits at a time. Each byte represents some context.
+	req.cmd = efp_get_register_byte(&slave, EFP_CMD_REGISTER_BYTE);
+	req.ack = efp_get_register_byte(&slave, EFP_CMD_REGISTER_SLAVE_ACK_BYTE);
+	req.data = efp_get_register_byte(&slave, EFP_CMD_REGISTER_DATA_BYTE);
+	req.arg = efp_get_register_byte(&slave, EFP_CMD_REGISTER_ARG_BYTE);
+	req.len = 0x0;
+
+	//Version 1 masters don't know unknown commands were ignored until they
+	//time out. HELLO only exists in version 2, whose frames have room for it.
+	if (req.cmd == EFP_CMD_HELLO || ! efp_execute(&req, &reply))
+		return;
+
+	//A version 1 STATUS reply has the progress in the data byte and the job
+	//echo in the arg byte.
+	if (req.cmd == EFP_CMD_STATUS && reply.ack == EFP_ACK_OK)
+	{
+		uint8_t progress = reply.arg;
+		reply.arg = reply.data;
+		reply.data = progress;
+	}
+
+	//Any payload goes in the result registers behind the command register,
+	//unpacked to a digit a byte.
+	if (reply.len > 0)
+	{
+		uint8_t digits[EFP_RESULT_REGISTERS * 4];
+		uint8_t count = reply.len * 2 < sizeof(digits) ? reply.len * 2 : sizeof(digits);
+
+		for (uint8_t i=0; i<count; ++i)
+			digits[i] = efp_get_digit(reply.payload, i);
+		for (uint8_t r=0; r<EFP_RESULT_REGISTERS; ++r)
+			device.setRegister(1 + r, efp_pack_bytes(digits, count, r * 4));
+	}
+
+	efp_set_register_byte(&slave, EFP_CMD_REGISTER_BYTE, reply.cmd);
+	efp_set_register_byte(&slave, EFP_CMD_REGISTER_DATA_BYTE, reply.data & 0xff);
+	efp_set_register_byte(&slave, EFP_CMD_REGISTER_ARG_BYTE, reply.arg);
+	efp_set_ack(&slave, reply.ack);
+
+	//The command register goes last so the master never sees the ACK first.
+	device.setRegister(0x0, efp_pack_registers(&slave));
+}
+
+/**
+ * Handles a command written as a version 2 frame. Frames that fail their
+ * checks are answered with EFP_ACK_BAD_FRAME so the master resends at once.
+ * The reply always goes in the registers from 0.
+ * @param base The register the frame was written from: 0, or
+ *             EFP_BROADCAST_REGISTER for a general call.
+ */
+static void efp_handle_v2(const uint16_t base)
+{
+	uint8_t frame[EFP_SLAVE_REGISTERS * 4];
+	efp_message req, reply;
+	uint8_t seq;
+
+	for (uint8_t r=0; r<EFP_SLAVE_REGISTERS; ++r)
+	{
+		uint32_t reg_val = device.getRegister(base + r);
+		for (uint8_t i=0; i<4; ++i)
+			frame[r * 4 + i] = (reg_val >> (i * 8)) & 0xff;
+	}
+
+	if (! efp_decode_frame(frame, &req, &seq))
+	{
+		Serial.printlnf("Corrupt frame received");
+		reply.cmd = frame[EFP_V2_CMD_BYTE];
+		reply.ack = EFP_ACK_BAD_FRAME;
+		reply.arg = 0x0;
+		reply.data = 0x0;
+		reply.len = 0x0;
+	}
+	else if (! efp_execute(&req, &reply))
+	{
+		reply.ack = EFP_ACK_ERR;
+	}
+
+	uint8_t len = efp_encode_frame(frame, &reply, seq);
+
+	//Register 0 holds the magic and sequence number, so it goes last.
+	for (int8_t r=EFP_SLAVE_REGISTERS -1; r>=0; --r)
+		device.setRegister(r, efp_pack_bytes(frame, len, r * 4));
+}
+
+/**
+ * The photon initialiser function.
+ */
+void setup()
+{
+	efp_slave_init(&slave);
+
+	//For debugging purposes.
+	Serial.begin(9600);
+	device.begin();
+
+#if defined(PLATFORM_ID) && PLATFORM_ID == PLATFORM_PHOTON_PRODUCTION
+	//Answer the general call address as well as our own, so the master can
+	//reach every slave on the bus with one write. Wire has no setting for it.
+	I2C1->CR1 |= I2C_CR1_ENGC;
+#endif
+	compute_thread = new Thread("compute_thread", compute);
+}
+
+/**
+ * The main system thread loop.
+ * Mostly checks for I2C changes and dispatches actions.
+ * @return void
+ */
+void loop()
+{
+	//If there I2C register has not been written by the master, there is nothing
+	//to do in this main thread.
+	if(! device.getRegisterSet(slave.reg_val))
+		return;
+
+	//At this point, the I2C register has been updated by the master. Upgraded
+	//masters start every frame with the version 2 magic byte.
+	Serial.printf("Command received from master: ");
+	if ((device.getRegister(slave.reg_val) & 0xff) == EFP_V2_MAGIC)
+		efp_handle_v2(slave.reg_val == EFP_BROADCAST_REGISTER ? EFP_BROADCAST_REGISTER : 0);
+	else if (slave.reg_val != EFP_BROADCAST_REGISTER)
+		efp_handle_v1();
 }
 
 /**
@@ -137,30 +334,44 @@ void compute()
 {
 	while (1)
 	{
-		if (slave.mode != EFP_MODE_WORK)
+		int8_t slot = efp_next_job(&slave);
+		if (slot < 0)
 		{
 			//If there's nothing to do, context switch back to the system thread.
 			os_thread_yield();
 			continue;
 		}
 
-		int start = slave.current_job_start_idx * EFP_JOB_FACTOR +1;
+		efp_job_slot *job = &slave.slots[slot];
+		uint8_t ticket = job->ticket;
+		int start = job->start_idx * EFP_JOB_FACTOR +1;
 		int end = start + (EFP_JOB_FACTOR -1);
-		int n = start;
-		Serial.printlnf("Computing %i to %i", start, end);
+		int n = start + job->progress;
+		bool cancelled = false;
+		uint8_t first = job->progress;
+		unsigned long started_us = micros();
+		Serial.printlnf("Computing %i to %i in slot %i", n, end, slot);
 
-		for (slave.current_job_progress=0; n<=end; ++slave.current_job_progress)
+		for (; n<=end && ! cancelled; ++n)
 		{
-			slave.current_job_results[slave.current_job_progress] = get_nth_digit(n++);
+			int digit = get_nth_digit_cancellable(n, &slave.cancel_computing);
+			cancelled = digit < 0 || ! efp_store_digit(&slave, slot, ticket, digit);
 			//After each digit of job has computed, give the system thread some
 			//time to respond to the masters I2C requests.
 			os_thread_yield();
 		}
 
-		efp_set_done(&slave);
+		if (cancelled)
+		{
+			Serial.printlnf("Job in slot %i was cancelled.", slot);
+			continue;
+		}
+
+		efp_set_done(&slave, slot, ticket);
+		efp_record_speed(&slave, micros() - started_us, EFP_JOB_FACTOR - first);
 		Serial.printlnf("Digit computation done.");
 		for (uint8_t x=0; x<EFP_JOB_FACTOR; ++x)
-			Serial.printf("%i", slave.current_job_results[x]);
+			Serial.printf("%i", efp_get_digit(job->results, x));
 		Serial.printf("\n");
 		os_thread_yield();
 
@@ -6,14 +6,98 @@
 #define EFP_CMD_REGISTER_BYTE 0x0
 #define EFP_CMD_REGISTER_SLAVE_ACK_BYTE 0x1
 #define EFP_CMD_REGISTER_DATA_BYTE 0x2
+#define EFP_CMD_REGISTER_ARG_BYTE 0x3
+
+#define EFP_JOB_FACTOR 0x5
+
+//Results are kept and sent as packed BCD: two digits a byte, the earlier one
+//in the high nibble. An odd job leaves EFP_DIGIT_FILL in the last low nibble.
+#define EFP_RESULT_BYTES ((EFP_JOB_FACTOR + 1) / 2)
+#define EFP_DIGIT_FILL 0xf
+
+//Register 0 holds the command bytes. The registers after it hold a job's
+//results for version 1 masters, unpacked at four digits each, so
+//RESULT_BLOCK replies in one read.
+#define EFP_RESULT_REGISTERS ((EFP_JOB_FACTOR + 3) / 4)
+
+//Version 2 frames, in both directions, are a fixed header followed by len
+//payload bytes and a CRC-8 of everything before it:
+//magic, len, seq, cmd, ack, arg, data (32-bit little endian), payload, crc.
+#define EFP_V2_MAGIC 0xe2
+#define EFP_V2_MAGIC_BYTE 0x0
+#define EFP_V2_LEN_BYTE 0x1
+#define EFP_V2_SEQ_BYTE 0x2
+#define EFP_V2_CMD_BYTE 0x3
+#define EFP_V2_ACK_BYTE 0x4
+#define EFP_V2_ARG_BYTE 0x5
+#define EFP_V2_DATA_BYTE 0x6
+#define EFP_V2_HEADER 0xa
+
+//A HELLO reply describes the slave so the master can fit its settings to
+//it. The payload holds these bytes, and the data field the measured
+//microseconds a digit took on the last job, or 0 before the first job.
+#define EFP_VERSION 0x2
+#define EFP_CAPS_VERSION_BYTE 0x0
+#define EFP_CAPS_JOB_FACTOR_BYTE 0x1
+#define EFP_CAPS_QUEUE_DEPTH_BYTE 0x2
+#define EFP_CAPS_JOB_TYPES_BYTE 0x3
+#define EFP_CAPS_KERNELS_BYTE 0x4
+#define EFP_CAPS_RESULT_BYTES_BYTE 0x5
+#define EFP_CAPS_FEATURES_BYTE 0x6
+#define EFP_CAPS_LEN 0x7
+
+//Bits of the job types, kernels and features bytes.
+#define EFP_JOB_TYPE_PI_DIGITS 0x1
+#define EFP_KERNEL_PLOUFFE 0x1
+#define EFP_FEATURE_GENERAL_CALL 0x1
+#define EFP_FEATURE_LEASE 0x2
+
+//Frames written to the I2C general call address reach every slave on the
+//bus at once. Each handles it as if it were addressed, and the master reads
+//the replies one slave at a time. RESET and CANCEL with EFP_SLOT_ALL apply
+//to every job slot.
+#define EFP_GENERAL_CALL_ADDR 0x0
+#define EFP_SLOT_ALL 0xff
+
+//General call frames are written from this register on rather than from
+//register 0, since the select's low byte follows the general call address
+//and may not be 0x00, 0x04, 0x06 or odd there. Replies still go in the
+//registers from 0, where the master reads each slave's.
+#define EFP_BROADCAST_REGISTER 0x10
+
+//A version 2 ORDER may carry a lease after the first digit byte: a 32-bit
+//little endian token the master picks for this one assignment of the job.
+//STATUS and RESULT_BLOCK replies about a leased slot end with it, so the
+//master can tell its results from those of a job it has since given away.
+#define EFP_ORDER_LEASE_BYTE 0x1
+#define EFP_LEASE_LEN 0x4
+#define EFP_NO_LEASE 0x0
+
+//A version 2 RESULT_BLOCK may carry the index of the last digit wanted. The
+//reply stops there even if the job has got further since the master asked.
+#define EFP_RESULT_BLOCK_END_BYTE 0x0
+
+#define EFP_PAYLOAD_MAX (EFP_RESULT_BYTES + EFP_LEASE_LEN > EFP_CAPS_LEN ? EFP_RESULT_BYTES + EFP_LEASE_LEN : EFP_CAPS_LEN)
+#define EFP_V2_FRAME_MAX (EFP_V2_HEADER + EFP_PAYLOAD_MAX + 1)
 
 #define EFP_SLAVE_ADDR 0x10
-#define EFP_SLAVE_REGISTERS 0x2
+#define EFP_SLAVE_REGISTERS ((EFP_V2_FRAME_MAX + 3) / 4 > 1 + EFP_RESULT_REGISTERS ? (EFP_V2_FRAME_MAX + 3) / 4 : 1 + EFP_RESULT_REGISTERS)
+#define EFP_DEVICE_REGISTERS (EFP_BROADCAST_REGISTER + EFP_SLAVE_REGISTERS)
+#if EFP_SLAVE_REGISTERS > EFP_BROADCAST_REGISTER
+#error The broadcast registers overlap the addressed ones.
+#endif
 
-#define EFP_JOB_FACTOR 0x5
+//The number of job orders a slave will hold at once. The master keeps this
+//queue topped up so the compute thread never waits on the bus.
+#define EFP_QUEUE_DEPTH 0x3
+
+//Set in an ORDER's arg byte to free the finished job slot in the low bits
+//before queueing.
+#define EFP_ORDER_RESET_FLAG 0x80
 
 #define EFP_ACK_OK 0x1
 #define EFP_ACK_ERR 0x2
+#define EFP_ACK_BAD_FRAME 0x3
 
 typedef enum
 {
@@ -21,7 +105,10 @@ typedef enum
 	EFP_CMD_ORDER = 0x1,
 	EFP_CMD_STATUS = 0x2,
 	EFP_CMD_RESULT = 0x3,
-	EFP_CMD_RESET = 0x4
+	EFP_CMD_RESET = 0x4,
+	EFP_CMD_RESULT_BLOCK = 0x5,
+	EFP_CMD_CANCEL = 0x6,
+	EFP_CMD_HELLO = 0x7
 } EFP_CMD;
 
 typedef enum
@@ -34,9 +121,33 @@ typedef enum
 typedef struct
 {
 	EFP_MODE mode;
-	uint8_t current_job_start_idx;
-	uint8_t current_job_progress = 0x0;
-	uint8_t current_job_results[EFP_JOB_FACTOR];
+	uint8_t ticket;
+	uint32_t start_idx;
+	uint8_t progress;
+	uint8_t results[EFP_RESULT_BYTES];
+	uint32_t lease;
+} efp_job_slot;
+
+//A command or reply, whichever protocol version it arrived in.
+typedef struct
+{
+	uint8_t cmd;
+	uint8_t ack;
+	uint8_t arg;
+	uint32_t data;
+	uint8_t len;
+	uint8_t payload[EFP_PAYLOAD_MAX];
+} efp_message;
+
+typedef struct
+{
+	efp_job_slot slots[EFP_QUEUE_DEPTH];
+	uint8_t next_ticket;
+	//The slot being computed, and a flag the kernel checks to give up on it.
+	int8_t computing;
+	volatile bool cancel_computing;
+	//How long a digit took on the last job finished, for HELLO replies.
+	uint32_t us_per_digit;
 	uint16_t reg_val;
 	uint8_t registers[4];
 } efp_slave;
@@ -45,11 +156,26 @@ void efp_slave_init(efp_slave *slave);
 void efp_slave_parse_registers(const uint32_t reg_val, efp_slave *slave);
 void efp_dump_registers(const efp_slave *slave);
 uint32_t efp_pack_registers(const efp_slave *slave);
+uint32_t efp_pack_bytes(const uint8_t *bytes, const uint8_t len, const uint8_t first);
+uint8_t efp_crc8(const uint8_t *data, const uint8_t len);
+uint8_t efp_get_digit(const uint8_t *packed, const uint8_t idx);
+void efp_set_digit(uint8_t *packed, const uint8_t idx, const uint8_t digit);
+uint8_t efp_pack_digits(uint8_t *des, const uint8_t *packed, const uint8_t first, const uint8_t count);
+bool efp_decode_frame(const uint8_t *frame, efp_message *msg, uint8_t *seq);
+uint8_t efp_encode_frame(uint8_t *frame, const efp_message *msg, const uint8_t seq);
 void efp_set_ack(efp_slave *slave, const uint8_t value);
 uint8_t efp_get_register_byte(const efp_slave *slave, const uint8_t index);
 void efp_set_register_byte(efp_slave *slave, const uint8_t index, const uint8_t val);
-void efp_set_job(efp_slave *slave, const uint8_t start_idx);
-void efp_set_done(efp_slave *slave);
-void efp_set_idle(efp_slave *slave);
+int8_t efp_queue_job(efp_slave *slave, const uint32_t start_idx, const uint8_t first, const uint32_t lease);
+int8_t efp_next_job(efp_slave *slave);
+bool efp_store_digit(efp_slave *slave, const uint8_t slot, const uint8_t ticket, const uint8_t digit);
+void efp_set_done(efp_slave *slave, const uint8_t slot, const uint8_t ticket);
+void efp_set_idle(efp_slave *slave, const uint8_t slot);
+bool efp_reset_job(efp_slave *slave, const uint8_t slot);
+void efp_cancel_job(efp_slave *slave, const uint8_t slot);
+void efp_record_speed(efp_slave *slave, const uint32_t elapsed_us, const uint8_t digits);
+uint8_t efp_get_caps(const efp_slave *slave, uint8_t *des, uint32_t *us_per_digit);
+uint32_t efp_read_lease(const efp_message *msg);
+uint8_t efp_append_lease(const efp_job_slot *job, uint8_t *payload, const uint8_t len);
 
 #endif
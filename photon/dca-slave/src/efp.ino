@@ -16,12 +16,21 @@ void efp_slave_init(efp_slave *slave)
 	os_mutex_create(&register_lock);
 
 	os_mutex_lock(register_lock);
-	slave->mode = EFP_MODE_IDLE;
-	slave->current_job_start_idx = 0x0;
-	slave->current_job_progress = 0x0;
+	slave->next_ticket = 0x0;
+	slave->computing = -1;
+	slave->cancel_computing = false;
+	slave->us_per_digit = 0x0;
 
-	for (uint8_t i=0; i<EFP_JOB_FACTOR; ++i)
-		slave->current_job_results[i] = 0x0;
+	for (uint8_t slot=0; slot<EFP_QUEUE_DEPTH; ++slot)
+	{
+		slave->slots[slot].mode = EFP_MODE_IDLE;
+		slave->slots[slot].ticket = 0x0;
+		slave->slots[slot].start_idx = 0x0;
+		slave->slots[slot].progress = 0x0;
+		slave->slots[slot].lease = EFP_NO_LEASE;
+		for (uint8_t i=0; i<EFP_RESULT_BYTES; ++i)
+			slave->slots[slot].results[i] = 0x0;
+	}
 
 	for (uint8_t i=0; i<4; ++i)
 		slave->registers[i] = 0x0;
@@ -74,6 +83,143 @@ uint32_t efp_pack_registers(const efp_slave *slave)
 	return result;
 }
 
+/**
+ * Packs four bytes of a buffer into a 32-bit integer suitable for writing to
+ * one of the photon's registers. Bytes past the end of the buffer are sent
+ * as zero.
+ * @param  bytes    A pointer to the buffer.
+ * @param  len      The number of bytes in the buffer.
+ * @param  first    The index of the first byte to pack.
+ * @return uint32_t An unsigned 32-bit integer.
+ */
+uint32_t efp_pack_bytes(const uint8_t *bytes, const uint8_t len, const uint8_t first)
+{
+	uint32_t result = 0x0;
+	for (int8_t i=0x3; i>=0; --i)
+	{
+		uint8_t idx = first + i;
+		result = (result << 8) | (idx < len ? bytes[idx] : 0x0);
+	}
+	return result;
+}
+
+/**
+ * Computes the CRC-8 (SMBus PEC, polynomial 0x07) of a block of bytes.
+ * @param  data A pointer to the bytes.
+ * @param  len  The number of bytes.
+ * @return      The CRC.
+ */
+uint8_t efp_crc8(const uint8_t *data, const uint8_t len)
+{
+	uint8_t crc = 0x0;
+	for (uint8_t i=0; i<len; ++i)
+	{
+		crc ^= data[i];
+		for (uint8_t bit=0; bit<8; ++bit)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+	}
+	return crc;
+}
+
+/**
+ * Reads a digit from a packed BCD result buffer.
+ * @param  packed A pointer to the packed digits.
+ * @param  idx    The index of the digit, starting from 0.
+ * @return        The digit.
+ */
+uint8_t efp_get_digit(const uint8_t *packed, const uint8_t idx)
+{
+	return (idx & 0x1) ? packed[idx / 2] & 0xf : packed[idx / 2] >> 4;
+}
+
+/**
+ * Stores a digit in a packed BCD result buffer.
+ * @param packed A pointer to the packed digits.
+ * @param idx    The index of the digit, starting from 0.
+ * @param digit  The digit to store.
+ */
+void efp_set_digit(uint8_t *packed, const uint8_t idx, const uint8_t digit)
+{
+	if (idx & 0x1)
+		packed[idx / 2] = (packed[idx / 2] & 0xf0) | (digit & 0xf);
+	else
+		packed[idx / 2] = (packed[idx / 2] & 0x0f) | (digit << 4);
+}
+
+/**
+ * Packs a run of digits from a packed BCD buffer into a new buffer, so the
+ * first digit lands in the high nibble of des[0].
+ * @param  des    A pointer to at least (count + 1) / 2 bytes to store the digits in.
+ * @param  packed A pointer to the packed digits.
+ * @param  first  The index of the first digit to copy.
+ * @param  count  The number of digits to copy.
+ * @return        The number of bytes stored.
+ */
+uint8_t efp_pack_digits(uint8_t *des, const uint8_t *packed, const uint8_t first, const uint8_t count)
+{
+	uint8_t len = (count + 1) / 2;
+
+	des[len -1] = EFP_DIGIT_FILL;
+	for (uint8_t i=0; i<count; ++i)
+		efp_set_digit(des, i, efp_get_digit(packed, first + i));
+
+	return len;
+}
+
+/**
+ * Decodes a version 2 frame written by the master.
+ * @param  frame A pointer to at least EFP_V2_FRAME_MAX bytes holding the frame.
+ * @param  msg   A pointer to the efp_message to store the command in.
+ * @param  seq   A pointer to store the frame's sequence number in.
+ * @return       False if the frame is malformed or fails its CRC.
+ */
+bool efp_decode_frame(const uint8_t *frame, efp_message *msg, uint8_t *seq)
+{
+	uint8_t len = frame[EFP_V2_LEN_BYTE];
+
+	*seq = frame[EFP_V2_SEQ_BYTE];
+	if (frame[EFP_V2_MAGIC_BYTE] != EFP_V2_MAGIC || len > EFP_PAYLOAD_MAX)
+		return false;
+	if (efp_crc8(frame, EFP_V2_HEADER + len) != frame[EFP_V2_HEADER + len])
+		return false;
+
+	msg->cmd = frame[EFP_V2_CMD_BYTE];
+	msg->ack = frame[EFP_V2_ACK_BYTE];
+	msg->arg = frame[EFP_V2_ARG_BYTE];
+	msg->data = 0x0;
+	for (int8_t i=3; i>=0; --i)
+		msg->data = (msg->data << 8) | frame[EFP_V2_DATA_BYTE + i];
+	msg->len = len;
+	for (uint8_t i=0; i<len; ++i)
+		msg->payload[i] = frame[EFP_V2_HEADER + i];
+
+	return true;
+}
+
+/**
+ * Encodes a reply as a version 2 frame.
+ * @param  frame A pointer to at least EFP_V2_FRAME_MAX bytes to store the frame in.
+ * @param  msg   A pointer to the reply.
+ * @param  seq   The sequence number of the command being answered.
+ * @return       The length of the frame in bytes.
+ */
+uint8_t efp_encode_frame(uint8_t *frame, const efp_message *msg, const uint8_t seq)
+{
+	frame[EFP_V2_MAGIC_BYTE] = EFP_V2_MAGIC;
+	frame[EFP_V2_LEN_BYTE] = msg->len;
+	frame[EFP_V2_SEQ_BYTE] = seq;
+	frame[EFP_V2_CMD_BYTE] = msg->cmd;
+	frame[EFP_V2_ACK_BYTE] = msg->ack;
+	frame[EFP_V2_ARG_BYTE] = msg->arg;
+	for (uint8_t i=0; i<4; ++i)
+		frame[EFP_V2_DATA_BYTE + i] = (msg->data >> (i * 8)) & 0xff;
+	for (uint8_t i=0; i<msg->len; ++i)
+		frame[EFP_V2_HEADER + i] = msg->payload[i];
+	frame[EFP_V2_HEADER + msg->len] = efp_crc8(frame, EFP_V2_HEADER + msg->len);
+
+	return EFP_V2_HEADER + msg->len + 1;
+}
+
 /**
  * Sets the ACK byte of the efp_slave register.
  * This allows the I2C master to determine the command was read.
@@ -122,40 +268,235 @@ void efp_set_register_byte(efp_slave *slave, const uint8_t index, const uint8_t
 }
 
 /**
- * Sets the efp_slave's job base. Resets job progress and previous results.
- * Can be safely called to restart a job.
- * @param slave     A pointer to the efp_slave
- * @param start_idx The job sets starting index.
+ * Queues a job on the first free slot of the efp_slave. Resets the slot's
+ * progress and previous results.
+ * @param  slave     A pointer to the efp_slave
+ * @param  start_idx The job sets starting index.
+ * @param  first     The first digit to compute; the master already has the ones before it.
+ * @param  lease     The lease the master ordered the job under, or EFP_NO_LEASE.
+ * @return           The slot number the job was queued in, or -1 if the queue is full.
+ */
+int8_t efp_queue_job(efp_slave *slave, const uint32_t start_idx, const uint8_t first, const uint32_t lease)
+{
+	int8_t result = -1;
+
+	os_mutex_lock(register_lock);
+	for (uint8_t slot=0; slot<EFP_QUEUE_DEPTH; ++slot)
+	{
+		if (slave->slots[slot].mode != EFP_MODE_IDLE)
+			continue;
+
+		slave->slots[slot].ticket = slave->next_ticket++;
+		slave->slots[slot].start_idx = start_idx;
+		slave->slots[slot].progress = first;
+		slave->slots[slot].lease = lease;
+		for (uint8_t i=0; i<EFP_RESULT_BYTES; ++i)
+			slave->slots[slot].results[i] = 0x0;
+		slave->slots[slot].mode = EFP_MODE_WORK;
+		result = slot;
+		break;
+	}
+	os_mutex_unlock(register_lock);
+
+	return result;
+}
+
+/**
+ * Finds the oldest queued job that is waiting to be computed and marks it
+ * as the one being computed.
+ * Jobs are computed in the order they were received from the master.
+ * @param  slave A pointer to the efp_slave
+ * @return       The slot number of the job, or -1 if there is nothing to do.
  */
-void efp_set_job(efp_slave *slave, const uint8_t start_idx)
+int8_t efp_next_job(efp_slave *slave)
 {
+	int8_t result = -1;
+	uint8_t oldest_age = 0x0;
+
 	os_mutex_lock(register_lock);
-	slave->current_job_start_idx = start_idx;
-	slave->current_job_progress = 0x0;
-	for (uint8_t i=0; i<EFP_JOB_FACTOR; ++i)
-		slave->current_job_results[i] = 0x0;
-	slave->mode = EFP_MODE_WORK;
+	for (uint8_t slot=0; slot<EFP_QUEUE_DEPTH; ++slot)
+	{
+		if (slave->slots[slot].mode != EFP_MODE_WORK)
+			continue;
+
+		//Tickets wrap, so compare by age relative to the next ticket.
+		uint8_t age = slave->next_ticket - slave->slots[slot].ticket;
+		if (result < 0 || age > oldest_age)
+		{
+			result = slot;
+			oldest_age = age;
+		}
+	}
+	slave->computing = result;
+	slave->cancel_computing = false;
 	os_mutex_unlock(register_lock);
+
+	return result;
 }
 
 /**
- * Set the slave to computation done status.
+ * Stores the next digit of a job being computed. This is the compute thread's
+ * safe point: a job cancelled while the digit was being computed is left be.
+ * @param  slave  A pointer to the efp_slave
+ * @param  slot   The job slot number
+ * @param  ticket The ticket the job had when the compute thread picked it up
+ * @param  digit  The digit
+ * @return        False if the job was cancelled and the compute thread should drop it.
+ */
+bool efp_store_digit(efp_slave *slave, const uint8_t slot, const uint8_t ticket, const uint8_t digit)
+{
+	bool result = false;
+
+	os_mutex_lock(register_lock);
+	efp_job_slot *job = &slave->slots[slot];
+	if (job->mode == EFP_MODE_WORK && job->ticket == ticket && job->progress < EFP_JOB_FACTOR)
+	{
+		efp_set_digit(job->results, job->progress, digit);
+		job->progress++;
+		result = true;
+	}
+	os_mutex_unlock(register_lock);
+
+	return result;
+}
+
+/**
+ * Set a job slot to computation done status, unless the job was cancelled.
+ * @param slave  A pointer to the efp_slave
+ * @param slot   The job slot number
+ * @param ticket The ticket the job had when the compute thread picked it up
+ */
+void efp_set_done(efp_slave *slave, const uint8_t slot, const uint8_t ticket)
+{
+	os_mutex_lock(register_lock);
+	if (slave->slots[slot].mode == EFP_MODE_WORK && slave->slots[slot].ticket == ticket)
+		slave->slots[slot].mode = EFP_MODE_DONE;
+	os_mutex_unlock(register_lock);
+}
+
+/**
+ * Set a job slot to idle status, freeing it for another job.
  * @param slave A pointer to the efp_slave
+ * @param slot  The job slot number
  */
-void efp_set_done(efp_slave *slave)
+void efp_set_idle(efp_slave *slave, const uint8_t slot)
 {
 	os_mutex_lock(register_lock);
-	slave->mode = EFP_MODE_DONE;
+	slave->slots[slot].mode = EFP_MODE_IDLE;
 	os_mutex_unlock(register_lock);
 }
 
 /**
- * Set the slave to idle status.
+ * Frees a job slot only if its job is done, so the results can't be lost to
+ * a reset meant for another job.
+ * @param  slave A pointer to the efp_slave
+ * @param  slot  The job slot number
+ * @return       False if the slot holds no finished job; it is left untouched.
+ */
+bool efp_reset_job(efp_slave *slave, const uint8_t slot)
+{
+	bool result = false;
+
+	os_mutex_lock(register_lock);
+	if (slave->slots[slot].mode == EFP_MODE_DONE)
+	{
+		slave->slots[slot].mode = EFP_MODE_IDLE;
+		result = true;
+	}
+	os_mutex_unlock(register_lock);
+
+	return result;
+}
+
+/**
+ * Frees a job slot whatever it holds. A job being computed in the slot is
+ * given up on at the kernel's next check.
  * @param slave A pointer to the efp_slave
+ * @param slot  The job slot number
+ */
+void efp_cancel_job(efp_slave *slave, const uint8_t slot)
+{
+	os_mutex_lock(register_lock);
+	slave->slots[slot].mode = EFP_MODE_IDLE;
+	if (slave->computing == slot)
+		slave->cancel_computing = true;
+	os_mutex_unlock(register_lock);
+}
+
+/**
+ * Records how fast the last job was computed.
+ * @param slave      A pointer to the efp_slave
+ * @param elapsed_us The microseconds the job's digits took.
+ * @param digits     The number of digits computed.
  */
-void efp_set_idle(efp_slave *slave)
+void efp_record_speed(efp_slave *slave, const uint32_t elapsed_us, const uint8_t digits)
 {
+	if (digits == 0)
+		return;
+
 	os_mutex_lock(register_lock);
-	slave->mode = EFP_MODE_IDLE;
+	slave->us_per_digit = elapsed_us / digits;
 	os_mutex_unlock(register_lock);
 }
+
+/**
+ * Describes the slave for a HELLO reply.
+ * @param  slave        A pointer to the efp_slave
+ * @param  des          A pointer to EFP_CAPS_LEN bytes to store the description in.
+ * @param  us_per_digit A pointer to store the measured microseconds per digit in.
+ * @return              The number of bytes stored.
+ */
+uint8_t efp_get_caps(const efp_slave *slave, uint8_t *des, uint32_t *us_per_digit)
+{
+	des[EFP_CAPS_VERSION_BYTE] = EFP_VERSION;
+	des[EFP_CAPS_JOB_FACTOR_BYTE] = EFP_JOB_FACTOR;
+	des[EFP_CAPS_QUEUE_DEPTH_BYTE] = EFP_QUEUE_DEPTH;
+	des[EFP_CAPS_JOB_TYPES_BYTE] = EFP_JOB_TYPE_PI_DIGITS;
+	des[EFP_CAPS_KERNELS_BYTE] = EFP_KERNEL_PLOUFFE;
+	des[EFP_CAPS_RESULT_BYTES_BYTE] = EFP_RESULT_BYTES;
+	des[EFP_CAPS_FEATURES_BYTE] = EFP_FEATURE_GENERAL_CALL | EFP_FEATURE_LEASE;
+
+	os_mutex_lock(register_lock);
+	*us_per_digit = slave->us_per_digit;
+	os_mutex_unlock(register_lock);
+
+	return EFP_CAPS_LEN;
+}
+
+/**
+ * Reads the lease an ORDER was sent under.
+ * @param  msg A pointer to the decoded ORDER.
+ * @return     The lease, or EFP_NO_LEASE if the master didn't send one.
+ */
+uint32_t efp_read_lease(const efp_message *msg)
+{
+	uint32_t lease = EFP_NO_LEASE;
+
+	if (msg->len < EFP_ORDER_LEASE_BYTE + EFP_LEASE_LEN)
+		return EFP_NO_LEASE;
+
+	for (uint8_t i=0; i<EFP_LEASE_LEN; ++i)
+		lease |= (uint32_t)msg->payload[EFP_ORDER_LEASE_BYTE + i] << (i * 8);
+
+	return lease;
+}
+
+/**
+ * Ends a reply's payload with the lease of the job it is about. Jobs
+ * ordered without a lease add nothing, so older masters see the payload
+ * they expect.
+ * @param  job     A pointer to the job slot the reply is about.
+ * @param  payload A pointer to the reply's payload, with room for the lease.
+ * @param  len     The number of payload bytes already stored.
+ * @return         The payload length with the lease.
+ */
+uint8_t efp_append_lease(const efp_job_slot *job, uint8_t *payload, const uint8_t len)
+{
+	if (job->lease == EFP_NO_LEASE)
+		return len;
+
+	for (uint8_t i=0; i<EFP_LEASE_LEN; ++i)
+		payload[len + i] = (job->lease >> (i * 8)) & 0xff;
+
+	return len + EFP_LEASE_LEN;
+}